@@ -0,0 +1,48 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#include <string.h>
+
+#include "cms.h"
+#include "xmalloc.h"
+#include "built_in.h"
+#include "die.h"
+
+struct cms *cms_new(unsigned int bits) {
+
+    struct cms *c;
+
+    bug_on(bits < 4 || bits > 24);
+
+    c = xzmalloc(sizeof(*c) + CMS_DEPTH * ((size_t)1 << bits) * sizeof(c->cnt[0]));
+    c->mask = (1U << bits) - 1;
+
+    return c;
+
+}
+
+void cms_free(struct cms *c) {
+    xfree(c);
+}
+
+static size_t cms_size(const struct cms *c) {
+    return sizeof(*c) + CMS_DEPTH * ((size_t)c->mask + 1) * sizeof(c->cnt[0]);
+}
+
+struct cms *cms_dup(const struct cms *c) {
+
+    struct cms *d = xmalloc(cms_size(c));
+
+    memcpy(d, c, cms_size(c));
+
+    return d;
+
+}
+
+void cms_copy(struct cms *dst, const struct cms *src) {
+
+    bug_on(dst->mask != src->mask);
+    memcpy(dst, src, cms_size(src));
+
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#ifndef CMS_H
+#define CMS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Count-Min sketch with conservative update: CMS_DEPTH rows of 2^bits
+// counters. a point query never undercounts and overcounts by at most
+// e / 2^bits of the total with probability 1 - e^-CMS_DEPTH; conservative
+// update only raises the counters that hold the minimum, which tightens
+// that a lot for skewed traffic. 2^14 wide is 256 KB per sketch.
+#define CMS_DEPTH 4
+#define CMS_BITS_DEFAULT 14
+
+struct cms {
+    uint32_t mask;
+    uint64_t total;
+    uint32_t cnt[];
+};
+
+struct cms *cms_new(unsigned int bits);
+void cms_free(struct cms *c);
+struct cms *cms_dup(const struct cms *c);
+void cms_copy(struct cms *dst, const struct cms *src);
+
+// row i uses h1 + i * h2 of one 64 bit hash
+static inline uint32_t cms_slot(const struct cms *c, uint64_t hash, int row) {
+    uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1;
+    return row * (c->mask + 1) + ((h1 + row * h2) & c->mask);
+}
+
+static inline void cms_add(struct cms *c, uint64_t hash) {
+    uint32_t slot[CMS_DEPTH], min = UINT32_MAX;
+    int i;
+
+    for (i = 0; i < CMS_DEPTH; i++) {
+        slot[i] = cms_slot(c, hash, i);
+        if (c->cnt[slot[i]] < min)
+            min = c->cnt[slot[i]];
+    }
+
+    c->total++;
+    if (min == UINT32_MAX)
+        return;
+
+    for (i = 0; i < CMS_DEPTH; i++) {
+        if (c->cnt[slot[i]] == min)
+            c->cnt[slot[i]] = min + 1;
+    }
+}
+
+// n occurrences at once, e.g. a count aggregated elsewhere
+static inline void cms_add_n(struct cms *c, uint64_t hash, uint32_t n) {
+    uint32_t slot[CMS_DEPTH], min = UINT32_MAX;
+    int i;
+
+    for (i = 0; i < CMS_DEPTH; i++) {
+        slot[i] = cms_slot(c, hash, i);
+        if (c->cnt[slot[i]] < min)
+            min = c->cnt[slot[i]];
+    }
+
+    c->total += n;
+    min = min > UINT32_MAX - n ? UINT32_MAX : min + n;
+    for (i = 0; i < CMS_DEPTH; i++) {
+        if (c->cnt[slot[i]] < min)
+            c->cnt[slot[i]] = min;
+    }
+}
+
+static inline uint64_t cms_query(const struct cms *c, uint64_t hash) {
+    uint32_t min = UINT32_MAX, v;
+    int i;
+
+    for (i = 0; i < CMS_DEPTH; i++) {
+        v = c->cnt[cms_slot(c, hash, i)];
+        if (v < min)
+            min = v;
+    }
+
+    return min;
+}
+
+// upper bound of the overcount at the stated probability
+static inline uint64_t cms_error(const struct cms *c) {
+    return (uint64_t)(2.718281828 * c->total / (c->mask + 1.0) + 0.5);
+}
+
+#endif /* CMS_H */
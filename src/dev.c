@@ -1,3 +1,5 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/ioctl.h>
@@ -190,6 +192,27 @@ u32 device_bitrate(const char *ifname)
 	return scopper ? : swireless;
 }
 
+/* NUMA node the NIC hangs off, -1 if unknown or not NUMA */
+int device_numa_node(const char *ifname)
+{
+	int node = -1;
+	char buff[32], sysname[128];
+	FILE *fp;
+
+	slprintf(sysname, sizeof(sysname),
+		 "/sys/class/net/%s/device/numa_node", ifname);
+
+	fp = fopen(sysname, "r");
+	if (!fp)
+		return -1;
+
+	if (fgets(buff, sizeof(buff), fp) != NULL)
+		node = atoi(buff);
+
+	fclose(fp);
+	return node;
+}
+
 short device_enter_promiscuous_mode(const char *ifname)
 {
 	short ifflags;
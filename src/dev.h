@@ -12,6 +12,7 @@ extern short device_get_flags(const char *ifname);
 extern void device_set_flags(const char *ifname, const short flags);
 extern int device_up_and_running(const char *ifname);
 extern u32 device_bitrate(const char *ifname);
+extern int device_numa_node(const char *ifname);
 extern short device_enter_promiscuous_mode(const char *ifname);
 extern void device_leave_promiscuous_mode(const char *ifname, short oldflags);
 
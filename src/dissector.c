@@ -64,7 +64,7 @@ static void dissector_main(struct pkt_buff *pkt, struct protocol *start,
 void dissector_entry_point(uint8_t *packet, size_t len, int linktype, int mode, unsigned char pkttype, void *ctxt)
 {
 	struct protocol *proto_start, *proto_end;
-	struct pkt_buff *pkt;
+	struct pkt_buff buf, *pkt;
 
     /*
      * we always at least visit() now
@@ -72,7 +72,7 @@ void dissector_entry_point(uint8_t *packet, size_t len, int linktype, int mode,
         return;
     */
 
-    pkt = pkt_alloc(packet, len);
+    pkt = pkt_init(&buf, packet, len);
     pkt->pkttype = pkttype;
 
 	switch (linktype) {
@@ -114,7 +114,6 @@ void dissector_entry_point(uint8_t *packet, size_t len, int linktype, int mode,
 	}
 
 	tprintf_flush();
-	pkt_free(pkt);
 }
 
 void dissector_init_all(int fnttype)
@@ -3,34 +3,84 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #include "dnsctxt.h"
+#include "dnswindow.h"
 #include "xmalloc.h"
+#include "geoip.h"
+#include "statshm.h"
+#include "export.h"
+#include "state.h"
 
 // uthash LRU: https://gist.github.com/jehiah/900846
 
-void dnsctxt_init(struct dnsctxt *ctxt, uint32_t local_net, uint8_t local_bits) {
+struct dnsctxt_decay dnsctxt_decay;
+
+struct intern dnsctxt_names;
+
+const uint64_t dnsctxt_lat_bound[DNS_LAT_BUCKETS] = {
+    100000ULL, 250000ULL, 500000ULL,
+    1000000ULL, 2500000ULL, 5000000ULL,
+    10000000ULL, 25000000ULL, 50000000ULL,
+    100000000ULL, 250000000ULL, 500000000ULL,
+    1000000000ULL, UINT64_MAX,
+};
+
+const char *dnsctxt_table_name[DNS_TABLE_NR] = {
+    [DNS_TABLE_SOURCE] = "Incoming Source IPs",
+    [DNS_TABLE_DEST] = "Outgoing Destination IPs",
+    [DNS_TABLE_MALFORMED] = "Malformed Source IPs",
+    [DNS_TABLE_SRC_PORT] = "Incoming Source Ports",
+    [DNS_TABLE_QNAME] = "Queried Names",
+    [DNS_TABLE_NXDOMAIN] = "NXDOMAIN Names",
+    [DNS_TABLE_REFUSED] = "REFUSED Names",
+    [DNS_TABLE_QTYPE] = "Query Types",
+    [DNS_TABLE_GEO_ASN] = "GEO ASN",
+    [DNS_TABLE_GEO_LOC] = "GEO Location",
+};
+
+const char *dnsctxt_tier_name[DNS_TIER_NR] = {
+    [DNS_TIER_FULL] = "full",
+    [DNS_TIER_HEADER] = "header",
+    [DNS_TIER_SAMPLE] = "sample",
+};
+
+void dnsctxt_init(struct dnsctxt *ctxt) {
 
     ctxt->source_table = NULL;
     ctxt->dest_table = NULL;
     ctxt->malformed_table = NULL;
     ctxt->src_port_table = NULL;
-    ctxt->query_name2_table = NULL;
-    ctxt->query_name3_table = NULL;
+    ctxt->qnames = ntree_new(NTREE_DEPTH_DEFAULT, NTREE_MAX_NODES_DEFAULT);
     ctxt->nxdomain_table = NULL;
     ctxt->refused_table = NULL;
+    ctxt->qtype_table = NULL;
     ctxt->geo_asn_table = NULL;
     ctxt->geo_loc_table = NULL;
 
     ctxt->have_geo_asn = 0;
     ctxt->have_geo_loc = 0;
 
-    ctxt->local_net = local_net;
-    ctxt->local_bits = local_bits;
+    slab_init(&ctxt->int_slab, "int32_entry", sizeof(struct int32_entry));
+    slab_init(&ctxt->str_slab, "str_entry", sizeof(struct str_entry));
+
+    dnsctxt_uniq_init(&ctxt->uniq);
+    memset(ctxt->cms, 0, sizeof(ctxt->cms));
+    ctxt->sketches = NULL;
+    memset(ctxt->prefix4, 0, sizeof(ctxt->prefix4));
+    memset(ctxt->prefix6, 0, sizeof(ctxt->prefix6));
+
+    netset_init(&ctxt->local);
 
     ctxt->seen = 0;
     ctxt->incoming = 0;
+    ctxt->lat = xzmalloc(sizeof(*ctxt->lat));
 
     ctxt->cnt_query = 0;
     ctxt->cnt_reply = 0;
@@ -43,55 +93,237 @@ void dnsctxt_init(struct dnsctxt *ctxt, uint32_t local_net, uint8_t local_bits)
     ctxt->cnt_malformed = 0;
     ctxt->cnt_edns = 0;
 
+    ctxt->event_time = 0;
+    ctxt->first_ts = 0;
+    ctxt->now = 0;
+    ctxt->interval = 0;
+    ctxt->interval_end = 0;
+    ctxt->tick_end = 0;
+    ctxt->win = NULL;
+    ctxt->geo_defer = NULL;
+    ctxt->shm = NULL;
+    ctxt->exp = NULL;
+    memset(&ctxt->export_uniq, 0, sizeof(ctxt->export_uniq));
+    ctxt->state_path = NULL;
+    memset(&ctxt->shed, 0, sizeof(ctxt->shed));
+    ctxt->shed.rate = 1;
+    ctxt->stage = NULL;
+    memset(&ctxt->interval_start, 0, sizeof(ctxt->interval_start));
+    memset(&ctxt->closed_start, 0, sizeof(ctxt->closed_start));
+    memset(&ctxt->closed_end, 0, sizeof(ctxt->closed_end));
+
 }
 
-void dnsctxt_free(struct dnsctxt *ctxt) {
-    struct int32_entry *entry, *tmp_entry;
-    struct str_entry *sentry, *tmp_sentry;
+void dnsctxt_snapshot(struct dnsctxt *ctxt, struct dnsctxt_snap *snap, uint64_t ts) {
+
+    snap->ts = ts;
+    snap->seen = ctxt->seen;
+    snap->incoming = ctxt->incoming;
+    snap->cnt_query = ctxt->cnt_query;
+    snap->cnt_reply = ctxt->cnt_reply;
+    snap->cnt_status_srvfail = ctxt->cnt_status_srvfail;
+    snap->cnt_status_nxdomain = ctxt->cnt_status_nxdomain;
+    snap->cnt_status_refused = ctxt->cnt_status_refused;
+    snap->cnt_malformed = ctxt->cnt_malformed;
 
-    // XXX make this a macro
-    HASH_ITER(hh, ctxt->source_table, entry, tmp_entry) {
-        HASH_DELETE(hh, ctxt->source_table, entry);
-        free(entry);
+}
+
+void dnsctxt_set_interval(struct dnsctxt *ctxt, uint64_t interval) {
+    ctxt->interval = interval;
+    ctxt->interval_end = 0;
+    ctxt->tick_end = 0;
+}
+
+void dnsctxt_set_decay(struct dnsctxt *ctxt, uint64_t tau) {
+    memset(&dnsctxt_decay, 0, sizeof(dnsctxt_decay));
+    dnsctxt_decay.tau = tau;
+    dnsctxt_decay.weight = 1;
+    ctxt->tick_end = 0;
+}
+
+static void dnsctxt_decay_advance(uint64_t ts) {
+
+    uint64_t span = DECAY_EPOCH_TAUS * dnsctxt_decay.tau, n;
+
+    if (!dnsctxt_decay.landmark)
+        dnsctxt_decay.landmark = ts;
+    if (ts - dnsctxt_decay.landmark >= span) {
+        n = (ts - dnsctxt_decay.landmark) / span;
+        dnsctxt_decay.epoch += n;
+        dnsctxt_decay.landmark += n * span;
     }
-    HASH_ITER(hh, ctxt->dest_table, entry, tmp_entry) {
-        HASH_DELETE(hh, ctxt->dest_table, entry);
-        free(entry);
+
+    dnsctxt_decay.weight = exp((double)(ts - dnsctxt_decay.landmark) / dnsctxt_decay.tau);
+    dnsctxt_decay.next = ts + DECAY_RES;
+
+}
+
+// slow path of dnsctxt_tick: first packet, interval, window or decay step
+int __dnsctxt_tick(struct dnsctxt *ctxt, uint64_t ts) {
+
+    int crossed = 0;
+
+    if (!ctxt->first_ts)
+        ctxt->first_ts = ts;
+    ctxt->now = ts;
+    ctxt->tick_end = UINT64_MAX;
+
+    if (ctxt->win)
+        ctxt->tick_end = dnswin_tick(ctxt->win, ctxt, ts);
+
+    if (dnsctxt_decay.tau) {
+        if (ts >= dnsctxt_decay.next)
+            dnsctxt_decay_advance(ts);
+        if (dnsctxt_decay.next < ctxt->tick_end)
+            ctxt->tick_end = dnsctxt_decay.next;
     }
-    HASH_ITER(hh, ctxt->malformed_table, entry, tmp_entry) {
-        HASH_DELETE(hh, ctxt->malformed_table, entry);
-        free(entry);
+
+    if (ctxt->shm) {
+        if (ts >= ctxt->shm_next) {
+            dnsctxt_publish(ctxt);
+            ctxt->shm_next = ts - ts % ctxt->shm->period + ctxt->shm->period;
+        }
+        if (ctxt->shm_next < ctxt->tick_end)
+            ctxt->tick_end = ctxt->shm_next;
     }
-    HASH_ITER(hh, ctxt->src_port_table, entry, tmp_entry) {
-        HASH_DELETE(hh, ctxt->src_port_table, entry);
-        free(entry);
+
+    if (ctxt->exp) {
+        if (ts >= ctxt->export_next) {
+            // the first due time only aligns the period
+            if (ctxt->export_next)
+                dnsctxt_export(ctxt);
+            ctxt->export_next = ts - ts % ctxt->export_period + ctxt->export_period;
+        }
+        if (ctxt->export_next < ctxt->tick_end)
+            ctxt->tick_end = ctxt->export_next;
     }
-    HASH_ITER(hh, ctxt->query_name2_table, sentry, tmp_sentry) {
-        HASH_DELETE(hh, ctxt->query_name2_table, sentry);
-        free(sentry);
+
+    if (ctxt->state_path) {
+        if (ts >= ctxt->state_next) {
+            if (ctxt->state_next)
+                dnsctxt_save_state(ctxt);
+            ctxt->state_next = ts - ts % ctxt->state_period + ctxt->state_period;
+        }
+        if (ctxt->state_next < ctxt->tick_end)
+            ctxt->tick_end = ctxt->state_next;
     }
-    HASH_ITER(hh, ctxt->query_name3_table, sentry, tmp_sentry) {
-        HASH_DELETE(hh, ctxt->query_name3_table, sentry);
-        free(sentry);
+
+    if (!ctxt->interval || ts < ctxt->interval_end)
+        goto out;
+
+    // intervals are aligned to multiples of their length, a gap in the
+    // capture closes the open one and skips the empty ones. the packet
+    // at hand is not counted yet, so it falls into the new interval. the
+    // first one starts at the first packet, rates over the part before
+    // it would come out too low
+    if (ctxt->interval_end) {
+        dnsctxt_geo_flush(ctxt);
+        ctxt->closed_start = ctxt->interval_start;
+        dnsctxt_snapshot(ctxt, &ctxt->closed_end, ctxt->interval_end);
+        crossed = 1;
+        dnsctxt_snapshot(ctxt, &ctxt->interval_start, ts - ts % ctxt->interval);
     }
-    HASH_ITER(hh, ctxt->nxdomain_table, sentry, tmp_sentry) {
-        HASH_DELETE(hh, ctxt->nxdomain_table, sentry);
-        free(sentry);
+    else {
+        dnsctxt_snapshot(ctxt, &ctxt->interval_start, ts);
     }
-    HASH_ITER(hh, ctxt->refused_table, sentry, tmp_sentry) {
-        HASH_DELETE(hh, ctxt->refused_table, sentry);
-        free(sentry);
+    ctxt->interval_end = ts - ts % ctxt->interval + ctxt->interval;
+
+out:
+    if (ctxt->interval && ctxt->interval_end < ctxt->tick_end)
+        ctxt->tick_end = ctxt->interval_end;
+
+    return crossed;
+
+}
+
+void dnsctxt_free(struct dnsctxt *ctxt) {
+    int i;
+
+    dnsctxt_free_int_table(&ctxt->source_table, &ctxt->int_slab);
+    dnsctxt_free_int_table(&ctxt->dest_table, &ctxt->int_slab);
+    dnsctxt_free_int_table(&ctxt->malformed_table, &ctxt->int_slab);
+    dnsctxt_free_int_table(&ctxt->src_port_table, &ctxt->int_slab);
+    dnsctxt_free_str_table(&ctxt->nxdomain_table, &ctxt->str_slab);
+    dnsctxt_free_str_table(&ctxt->refused_table, &ctxt->str_slab);
+    dnsctxt_free_str_table(&ctxt->qtype_table, &ctxt->str_slab);
+    dnsctxt_free_int_table(&ctxt->geo_asn_table, &ctxt->int_slab);
+    dnsctxt_free_int_table(&ctxt->geo_loc_table, &ctxt->int_slab);
+    slab_destroy(&ctxt->int_slab);
+    slab_destroy(&ctxt->str_slab);
+
+    if (ctxt->win) {
+        dnswin_free(ctxt->win);
+        ctxt->win = NULL;
     }
-    HASH_ITER(hh, ctxt->geo_asn_table, sentry, tmp_sentry) {
-        HASH_DELETE(hh, ctxt->geo_asn_table, sentry);
-        free(sentry);
+
+    if (ctxt->lat)
+        xfree(ctxt->lat);
+
+    if (ctxt->stage)
+        xfree(ctxt->stage);
+    if (ctxt->exp)
+        dnsctxt_uniq_free(&ctxt->export_uniq);
+    ctxt->shm = NULL;
+    ctxt->exp = NULL;
+    ctxt->state_path = NULL;
+
+    if (ctxt->geo_defer) {
+        xfree(ctxt->geo_defer->key);
+        xfree(ctxt->geo_defer->count);
+        xfree(ctxt->geo_defer);
+        ctxt->geo_defer = NULL;
     }
-    HASH_ITER(hh, ctxt->geo_loc_table, sentry, tmp_sentry) {
-        HASH_DELETE(hh, ctxt->geo_loc_table, sentry);
-        free(sentry);
+
+    dnsctxt_uniq_free(&ctxt->uniq);
+    netset_free(&ctxt->local);
+    if (ctxt->qnames) {
+        ntree_free(ctxt->qnames);
+        ctxt->qnames = NULL;
+    }
+
+    for (i = 0; i < DNS_TABLE_NR; i++) {
+        if (ctxt->cms[i])
+            cms_free(ctxt->cms[i]);
+        ctxt->cms[i] = NULL;
+    }
+    if (ctxt->sketches) {
+        for (i = 0; i < DNS_TABLE_NR; i++) {
+            if (ctxt->sketches->cms[i])
+                cms_free(ctxt->sketches->cms[i]);
+        }
+        pthread_cond_destroy(&ctxt->sketches->refreshed);
+        pthread_mutex_destroy(&ctxt->sketches->lock);
+        xfree(ctxt->sketches);
+        ctxt->sketches = NULL;
+    }
+    for (i = 0; i < DNS_PREFIX_NR; i++) {
+        if (ctxt->prefix4[i])
+            lpm_free(ctxt->prefix4[i]);
+        if (ctxt->prefix6[i])
+            lpm_free(ctxt->prefix6[i]);
+        ctxt->prefix4[i] = ctxt->prefix6[i] = NULL;
     }
 }
 
+void dnsctxt_uniq_init(struct dnsctxt_uniq *uniq) {
+    uniq->source = hll_new(HLL_P_DEFAULT);
+    uniq->source24 = hll_new(HLL_P_DEFAULT);
+    uniq->qname = hll_new(HLL_P_DEFAULT);
+}
+
+void dnsctxt_uniq_reset(struct dnsctxt_uniq *uniq) {
+    hll_reset(uniq->source);
+    hll_reset(uniq->source24);
+    hll_reset(uniq->qname);
+}
+
+void dnsctxt_uniq_free(struct dnsctxt_uniq *uniq) {
+    hll_free(uniq->source);
+    hll_free(uniq->source24);
+    hll_free(uniq->qname);
+    memset(uniq, 0, sizeof(*uniq));
+}
+
 int sort_int_by_count(void *a, void *b) {
     struct int32_entry *left = (struct int32_entry *)a;
     struct int32_entry *right = (struct int32_entry *)b;
@@ -103,6 +335,29 @@ int sort_int_by_count(void *a, void *b) {
         return 1;
 }
 
+// scores must have been rescaled to the current epoch
+int sort_int_by_score(void *a, void *b) {
+    struct int32_entry *left = (struct int32_entry *)a;
+    struct int32_entry *right = (struct int32_entry *)b;
+    if (left->score == right->score)
+        return 0;
+    else if (left->score > right->score)
+        return -1;
+    else
+        return 1;
+}
+
+int sort_str_by_score(void *a, void *b) {
+    struct str_entry *left = (struct str_entry *)a;
+    struct str_entry *right = (struct str_entry *)b;
+    if (left->score == right->score)
+        return 0;
+    else if (left->score > right->score)
+        return -1;
+    else
+        return 1;
+}
+
 // XXX could be macro from int version
 int sort_str_by_count(void *a, void *b) {
     struct str_entry *left = (struct str_entry *)a;
@@ -122,9 +377,18 @@ void _print_table_int(struct int32_entry *table, int size) {
     if (!table)
         return;
 
-    HASH_SORT(table, sort_int_by_count);
+    if (dnsctxt_decay.tau) {
+        HASH_ITER(hh, table, entry, tmp_entry)
+            dnsctxt_decay_rescale(&entry->score, &entry->epoch);
+        HASH_SORT(table, sort_int_by_score);
+    }
+    else
+        HASH_SORT(table, sort_int_by_count);
     HASH_ITER(hh, table, entry, tmp_entry) {
-        printf("%u %lu\n", entry->key, entry->count);
+        if (dnsctxt_decay.tau)
+            printf("%u %lu %.1f/s\n", entry->key, entry->count, dnsctxt_decay_rate(entry->score));
+        else
+            printf("%u %lu\n", entry->key, entry->count);
         if (++i >= size)
             break;
     }
@@ -138,10 +402,45 @@ void _print_table_ip(struct int32_entry *table, int size) {
     if (!table)
         return;
 
-    HASH_SORT(table, sort_int_by_count);
+    if (dnsctxt_decay.tau) {
+        HASH_ITER(hh, table, entry, tmp_entry)
+            dnsctxt_decay_rescale(&entry->score, &entry->epoch);
+        HASH_SORT(table, sort_int_by_score);
+    }
+    else
+        HASH_SORT(table, sort_int_by_count);
     HASH_ITER(hh, table, entry, tmp_entry) {
         inet_ntop(AF_INET, &entry->key, ip, sizeof(ip));
-        printf("%16s %lu\n", ip, entry->count);
+        if (dnsctxt_decay.tau)
+            printf("%16s %lu %.1f/s\n", ip, entry->count, dnsctxt_decay_rate(entry->score));
+        else
+            printf("%16s %lu\n", ip, entry->count);
+        if (++i >= size)
+            break;
+    }
+}
+
+void _print_table_geo(struct int32_entry *table, enum dnsctxt_table t, int size) {
+    struct int32_entry *entry, *tmp_entry;
+    char geo[80];
+    unsigned int i = 0;
+
+    if (!table)
+        return;
+
+    if (dnsctxt_decay.tau) {
+        HASH_ITER(hh, table, entry, tmp_entry)
+            dnsctxt_decay_rescale(&entry->score, &entry->epoch);
+        HASH_SORT(table, sort_int_by_score);
+    }
+    else
+        HASH_SORT(table, sort_int_by_count);
+    HASH_ITER(hh, table, entry, tmp_entry) {
+        dnsctxt_geo_str(t, entry->key, geo, sizeof(geo));
+        if (dnsctxt_decay.tau)
+            printf("%20s %lu %.1f/s\n", geo, entry->count, dnsctxt_decay_rate(entry->score));
+        else
+            printf("%20s %lu\n", geo, entry->count);
         if (++i >= size)
             break;
     }
@@ -154,38 +453,123 @@ void _print_table_str(struct str_entry *table, int size) {
     if (!table)
         return;
 
-    HASH_SORT(table, sort_str_by_count);
+    if (dnsctxt_decay.tau) {
+        HASH_ITER(hh, table, entry, tmp_entry)
+            dnsctxt_decay_rescale(&entry->score, &entry->epoch);
+        HASH_SORT(table, sort_str_by_score);
+    }
+    else
+        HASH_SORT(table, sort_str_by_count);
     HASH_ITER(hh, table, entry, tmp_entry) {
-        printf("%20s %lu\n", entry->key, entry->count);
+        if (dnsctxt_decay.tau)
+            printf("%20s %lu %.1f/s", intern_str(&dnsctxt_names, entry->key), entry->count,
+                   dnsctxt_decay_rate(entry->score));
+        else
+            printf("%20s %lu", intern_str(&dnsctxt_names, entry->key), entry->count);
+        printf("\n");
         if (++i >= size)
             break;
     }
 }
 
+// names at a depth of the name tree, like the old 2 and 3 label tables
+static void _print_names(struct ntree *t, unsigned int depth, int size) {
+    uint32_t top[MAX_SUMMARY_SIZE];
+    char name[MAX_DNAME_LEN];
+    struct ntree_node *node;
+    size_t i, n;
+
+    if (depth > t->depth)
+        return;
+    if (size > MAX_SUMMARY_SIZE)
+        size = MAX_SUMMARY_SIZE;
+
+    printf("\nQueried Names (%u)\n", depth);
+    n = ntree_top_depth(t, depth, dnsctxt_decay.tau ? dnsctxt_name_score : dnsctxt_name_count, top, size);
+    for (i = 0; i < n; i++) {
+        node = &t->node[top[i]];
+        ntree_name(t, top[i], name, sizeof(name));
+        if (dnsctxt_decay.tau)
+            printf("%20s %lu %.1f/s", name, node->count, dnsctxt_decay_rate(node->score));
+        else
+            printf("%20s %lu", name, node->count);
+        if (node->hll)
+            printf(" (%lu unique labels)", hll_count(node->hll));
+        printf("\n");
+    }
+}
+
+static void _print_prefixes(struct lpm *t, const char *name, int size) {
+    struct lpm_top top[MAX_SUMMARY_SIZE];
+    char buf[INET6_ADDRSTRLEN + 4];
+    size_t i, n;
+    unsigned int level;
+
+    if (!t || !t->total)
+        return;
+    if (size > MAX_SUMMARY_SIZE)
+        size = MAX_SUMMARY_SIZE;
+
+    for (level = 0; level < t->nr_len; level++) {
+        printf("\n%s /%u\n", name, t->len[level]);
+        n = lpm_top(t, level, top, size);
+        for (i = 0; i < n; i++)
+            printf("%20s %lu\n", lpm_prefix_str(t, top[i].addr, level, buf, sizeof(buf)), top[i].count);
+        if (t->overflow[level])
+            printf("%20s %lu\n", "(not tracked)", t->overflow[level]);
+    }
+}
+
+static void _print_zone_ranking(struct dnsctxt *ctxt, int size) {
+    struct dnsctxt_zone_rank rank[MAX_SUMMARY_SIZE];
+    char zone[MAX_DNAME_LEN];
+    size_t i, n;
+
+    n = dnsctxt_zone_ranking(ctxt, rank, size < MAX_SUMMARY_SIZE ? size : MAX_SUMMARY_SIZE);
+    if (!n)
+        return;
+
+    printf("\nZones by Unique Labels per Query\n");
+    for (i = 0; i < n; i++)
+        printf("%20s %lu/%lu (%.2f)\n", ntree_name(ctxt->qnames, rank[i].node, zone, sizeof(zone)), rank[i].labels, rank[i].queries, rank[i].ratio);
+}
+
 void dnsctxt_table_summary(struct dnsctxt *ctxt, int size) {
 
+    dnsctxt_geo_flush(ctxt);
+
+    printf("\nUnique (estimated)\n");
+    printf("%20s %lu\n", "source IPs", hll_count(ctxt->uniq.source));
+    printf("%20s %lu\n", "source /24s", hll_count(ctxt->uniq.source24));
+    printf("%20s %lu\n", "qnames", hll_count(ctxt->uniq.qname));
+
     printf("\nIncoming Sources IPs\n");
     _print_table_ip(ctxt->source_table, size);
+    _print_prefixes(ctxt->prefix4[DNS_TABLE_SOURCE], "Incoming Source Prefixes", size);
+    _print_prefixes(ctxt->prefix6[DNS_TABLE_SOURCE], "Incoming Source Prefixes", size);
     printf("\nIncoming Query Types\n");
     _print_table_str(ctxt->qtype_table, size);
     printf("\nIncoming Source Ports\n");
     _print_table_int(ctxt->src_port_table, size);
     printf("\nOutgoing Destinations IPs\n");
     _print_table_ip(ctxt->dest_table, size);
+    _print_prefixes(ctxt->prefix4[DNS_TABLE_DEST], "Outgoing Destination Prefixes", size);
+    _print_prefixes(ctxt->prefix6[DNS_TABLE_DEST], "Outgoing Destination Prefixes", size);
     printf("\nMalformed DNS Incoming Source IPs\n");
     _print_table_ip(ctxt->malformed_table, size);
-    printf("\nQueried Names (2)\n");
-    _print_table_str(ctxt->query_name2_table, size);
-    printf("\nQueried Names (3)\n");
-    _print_table_str(ctxt->query_name3_table, size);
+    _print_prefixes(ctxt->prefix4[DNS_TABLE_MALFORMED], "Malformed Source Prefixes", size);
+    _print_prefixes(ctxt->prefix6[DNS_TABLE_MALFORMED], "Malformed Source Prefixes", size);
+    _print_names(ctxt->qnames, 2, size);
+    _print_names(ctxt->qnames, 3, size);
+    _print_zone_ranking(ctxt, size);
     printf("\nNXDOMAIN Names\n");
     _print_table_str(ctxt->nxdomain_table, size);
     printf("\nREFUSED Names\n");
     _print_table_str(ctxt->refused_table, size);
     printf("\nGEO ASN\n");
-    _print_table_str(ctxt->geo_asn_table, size);
+    _print_table_geo(ctxt->geo_asn_table, DNS_TABLE_GEO_ASN, size);
     printf("\nGEO Location\n");
-    _print_table_str(ctxt->geo_loc_table, size);
+    _print_table_geo(ctxt->geo_loc_table, DNS_TABLE_GEO_LOC, size);
 
 }
 
@@ -204,77 +588,827 @@ struct int32_entry *lru_get_int(struct int32_entry **table, uint32_t key)
     return NULL;
 }
 
-void lru_add_int(struct int32_entry **table, uint32_t key)
+struct int32_entry *lru_add_int(struct int32_entry **table, struct slab *slab, uint32_t key, unsigned int max)
 {
-    struct int32_entry *entry, *tmp_entry;
-    entry = xmalloc(sizeof(struct int32_entry));
+    struct int32_entry *entry, *tmp_entry, *added;
+    added = entry = slab_alloc(slab);
     entry->key = key;
     entry->count = 1;
+    entry->score = 0;
+    entry->epoch = dnsctxt_decay.epoch;
+    dnsctxt_decay_hit(&entry->score, &entry->epoch);
     HASH_ADD(hh, *table, key, sizeof(uint32_t), entry);
 
     // prune the cache
-    if (HASH_COUNT(*table) >= MAX_LRU_SIZE) {
+    if (HASH_COUNT(*table) >= max) {
         HASH_ITER(hh, *table, entry, tmp_entry) {
             // prune the first entry (loop is based on insertion order so this deletes the oldest item)
             HASH_DELETE(hh, *table, entry);
-            free(entry);
+            slab_free(slab, entry);
             break;
         }
     }
+
+    return added;
 }
 
-struct str_entry *lru_get_str(struct str_entry **table, char *key)
+struct str_entry *lru_get_str(struct str_entry **table, uint32_t key)
 {
     struct str_entry *entry;
     if (!*table)
         return NULL;
-    HASH_FIND_STR(*table, key, entry);
+    HASH_FIND(hh, *table, &key, sizeof(uint32_t), entry);
     if (entry) {
         // remove it (so the subsequent add will throw it on the front of the list)
         HASH_DELETE(hh, *table, entry);
-        HASH_ADD_STR(*table, key, entry);
+        HASH_ADD(hh, *table, key, sizeof(uint32_t), entry);
         return entry;
     }
     return NULL;
 }
 
-void lru_add_str(struct str_entry **table, char *key)
+// takes over the reference to key
+struct str_entry *lru_add_str(struct str_entry **table, struct slab *slab, uint32_t key, unsigned int max)
 {
-    struct str_entry *entry, *tmp_entry;
-    entry = xmalloc(sizeof(struct str_entry));
-    strncpy(entry->key, key, MAX_DNAME_LEN);
+    struct str_entry *entry, *tmp_entry, *added;
+    added = entry = slab_alloc(slab);
+    entry->key = key;
     entry->count = 1;
-    HASH_ADD_STR(*table, key, entry);
+    entry->score = 0;
+    entry->epoch = dnsctxt_decay.epoch;
+    dnsctxt_decay_hit(&entry->score, &entry->epoch);
+    HASH_ADD(hh, *table, key, sizeof(uint32_t), entry);
 
     // prune the cache
-    if (HASH_COUNT(*table) >= MAX_LRU_SIZE) {
+    if (HASH_COUNT(*table) >= max) {
         HASH_ITER(hh, *table, entry, tmp_entry) {
             // prune the first entry (loop is based on insertion order so this deletes the oldest item)
             HASH_DELETE(hh, *table, entry);
-            free(entry);
+            intern_put(&dnsctxt_names, entry->key);
+            slab_free(slab, entry);
             break;
         }
     }
+
+    return added;
 }
 
-void dnsctxt_count_ip(struct int32_entry **table, uint32_t key) {
+void dnsctxt_count_ip_max(struct int32_entry **table, struct slab *slab, uint32_t key, unsigned int max) {
 
     struct int32_entry *entry = lru_get_int(table, key);
     if (entry) {
         entry->count++;
+        dnsctxt_decay_hit(&entry->score, &entry->epoch);
         return;
     }
-    lru_add_int(table, key);
+    lru_add_int(table, slab, key, max);
 
 }
 
-void dnsctxt_count_name(struct str_entry **table, char *name) {
+// the hash is hll_hash_mem of the name, so callers that sketch it too
+// hash once
+struct str_entry *dnsctxt_count_name_hash(struct str_entry **table, struct slab *slab, const char *name,
+                                          size_t len, uint64_t hash, unsigned int max) {
+
+    struct str_entry *entry = NULL;
+    uint32_t key = intern_find(&dnsctxt_names, name, len, hash);
 
-    struct str_entry *entry = lru_get_str(table, name);
+    if (key != INTERN_NONE)
+        entry = lru_get_str(table, key);
     if (entry) {
         entry->count++;
+        dnsctxt_decay_hit(&entry->score, &entry->epoch);
+        return entry;
+    }
+    return lru_add_str(table, slab, intern_get(&dnsctxt_names, name, len, hash), max);
+
+}
+
+struct str_entry *dnsctxt_count_name_max(struct str_entry **table, struct slab *slab, char *name, unsigned int max) {
+    size_t len = strlen(name);
+    return dnsctxt_count_name_hash(table, slab, name, len, hll_hash_mem(name, len), max);
+}
+
+void dnsctxt_free_int_table(struct int32_entry **table, struct slab *slab) {
+    struct int32_entry *entry, *tmp_entry;
+
+    HASH_ITER(hh, *table, entry, tmp_entry) {
+        HASH_DELETE(hh, *table, entry);
+        slab_free(slab, entry);
+    }
+}
+
+void dnsctxt_free_str_table(struct str_entry **table, struct slab *slab) {
+    struct str_entry *entry, *tmp_entry;
+
+    HASH_ITER(hh, *table, entry, tmp_entry) {
+        HASH_DELETE(hh, *table, entry);
+        intern_put(&dnsctxt_names, entry->key);
+        slab_free(slab, entry);
+    }
+}
+
+struct int32_entry **dnsctxt_int_table(struct dnsctxt *ctxt, enum dnsctxt_table t) {
+    switch (t) {
+    case DNS_TABLE_SOURCE:
+        return &ctxt->source_table;
+    case DNS_TABLE_DEST:
+        return &ctxt->dest_table;
+    case DNS_TABLE_MALFORMED:
+        return &ctxt->malformed_table;
+    case DNS_TABLE_SRC_PORT:
+        return &ctxt->src_port_table;
+    case DNS_TABLE_GEO_ASN:
+        return &ctxt->geo_asn_table;
+    case DNS_TABLE_GEO_LOC:
+        return &ctxt->geo_loc_table;
+    default:
+        return NULL;
+    }
+}
+
+struct str_entry **dnsctxt_str_table(struct dnsctxt *ctxt, enum dnsctxt_table t) {
+    switch (t) {
+    case DNS_TABLE_NXDOMAIN:
+        return &ctxt->nxdomain_table;
+    case DNS_TABLE_REFUSED:
+        return &ctxt->refused_table;
+    case DNS_TABLE_QTYPE:
+        return &ctxt->qtype_table;
+    default:
+        return NULL;
+    }
+}
+
+void dnsctxt_enable_cms(struct dnsctxt *ctxt, unsigned int bits) {
+    int i;
+
+    for (i = 0; i < DNS_TABLE_NR; i++) {
+        if (!ctxt->cms[i])
+            ctxt->cms[i] = cms_new(bits);
+    }
+}
+
+void dnsctxt_set_prefixes(struct dnsctxt *ctxt, const uint8_t *len4, int nr_len4, const uint8_t *len6, int nr_len6) {
+    int i;
+
+    for (i = 0; i < DNS_PREFIX_NR; i++) {
+        if (nr_len4 > 0 && !ctxt->prefix4[i])
+            ctxt->prefix4[i] = lpm_new(32, len4, nr_len4, LPM_MAX_NODES_DEFAULT);
+        if (nr_len6 > 0 && !ctxt->prefix6[i])
+            ctxt->prefix6[i] = lpm_new(128, len6, nr_len6, LPM_MAX_NODES_DEFAULT);
+    }
+}
+
+// n hits of a key at once, from an aggregate
+static void dnsctxt_track_ip_n(struct dnsctxt *ctxt, enum dnsctxt_table t, uint32_t key, uint32_t n) {
+    struct int32_entry **table = dnsctxt_int_table(ctxt, t), *entry;
+
+    if ((entry = lru_get_int(table, key))) {
+        entry->count += n;
+        dnsctxt_decay_hit_n(&entry->score, &entry->epoch, n);
+    }
+    else {
+        entry = lru_add_int(table, &ctxt->int_slab, key, MAX_LRU_SIZE);
+        entry->count = n;
+        dnsctxt_decay_hit_n(&entry->score, &entry->epoch, n - 1);
+    }
+    if (ctxt->cms[t])
+        cms_add_n(ctxt->cms[t], hll_hash_u32(key), n);
+}
+
+void dnsctxt_enable_geo_defer(struct dnsctxt *ctxt) {
+    struct dnsctxt_geo_defer *d = xzmalloc(sizeof(*d));
+
+    d->mask = 1023;
+    d->key = xzmalloc((d->mask + 1) * sizeof(*d->key));
+    d->count = xmalloc((d->mask + 1) * sizeof(*d->count));
+    ctxt->geo_defer = d;
+}
+
+void dnsctxt_geo_defer_grow(struct dnsctxt_geo_defer *d) {
+    uint32_t *key = d->key, *count = d->count, mask = d->mask, i, j;
+
+    d->mask = mask * 2 + 1;
+    d->key = xzmalloc((d->mask + 1) * sizeof(*d->key));
+    d->count = xmalloc((d->mask + 1) * sizeof(*d->count));
+    for (i = 0; i <= mask; i++) {
+        if (!key[i])
+            continue;
+        for (j = hll_hash_u32(key[i]) & d->mask; d->key[j]; j = (j + 1) & d->mask)
+            ;
+        d->key[j] = key[i];
+        d->count[j] = count[i];
+    }
+    xfree(key);
+    xfree(count);
+}
+
+// resolve each pending /24 once, by its first address, and count it into
+// the geo tables weighted by its packets. called at the end of an
+// interval, before the tables are read and when the table is full, so
+// decayed rates see the packets at flush time
+void dnsctxt_geo_flush(struct dnsctxt *ctxt) {
+    struct dnsctxt_geo_defer *d = ctxt->geo_defer;
+    uint32_t i, addr;
+
+    if (!d || !d->nr)
+        return;
+
+    for (i = 0; i <= d->mask; i++) {
+        if (!d->key[i])
+            continue;
+        addr = htonl((d->key[i] - 1) << 8);
+        if (ctxt->have_geo_loc)
+            dnsctxt_track_ip_n(ctxt, DNS_TABLE_GEO_LOC, geoip4_loc_code_by_ip(addr), d->count[i]);
+        if (ctxt->have_geo_asn)
+            dnsctxt_track_ip_n(ctxt, DNS_TABLE_GEO_ASN, geoip4_asn_by_ip(addr), d->count[i]);
+        d->key[i] = 0;
+    }
+    d->nr = 0;
+}
+
+void dnsctxt_track_ip(struct dnsctxt *ctxt, enum dnsctxt_table t, uint32_t key) {
+    dnsctxt_count_ip_max(dnsctxt_int_table(ctxt, t), &ctxt->int_slab, key, MAX_LRU_SIZE);
+    if (ctxt->cms[t])
+        cms_add(ctxt->cms[t], hll_hash_u32(key));
+    if (t < DNS_PREFIX_NR && ctxt->prefix4[t])
+        lpm_add(ctxt->prefix4[t], (const uint8_t *)&key);
+}
+
+// ipv6 addresses only have the prefix rollups
+void dnsctxt_track_ip6(struct dnsctxt *ctxt, enum dnsctxt_table t, const uint8_t *addr) {
+    if (t < DNS_PREFIX_NR && ctxt->prefix6[t])
+        lpm_add(ctxt->prefix6[t], addr);
+}
+
+void dnsctxt_set_name_tree(struct dnsctxt *ctxt, unsigned int depth, uint32_t max_node) {
+    ntree_free(ctxt->qnames);
+    ctxt->qnames = ntree_new(depth, max_node);
+}
+
+// count a query name at every depth, returns its zone if it has one
+struct ntree_node *dnsctxt_track_qname(struct dnsctxt *ctxt, const char *qname) {
+    struct ntree *t = ctxt->qnames;
+    uint32_t path[NTREE_MAX_DEPTH];
+    uint64_t hash[NTREE_MAX_DEPTH];
+    unsigned int i, n;
+
+    n = ntree_add(t, qname, path, hash);
+    for (i = 0; i < n; i++) {
+        if (path[i] != NTREE_NONE)
+            dnsctxt_decay_hit(&t->node[path[i]].score, &t->node[path[i]].epoch);
+        if (ctxt->cms[DNS_TABLE_QNAME])
+            cms_add(ctxt->cms[DNS_TABLE_QNAME], hash[i]);
+    }
+
+    return n >= 2 && path[1] != NTREE_NONE ? &t->node[path[1]] : NULL;
+}
+
+// ntree_rank_fn for lifetime counts and for decayed rates
+double dnsctxt_name_count(struct ntree_node *node) {
+    return node->count;
+}
+
+double dnsctxt_name_score(struct ntree_node *node) {
+    dnsctxt_decay_rescale(&node->score, &node->epoch);
+    return node->score;
+}
+
+struct str_entry *dnsctxt_track_name(struct dnsctxt *ctxt, enum dnsctxt_table t, const char *name) {
+    size_t len = strlen(name);
+    uint64_t hash = hll_hash_mem(name, len);
+
+    if (ctxt->cms[t])
+        cms_add(ctxt->cms[t], hash);
+    return dnsctxt_count_name_hash(dnsctxt_str_table(ctxt, t), &ctxt->str_slab, name, len, hash, MAX_LRU_SIZE);
+}
+
+// display string of a geo table key, only needed when printing
+char *dnsctxt_geo_str(enum dnsctxt_table t, uint32_t key, char *buf, size_t size) {
+    const char *org;
+
+    if (t == DNS_TABLE_GEO_LOC)
+        return geoip_loc_str(key, buf, size);
+
+    org = geoip_asn_org(key);
+    snprintf(buf, size, "AS%u %s", key, org ? org : "Unknown");
+    return buf;
+}
+
+// point queries, they leave the LRU order alone
+void dnsctxt_query_ip(struct dnsctxt *ctxt, enum dnsctxt_table t, uint32_t key, struct dnsctxt_freq *freq) {
+    struct int32_entry *entry = NULL, **table = dnsctxt_int_table(ctxt, t);
+
+    memset(freq, 0, sizeof(*freq));
+
+    if (*table)
+        HASH_FIND(hh, *table, &key, sizeof(uint32_t), entry);
+    if (entry) {
+        freq->table = entry->count;
+        freq->in_table = 1;
+    }
+    if (ctxt->cms[t]) {
+        freq->sketch = cms_query(ctxt->cms[t], hll_hash_u32(key));
+        freq->sketch_error = cms_error(ctxt->cms[t]);
+        freq->have_sketch = 1;
+    }
+}
+
+// names deeper than the name tree count at their suffix there
+void dnsctxt_query_name(struct dnsctxt *ctxt, enum dnsctxt_table t, const char *name, struct dnsctxt_freq *freq) {
+    struct str_entry *entry = NULL, **table = dnsctxt_str_table(ctxt, t);
+    size_t len = strlen(name);
+    uint64_t hash = hll_hash_mem(name, len);
+    uint32_t node, key;
+
+    memset(freq, 0, sizeof(*freq));
+
+    if (t == DNS_TABLE_QNAME) {
+        node = ntree_find(ctxt->qnames, name);
+        if (node != NTREE_NONE) {
+            freq->table = ctxt->qnames->node[node].count;
+            freq->in_table = 1;
+        }
+        if (ctxt->cms[t]) {
+            freq->sketch = cms_query(ctxt->cms[t], ntree_hash(name, ctxt->qnames->depth));
+            freq->sketch_error = cms_error(ctxt->cms[t]);
+            freq->have_sketch = 1;
+        }
+        return;
+    }
+
+    key = intern_find(&dnsctxt_names, name, len, hash);
+    if (*table && key != INTERN_NONE)
+        HASH_FIND(hh, *table, &key, sizeof(uint32_t), entry);
+    if (entry) {
+        freq->table = entry->count;
+        freq->in_table = 1;
+    }
+    if (ctxt->cms[t]) {
+        freq->sketch = cms_query(ctxt->cms[t], hash);
+        freq->sketch_error = cms_error(ctxt->cms[t]);
+        freq->have_sketch = 1;
+    }
+}
+
+// tables a lookup key can be in: ipv4 addresses go to the ip tables,
+// plain numbers to the port table, AS<n> and CC/SUB to the geo tables and
+// anything else to the name tables. sets the range of tables and the int
+// key of int tables, returns 0 if the key cannot be in any
+static int dnsctxt_lookup_key(const char *key, int *first, int *last, uint32_t *ikey) {
+    uint32_t addr;
+    char *end;
+    unsigned long port;
+
+    if (inet_pton(AF_INET, key, &addr) == 1) {
+        *first = DNS_TABLE_SOURCE;
+        *last = DNS_TABLE_MALFORMED;
+        *ikey = addr;
+        return 1;
+    }
+
+    port = strtoul(key, &end, 10);
+    if (*key && !*end && port <= 65535) {
+        *first = *last = DNS_TABLE_SRC_PORT;
+        *ikey = port;
+        return 1;
+    }
+
+    // AS13335, or a location as printed, US/CA
+    if ((key[0] == 'A' || key[0] == 'a') && (key[1] == 'S' || key[1] == 's') && isdigit(key[2])) {
+        addr = strtoul(key + 2, &end, 10);
+        if (!*end) {
+            *first = *last = DNS_TABLE_GEO_ASN;
+            *ikey = addr;
+            return 1;
+        }
+    }
+    if ((end = strchr(key, '/'))) {
+        addr = geoip_loc_code(key, end - key, end + 1, strlen(end + 1));
+        if (!addr)
+            return 0;
+        *first = *last = DNS_TABLE_GEO_LOC;
+        *ikey = addr;
+        return 1;
+    }
+
+    if (strlen(key) >= MAX_DNAME_LEN)
+        return 0;
+    *first = DNS_TABLE_QNAME;
+    *last = DNS_TABLE_NR - 1;
+
+    return 1;
+}
+
+// query every table the key can be in, see dnsctxt_lookup_key. returns
+// how many tables were queried
+int dnsctxt_lookup(struct dnsctxt *ctxt, const char *key, struct dnsctxt_freq freq[DNS_TABLE_NR]) {
+    uint32_t ikey = 0;
+    int t, first, last, n = 0;
+
+    memset(freq, 0, DNS_TABLE_NR * sizeof(freq[0]));
+    dnsctxt_geo_flush(ctxt);
+
+    if (!dnsctxt_lookup_key(key, &first, &last, &ikey))
+        return 0;
+    for (t = first; t <= last; t++, n++) {
+        if (DNS_TABLE_IS_INT(t))
+            dnsctxt_query_ip(ctxt, t, ikey, &freq[t]);
+        else
+            dnsctxt_query_name(ctxt, t, key, &freq[t]);
+        freq[t].queried = 1;
+    }
+
+    return n;
+}
+
+// NULL without sketches. the copies are allocated here, once
+struct dnsctxt_sketches *dnsctxt_enable_sketches(struct dnsctxt *ctxt) {
+    struct dnsctxt_sketches *sk;
+    int i;
+
+    if (ctxt->sketches)
+        return ctxt->sketches;
+    for (i = 0; i < DNS_TABLE_NR && !ctxt->cms[i]; i++)
+        ;
+    if (i == DNS_TABLE_NR)
+        return NULL;
+
+    sk = xzmalloc(sizeof(*sk));
+    pthread_mutex_init(&sk->lock, NULL);
+    pthread_cond_init(&sk->refreshed, NULL);
+    sk->name_depth = ctxt->qnames->depth;
+    for (i = 0; i < DNS_TABLE_NR; i++) {
+        if (ctxt->cms[i])
+            sk->cms[i] = cms_dup(ctxt->cms[i]);
+    }
+    ctxt->sketches = sk;
+
+    return sk;
+}
+
+// on the capture thread, at publish time: refresh the copy if a reader
+// waits for it, never block on one
+static void dnsctxt_refresh_sketches(struct dnsctxt *ctxt) {
+    struct dnsctxt_sketches *sk = ctxt->sketches;
+    int i;
+
+    if (!__atomic_load_n(&sk->wanted, __ATOMIC_RELAXED) || pthread_mutex_trylock(&sk->lock))
+        return;
+    for (i = 0; i < DNS_TABLE_NR; i++) {
+        if (sk->cms[i])
+            cms_copy(sk->cms[i], ctxt->cms[i]);
+    }
+    sk->wanted = 0;
+    sk->nr_refresh++;
+    pthread_cond_broadcast(&sk->refreshed);
+    pthread_mutex_unlock(&sk->lock);
+}
+
+// sketch only lookup, from any thread. waits for the next publish to
+// refresh the copy, or answers from the last one after
+// DNSCTXT_SKETCHES_WAIT_SEC if capture is idle. returns how many tables
+// were queried
+int dnsctxt_lookup_sketches(struct dnsctxt_sketches *sk, const char *key, struct dnsctxt_freq freq[DNS_TABLE_NR]) {
+    struct timespec deadline;
+    uint64_t nr_refresh, hash;
+    uint32_t ikey = 0;
+    int t, first, last, n = 0;
+
+    memset(freq, 0, DNS_TABLE_NR * sizeof(freq[0]));
+    if (!dnsctxt_lookup_key(key, &first, &last, &ikey))
+        return 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += DNSCTXT_SKETCHES_WAIT_SEC;
+    pthread_mutex_lock(&sk->lock);
+    nr_refresh = sk->nr_refresh;
+    __atomic_store_n(&sk->wanted, 1, __ATOMIC_RELAXED);
+    while (sk->nr_refresh == nr_refresh) {
+        if (pthread_cond_timedwait(&sk->refreshed, &sk->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    for (t = first; t <= last; t++, n++) {
+        freq[t].queried = 1;
+        if (!sk->cms[t])
+            continue;
+        if (DNS_TABLE_IS_INT(t))
+            hash = hll_hash_u32(ikey);
+        else if (t == DNS_TABLE_QNAME)
+            hash = ntree_hash(key, sk->name_depth);
+        else
+            hash = hll_hash_mem(key, strlen(key));
+        freq[t].sketch = cms_query(sk->cms[t], hash);
+        freq[t].sketch_error = cms_error(sk->cms[t]);
+        freq[t].have_sketch = 1;
+    }
+    pthread_mutex_unlock(&sk->lock);
+
+    return n;
+}
+
+// zones of the name tree with a label sketch, the highest ratio of
+// distinct leftmost labels to queries first. a zone under a random
+// subdomain flood goes towards 1, a busy but normal one towards 0
+size_t dnsctxt_zone_ranking(struct dnsctxt *ctxt, struct dnsctxt_zone_rank *rank, size_t max) {
+    struct ntree *t = ctxt->qnames;
+    struct ntree_node *entry;
+    struct dnsctxt_zone_rank cur;
+    size_t n = 0, pos;
+    uint32_t i;
+
+    for (i = 1; i < t->nr_node; i++) {
+        entry = &t->node[i];
+        if (!entry->depth || !entry->hll || entry->count - entry->hll_start < ZONE_RANK_MIN_COUNT)
+            continue;
+
+        cur.node = i;
+        cur.queries = entry->count - entry->hll_start;
+        cur.labels = hll_count(entry->hll);
+        // the estimate can overshoot a little
+        if (cur.labels > cur.queries)
+            cur.labels = cur.queries;
+        cur.ratio = (double)cur.labels / cur.queries;
+
+        if (n == max && (!max || cur.ratio <= rank[n - 1].ratio))
+            continue;
+        pos = n < max ? n++ : n - 1;
+        while (pos > 0 && rank[pos - 1].ratio < cur.ratio) {
+            rank[pos] = rank[pos - 1];
+            pos--;
+        }
+        rank[pos] = cur;
+    }
+
+    return n;
+}
+
+// the segment stays owned by the caller
+static void dnsctxt_stage_alloc(struct dnsctxt *ctxt) {
+    if (!ctxt->stage) {
+        ctxt->stage = xzmalloc(sizeof(*ctxt->stage));
+        ctxt->stage_ts = UINT64_MAX;
+    }
+}
+
+void dnsctxt_enable_shm(struct dnsctxt *ctxt, struct statshm *shm) {
+    ctxt->shm = shm;
+    ctxt->shm_next = 0;
+    ctxt->tick_end = 0;
+    dnsctxt_stage_alloc(ctxt);
+}
+
+void dnsctxt_enable_export(struct dnsctxt *ctxt, struct export *exp, uint64_t period) {
+    ctxt->exp = exp;
+    ctxt->export_period = period;
+    ctxt->export_next = 0;
+    dnsctxt_uniq_init(&ctxt->export_uniq);
+    ctxt->tick_end = 0;
+    dnsctxt_stage_alloc(ctxt);
+}
+
+void dnsctxt_enable_shed(struct dnsctxt *ctxt) {
+    ctxt->shed.enabled = 1;
+    ctxt->shed.next = 0;
+}
+
+// one step down or up per check, returns 1 if the tier or rate changed
+int dnsctxt_shed_update(struct dnsctxt *ctxt, unsigned int occupancy, uint64_t drops) {
+
+    struct dnsctxt_shed *s = &ctxt->shed;
+    int pressure, changed = 0;
+
+    pressure = drops > s->drops || (occupancy >= DNS_SHED_HIGH && occupancy >= s->occupancy);
+    s->occupancy = occupancy;
+    s->drops = drops;
+    s->next = ctxt->now + DNS_SHED_CHECK;
+    if (!s->calm_since)
+        s->calm_since = ctxt->now;
+
+    if (pressure) {
+        s->calm_since = ctxt->now;
+        if (s->tier == DNS_TIER_FULL) {
+            s->tier = DNS_TIER_HEADER;
+            changed = 1;
+        }
+        else if (s->tier == DNS_TIER_HEADER) {
+            s->tier = DNS_TIER_SAMPLE;
+            s->rate = 2;
+            changed = 1;
+        }
+        else if (s->rate < DNS_SHED_RATE_MAX) {
+            s->rate *= 2;
+            changed = 1;
+        }
+    }
+    else if (occupancy < DNS_SHED_LOW && ctxt->now - s->calm_since >= DNS_SHED_CALM) {
+        s->calm_since = ctxt->now;
+        if (s->tier == DNS_TIER_SAMPLE && s->rate > 2) {
+            s->rate /= 2;
+            changed = 1;
+        }
+        else if (s->tier == DNS_TIER_SAMPLE) {
+            s->tier = DNS_TIER_HEADER;
+            s->rate = 1;
+            changed = 1;
+        }
+        else if (s->tier == DNS_TIER_HEADER) {
+            s->tier = DNS_TIER_FULL;
+            changed = 1;
+        }
+    }
+
+    if (changed) {
+        s->skip = 0;
+        s->nr_change++;
+    }
+
+    return changed;
+
+}
+
+// the path stays owned by the caller
+void dnsctxt_enable_state(struct dnsctxt *ctxt, const char *path, uint64_t period) {
+    ctxt->state_path = path;
+    ctxt->state_period = period;
+    ctxt->state_next = 0;
+    ctxt->tick_end = 0;
+    dnsctxt_stage_alloc(ctxt);
+}
+
+// a failed save keeps the last good file, capture goes on
+void dnsctxt_save_state(struct dnsctxt *ctxt) {
+    if (state_save(ctxt, ctxt->state_path))
+        fprintf(stderr, "Cannot save state to %s: %s\n", ctxt->state_path, strerror(errno));
+}
+
+struct publish_top {
+    uint32_t key;
+    uint64_t count;
+    double rate, by;
+};
+
+// keep the STATSHM_TOPK largest in top, without sorting the table
+static void publish_add(struct publish_top *top, uint32_t *n, uint32_t key, uint64_t count,
+                        double *score, uint32_t *epoch) {
+    double rate = 0, by = count;
+    uint32_t pos = *n;
+
+    if (dnsctxt_decay.tau) {
+        dnsctxt_decay_rescale(score, epoch);
+        by = rate = dnsctxt_decay_rate(*score);
+    }
+    if (pos == STATSHM_TOPK) {
+        if (by <= top[pos - 1].by)
+            return;
+        pos--;
+    }
+    else {
+        (*n)++;
+    }
+    while (pos > 0 && top[pos - 1].by < by) {
+        top[pos] = top[pos - 1];
+        pos--;
+    }
+    top[pos].key = key;
+    top[pos].count = count;
+    top[pos].rate = rate;
+    top[pos].by = by;
+}
+
+static void publish_table(struct dnsctxt *ctxt, enum dnsctxt_table t, struct statshm_table *out) {
+    struct publish_top top[STATSHM_TOPK];
+    struct int32_entry **itable = dnsctxt_int_table(ctxt, t), *ientry, *itmp;
+    struct str_entry **stable = dnsctxt_str_table(ctxt, t), *sentry, *stmp;
+    struct statshm_entry *e;
+    uint32_t i, n = 0;
+
+    if (itable) {
+        HASH_ITER(hh, *itable, ientry, itmp)
+            publish_add(top, &n, ientry->key, ientry->count, &ientry->score, &ientry->epoch);
+    }
+    if (stable) {
+        HASH_ITER(hh, *stable, sentry, stmp)
+            publish_add(top, &n, sentry->key, sentry->count, &sentry->score, &sentry->epoch);
+    }
+
+    snprintf(out->title, sizeof(out->title), "%s", dnsctxt_table_name[t]);
+    for (i = 0; i < n; i++) {
+        e = &out->entry[i];
+        e->count = top[i].count;
+        e->rate = top[i].rate;
+        switch (t) {
+        case DNS_TABLE_SOURCE:
+        case DNS_TABLE_DEST:
+        case DNS_TABLE_MALFORMED:
+            inet_ntop(AF_INET, &top[i].key, e->key, sizeof(e->key));
+            break;
+        case DNS_TABLE_SRC_PORT:
+            snprintf(e->key, sizeof(e->key), "%u", top[i].key);
+            break;
+        case DNS_TABLE_GEO_ASN:
+        case DNS_TABLE_GEO_LOC:
+            dnsctxt_geo_str(t, top[i].key, e->key, sizeof(e->key));
+            break;
+        default:
+            snprintf(e->key, sizeof(e->key), "%s", intern_str(&dnsctxt_names, top[i].key));
+            break;
+        }
+    }
+    out->n = n;
+}
+
+static void publish_names(struct ntree *t, unsigned int depth, struct statshm_table *out) {
+    uint32_t top[STATSHM_TOPK];
+    struct ntree_node *node;
+    size_t i, n = 0;
+
+    snprintf(out->title, sizeof(out->title), "Queried Names (%u)", depth);
+    if (depth <= t->depth)
+        n = ntree_top_depth(t, depth, dnsctxt_decay.tau ? dnsctxt_name_score : dnsctxt_name_count,
+                            top, STATSHM_TOPK);
+    for (i = 0; i < n; i++) {
+        node = &t->node[top[i]];
+        ntree_name(t, top[i], out->entry[i].key, sizeof(out->entry[i].key));
+        out->entry[i].count = node->count;
+        out->entry[i].rate = dnsctxt_decay.tau ? dnsctxt_decay_rate(node->score) : 0;
+    }
+    out->n = n;
+}
+
+// build the tables aside, so readers only wait for the copy into the
+// segment or file. nothing to rebuild without a packet since the last time
+void dnsctxt_stage(struct dnsctxt *ctxt) {
+    struct statshm_data *data = ctxt->stage;
+    uint32_t nr = 0;
+    int t;
+
+    if (ctxt->stage_ts == ctxt->now && ctxt->stage_seen == ctxt->seen)
         return;
+    ctxt->stage_ts = ctxt->now;
+    ctxt->stage_seen = ctxt->seen;
+
+    bug_on(DNS_TABLE_NR + 1 > STATSHM_TABLES);
+    bug_on(DNS_LAT_BUCKETS != STATSHM_LAT_BUCKETS);
+
+    dnsctxt_geo_flush(ctxt);
+
+    data->ts = ctxt->now;
+    data->first_ts = ctxt->first_ts;
+    data->seen = ctxt->seen;
+    data->incoming = ctxt->incoming;
+    data->cnt_query = ctxt->cnt_query;
+    data->cnt_reply = ctxt->cnt_reply;
+    data->cnt_status_noerror = ctxt->cnt_status_noerror;
+    data->cnt_status_srvfail = ctxt->cnt_status_srvfail;
+    data->cnt_status_nxdomain = ctxt->cnt_status_nxdomain;
+    data->cnt_status_refused = ctxt->cnt_status_refused;
+    data->cnt_malformed = ctxt->cnt_malformed;
+    data->cnt_edns = ctxt->cnt_edns;
+    data->uniq_source = hll_count(ctxt->uniq.source);
+    data->uniq_source24 = hll_count(ctxt->uniq.source24);
+    data->uniq_qname = hll_count(ctxt->uniq.qname);
+    memcpy(data->lat_bound, dnsctxt_lat_bound, sizeof(data->lat_bound));
+    memcpy(data->lat_bucket, ctxt->lat->bucket, sizeof(data->lat_bucket));
+    data->lat_sum = ctxt->lat->sum;
+    data->lat_count = ctxt->lat->count;
+    data->lat_unmatched = ctxt->lat->unmatched;
+    data->shed_tier = ctxt->shed.tier;
+    data->shed_rate = ctxt->shed.rate;
+    data->kernel_drops = ctxt->shed.drops;
+    data->sampled_out = ctxt->shed.sampled_out;
+
+    for (t = 0; t < DNS_TABLE_NR; t++) {
+        if (t == DNS_TABLE_QNAME)
+            publish_names(ctxt->qnames, 2, &data->table[nr++]);
+        else
+            publish_table(ctxt, t, &data->table[nr++]);
     }
-    lru_add_str(table, name);
+    publish_names(ctxt->qnames, 3, &data->table[nr++]);
+    data->nr_table = nr;
+}
+
+void dnsctxt_publish(struct dnsctxt *ctxt) {
+    dnsctxt_stage(ctxt);
+    statshm_write_begin(ctxt->shm);
+    memcpy(&ctxt->shm->data, ctxt->stage, sizeof(*ctxt->stage));
+    statshm_write_end(ctxt->shm);
+    if (ctxt->sketches)
+        dnsctxt_refresh_sketches(ctxt);
+}
+
+// a record's sketches cover its period, like its counter deltas, so
+// unions of them give the distinct counts of any span of records
+void dnsctxt_export(struct dnsctxt *ctxt) {
+    struct hll *uniq[EXPORT_SKETCHES] = {
+        [EXPORT_UNIQ_SOURCE] = ctxt->export_uniq.source,
+        [EXPORT_UNIQ_SOURCE24] = ctxt->export_uniq.source24,
+        [EXPORT_UNIQ_QNAME] = ctxt->export_uniq.qname,
+    };
 
+    dnsctxt_stage(ctxt);
+    export_send(ctxt->exp, ctxt->stage, uniq);
+    dnsctxt_uniq_reset(&ctxt->export_uniq);
 }
@@ -5,7 +5,22 @@
 #ifndef DNSCTXT_H
 #define DNSCTXT_H
 
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <arpa/inet.h>
+
 #include "uthash.h"
+#include "hll.h"
+#include "cms.h"
+#include "lpm.h"
+#include "netset.h"
+#include "nametree.h"
+#include "intern.h"
+#include "slab.h"
+#include "statshm.h"
 
 // max length of domain name. 253 is the max according to standard,
 // can make it smaller if we truncate and save memory
@@ -18,27 +33,226 @@
 // max summary table size
 #define MAX_SUMMARY_SIZE 20
 
+// per zone distinct leftmost label sketches, for random subdomain
+// (water torture) floods. a zone gets one once it has ZONE_HLL_MIN_COUNT
+// queries and while fewer than ZONE_HLL_MAX are live, so names that are
+// random down to the zone never get one and memory stays at
+// ZONE_HLL_MAX * hll_size(ZONE_HLL_P) whatever the query rate
+#define ZONE_HLL_P 8
+#define ZONE_HLL_MIN_COUNT 64
+#define ZONE_HLL_MAX 1024
+
+// zones with fewer queries since their sketch are not ranked
+#define ZONE_RANK_MIN_COUNT 256
+
 // accumulator hash table keyed by ip address (in int form)
 // or other 32 bit key
 struct int32_entry {
     uint32_t key;
     uint64_t count;
+    // time decayed count, see struct dnsctxt_decay
+    double score;
+    uint32_t epoch;
     // LRU hash
     UT_hash_handle hh;
     // sorted hash
     UT_hash_handle hh_srt;
 };
 
-// accumulator hash table keyed by string
+// accumulator hash table keyed by string, interned in dnsctxt_names. the
+// entry holds a reference to it, and the table is keyed by the handle
 struct str_entry {
-    char key[MAX_DNAME_LEN];
+    uint32_t key;
     uint64_t count;
+    double score;
+    uint32_t epoch;
     // LRU hash
     UT_hash_handle hh;
     // sorted hash
     UT_hash_handle hh_srt;
 };
 
+// a zone ranked by distinct leftmost labels per query
+struct dnsctxt_zone_rank {
+    // in dnsctxt.qnames
+    uint32_t node;
+    uint64_t queries;
+    uint64_t labels;
+    double ratio;
+};
+
+struct dnswin;
+struct export;
+
+// forward decay: a hit at time t adds exp((t - landmark) / tau) to the score
+// of its key. scores of different keys compare as their current decayed
+// rates without touching them, so tables rank by what is loud right now at
+// the cost of an add. the landmark moves every DECAY_EPOCH_TAUS * tau to
+// keep weights finite; entries of older epochs are rescaled when touched
+// or read. the weight is refreshed every DECAY_RES of the dnsctxt clock.
+#define DECAY_EPOCH_TAUS 64
+#define DECAY_RES 1000000ULL
+
+struct dnsctxt_decay {
+    uint64_t tau;
+    uint64_t landmark;
+    uint64_t next;
+    uint32_t epoch;
+    double weight;
+};
+
+extern struct dnsctxt_decay dnsctxt_decay;
+
+// keys of every str_entry table, the windows' included
+extern struct intern dnsctxt_names;
+
+// aggregation tables, int keyed ones first
+enum dnsctxt_table {
+    DNS_TABLE_SOURCE,
+    DNS_TABLE_DEST,
+    DNS_TABLE_MALFORMED,
+    DNS_TABLE_SRC_PORT,
+    DNS_TABLE_GEO_ASN,
+    DNS_TABLE_GEO_LOC,
+    DNS_TABLE_QNAME,
+    DNS_TABLE_NXDOMAIN,
+    DNS_TABLE_REFUSED,
+    DNS_TABLE_QTYPE,
+    DNS_TABLE_NR
+};
+
+#define DNS_TABLE_IS_INT(t) ((t) < DNS_TABLE_QNAME)
+
+// the ip tables have prefix rollups, per address family
+#define DNS_PREFIX_NR (DNS_TABLE_MALFORMED + 1)
+
+extern const char *dnsctxt_table_name[DNS_TABLE_NR];
+
+// source /24 packet counts waiting to be resolved to geo. distinct /24s
+// are far fewer than packets, so resolving each once per flush, weighted
+// by its count, takes the database off the per packet path. past
+// DNS_GEO_DEFER_MAX slots, as under a flood of spoofed sources, the table
+// is flushed instead of grown
+#define DNS_GEO_DEFER_MAX (1 << 16)
+
+struct dnsctxt_geo_defer {
+    // host order /24 plus one, 0 for an empty slot
+    uint32_t *key;
+    uint32_t *count;
+    uint32_t mask, nr;
+};
+
+// answer to a point query: the table count is exact but only covers the
+// time since the key last entered the table; the sketch, if any, bounds
+// the count since start from above
+struct dnsctxt_freq {
+    uint64_t table;
+    int in_table;
+    uint64_t sketch;
+    uint64_t sketch_error;
+    int have_sketch;
+    int queried;
+};
+
+// longest a sketch lookup waits for a fresh copy, two publish periods
+#define DNSCTXT_SKETCHES_WAIT_SEC 2
+
+// copy of the Count-Min sketches for point queries from another thread.
+// copying them all costs up to a few hundred MB of memcpy, so it is only
+// refreshed on demand: a reader sets wanted and waits for the next publish
+// to copy, under the lock, which the capture thread only ever trylocks
+struct dnsctxt_sketches {
+    pthread_mutex_t lock;
+    pthread_cond_t refreshed;
+    int wanted;
+    uint64_t nr_refresh;
+    // name tree depth the qname sketch hashes at
+    unsigned int name_depth;
+    struct cms *cms[DNS_TABLE_NR];
+};
+
+// distinct source ips, source /24s and qnames
+struct dnsctxt_uniq {
+    struct hll *source;
+    struct hll *source24;
+    struct hll *qname;
+};
+
+// point in time copy of the general counters, for rates
+struct dnsctxt_snap {
+    uint64_t ts;
+    uint64_t seen;
+    uint64_t incoming;
+    uint64_t cnt_query;
+    uint64_t cnt_reply;
+    uint64_t cnt_status_srvfail;
+    uint64_t cnt_status_nxdomain;
+    uint64_t cnt_status_refused;
+    uint64_t cnt_malformed;
+};
+
+// query to reply latency of the server side: incoming queries are kept by
+// client address, port and id in a direct mapped table, where a query
+// landing on a taken slot replaces the older one, and the outgoing reply
+// that matches is timed into the histogram. dnsctxt_lat_bound are the
+// upper bounds of the buckets in ns, the last one catches the rest
+#define DNS_LAT_SLOTS (64 * 1024)
+#define DNS_LAT_BUCKETS 14
+
+extern const uint64_t dnsctxt_lat_bound[DNS_LAT_BUCKETS];
+
+struct dnsctxt_latency {
+    uint64_t tag[DNS_LAT_SLOTS];
+    uint64_t ts[DNS_LAT_SLOTS];
+    // not cumulative
+    uint64_t bucket[DNS_LAT_BUCKETS];
+    uint64_t sum;
+    uint64_t count;
+    // replies without a query
+    uint64_t unmatched;
+};
+
+// load shedding: when the capture falls behind, the analysis steps down
+// to cheaper tiers instead of letting the kernel drop packets at random.
+// the capture looks at the ring every DNS_SHED_CHECK of the dnsctxt clock
+// and reports how full it is and the kernel drops so far. a check with new
+// drops, or with the ring over DNS_SHED_HIGH percent full and not draining,
+// steps down one tier: from the full parse to the header counters only,
+// then to the header counters of 1 in 2 packets, 1 in 4 and so on to
+// DNS_SHED_RATE_MAX, each sampled packet counting for rate. once the ring
+// stayed under DNS_SHED_LOW percent without drops for DNS_SHED_CALM, it
+// steps back up one tier, and so on until the full parse again.
+#define DNS_SHED_CHECK (100 * 1000000ULL)
+#define DNS_SHED_CALM (2 * 1000000000ULL)
+#define DNS_SHED_HIGH 50
+#define DNS_SHED_LOW 12
+#define DNS_SHED_RATE_MAX 1024
+
+enum dnsctxt_tier {
+    DNS_TIER_FULL,
+    DNS_TIER_HEADER,
+    DNS_TIER_SAMPLE,
+    DNS_TIER_NR
+};
+
+extern const char *dnsctxt_tier_name[DNS_TIER_NR];
+
+struct dnsctxt_shed {
+    int enabled;
+    enum dnsctxt_tier tier;
+    // 1 in rate packets analysed, 1 but in DNS_TIER_SAMPLE
+    uint32_t rate;
+    // packets to skip before the next sample
+    uint32_t skip;
+    uint64_t next;
+    uint64_t calm_since;
+    // ring percent full and kernel drops since start at the last check
+    unsigned int occupancy;
+    uint64_t drops;
+    uint64_t nr_change;
+    uint64_t sampled_out;
+};
+
 // context structure that gets passed to dns processing function
 struct dnsctxt {
 
@@ -53,9 +267,8 @@ struct dnsctxt {
     // src ports
     struct int32_entry *src_port_table;
 
-    // queried name tables, for 2,3 label lengths
-    struct str_entry *query_name2_table;
-    struct str_entry *query_name3_table;
+    // queried names by suffix, at every depth
+    struct ntree *qnames;
 
     // NXDOMAIN names
     struct str_entry *nxdomain_table;
@@ -66,20 +279,38 @@ struct dnsctxt {
     // QUERY types
     struct str_entry *qtype_table;
 
-    // GEO
+    // GEO, keyed by ASN and by geoip_loc_code, see dnsctxt_geo_str
     int have_geo_asn;
     int have_geo_loc;
-    struct str_entry *geo_asn_table;
-    struct str_entry *geo_loc_table;
+    struct int32_entry *geo_asn_table;
+    struct int32_entry *geo_loc_table;
+
+    // entries of the tables above
+    struct slab int_slab;
+    struct slab str_slab;
 
-    // local network so we can decide what is "incoming" vs "outgoing"
-    uint32_t local_net;
-    uint8_t local_bits;
+    // local networks so we can decide what is "incoming" vs "outgoing",
+    // families without any fall back to the packet type
+    struct netset local;
+
+    // distinct counts since start
+    struct dnsctxt_uniq uniq;
+
+    // Count-Min sketches next to the tables, NULL if off
+    struct cms *cms[DNS_TABLE_NR];
+    // their copy for lookups from other threads, NULL if off
+    struct dnsctxt_sketches *sketches;
+
+    // prefix rollups of the ip tables, NULL if off
+    struct lpm *prefix4[DNS_PREFIX_NR];
+    struct lpm *prefix6[DNS_PREFIX_NR];
 
     // general packet counters
     uint64_t seen;
     uint64_t incoming;
 
+    struct dnsctxt_latency *lat;
+
     // dns header counters
     uint64_t cnt_query;
     uint64_t cnt_reply;
@@ -92,17 +323,252 @@ struct dnsctxt {
     uint64_t cnt_malformed;
     uint64_t cnt_edns;
 
+    // clock in ns since the epoch, advanced by packet timestamps. in event
+    // time mode (pcap input) it replaces the wall clock for rates, dump
+    // rotation and snapshots, so offline runs report capture time figures
+    int event_time;
+    uint64_t first_ts;
+    uint64_t now;
+
+    // snapshot interval in ns (0 = off), end of the current one and the
+    // counters at its start, plus both ends of the last closed one
+    uint64_t interval;
+    uint64_t interval_end;
+    struct dnsctxt_snap interval_start;
+    struct dnsctxt_snap closed_start, closed_end;
+
+    // earliest time dnsctxt_tick has work to do
+    uint64_t tick_end;
+
+    // tumbling windows, NULL if off
+    struct dnswin *win;
+
+    // geo resolved per source /24 when the tables are read instead of
+    // per packet, NULL if off
+    struct dnsctxt_geo_defer *geo_defer;
+
+    // counters and top tables published to readers in other processes
+    // every shm->period, NULL if off
+    struct statshm *shm;
+    uint64_t shm_next;
+
+    // binary records sent every export_period, NULL if off
+    struct export *exp;
+    uint64_t export_period;
+    uint64_t export_next;
+    // distinct counts since the last record, only with exp
+    struct dnsctxt_uniq export_uniq;
+
+    // aggregation state saved to a file every state_period, NULL if off
+    const char *state_path;
+    uint64_t state_period;
+    uint64_t state_next;
+
+    // analysis tier under load, see struct dnsctxt_shed
+    struct dnsctxt_shed shed;
+
+    // counters and top tables rendered for the ones above, built once
+    // when several are due at the same time
+    struct statshm_data *stage;
+    uint64_t stage_ts, stage_seen;
+
 };
 
-void dnsctxt_init(struct dnsctxt *ctxt, uint32_t local_net, uint8_t local_bits);
+void dnsctxt_init(struct dnsctxt *ctxt);
 void dnsctxt_free(struct dnsctxt *ctxt);
 void dnsctxt_table_summary(struct dnsctxt *ctxt, int size);
 
-void dnsctxt_count_ip(struct int32_entry **table, uint32_t key);
-void dnsctxt_count_name(struct str_entry **table, char *name);
-#define dnsctxt_count_int dnsctxt_count_ip
+void dnsctxt_count_ip_max(struct int32_entry **table, struct slab *slab, uint32_t key, unsigned int max);
+struct str_entry *dnsctxt_count_name_max(struct str_entry **table, struct slab *slab, char *name, unsigned int max);
+struct str_entry *dnsctxt_count_name_hash(struct str_entry **table, struct slab *slab, const char *name,
+                                          size_t len, uint64_t hash, unsigned int max);
+void dnsctxt_track_ip(struct dnsctxt *ctxt, enum dnsctxt_table t, uint32_t key);
+struct str_entry *dnsctxt_track_name(struct dnsctxt *ctxt, enum dnsctxt_table t, const char *name);
+struct ntree_node *dnsctxt_track_qname(struct dnsctxt *ctxt, const char *qname);
+void dnsctxt_set_name_tree(struct dnsctxt *ctxt, unsigned int depth, uint32_t max_node);
+double dnsctxt_name_count(struct ntree_node *node);
+double dnsctxt_name_score(struct ntree_node *node);
+void dnsctxt_track_ip6(struct dnsctxt *ctxt, enum dnsctxt_table t, const uint8_t *addr);
+void dnsctxt_set_prefixes(struct dnsctxt *ctxt, const uint8_t *len4, int nr_len4, const uint8_t *len6, int nr_len6);
+void dnsctxt_enable_cms(struct dnsctxt *ctxt, unsigned int bits);
+void dnsctxt_query_ip(struct dnsctxt *ctxt, enum dnsctxt_table t, uint32_t key, struct dnsctxt_freq *freq);
+void dnsctxt_query_name(struct dnsctxt *ctxt, enum dnsctxt_table t, const char *name, struct dnsctxt_freq *freq);
+size_t dnsctxt_zone_ranking(struct dnsctxt *ctxt, struct dnsctxt_zone_rank *rank, size_t max);
+int dnsctxt_lookup(struct dnsctxt *ctxt, const char *key, struct dnsctxt_freq freq[DNS_TABLE_NR]);
+struct dnsctxt_sketches *dnsctxt_enable_sketches(struct dnsctxt *ctxt);
+int dnsctxt_lookup_sketches(struct dnsctxt_sketches *sk, const char *key, struct dnsctxt_freq freq[DNS_TABLE_NR]);
+char *dnsctxt_geo_str(enum dnsctxt_table t, uint32_t key, char *buf, size_t size);
+void dnsctxt_enable_geo_defer(struct dnsctxt *ctxt);
+void dnsctxt_geo_defer_grow(struct dnsctxt_geo_defer *defer);
+void dnsctxt_geo_flush(struct dnsctxt *ctxt);
+void dnsctxt_enable_shm(struct dnsctxt *ctxt, struct statshm *shm);
+void dnsctxt_publish(struct dnsctxt *ctxt);
+void dnsctxt_enable_export(struct dnsctxt *ctxt, struct export *exp, uint64_t period);
+void dnsctxt_export(struct dnsctxt *ctxt);
+void dnsctxt_enable_shed(struct dnsctxt *ctxt);
+int dnsctxt_shed_update(struct dnsctxt *ctxt, unsigned int occupancy, uint64_t drops);
+void dnsctxt_enable_state(struct dnsctxt *ctxt, const char *path, uint64_t period);
+void dnsctxt_save_state(struct dnsctxt *ctxt);
+void dnsctxt_stage(struct dnsctxt *ctxt);
+struct int32_entry **dnsctxt_int_table(struct dnsctxt *ctxt, enum dnsctxt_table t);
+struct str_entry **dnsctxt_str_table(struct dnsctxt *ctxt, enum dnsctxt_table t);
+void dnsctxt_free_int_table(struct int32_entry **table, struct slab *slab);
+void dnsctxt_free_str_table(struct str_entry **table, struct slab *slab);
+
+void dnsctxt_snapshot(struct dnsctxt *ctxt, struct dnsctxt_snap *snap, uint64_t ts);
+void dnsctxt_set_interval(struct dnsctxt *ctxt, uint64_t interval);
+int __dnsctxt_tick(struct dnsctxt *ctxt, uint64_t ts);
+
+// advance the clock to a packet timestamp, which may be slightly out of
+// order. returns 1 when it crossed the end of the snapshot interval,
+// closes tumbling windows on the way
+static inline int dnsctxt_tick(struct dnsctxt *ctxt, uint64_t ts) {
+    if (ts <= ctxt->now)
+        return 0;
+    if (ts < ctxt->tick_end) {
+        ctxt->now = ts;
+        return 0;
+    }
+    return __dnsctxt_tick(ctxt, ts);
+}
+
+// a check of the capture backlog is due
+static inline int dnsctxt_shed_due(const struct dnsctxt *ctxt) {
+    return ctxt->shed.enabled && ctxt->now >= ctxt->shed.next;
+}
+
+// in DNS_TIER_SAMPLE the capture hands only 1 in rate packets on
+static inline int dnsctxt_shed_skip(struct dnsctxt *ctxt) {
+    struct dnsctxt_shed *s = &ctxt->shed;
+
+    if (likely(s->tier != DNS_TIER_SAMPLE))
+        return 0;
+    if (s->skip) {
+        s->skip--;
+        s->sampled_out++;
+        return 1;
+    }
+    s->skip = s->rate - 1;
+    return 0;
+}
+
+void dnsctxt_set_decay(struct dnsctxt *ctxt, uint64_t tau);
+
+// bring a score to the current epoch, call before comparing scores
+static inline void dnsctxt_decay_rescale(double *score, uint32_t *epoch) {
+    if (*epoch != dnsctxt_decay.epoch) {
+        *score *= exp(-(double)(dnsctxt_decay.epoch - *epoch) * DECAY_EPOCH_TAUS);
+        *epoch = dnsctxt_decay.epoch;
+    }
+}
+
+static inline void dnsctxt_decay_hit(double *score, uint32_t *epoch) {
+    if (!dnsctxt_decay.tau)
+        return;
+    dnsctxt_decay_rescale(score, epoch);
+    *score += dnsctxt_decay.weight;
+}
+
+static inline void dnsctxt_decay_hit_n(double *score, uint32_t *epoch, uint64_t n) {
+    if (!dnsctxt_decay.tau)
+        return;
+    dnsctxt_decay_rescale(score, epoch);
+    *score += dnsctxt_decay.weight * n;
+}
+
+// current rate per second of a rescaled score
+static inline double dnsctxt_decay_rate(double score) {
+    return score / dnsctxt_decay.weight / ((double)dnsctxt_decay.tau / 1e9);
+}
+
+void dnsctxt_uniq_init(struct dnsctxt_uniq *uniq);
+void dnsctxt_uniq_reset(struct dnsctxt_uniq *uniq);
+void dnsctxt_uniq_free(struct dnsctxt_uniq *uniq);
+
+// one hash per key, shared by all sketches the key goes into
+static inline void dnsctxt_uniq_source(struct dnsctxt_uniq *uniq, uint64_t h_source, uint64_t h_source24) {
+    hll_add(uniq->source, h_source);
+    hll_add(uniq->source24, h_source24);
+}
+
+static inline void dnsctxt_geo_defer(struct dnsctxt *ctxt, uint32_t addr) {
+    struct dnsctxt_geo_defer *d = ctxt->geo_defer;
+    uint32_t key = (ntohl(addr) >> 8) + 1, i;
+
+    for (i = hll_hash_u32(key) & d->mask; d->key[i]; i = (i + 1) & d->mask) {
+        if (d->key[i] == key) {
+            d->count[i]++;
+            return;
+        }
+    }
+    d->key[i] = key;
+    d->count[i] = 1;
+    if (++d->nr * 2 > d->mask + 1) {
+        if (d->mask + 1 < DNS_GEO_DEFER_MAX)
+            dnsctxt_geo_defer_grow(d);
+        else
+            dnsctxt_geo_flush(ctxt);
+    }
+}
+
+static inline void dnsctxt_uniq_qname(struct dnsctxt_uniq *uniq, uint64_t h_qname) {
+    hll_add(uniq->qname, h_qname);
+}
+
+// addr is 4 or 16 bytes, port and id as on the wire. never 0, which marks
+// a free slot
+static inline uint64_t dnsctxt_lat_key(const void *addr, size_t alen, uint16_t port, uint16_t id) {
+    char key[16 + 4];
+
+    memcpy(key, addr, alen);
+    memcpy(key + alen, &port, sizeof(port));
+    memcpy(key + alen + sizeof(port), &id, sizeof(id));
+    return hll_hash_mem(key, alen + 4) | 1;
+}
+
+static inline void dnsctxt_lat_query(struct dnsctxt *ctxt, uint64_t key) {
+    uint32_t i = key & (DNS_LAT_SLOTS - 1);
+
+    ctxt->lat->tag[i] = key;
+    ctxt->lat->ts[i] = ctxt->now;
+}
+
+static inline void dnsctxt_lat_reply(struct dnsctxt *ctxt, uint64_t key) {
+    struct dnsctxt_latency *l = ctxt->lat;
+    uint32_t i = key & (DNS_LAT_SLOTS - 1), b;
+    uint64_t ns;
+
+    if (l->tag[i] != key) {
+        l->unmatched++;
+        return;
+    }
+    l->tag[i] = 0;
+    ns = ctxt->now > l->ts[i] ? ctxt->now - l->ts[i] : 0;
+    for (b = 0; b < DNS_LAT_BUCKETS - 1 && ns > dnsctxt_lat_bound[b]; b++)
+        ;
+    l->bucket[b]++;
+    l->sum += ns;
+    l->count++;
+}
+
+static inline uint64_t dnsctxt_hash_source24(uint32_t addr) {
+    return hll_hash_u32(addr & htonl(0xffffff00));
+}
+
+static inline void dnsctxt_zone_uniq(struct ntree *t, struct ntree_node *zone, uint64_t h_label) {
+    if (!zone->hll) {
+        if (zone->count < ZONE_HLL_MIN_COUNT || t->nr_hll >= ZONE_HLL_MAX)
+            return;
+        zone->hll = hll_new(ZONE_HLL_P);
+        zone->hll_start = zone->count - 1;
+        t->nr_hll++;
+    }
+    hll_add(zone->hll, h_label);
+}
 
 int sort_int_by_count(void *a, void *b);
 int sort_str_by_count(void *a, void *b);
+int sort_int_by_score(void *a, void *b);
+int sort_str_by_score(void *a, void *b);
 
 #endif /* DNSCTXT_H */
@@ -0,0 +1,336 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#include <string.h>
+
+#include "dnswindow.h"
+#include "xmalloc.h"
+
+// tumbling windows over the dnsctxt clock. each level counts into its open
+// tables; at the boundary the open and spare tables are only flipped. the
+// closed ones are reduced to their top entries and distinct counts in the
+// ring and emptied later, DNSWIN_DRAIN_STEP entries per step of packet
+// time, so capture does not stall on a boundary. a reader of the ring
+// finishes the reduction of the last window itself, and the next flip
+// whatever is left. the ring slot is reused once it is nr_ring windows
+// old, so memory stays bounded.
+
+enum {
+    DRAIN_TOP_SOURCE,
+    DRAIN_TOP_QUERY,
+    DRAIN_TOP_NXDOMAIN,
+    // distinct counts, references to the top keys; the slot is final
+    DRAIN_UNIQ,
+    DRAIN_PUT_QUERY,
+    DRAIN_PUT_NXDOMAIN,
+    DRAIN_CLEAR,
+    DRAIN_DONE
+};
+
+const uint64_t dnswin_len[DNSWIN_LEVELS] = {
+    1000000000ULL,
+    10000000000ULL,
+    60000000000ULL,
+};
+
+struct dnswin *dnswin_new(size_t nr_ring) {
+
+    struct dnswin *win = xzmalloc(sizeof(*win));
+    int i;
+
+    win->nr_ring = nr_ring;
+    for (i = 0; i < DNSWIN_LEVELS; i++) {
+        struct dnswin_level *level = &win->level[i];
+
+        level->len = dnswin_len[i];
+        level->cur = &level->tables[0];
+        level->spare = &level->tables[1];
+        level->ring = xzmalloc(nr_ring * sizeof(*level->ring));
+        dnsctxt_uniq_init(&level->tables[0].uniq);
+        dnsctxt_uniq_init(&level->tables[1].uniq);
+        slab_init(&level->tables[0].int_slab, "window int32_entry", sizeof(struct int32_entry));
+        slab_init(&level->tables[0].str_slab, "window str_entry", sizeof(struct str_entry));
+        slab_init(&level->tables[1].int_slab, "window int32_entry", sizeof(struct int32_entry));
+        slab_init(&level->tables[1].str_slab, "window str_entry", sizeof(struct str_entry));
+    }
+
+    return win;
+
+}
+
+// empty the tables: only the name references are dropped one by one, the
+// entries go with their slabs
+static void dnswin_free_tables(struct dnswin_tables *tables) {
+
+    struct str_entry *entry, *tmp_entry;
+
+    HASH_ITER(hh, tables->query_name2_table, entry, tmp_entry)
+        intern_put(&dnsctxt_names, entry->key);
+    HASH_ITER(hh, tables->nxdomain_table, entry, tmp_entry)
+        intern_put(&dnsctxt_names, entry->key);
+    HASH_CLEAR(hh, tables->source_table);
+    HASH_CLEAR(hh, tables->query_name2_table);
+    HASH_CLEAR(hh, tables->nxdomain_table);
+    slab_reset(&tables->int_slab);
+    slab_reset(&tables->str_slab);
+
+}
+
+static void top_str_put(struct dnswin_top_str *top, size_t *n) {
+
+    size_t i;
+
+    for (i = 0; i < *n; i++)
+        intern_put(&dnsctxt_names, top[i].key);
+    *n = 0;
+
+}
+
+static void dnswin_put_ring(struct dnswin *win, struct dnswin_level *level) {
+
+    size_t i;
+
+    for (i = 0; i < win->nr_ring; i++) {
+        top_str_put(level->ring[i].query, &level->ring[i].n_query);
+        top_str_put(level->ring[i].nxdomain, &level->ring[i].n_nxdomain);
+    }
+
+}
+
+// insert into a descending top list of at most DNSWIN_TOPK, returns the
+// slot. both kinds of list have their count at the same offset
+#define TOP_COUNT(top, stride, i) \
+    (*(uint64_t *)((char *)(top) + (i) * (stride) + offsetof(struct dnswin_top_int, count)))
+
+static size_t top_slot(void *top, size_t stride, size_t *n, uint64_t count) {
+
+    size_t pos = *n;
+
+    if (pos == DNSWIN_TOPK) {
+        if (count <= TOP_COUNT(top, stride, pos - 1))
+            return DNSWIN_TOPK;
+        pos--;
+    }
+    else {
+        (*n)++;
+    }
+
+    // shift smaller ones down
+    while (pos > 0 && TOP_COUNT(top, stride, pos - 1) < count) {
+        memcpy((char *)top + pos * stride, (char *)top + (pos - 1) * stride, stride);
+        pos--;
+    }
+
+    return pos;
+
+}
+
+// walks resume at *pos, NULL being the start, and return 1 when through
+
+static int drain_top_int(struct int32_entry *table, void **pos, struct dnswin_top_int *top,
+                         size_t *n, size_t *budget) {
+
+    struct int32_entry *entry = *pos ? *pos : table;
+    size_t slot;
+
+    for (; entry && *budget; entry = entry->hh.next, (*budget)--) {
+        slot = top_slot(top, sizeof(*top), n, entry->count);
+        if (slot == DNSWIN_TOPK)
+            continue;
+        top[slot].key = entry->key;
+        top[slot].count = entry->count;
+    }
+    *pos = entry;
+
+    return !entry;
+
+}
+
+// the keys that made it are referenced once the list is final
+static int drain_top_str(struct str_entry *table, void **pos, struct dnswin_top_str *top,
+                         size_t *n, size_t *budget) {
+
+    struct str_entry *entry = *pos ? *pos : table;
+    size_t slot;
+
+    for (; entry && *budget; entry = entry->hh.next, (*budget)--) {
+        slot = top_slot(top, sizeof(*top), n, entry->count);
+        if (slot == DNSWIN_TOPK)
+            continue;
+        top[slot].key = entry->key;
+        top[slot].count = entry->count;
+    }
+    *pos = entry;
+
+    return !entry;
+
+}
+
+static int drain_put_str(struct str_entry *table, void **pos, size_t *budget) {
+
+    struct str_entry *entry = *pos ? *pos : table;
+
+    for (; entry && *budget; entry = entry->hh.next, (*budget)--)
+        intern_put(&dnsctxt_names, entry->key);
+    *pos = entry;
+
+    return !entry;
+
+}
+
+// work off the closed tables up to phase until, or budget entries
+static void dnswin_drain(struct dnswin_level *level, int until, size_t budget) {
+
+    struct dnswin_tables *closed = level->drain;
+    struct dnswin_closed *slot = level->drain_slot;
+    int done;
+    size_t i;
+
+    while (level->drain && level->drain_phase < until && budget) {
+        switch (level->drain_phase) {
+        case DRAIN_TOP_SOURCE:
+            done = drain_top_int(closed->source_table, &level->drain_pos,
+                                 slot->source, &slot->n_source, &budget);
+            break;
+        case DRAIN_TOP_QUERY:
+            done = drain_top_str(closed->query_name2_table, &level->drain_pos,
+                                 slot->query, &slot->n_query, &budget);
+            break;
+        case DRAIN_TOP_NXDOMAIN:
+            done = drain_top_str(closed->nxdomain_table, &level->drain_pos,
+                                 slot->nxdomain, &slot->n_nxdomain, &budget);
+            break;
+        case DRAIN_UNIQ:
+            for (i = 0; i < slot->n_query; i++)
+                intern_ref(&dnsctxt_names, slot->query[i].key);
+            for (i = 0; i < slot->n_nxdomain; i++)
+                intern_ref(&dnsctxt_names, slot->nxdomain[i].key);
+            slot->uniq_source = hll_count(closed->uniq.source);
+            slot->uniq_source24 = hll_count(closed->uniq.source24);
+            slot->uniq_qname = hll_count(closed->uniq.qname);
+            budget--;
+            done = 1;
+            break;
+        case DRAIN_PUT_QUERY:
+            done = drain_put_str(closed->query_name2_table, &level->drain_pos, &budget);
+            break;
+        case DRAIN_PUT_NXDOMAIN:
+            done = drain_put_str(closed->nxdomain_table, &level->drain_pos, &budget);
+            break;
+        default:
+            // the names are put already, the entries go with their slabs
+            HASH_CLEAR(hh, closed->source_table);
+            HASH_CLEAR(hh, closed->query_name2_table);
+            HASH_CLEAR(hh, closed->nxdomain_table);
+            slab_reset(&closed->int_slab);
+            slab_reset(&closed->str_slab);
+            dnsctxt_uniq_reset(&closed->uniq);
+            budget--;
+            done = 1;
+            break;
+        }
+        if (done) {
+            level->drain_phase++;
+            level->drain_pos = NULL;
+        }
+    }
+
+    if (level->drain_phase == DRAIN_DONE)
+        level->drain = NULL;
+
+}
+
+static void dnswin_close(struct dnswin *win, struct dnswin_level *level, struct dnsctxt *ctxt) {
+
+    struct dnswin_closed *slot = &level->ring[level->head];
+
+    // the spare tables are the last window's, they have to be empty
+    dnswin_drain(level, DRAIN_DONE, SIZE_MAX);
+
+    // packets from here on go to the spare tables
+    level->drain = level->cur;
+    level->cur = level->spare;
+    level->spare = level->drain;
+
+    slot->start = level->start;
+    dnsctxt_snapshot(ctxt, &slot->end, level->end);
+    top_str_put(slot->query, &slot->n_query);
+    top_str_put(slot->nxdomain, &slot->n_nxdomain);
+    slot->n_source = 0;
+    level->drain_slot = slot;
+    level->drain_phase = DRAIN_TOP_SOURCE;
+    level->drain_pos = NULL;
+
+    level->head = (level->head + 1) % win->nr_ring;
+    if (level->used < win->nr_ring)
+        level->used++;
+
+}
+
+void dnswin_free(struct dnswin *win) {
+
+    int i;
+
+    for (i = 0; i < DNSWIN_LEVELS; i++) {
+        dnswin_drain(&win->level[i], DRAIN_DONE, SIZE_MAX);
+        dnswin_put_ring(win, &win->level[i]);
+        dnswin_free_tables(&win->level[i].tables[0]);
+        dnswin_free_tables(&win->level[i].tables[1]);
+        dnsctxt_uniq_free(&win->level[i].tables[0].uniq);
+        dnsctxt_uniq_free(&win->level[i].tables[1].uniq);
+        slab_destroy(&win->level[i].tables[0].int_slab);
+        slab_destroy(&win->level[i].tables[0].str_slab);
+        slab_destroy(&win->level[i].tables[1].int_slab);
+        slab_destroy(&win->level[i].tables[1].str_slab);
+        xfree(win->level[i].ring);
+    }
+    xfree(win);
+
+}
+
+// called from the slow path of dnsctxt_tick, returns the next boundary
+uint64_t dnswin_tick(struct dnswin *win, struct dnsctxt *ctxt, uint64_t ts) {
+
+    uint64_t next = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < DNSWIN_LEVELS; i++) {
+        struct dnswin_level *level = &win->level[i];
+
+        if (ts >= level->end) {
+            // a gap in traffic closes the open window only, empty ones
+            // in between are not recorded
+            if (level->end)
+                dnswin_close(win, level, ctxt);
+            dnsctxt_snapshot(ctxt, &level->start, ts - ts % level->len);
+            level->end = ts - ts % level->len + level->len;
+        }
+        if (level->end < next)
+            next = level->end;
+
+        if (level->drain) {
+            dnswin_drain(level, DRAIN_DONE, DNSWIN_DRAIN_STEP);
+            if (level->drain && ts + DNSWIN_DRAIN_EVERY < next)
+                next = ts + DNSWIN_DRAIN_EVERY;
+        }
+    }
+
+    return next;
+
+}
+
+// closed window of a level, age 0 being the most recent one
+const struct dnswin_closed *dnswin_get(struct dnswin *win, int level, size_t age) {
+
+    struct dnswin_level *l = &win->level[level];
+
+    if (age >= l->used)
+        return NULL;
+
+    // the last one may not be reduced yet
+    dnswin_drain(l, DRAIN_PUT_QUERY, SIZE_MAX);
+
+    return &l->ring[(l->head + win->nr_ring - 1 - age) % win->nr_ring];
+
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#ifndef DNSWINDOW_H
+#define DNSWINDOW_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "dnsctxt.h"
+
+// tumbling window lengths, 1s, 10s and 60s
+#define DNSWIN_LEVELS 3
+
+// most closed windows kept per level, an hour of 1s ones
+#define DNSWIN_RING_MAX 3600
+
+// entries kept per table of a closed window
+#define DNSWIN_TOPK MAX_SUMMARY_SIZE
+
+// max table size while a window is open
+#define MAX_WINDOW_TABLE_SIZE 2000
+
+// entries a drain step of closed tables goes through, and the packet time
+// between steps
+#define DNSWIN_DRAIN_STEP 256
+#define DNSWIN_DRAIN_EVERY 1000000ULL
+
+struct dnswin_top_int {
+    uint32_t key;
+    uint64_t count;
+};
+
+// holds a reference to the interned key until the ring slot is reused
+struct dnswin_top_str {
+    uint32_t key;
+    uint64_t count;
+};
+
+// a closed window: counters at both ends and its top tables, sorted
+struct dnswin_closed {
+    struct dnsctxt_snap start, end;
+    uint64_t uniq_source, uniq_source24, uniq_qname;
+    size_t n_source, n_query, n_nxdomain;
+    struct dnswin_top_int source[DNSWIN_TOPK];
+    struct dnswin_top_str query[DNSWIN_TOPK];
+    struct dnswin_top_str nxdomain[DNSWIN_TOPK];
+};
+
+// tables filled while a window is open
+struct dnswin_tables {
+    struct int32_entry *source_table;
+    struct str_entry *query_name2_table;
+    struct str_entry *nxdomain_table;
+    struct dnsctxt_uniq uniq;
+    // own the entries, so closing the window drops them all at once
+    struct slab int_slab;
+    struct slab str_slab;
+};
+
+struct dnswin_level {
+    uint64_t len;
+    uint64_t end;
+    struct dnsctxt_snap start;
+    // packets count into *cur, flipped with *spare at the boundary
+    struct dnswin_tables *cur, *spare;
+    struct dnswin_tables tables[2];
+    // ring of the last nr_ring closed windows, head is the next slot
+    struct dnswin_closed *ring;
+    size_t head, used;
+    // tables of the last closed window while they are reduced into
+    // *drain_slot and emptied, a step at a time; NULL once done
+    struct dnswin_tables *drain;
+    struct dnswin_closed *drain_slot;
+    int drain_phase;
+    void *drain_pos;
+};
+
+struct dnswin {
+    size_t nr_ring;
+    struct dnswin_level level[DNSWIN_LEVELS];
+};
+
+extern const uint64_t dnswin_len[DNSWIN_LEVELS];
+
+struct dnswin *dnswin_new(size_t nr_ring);
+void dnswin_free(struct dnswin *win);
+uint64_t dnswin_tick(struct dnswin *win, struct dnsctxt *ctxt, uint64_t ts);
+const struct dnswin_closed *dnswin_get(struct dnswin *win, int level, size_t age);
+
+// count into the open window of every level
+static inline void dnswin_count_source(struct dnswin *win, uint32_t addr) {
+    int i;
+    for (i = 0; i < DNSWIN_LEVELS; i++)
+        dnsctxt_count_ip_max(&win->level[i].cur->source_table, &win->level[i].cur->int_slab, addr, MAX_WINDOW_TABLE_SIZE);
+}
+
+static inline void dnswin_count_query(struct dnswin *win, char *name) {
+    size_t len = strlen(name);
+    uint64_t hash = hll_hash_mem(name, len);
+    int i;
+    for (i = 0; i < DNSWIN_LEVELS; i++)
+        dnsctxt_count_name_hash(&win->level[i].cur->query_name2_table, &win->level[i].cur->str_slab, name, len, hash, MAX_WINDOW_TABLE_SIZE);
+}
+
+static inline void dnswin_count_nxdomain(struct dnswin *win, char *name) {
+    size_t len = strlen(name);
+    uint64_t hash = hll_hash_mem(name, len);
+    int i;
+    for (i = 0; i < DNSWIN_LEVELS; i++)
+        dnsctxt_count_name_hash(&win->level[i].cur->nxdomain_table, &win->level[i].cur->str_slab, name, len, hash, MAX_WINDOW_TABLE_SIZE);
+}
+
+static inline void dnswin_uniq_source(struct dnswin *win, uint64_t h_source, uint64_t h_source24) {
+    int i;
+    for (i = 0; i < DNSWIN_LEVELS; i++)
+        dnsctxt_uniq_source(&win->level[i].cur->uniq, h_source, h_source24);
+}
+
+static inline void dnswin_uniq_qname(struct dnswin *win, uint64_t h_qname) {
+    int i;
+    for (i = 0; i < DNSWIN_LEVELS; i++)
+        dnsctxt_uniq_qname(&win->level[i].cur->uniq, h_qname);
+}
+
+#endif /* DNSWINDOW_H */
@@ -0,0 +1,583 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+
+#include "export.h"
+#include "dnsctxt.h"
+#include "xmalloc.h"
+#include "die.h"
+
+enum {
+    SKETCH_SPARSE,
+    SKETCH_DENSE,
+};
+
+static inline uint8_t *put_varint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+// NULL if it runs past end or over 64 bits
+static inline const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+    unsigned int shift;
+
+    *v = 0;
+    for (shift = 0; p < end && shift < 64; shift += 7) {
+        *v |= (uint64_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+            return p;
+    }
+    return NULL;
+}
+
+static inline uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static void get_counters(const struct statshm_data *d, uint64_t c[EXPORT_COUNTERS]) {
+    c[EXPORT_SEEN] = d->seen;
+    c[EXPORT_INCOMING] = d->incoming;
+    c[EXPORT_QUERY] = d->cnt_query;
+    c[EXPORT_REPLY] = d->cnt_reply;
+    c[EXPORT_NOERROR] = d->cnt_status_noerror;
+    c[EXPORT_SRVFAIL] = d->cnt_status_srvfail;
+    c[EXPORT_NXDOMAIN] = d->cnt_status_nxdomain;
+    c[EXPORT_REFUSED] = d->cnt_status_refused;
+    c[EXPORT_MALFORMED] = d->cnt_malformed;
+    c[EXPORT_EDNS] = d->cnt_edns;
+    c[EXPORT_LAT_SUM] = d->lat_sum;
+    c[EXPORT_LAT_COUNT] = d->lat_count;
+    c[EXPORT_LAT_UNMATCHED] = d->lat_unmatched;
+    c[EXPORT_KERNEL_DROPS] = d->kernel_drops;
+    c[EXPORT_SAMPLED_OUT] = d->sampled_out;
+}
+
+static void set_counters(struct statshm_data *d, const uint64_t c[EXPORT_COUNTERS]) {
+    d->seen = c[EXPORT_SEEN];
+    d->incoming = c[EXPORT_INCOMING];
+    d->cnt_query = c[EXPORT_QUERY];
+    d->cnt_reply = c[EXPORT_REPLY];
+    d->cnt_status_noerror = c[EXPORT_NOERROR];
+    d->cnt_status_srvfail = c[EXPORT_SRVFAIL];
+    d->cnt_status_nxdomain = c[EXPORT_NXDOMAIN];
+    d->cnt_status_refused = c[EXPORT_REFUSED];
+    d->cnt_malformed = c[EXPORT_MALFORMED];
+    d->cnt_edns = c[EXPORT_EDNS];
+    d->lat_sum = c[EXPORT_LAT_SUM];
+    d->lat_count = c[EXPORT_LAT_COUNT];
+    d->lat_unmatched = c[EXPORT_LAT_UNMATCHED];
+    d->kernel_drops = c[EXPORT_KERNEL_DROPS];
+    d->sampled_out = c[EXPORT_SAMPLED_OUT];
+}
+
+static int export_connect(struct export *e) {
+
+    int type = e->dest == EXPORT_UDP ? SOCK_DGRAM : SOCK_STREAM;
+
+    e->fd = socket(e->addr.ss_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (e->fd < 0)
+        return -1;
+    if (connect(e->fd, (struct sockaddr *)&e->addr, e->addr_len)) {
+        close(e->fd);
+        e->fd = -1;
+        return -1;
+    }
+
+    return 0;
+
+}
+
+// a collector that is not up yet is retried at every record
+struct export *export_open(const char *dest, const char *source) {
+
+    struct export *e = xzmalloc(sizeof(*e));
+    struct sockaddr_un *sun = (struct sockaddr_un *)&e->addr;
+    struct addrinfo hints, *ai;
+    char host[256], *port;
+
+    e->name = xstrdup(dest);
+    e->fd = -1;
+    e->buf = xmalloc(EXPORT_RECORD_MAX);
+    e->fold = hll_new(EXPORT_HLL_P);
+
+    if (source)
+        snprintf(e->source, sizeof(e->source), "%s", source);
+    else if (gethostname(e->source, sizeof(e->source) - 1))
+        strcpy(e->source, "unknown");
+
+    if (!strncmp(dest, "unix:", 5)) {
+        e->dest = EXPORT_UNIX;
+        if (strlen(dest + 5) >= sizeof(sun->sun_path))
+            panic("Export socket path too long: %s\n", dest + 5);
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, dest + 5);
+        e->addr_len = sizeof(*sun);
+        export_connect(e);
+    }
+    else if (!strncmp(dest, "udp:", 4)) {
+        e->dest = EXPORT_UDP;
+        if (strlen(dest + 4) >= sizeof(host))
+            panic("Export address too long: %s\n", dest + 4);
+        strcpy(host, dest[4] == '[' ? dest + 5 : dest + 4);
+        port = strrchr(host, ':');
+        if (!port)
+            panic("Export address needs a port: %s\n", dest);
+        *port++ = 0;
+        if (dest[4] == '[' && strchr(host, ']'))
+            *strchr(host, ']') = 0;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_NUMERICSERV;
+        if (getaddrinfo(host, port, &hints, &ai))
+            panic("Cannot resolve export address %s\n", dest);
+        memcpy(&e->addr, ai->ai_addr, ai->ai_addrlen);
+        e->addr_len = ai->ai_addrlen;
+        freeaddrinfo(ai);
+        if (export_connect(e))
+            panic("Cannot create export socket: %s\n", strerror(errno));
+    }
+    else {
+        e->dest = EXPORT_FILE;
+        e->fd = open(dest, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (e->fd < 0)
+            panic("Cannot open export file %s: %s\n", dest, strerror(errno));
+    }
+
+    return e;
+
+}
+
+void export_close(struct export *e) {
+    if (e->fd >= 0)
+        close(e->fd);
+    hll_free(e->fold);
+    xfree(e->buf);
+    xfree(e->name);
+    xfree(e);
+}
+
+// the smaller of the two encodings, registers are below 64
+static uint8_t *put_sketch(uint8_t *p, enum export_sketch id, const struct hll *h) {
+
+    size_t i, m = (size_t)1 << h->p, nz = 0, sparse = 0, dense = m / 4 * 3;
+    uint8_t *len, *q;
+    size_t last = 0;
+
+    for (i = 0; i < m; i++) {
+        if (h->reg[i]) {
+            sparse += (i - last >= 0x80 ? 2 : 1) + 1;
+            last = i;
+            nz++;
+        }
+    }
+
+    *p++ = id;
+    *p++ = h->p;
+    *p++ = sparse < dense ? SKETCH_SPARSE : SKETCH_DENSE;
+    // the length in 2 bytes, filled in after
+    len = p;
+    p += 2;
+    q = p;
+    if (sparse < dense) {
+        p = put_varint(p, nz);
+        for (i = 0, last = 0; i < m; i++) {
+            if (h->reg[i]) {
+                p = put_varint(p, i - last);
+                *p++ = h->reg[i];
+                last = i;
+            }
+        }
+    }
+    else {
+        for (i = 0; i < m; i += 4) {
+            *p++ = h->reg[i] << 2 | h->reg[i + 1] >> 4;
+            *p++ = h->reg[i + 1] << 4 | h->reg[i + 2] >> 2;
+            *p++ = h->reg[i + 2] << 6 | (h->reg[i + 3] & 0x3f);
+        }
+    }
+    len[0] = (p - q) | 0x80;
+    len[1] = (p - q) >> 7;
+
+    return p;
+
+}
+
+// the tables go last and lose their tail entries if the record is full
+size_t export_encode(struct export *e, const struct statshm_data *d,
+                     struct hll *const uniq[EXPORT_SKETCHES]) {
+
+    // tables get what is left but room for the tier at the end
+    uint8_t *p = e->buf, *end = e->buf + EXPORT_RECORD_MAX - 16, *nr_at, *body;
+    const struct statshm_table *t;
+    const struct hll *h;
+    uint64_t c[EXPORT_COUNTERS], prev, num;
+    enum export_key type;
+    uint32_t addr, i, n;
+    size_t len, body_len;
+
+    bug_on(STATSHM_TOPK >= 0x80 || EXPORT_RECORD_MAX >= 1 << 21);
+
+    memcpy(p, EXPORT_MAGIC, 3);
+    p[3] = EXPORT_VERSION;
+    p += 4;
+    // the body length goes in 3 bytes, not minimal but fixed
+    body = p + 3;
+    p = body;
+
+    p = put_varint(p, e->seq);
+    p = put_varint(p, d->ts);
+    p = put_varint(p, e->last_ts && d->ts > e->last_ts ? d->ts - e->last_ts : 0);
+    p = put_varint(p, d->first_ts);
+    len = strlen(e->source);
+    p = put_varint(p, len);
+    memcpy(p, e->source, len);
+    p += len;
+
+    get_counters(d, c);
+    p = put_varint(p, EXPORT_COUNTERS);
+    for (i = 0; i < EXPORT_COUNTERS; i++) {
+        p = put_varint(p, c[i] > e->prev[i] ? c[i] - e->prev[i] : 0);
+        e->prev[i] = c[i];
+    }
+
+    p = put_varint(p, STATSHM_LAT_BUCKETS);
+    for (i = 0; i < STATSHM_LAT_BUCKETS; i++) {
+        p = put_varint(p, d->lat_bound[i]);
+        p = put_varint(p, d->lat_bucket[i] > e->prev_lat[i] ? d->lat_bucket[i] - e->prev_lat[i] : 0);
+        e->prev_lat[i] = d->lat_bucket[i];
+    }
+
+    p = put_varint(p, EXPORT_SKETCHES);
+    for (i = 0; i < EXPORT_SKETCHES; i++) {
+        h = uniq[i];
+        if (h->p > EXPORT_HLL_P) {
+            hll_reset(e->fold);
+            hll_fold(e->fold, h);
+            h = e->fold;
+        }
+        p = put_sketch(p, i, h);
+    }
+
+    p = put_varint(p, d->nr_table);
+    for (i = 0; i < d->nr_table && i < STATSHM_TABLES; i++) {
+        t = &d->table[i];
+        switch (i) {
+        case DNS_TABLE_SOURCE:
+        case DNS_TABLE_DEST:
+        case DNS_TABLE_MALFORMED:
+            type = EXPORT_KEY_IPV4;
+            break;
+        case DNS_TABLE_SRC_PORT:
+            type = EXPORT_KEY_UINT;
+            break;
+        default:
+            type = EXPORT_KEY_STR;
+            break;
+        }
+        len = strnlen(t->title, sizeof(t->title) - 1);
+        if (p + 4 + len > end)
+            break;
+        *p++ = i;
+        *p++ = type;
+        p = put_varint(p, len);
+        memcpy(p, t->title, len);
+        p += len;
+        // 1 byte as n < 0x80, filled in once the entries that fit are in
+        nr_at = p++;
+        for (n = 0, prev = 0; n < t->n && n < STATSHM_TOPK; n++) {
+            len = strnlen(t->entry[n].key, sizeof(t->entry[n].key) - 1);
+            if (p + 10 + 2 + len > end)
+                break;
+            p = put_varint(p, zigzag((int64_t)(t->entry[n].count - prev)));
+            prev = t->entry[n].count;
+            switch (type) {
+            case EXPORT_KEY_IPV4:
+                if (inet_pton(AF_INET, t->entry[n].key, &addr) != 1)
+                    addr = 0;
+                memcpy(p, &addr, 4);
+                p += 4;
+                break;
+            case EXPORT_KEY_UINT:
+                num = strtoull(t->entry[n].key, NULL, 10);
+                p = put_varint(p, num);
+                break;
+            default:
+                p = put_varint(p, len);
+                memcpy(p, t->entry[n].key, len);
+                p += len;
+                break;
+            }
+        }
+        *nr_at = n;
+    }
+
+    *p++ = d->shed_tier;
+    p = put_varint(p, d->shed_rate);
+
+    body_len = p - body;
+    body[-3] = body_len | 0x80;
+    body[-2] = (body_len >> 7) | 0x80;
+    body[-1] = body_len >> 14;
+
+    e->seq++;
+    e->last_ts = d->ts;
+
+    return p - e->buf;
+
+}
+
+// records that do not go out whole are dropped, never waited for
+void export_send(struct export *e, const struct statshm_data *data,
+                 struct hll *const uniq[EXPORT_SKETCHES]) {
+
+    size_t len = export_encode(e, data, uniq);
+    ssize_t n;
+
+    if (e->fd < 0 && (e->dest == EXPORT_FILE || export_connect(e))) {
+        e->nr_dropped++;
+        return;
+    }
+
+    if (e->dest == EXPORT_FILE)
+        n = write(e->fd, e->buf, len);
+    else
+        n = send(e->fd, e->buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n != (ssize_t)len) {
+        e->nr_dropped++;
+        // a cut record would desync the stream, so start over on a new
+        // connection. a datagram stays whole, the socket can stay
+        if (e->dest == EXPORT_UNIX) {
+            close(e->fd);
+            e->fd = -1;
+        }
+        return;
+    }
+    e->nr_sent++;
+    e->bytes_sent += len;
+
+}
+
+void export_rec_init(struct export_rec *rec) {
+
+    int i;
+
+    memset(rec, 0, sizeof(*rec));
+    for (i = 0; i < EXPORT_SKETCHES; i++)
+        rec->uniq[i] = hll_new(EXPORT_HLL_P);
+
+}
+
+void export_rec_free(struct export_rec *rec) {
+
+    int i;
+
+    for (i = 0; i < EXPORT_SKETCHES; i++)
+        hll_free(rec->uniq[i]);
+
+}
+
+#define GET(v) do { if (!(p = get_varint(p, end, &(v)))) return -1; } while (0)
+#define NEED(n) do { if ((size_t)(end - p) < (size_t)(n)) return -1; } while (0)
+
+static const uint8_t *get_sketch(const uint8_t *p, const uint8_t *end, uint8_t enc, struct hll *h) {
+
+    size_t i, m = (size_t)1 << h->p;
+    uint64_t nz, idx, delta;
+
+    if (enc == SKETCH_SPARSE) {
+        if (!(p = get_varint(p, end, &nz)))
+            return NULL;
+        for (idx = 0; nz; nz--) {
+            if (!(p = get_varint(p, end, &delta)) || p >= end)
+                return NULL;
+            idx += delta;
+            if (idx >= m)
+                return NULL;
+            h->reg[idx] = *p++;
+        }
+    }
+    else {
+        if ((size_t)(end - p) < m / 4 * 3)
+            return NULL;
+        for (i = 0; i < m; i += 4, p += 3) {
+            h->reg[i] = p[0] >> 2;
+            h->reg[i + 1] = (p[0] & 0x3) << 4 | p[1] >> 4;
+            h->reg[i + 2] = (p[1] & 0xf) << 2 | p[2] >> 6;
+            h->reg[i + 3] = p[2] & 0x3f;
+        }
+    }
+
+    return p;
+
+}
+
+static long decode_body(const uint8_t *p, const uint8_t *end, struct export_rec *rec) {
+
+    struct statshm_data *d = &rec->data;
+    struct statshm_table scratch, *t;
+    uint64_t c[EXPORT_COUNTERS] = { 0 }, nr, i, j, v, len, n;
+    const uint8_t *skip;
+    int64_t count;
+    uint8_t id, type, enc, p_hll;
+    struct in_addr addr;
+
+    GET(rec->seq);
+    GET(d->ts);
+    GET(rec->duration);
+    GET(d->first_ts);
+    GET(len);
+    NEED(len);
+    if (len >= sizeof(rec->source))
+        return -1;
+    memcpy(rec->source, p, len);
+    rec->source[len] = 0;
+    p += len;
+
+    GET(nr);
+    for (i = 0; i < nr; i++) {
+        GET(v);
+        if (i < EXPORT_COUNTERS)
+            c[i] = v;
+    }
+    set_counters(d, c);
+
+    GET(nr);
+    for (i = 0; i < nr; i++) {
+        GET(v);
+        if (i < STATSHM_LAT_BUCKETS)
+            d->lat_bound[i] = v;
+        GET(v);
+        if (i < STATSHM_LAT_BUCKETS)
+            d->lat_bucket[i] = v;
+    }
+
+    GET(nr);
+    for (i = 0; i < nr; i++) {
+        NEED(3);
+        id = *p++;
+        p_hll = *p++;
+        enc = *p++;
+        GET(len);
+        NEED(len);
+        skip = p + len;
+        if (id < EXPORT_SKETCHES && p_hll == EXPORT_HLL_P && enc <= SKETCH_DENSE &&
+            !get_sketch(p, skip, enc, rec->uniq[id]))
+            return -1;
+        p = skip;
+    }
+    d->uniq_source = hll_count(rec->uniq[EXPORT_UNIQ_SOURCE]);
+    d->uniq_source24 = hll_count(rec->uniq[EXPORT_UNIQ_SOURCE24]);
+    d->uniq_qname = hll_count(rec->uniq[EXPORT_UNIQ_QNAME]);
+
+    GET(nr);
+    for (i = 0; i < nr; i++) {
+        NEED(2);
+        id = *p++;
+        type = *p++;
+        t = id < STATSHM_TABLES ? &d->table[id] : &scratch;
+        GET(len);
+        NEED(len);
+        if (len >= sizeof(t->title))
+            return -1;
+        memcpy(t->title, p, len);
+        t->title[len] = 0;
+        p += len;
+        GET(n);
+        if (n > STATSHM_TOPK)
+            return -1;
+        for (j = 0, count = 0; j < n; j++) {
+            GET(v);
+            count += unzigzag(v);
+            t->entry[j].count = count;
+            t->entry[j].rate = 0;
+            t->entry[j].error = 0;
+            switch (type) {
+            case EXPORT_KEY_IPV4:
+                NEED(4);
+                memcpy(&addr, p, 4);
+                p += 4;
+                inet_ntop(AF_INET, &addr, t->entry[j].key, sizeof(t->entry[j].key));
+                break;
+            case EXPORT_KEY_UINT:
+                GET(v);
+                snprintf(t->entry[j].key, sizeof(t->entry[j].key), "%lu", v);
+                break;
+            case EXPORT_KEY_STR:
+                GET(len);
+                NEED(len);
+                if (len >= sizeof(t->entry[j].key))
+                    return -1;
+                memcpy(t->entry[j].key, p, len);
+                t->entry[j].key[len] = 0;
+                p += len;
+                break;
+            default:
+                return -1;
+            }
+        }
+        t->n = n;
+        if (id < STATSHM_TABLES && id >= d->nr_table)
+            d->nr_table = id + 1;
+    }
+
+    // not in records of older writers
+    d->shed_rate = 1;
+    if (p < end) {
+        d->shed_tier = *p++;
+        GET(v);
+        d->shed_rate = v ? v : 1;
+    }
+
+    return 0;
+
+}
+
+// one record from the start of buf: its length, 0 if buf holds only part
+// of it, -1 if buf does not start with a valid record
+long export_decode(const uint8_t *buf, size_t len, struct export_rec *rec) {
+
+    const uint8_t *p, *end = buf + len;
+    uint64_t body;
+    int i;
+
+    if (len < 4)
+        return memcmp(buf, EXPORT_MAGIC, len < 3 ? len : 3) ? -1 : 0;
+    if (memcmp(buf, EXPORT_MAGIC, 3) || buf[3] != EXPORT_VERSION)
+        return -1;
+    p = get_varint(buf + 4, end, &body);
+    if (!p)
+        return len < 4 + 10 ? 0 : -1;
+    if (body > EXPORT_RECORD_MAX)
+        return -1;
+    if (body > (uint64_t)(end - p))
+        return 0;
+    end = p + body;
+
+    memset(&rec->data, 0, sizeof(rec->data));
+    for (i = 0; i < EXPORT_SKETCHES; i++)
+        hll_reset(rec->uniq[i]);
+    if (decode_body(p, end, rec))
+        return -1;
+
+    return end - buf;
+
+}
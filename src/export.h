@@ -0,0 +1,121 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#include "hll.h"
+#include "statshm.h"
+
+// compact binary record of the stats, one per export period, for central
+// collection from many hosts. a record is "PVX", a version byte and the
+// body length, then the body. integers are LEB128 varints unless sized:
+//
+//   seq, ts, duration since the previous record, first_ts (all ns)
+//   source: length, bytes
+//   nr counters, each as the delta since the previous record
+//   nr latency buckets, each as its upper bound in ns and the delta
+//     since the previous record
+//   nr sketches, each: id(1) p(1) encoding(1) length, registers either
+//     sparse as count and (index delta, value(1)) pairs, or dense packed
+//     6 bits each
+//   nr tables, each: id(1) key type(1) title length, title, n, and n
+//     entries of the zigzag delta from the previous count, then the key:
+//     4 bytes for ipv4, a varint for a number, length and bytes otherwise
+//   analysis tier(1) and sample rate, see struct dnsctxt_shed
+//
+// counters and buckets being deltas, a record covers its period on its
+// own and losing one, say over udp, loses only that period. so do the
+// sketches, the distinct sets of the period, which a collector unions
+// over any span of records. tables are the top entries as pktvisor shows
+// them. the sketches are folded to EXPORT_HLL_P, which bounds them
+// to 768 bytes each. readers skip counters and sketches they do not know,
+// and whatever follows the parts they know up to the body length.
+#define EXPORT_MAGIC "PVX"
+#define EXPORT_VERSION 1
+// fits a udp datagram
+#define EXPORT_RECORD_MAX 65000
+#define EXPORT_HLL_P 10
+#define EXPORT_SOURCE_LEN 64
+#define EXPORT_PERIOD_DEFAULT (10 * 1000000000ULL)
+
+enum export_counter {
+    EXPORT_SEEN,
+    EXPORT_INCOMING,
+    EXPORT_QUERY,
+    EXPORT_REPLY,
+    EXPORT_NOERROR,
+    EXPORT_SRVFAIL,
+    EXPORT_NXDOMAIN,
+    EXPORT_REFUSED,
+    EXPORT_MALFORMED,
+    EXPORT_EDNS,
+    EXPORT_LAT_SUM,
+    EXPORT_LAT_COUNT,
+    EXPORT_LAT_UNMATCHED,
+    EXPORT_KERNEL_DROPS,
+    EXPORT_SAMPLED_OUT,
+    EXPORT_COUNTERS
+};
+
+enum export_sketch {
+    EXPORT_UNIQ_SOURCE,
+    EXPORT_UNIQ_SOURCE24,
+    EXPORT_UNIQ_QNAME,
+    EXPORT_SKETCHES
+};
+
+enum export_key {
+    EXPORT_KEY_STR,
+    EXPORT_KEY_IPV4,
+    EXPORT_KEY_UINT,
+};
+
+enum export_dest {
+    EXPORT_FILE,
+    EXPORT_UNIX,
+    EXPORT_UDP,
+};
+
+// "udp:host:port", "unix:/path" for a stream socket, or a file appended to
+struct export {
+    enum export_dest dest;
+    char *name;
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char source[EXPORT_SOURCE_LEN];
+    // last record, for the deltas
+    uint64_t seq, last_ts;
+    uint64_t prev[EXPORT_COUNTERS];
+    uint64_t prev_lat[STATSHM_LAT_BUCKETS];
+    struct hll *fold;
+    uint8_t *buf;
+    uint64_t nr_sent, nr_dropped, bytes_sent;
+};
+
+// a record as read back, counters and latency buckets as deltas in data
+struct export_rec {
+    uint64_t seq, duration;
+    char source[EXPORT_SOURCE_LEN];
+    struct statshm_data data;
+    struct hll *uniq[EXPORT_SKETCHES];
+};
+
+struct export *export_open(const char *dest, const char *source);
+void export_close(struct export *e);
+size_t export_encode(struct export *e, const struct statshm_data *data,
+                     struct hll *const uniq[EXPORT_SKETCHES]);
+void export_send(struct export *e, const struct statshm_data *data,
+                 struct hll *const uniq[EXPORT_SKETCHES]);
+
+void export_rec_init(struct export_rec *rec);
+void export_rec_free(struct export_rec *rec);
+long export_decode(const uint8_t *buf, size_t len, struct export_rec *rec);
+
+#endif /* EXPORT_H */
@@ -10,14 +10,17 @@
 #include <math.h>
 #include <maxminddb.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "built_in.h"
 #include "die.h"
 #include "ioops.h"
 #include "str.h"
 #include "xmalloc.h"
+#include "uthash.h"
+#include "geoip.h"
 
-#define LOC_BUF_LEN 80
 #define GEO_OK(r) ((r) == MMDB_SUCCESS)
 #define GEO_ERROR(r) ((r) != MMDB_SUCCESS)
 
@@ -27,6 +30,15 @@ static bool has_city = false;
 static MMDB_s mmdb_isp;
 static bool has_isp = false;
 
+/* Organization of each ASN seen, filled on the first lookup of the ASN */
+struct as_org {
+	uint32_t asn;
+	char *name;
+	UT_hash_handle hh;
+};
+
+static struct as_org *as_orgs = NULL;
+
 int geoip_working(void)
 {
 	return (has_city && has_isp);
@@ -81,74 +93,6 @@ static char *lookup_string(MMDB_s *db, struct sockaddr *sa, ...)
 	}
 }
 
-/**
- * Lookup an ASN + Organization label.  This must be synthesized because GeoIP2 stores the AS num
- * and the org string separately.
- */
-static char *lookup_as_label(struct sockaddr *sa)
-{
-
-	MMDB_entry_data_s entry_data;
-	int status = lookup_entry_data(&mmdb_isp, sa, &entry_data, "autonomous_system_number", NULL);
-	if (GEO_ERROR(status) || !entry_data.has_data) {
-		entry_data.type = UINT32_MAX;
-	}
-
-	char *actual_org_name = lookup_string(&mmdb_isp, sa, "autonomous_system_organization", NULL);
-	char *name = actual_org_name ? actual_org_name : "Unknown";
-
-	char *buf = malloc(LOC_BUF_LEN);
-	switch (entry_data.type) {
-		case MMDB_DATA_TYPE_UINT16:
-			snprintf(buf, LOC_BUF_LEN, "AS%d %s", entry_data.uint16, name);
-		break;
-		case MMDB_DATA_TYPE_UINT32:
-			snprintf(buf, LOC_BUF_LEN, "AS%d %s", entry_data.uint32, name);
-		break;
-		case MMDB_DATA_TYPE_UINT64:
-			snprintf(buf, LOC_BUF_LEN, "AS%lu %s", entry_data.uint64, name);
-		break;
-		case MMDB_DATA_TYPE_INT32:
-			snprintf(buf, LOC_BUF_LEN, "AS%d %s", entry_data.int32, name);
-		break;
-		default:
-			snprintf(buf, LOC_BUF_LEN, "AS0 %s", name);
-		break;
-    }
-
-	if (actual_org_name) {
-		free(actual_org_name);
-	}
-
-	return buf;
-}
-
-const char *geoip4_as_name_by_ip(uint32_t ip)
-{
-	bug_on(!has_isp);
-
-	struct sockaddr_in sa;
-	sa.sin_family = AF_INET;
-	sa.sin_port = 1;
-	sa.sin_addr.s_addr = ip;  // calling conventions assume this is already in network form.
-
-	return lookup_as_label((struct sockaddr *) &sa);
-}
-
-const char *geoip4_as_name(struct sockaddr_in *sa)
-{
-	bug_on(!has_isp);
-
-	return lookup_as_label((struct sockaddr *) sa);
-}
-
-const char *geoip6_as_name(struct sockaddr_in6 *sa)
-{
-	bug_on(!has_isp);
-
-	return lookup_as_label((struct sockaddr *) sa);
-}
-
 static float lookup_lat_or_lon(struct sockaddr *sa, char *lat_or_lon)
 {
 	MMDB_entry_data_s entry_data;
@@ -230,32 +174,409 @@ const char *geoip6_country_name(struct sockaddr_in6 *sa)
 	return name;
 }
 
-char *geoip4_loc_by_ip(uint32_t ip)
+static void sockaddr4(struct sockaddr_in *sa, uint32_t ip)
 {
-	bug_on(!has_city);
+	memset(sa, 0, sizeof(*sa));
+	sa->sin_family = AF_INET;
+	sa->sin_port = 1;
+	sa->sin_addr.s_addr = ip;
+}
 
-	struct sockaddr_in sa;
-	sa.sin_family = AF_INET;
-	sa.sin_port = 1;
-	sa.sin_addr.s_addr = ip;
+static uint32_t entry_asn(MMDB_entry_s *entry)
+{
+	MMDB_entry_data_s data;
+
+	if (GEO_ERROR(MMDB_get_value(entry, &data, "autonomous_system_number", NULL)) || !data.has_data)
+		return 0;
+
+	switch (data.type) {
+	case MMDB_DATA_TYPE_UINT16:
+		return data.uint16;
+	case MMDB_DATA_TYPE_UINT32:
+		return data.uint32;
+	case MMDB_DATA_TYPE_UINT64:
+		return data.uint64;
+	case MMDB_DATA_TYPE_INT32:
+		return data.int32;
+	default:
+		return 0;
+	}
+}
+
+/* Add the organization of an ASN to orgs unless it is there already */
+static void entry_org(MMDB_entry_s *entry, uint32_t asn, struct as_org **orgs)
+{
+	MMDB_entry_data_s data;
+	struct as_org *org;
+
+	HASH_FIND(hh, *orgs, &asn, sizeof(asn), org);
+	if (org)
+		return;
+
+	org = xzmalloc(sizeof(*org));
+	org->asn = asn;
+	if (GEO_OK(MMDB_get_value(entry, &data, "autonomous_system_organization", NULL)) &&
+	    data.has_data && data.type == MMDB_DATA_TYPE_UTF8_STRING)
+		org->name = strndup(data.utf8_string, data.data_size);
+	HASH_ADD(hh, *orgs, asn, sizeof(asn), org);
+}
+
+static void free_orgs(struct as_org **orgs)
+{
+	struct as_org *org, *tmp;
+
+	HASH_ITER(hh, *orgs, org, tmp) {
+		HASH_DEL(*orgs, org);
+		free(org->name);
+		xfree(org);
+	}
+}
+
+/* Country and subdivision as a geoip_loc_code(), without copying strings */
+static uint32_t entry_loc_code(MMDB_entry_s *entry)
+{
+	MMDB_entry_data_s country, region;
+
+	if (GEO_ERROR(MMDB_get_value(entry, &country, "country", "iso_code", NULL)) ||
+	    !country.has_data || country.type != MMDB_DATA_TYPE_UTF8_STRING)
+		country.data_size = 0;
+	if (GEO_ERROR(MMDB_get_value(entry, &region, "subdivisions", "0", "iso_code", NULL)) ||
+	    !region.has_data || region.type != MMDB_DATA_TYPE_UTF8_STRING)
+		region.data_size = 0;
+
+	return geoip_loc_code(country.utf8_string, country.data_size,
+			      region.data_size ? region.utf8_string : NULL, region.data_size);
+}
+
+/*
+ * Flattened IPv4 tables.  With geoip_flatten() the databases are walked once
+ * and every IPv4 network is turned into a range of a sorted array holding
+ * its ASN or location code, adjacent ranges with the same value merged, so
+ * a lookup is a binary search over a few MB instead of a search tree walk
+ * and a data section decode.  On SIGHUP a thread reopens the databases and
+ * builds new tables; the capture thread swaps them in at its next lookup
+ * and frees the old ones, so capture never waits on a reload.
+ */
+struct geo_flat {
+	/* host order, start[0] == 0, val[i] holds up to start[i + 1] - 1 */
+	uint32_t *start, *val;
+	size_t nr, cap;
+};
+
+struct geo_flat_db {
+	struct geo_flat asn, loc;
+	struct as_org *orgs;
+};
+
+/* Decoded value per data section offset while building */
+struct flat_seen {
+	uint32_t off, val;
+	UT_hash_handle hh;
+};
+
+struct flat_build {
+	MMDB_s *db;
+	struct geo_flat *flat;
+	struct flat_seen *seen;
+	struct as_org **orgs;
+};
+
+static char *flat_city_path, *flat_asn_path;
+static struct geo_flat_db *flat_cur;
+/* Set by the reload thread, flat_next is only valid once flat_done is */
+static struct geo_flat_db *flat_next;
+static volatile int flat_done;
+static volatile sig_atomic_t flat_reload_req;
+static bool flat_reloading;
+static pthread_t flat_thread;
+
+static void flat_add(struct geo_flat *flat, uint32_t start, uint32_t val)
+{
+	if (flat->nr && flat->val[flat->nr - 1] == val)
+		return;
+
+	if (flat->nr == flat->cap) {
+		flat->cap = flat->cap ? flat->cap * 2 : 4096;
+		flat->start = xrealloc(flat->start, flat->cap, sizeof(*flat->start));
+		flat->val = xrealloc(flat->val, flat->cap, sizeof(*flat->val));
+	}
+	flat->start[flat->nr] = start;
+	flat->val[flat->nr] = val;
+	flat->nr++;
+}
+
+static uint32_t flat_decode(struct flat_build *b, MMDB_entry_s *entry)
+{
+	struct flat_seen *seen;
+
+	HASH_FIND(hh, b->seen, &entry->offset, sizeof(uint32_t), seen);
+	if (seen)
+		return seen->val;
+
+	seen = xmalloc(sizeof(*seen));
+	seen->off = entry->offset;
+	if (b->orgs) {
+		seen->val = entry_asn(entry);
+		entry_org(entry, seen->val, b->orgs);
+	} else {
+		seen->val = entry_loc_code(entry);
+	}
+	HASH_ADD(hh, b->seen, off, sizeof(uint32_t), seen);
+
+	return seen->val;
+}
+
+static void flat_walk(struct flat_build *b, uint32_t node, uint32_t prefix, int depth);
+
+static void flat_record(struct flat_build *b, uint64_t record, uint8_t type,
+			MMDB_entry_s *entry, uint32_t prefix, int depth)
+{
+	switch (type) {
+	case MMDB_RECORD_TYPE_SEARCH_NODE:
+		if (depth < 32)
+			flat_walk(b, record, prefix, depth);
+		break;
+	case MMDB_RECORD_TYPE_DATA:
+		flat_add(b->flat, prefix, flat_decode(b, entry));
+		break;
+	default:
+		flat_add(b->flat, prefix, 0);
+		break;
+	}
+}
 
-	char *country = lookup_string(&mmdb_city, (struct sockaddr *) &sa, "country", "iso_code", NULL);
-	const char *region = geoip4_region_name(&sa);
+/* In order, so ranges come out sorted by start */
+static void flat_walk(struct flat_build *b, uint32_t node, uint32_t prefix, int depth)
+{
+	MMDB_search_node_s n;
+
+	if (GEO_ERROR(MMDB_read_node(b->db, node, &n))) {
+		flat_add(b->flat, prefix, 0);
+		return;
+	}
+
+	flat_record(b, n.left_record, n.left_record_type, &n.left_record_entry,
+		    prefix, depth + 1);
+	flat_record(b, n.right_record, n.right_record_type, &n.right_record_entry,
+		    prefix | (1U << (31 - depth)), depth + 1);
+}
+
+static void flat_build(MMDB_s *db, struct geo_flat *flat, struct as_org **orgs)
+{
+	struct flat_build b = { .db = db, .flat = flat, .orgs = orgs };
+	struct flat_seen *seen, *tmp;
+	MMDB_search_node_s n;
+	uint32_t node = 0;
+	int i;
+
+	/* IPv4 lives at ::/96 of an IPv6 tree */
+	if (db->metadata.ip_version == 6) {
+		for (i = 0; i < 96; i++) {
+			if (GEO_ERROR(MMDB_read_node(db, node, &n))) {
+				flat_add(flat, 0, 0);
+				return;
+			}
+			if (n.left_record_type != MMDB_RECORD_TYPE_SEARCH_NODE) {
+				flat_record(&b, n.left_record, n.left_record_type,
+					    &n.left_record_entry, 0, 32);
+				goto out;
+			}
+			node = n.left_record;
+		}
+	}
+	flat_walk(&b, node, 0, 0);
+out:
+	HASH_ITER(hh, b.seen, seen, tmp) {
+		HASH_DEL(b.seen, seen);
+		xfree(seen);
+	}
+}
+
+static void flat_free(struct geo_flat_db *fdb)
+{
+	if (!fdb)
+		return;
+
+	free(fdb->asn.start);
+	free(fdb->asn.val);
+	free(fdb->loc.start);
+	free(fdb->loc.val);
+	free_orgs(&fdb->orgs);
+	xfree(fdb);
+}
+
+/* Open the databases anew and flatten them, NULL if one cannot be opened */
+static struct geo_flat_db *flat_load(void)
+{
+	struct geo_flat_db *fdb = xzmalloc(sizeof(*fdb));
+	MMDB_s db;
+
+	if (flat_city_path) {
+		if (GEO_ERROR(MMDB_open(flat_city_path, MMDB_MODE_MMAP, &db)))
+			goto err;
+		flat_build(&db, &fdb->loc, NULL);
+		MMDB_close(&db);
+	}
+	if (flat_asn_path) {
+		if (GEO_ERROR(MMDB_open(flat_asn_path, MMDB_MODE_MMAP, &db)))
+			goto err;
+		flat_build(&db, &fdb->asn, &fdb->orgs);
+		MMDB_close(&db);
+	}
+
+	return fdb;
+err:
+	flat_free(fdb);
+	return NULL;
+}
 
-	char *buf = malloc(LOC_BUF_LEN);
-	snprintf(buf, LOC_BUF_LEN, "%s/%s",
-		(country ? country : "Unknown"),
-		(region ? region : "Unknown"));
+static void *flat_reload(void *arg __maybe_unused)
+{
+	flat_next = flat_load();
+	__atomic_store_n(&flat_done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/*
+ * Capture thread side of a reload: swap in tables that are ready, start a
+ * reload that was asked for.  A failed reload keeps the current tables.
+ */
+static void flat_update(void)
+{
+	struct geo_flat_db *old;
+
+	if (__atomic_load_n(&flat_done, __ATOMIC_ACQUIRE)) {
+		pthread_join(flat_thread, NULL);
+		if (flat_next) {
+			old = flat_cur;
+			flat_cur = flat_next;
+			flat_free(old);
+		}
+		flat_next = NULL;
+		flat_done = 0;
+		flat_reloading = false;
+	}
 
-	if (country) {
-		free(country);
+	if (flat_reload_req && !flat_reloading) {
+		flat_reload_req = 0;
+		if (!pthread_create(&flat_thread, NULL, flat_reload, NULL))
+			flat_reloading = true;
 	}
+}
 
-	if (region) {
-		free((char *)region);
+static inline uint32_t flat_lookup(const struct geo_flat *flat, uint32_t ip)
+{
+	size_t lo = 0, hi = flat->nr, mid;
+
+	ip = ntohl(ip);
+	/* last range starting at or below ip */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (flat->start[mid] <= ip)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	return buf;
+	return lo ? flat->val[lo - 1] : 0;
+}
+
+static inline struct geo_flat_db *flat_get(void)
+{
+	if (unlikely(flat_reload_req || flat_done))
+		flat_update();
+
+	return flat_cur;
+}
+
+/**
+ * Flatten the databases given to init_geoip() for all later ASN and location
+ * code lookups.  Returns 0, or -1 if a database cannot be read.
+ */
+int geoip_flatten(size_t *nr_loc, size_t *nr_asn)
+{
+	if (!(flat_cur = flat_load()))
+		return -1;
+
+	*nr_loc = flat_cur->loc.nr;
+	*nr_asn = flat_cur->asn.nr;
+
+	return 0;
+}
+
+/**
+ * Ask for the flattened tables to be rebuilt from the files, e.g. from a
+ * SIGHUP handler.  Does nothing unless geoip_flatten() was called.
+ */
+void geoip_request_reload(void)
+{
+	if (flat_cur)
+		flat_reload_req = 1;
+}
+
+/**
+ * ASN of an address, 0 if unknown.  The organization is only read from the
+ * database the first time an ASN shows up; geoip_asn_org() returns it.
+ */
+uint32_t geoip4_asn_by_ip(uint32_t ip)
+{
+	struct sockaddr_in sa;
+	MMDB_lookup_result_s res;
+	uint32_t asn;
+	int err;
+
+	if (flat_get())
+		return flat_lookup(&flat_cur->asn, ip);
+
+	bug_on(!has_isp);
+
+	sockaddr4(&sa, ip);
+	res = MMDB_lookup_sockaddr(&mmdb_isp, (struct sockaddr *) &sa, &err);
+	if (GEO_ERROR(err) || !res.found_entry)
+		return 0;
+
+	asn = entry_asn(&res.entry);
+	entry_org(&res.entry, asn, &as_orgs);
+
+	return asn;
+}
+
+/**
+ * Organization of an ASN returned by geoip4_asn_by_ip(), NULL if unknown.
+ */
+const char *geoip_asn_org(uint32_t asn)
+{
+	struct as_org *org;
+
+	if (flat_cur)
+		HASH_FIND(hh, flat_cur->orgs, &asn, sizeof(asn), org);
+	else
+		HASH_FIND(hh, as_orgs, &asn, sizeof(asn), org);
+
+	return org ? org->name : NULL;
+}
+
+/**
+ * Country and subdivision of an address as a geoip_loc_code().
+ */
+uint32_t geoip4_loc_code_by_ip(uint32_t ip)
+{
+	struct sockaddr_in sa;
+	MMDB_lookup_result_s res;
+	int err;
+
+	if (flat_get())
+		return flat_lookup(&flat_cur->loc, ip);
+
+	bug_on(!has_city);
+
+	sockaddr4(&sa, ip);
+	res = MMDB_lookup_sockaddr(&mmdb_city, (struct sockaddr *) &sa, &err);
+	if (GEO_ERROR(err) || !res.found_entry)
+		return 0;
+
+	return entry_loc_code(&res.entry);
 }
 
 void init_geoip(const char *citydb, const char *asndb)
@@ -266,17 +587,33 @@ void init_geoip(const char *citydb, const char *asndb)
 		result = MMDB_open(citydb, MMDB_MODE_MMAP, &mmdb_city);
 		bug_on(result != MMDB_SUCCESS);
 		has_city = true;
+		flat_city_path = xstrdup(citydb);
 	}
 
 	if (asndb) {
 		result = MMDB_open(asndb, MMDB_MODE_MMAP, &mmdb_isp);
 		bug_on(result != MMDB_SUCCESS);
 		has_isp = true;
+		flat_asn_path = xstrdup(asndb);
 	}
 }
 
 void destroy_geoip(void)
 {
+	if (flat_reloading) {
+		pthread_join(flat_thread, NULL);
+		flat_free(flat_next);
+		flat_next = NULL;
+		flat_done = 0;
+		flat_reloading = false;
+	}
+	flat_free(flat_cur);
+	flat_cur = NULL;
+	free_orgs(&as_orgs);
+	free(flat_city_path);
+	free(flat_asn_path);
+	flat_city_path = flat_asn_path = NULL;
+
 	if (has_city) {
 		MMDB_close(&mmdb_city);
 		has_city = false;
@@ -287,4 +624,3 @@ void destroy_geoip(void)
 		has_isp = false;
 	}
 }
-
@@ -2,6 +2,7 @@
 #define GEOIPH_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <netinet/in.h>
 
 #include "config.h"
@@ -20,10 +21,11 @@ extern float geoip4_longitude(struct sockaddr_in *sa);
 extern float geoip4_latitude(struct sockaddr_in *sa);
 extern float geoip6_longitude(struct sockaddr_in6 *sa);
 extern float geoip6_latitude(struct sockaddr_in6 *sa);
-extern const char *geoip4_as_name(struct sockaddr_in *sa);
-extern const char *geoip6_as_name(struct sockaddr_in6 *sa);
-extern const char *geoip4_as_name_by_ip(uint32_t ip);
-extern char *geoip4_loc_by_ip(uint32_t ip);
+extern uint32_t geoip4_asn_by_ip(uint32_t ip);
+extern uint32_t geoip4_loc_code_by_ip(uint32_t ip);
+extern const char *geoip_asn_org(uint32_t asn);
+extern int geoip_flatten(size_t *nr_loc, size_t *nr_asn);
+extern void geoip_request_reload(void);
 extern void destroy_geoip(void);
 #else
 static inline void init_geoip(int enforce)
@@ -89,15 +91,96 @@ static inline float geoip6_latitude(struct sockaddr_in6 *sa)
 	return .0f;
 }
 
-static inline const char *geoip4_as_name(struct sockaddr_in *sa)
+static inline uint32_t geoip4_asn_by_ip(uint32_t ip)
 {
-	return NULL;
+	return 0;
+}
+
+static inline uint32_t geoip4_loc_code_by_ip(uint32_t ip)
+{
+	return 0;
 }
 
-static inline const char *geoip6_as_name(struct sockaddr_in6 *sa)
+static inline const char *geoip_asn_org(uint32_t asn)
 {
 	return NULL;
 }
+
+static inline int geoip_flatten(size_t *nr_loc, size_t *nr_asn)
+{
+	return -1;
+}
+
+static inline void geoip_request_reload(void)
+{
+}
 #endif
 
+/*
+ * A country and subdivision ISO code packed into 32 bits, so the geo tables
+ * count integers: two letters of 5 bits each, then up to three alphanumerics
+ * in base 37 with 0 for none.  Either part is 0 if unknown.
+ */
+static inline uint32_t geoip_loc_char(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0' + 1;
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A' + 11;
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 11;
+	return 0;
+}
+
+static inline uint32_t geoip_loc_code(const char *country, size_t clen,
+				      const char *region, size_t rlen)
+{
+	uint32_t c0, c1, r = 0;
+	size_t i;
+
+	if (clen == 2 && (c0 = geoip_loc_char(country[0])) > 10 &&
+	    (c1 = geoip_loc_char(country[1])) > 10)
+		c0 = ((c0 - 10) << 5 | (c1 - 10)) << 16;
+	else
+		c0 = 0;
+
+	if (region && rlen <= 3) {
+		for (i = 0; i < rlen; i++) {
+			if (!(c1 = geoip_loc_char(region[i]))) {
+				r = 0;
+				break;
+			}
+			r = r * 37 + c1;
+		}
+	}
+
+	return c0 | r;
+}
+
+static inline char *geoip_loc_str(uint32_t code, char *buf, size_t size)
+{
+	static const char digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	char country[3] = "", region[4] = "";
+	uint32_t r = code & 0xffff;
+	int n = 0, i;
+
+	if (code >> 16) {
+		country[0] = 'A' + ((code >> 21) & 0x1f) - 1;
+		country[1] = 'A' + ((code >> 16) & 0x1f) - 1;
+		country[2] = 0;
+	}
+	for ( ; r && n < 3; r /= 37)
+		region[n++] = digits[r % 37 - 1];
+	region[n] = 0;
+	for (i = 0; i < n / 2; i++) {
+		char c = region[i];
+		region[i] = region[n - 1 - i];
+		region[n - 1 - i] = c;
+	}
+
+	snprintf(buf, size, "%s/%s", country[0] ? country : "Unknown",
+		 region[0] ? region : "Unknown");
+	return buf;
+}
+
 #endif /* GEOIPH_H */
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "hll.h"
+#include "xmalloc.h"
+#include "built_in.h"
+#include "die.h"
+
+struct hll *hll_new(unsigned int p) {
+
+    struct hll *h;
+
+    bug_on(p < 4 || p > 16);
+
+    h = xzmalloc(hll_size(p));
+    h->p = p;
+
+    return h;
+
+}
+
+void hll_free(struct hll *h) {
+    xfree(h);
+}
+
+void hll_reset(struct hll *h) {
+    memset(h->reg, 0, (size_t)1 << h->p);
+}
+
+void hll_merge(struct hll *dst, const struct hll *src) {
+
+    size_t i, m = (size_t)1 << dst->p;
+
+    bug_on(dst->p != src->p);
+
+    for (i = 0; i < m; i++) {
+        if (dst->reg[i] < src->reg[i])
+            dst->reg[i] = src->reg[i];
+    }
+
+}
+
+// merge src into a sketch of lower precision, which ends up as if built
+// at dst->p from the same hashes: the index bits dropped go in front of
+// the rank bits
+void hll_fold(struct hll *dst, const struct hll *src) {
+
+    size_t i, m = (size_t)1 << src->p;
+    unsigned int shift = src->p - dst->p;
+    uint32_t low;
+    uint8_t rank;
+
+    bug_on(dst->p > src->p);
+
+    for (i = 0; i < m; i++) {
+        if (!src->reg[i])
+            continue;
+        low = i & ((1U << shift) - 1);
+        rank = low ? shift - (31 - __builtin_clz(low)) : shift + src->reg[i];
+        if (dst->reg[i >> shift] < rank)
+            dst->reg[i >> shift] = rank;
+    }
+
+}
+
+uint64_t hll_count(const struct hll *h) {
+
+    size_t i, m = (size_t)1 << h->p, zeros = 0;
+    double sum = 0, alpha, est;
+
+    for (i = 0; i < m; i++) {
+        sum += ldexp(1.0, -h->reg[i]);
+        if (h->reg[i] == 0)
+            zeros++;
+    }
+
+    switch (m) {
+    case 16:
+        alpha = 0.673;
+        break;
+    case 32:
+        alpha = 0.697;
+        break;
+    case 64:
+        alpha = 0.709;
+        break;
+    default:
+        alpha = 0.7213 / (1 + 1.079 / m);
+    }
+
+    est = alpha * m * m / sum;
+
+    // linear counting while many registers are still empty
+    if (est <= 2.5 * m && zeros)
+        est = m * log((double)m / zeros);
+
+    return (uint64_t)(est + 0.5);
+
+}
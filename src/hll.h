@@ -0,0 +1,82 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#ifndef HLL_H
+#define HLL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// HyperLogLog distinct counter, 2^p one byte registers. standard error is
+// about 1.04 / sqrt(2^p): 1.6% at p = 12 (4 KB), 6.5% at p = 8 (256 B).
+// sketches of the same precision merge by register max, so per thread or
+// per interval sketches add up to the sketch of the union.
+#define HLL_P_DEFAULT 12
+
+struct hll {
+    uint8_t p;
+    uint8_t reg[];
+};
+
+struct hll *hll_new(unsigned int p);
+void hll_free(struct hll *h);
+void hll_reset(struct hll *h);
+void hll_merge(struct hll *dst, const struct hll *src);
+void hll_fold(struct hll *dst, const struct hll *src);
+uint64_t hll_count(const struct hll *h);
+
+static inline size_t hll_size(unsigned int p) {
+    return sizeof(struct hll) + ((size_t)1 << p);
+}
+
+// 64 bit finalizer of murmur3, good enough to spread ip addresses
+static inline uint64_t hll_hash_u32(uint32_t key) {
+    uint64_t h = key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// FNV-1a over the string, then the finalizer for the high bits
+static inline uint64_t hll_hash_str(const char *str) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for ( ; *str; str++) {
+        h ^= (uint8_t)*str;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// same over len bytes, for a label inside a name
+static inline uint64_t hll_hash_mem(const char *mem, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for ( ; len; mem++, len--) {
+        h ^= (uint8_t)*mem;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// top p bits pick the register, the rest give the rank
+static inline void hll_add(struct hll *h, uint64_t hash) {
+    uint64_t idx = hash >> (64 - h->p);
+    uint8_t rank = __builtin_clzll((hash << h->p) | (1ULL << (h->p - 1))) + 1;
+    if (h->reg[idx] < rank)
+        h->reg[idx] = rank;
+}
+
+#endif /* HLL_H */
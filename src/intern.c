@@ -0,0 +1,174 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#include <string.h>
+
+#include "intern.h"
+#include "xmalloc.h"
+#include "die.h"
+
+#define INTERN_BUCKETS_MIN 256
+#define INTERN_ARENA_MIN 4096
+// compact once this much is dead and it is at least half of the arena
+#define INTERN_COMPACT_MIN (64 * 1024)
+
+// records are kept 4 byte aligned for the slot field
+static inline size_t rec_size(size_t len) {
+    return (sizeof(struct intern_rec) + len + 1 + 3) & ~(size_t)3;
+}
+
+void intern_free(struct intern *p) {
+    free(p->arena);
+    free(p->slot);
+    free(p->bucket);
+    memset(p, 0, sizeof(*p));
+}
+
+uint32_t intern_find(const struct intern *p, const char *str, size_t len, uint64_t hash) {
+
+    const struct intern_rec *rec;
+    uint32_t h;
+
+    if (!p->bucket)
+        return INTERN_NONE;
+
+    for (h = p->bucket[hash & p->mask]; h; h = p->slot[h].next) {
+        if (p->slot[h].hash != hash)
+            continue;
+        rec = intern_rec(p, h);
+        if (rec->len == len && !memcmp(rec->str, str, len))
+            return h;
+    }
+
+    return INTERN_NONE;
+
+}
+
+// double the buckets and rechain the live slots from their stored hash
+static void intern_rehash(struct intern *p) {
+
+    uint32_t n = p->bucket ? (p->mask + 1) * 2 : INTERN_BUCKETS_MIN, h;
+
+    free(p->bucket);
+    p->bucket = xzmalloc(n * sizeof(*p->bucket));
+    p->mask = n - 1;
+    for (h = 1; h < p->nr_slot; h++) {
+        if (!p->slot[h].ref)
+            continue;
+        p->slot[h].next = p->bucket[p->slot[h].hash & p->mask];
+        p->bucket[p->slot[h].hash & p->mask] = h;
+    }
+
+}
+
+// slide the live records down over the dead ones, in arena order
+static void intern_compact(struct intern *p) {
+
+    struct intern_rec *rec;
+    size_t off = 0, to = 0, size;
+
+    while (off < p->used) {
+        rec = (struct intern_rec *)(p->arena + off);
+        size = rec_size(rec->len);
+        if (rec->slot != INTERN_NONE) {
+            if (to != off)
+                memmove(p->arena + to, rec, size);
+            p->slot[((struct intern_rec *)(p->arena + to))->slot].off = to;
+            to += size;
+        }
+        off += size;
+    }
+    p->used = to;
+    p->dead = 0;
+    p->compact++;
+
+}
+
+// handle of str, added if new, with one more reference
+uint32_t intern_get(struct intern *p, const char *str, size_t len, uint64_t hash) {
+
+    struct intern_rec *rec;
+    uint32_t h;
+    size_t size;
+
+    bug_on(len > UINT16_MAX);
+
+    if ((h = intern_find(p, str, len, hash)) != INTERN_NONE) {
+        p->slot[h].ref++;
+        return h;
+    }
+
+    size = rec_size(len);
+    if (p->used + size > p->cap) {
+        p->cap = p->cap ? p->cap * 2 : INTERN_ARENA_MIN;
+        while (p->used + size > p->cap)
+            p->cap *= 2;
+        p->arena = xrealloc(p->arena, 1, p->cap);
+    }
+
+    if (p->free) {
+        h = p->free;
+        p->free = p->slot[h].next;
+    }
+    else {
+        if (!p->nr_slot)
+            p->nr_slot = 1;
+        if (p->nr_slot >= p->cap_slot) {
+            p->cap_slot = p->cap_slot ? p->cap_slot * 2 : INTERN_BUCKETS_MIN;
+            p->slot = xrealloc(p->slot, p->cap_slot, sizeof(*p->slot));
+        }
+        h = p->nr_slot++;
+    }
+
+    rec = (struct intern_rec *)(p->arena + p->used);
+    rec->slot = h;
+    rec->len = len;
+    memcpy(rec->str, str, len);
+    rec->str[len] = 0;
+
+    p->slot[h].hash = hash;
+    p->slot[h].off = p->used;
+    p->slot[h].ref = 1;
+    p->used += size;
+    p->nr_live++;
+
+    if (!p->bucket || p->nr_live > p->mask + 1)
+        intern_rehash(p);
+    else {
+        p->slot[h].next = p->bucket[hash & p->mask];
+        p->bucket[hash & p->mask] = h;
+    }
+
+    return h;
+
+}
+
+// drop a reference, the last one frees the slot and its record
+void intern_put(struct intern *p, uint32_t h) {
+
+    struct intern_slot *s = &p->slot[h];
+    struct intern_rec *rec;
+    uint32_t *link;
+
+    bug_on(h == INTERN_NONE || !s->ref);
+
+    if (--s->ref)
+        return;
+
+    for (link = &p->bucket[s->hash & p->mask]; *link != h; link = &p->slot[*link].next)
+        ;
+    *link = s->next;
+
+    rec = (struct intern_rec *)(p->arena + s->off);
+    rec->slot = INTERN_NONE;
+    p->dead += rec_size(rec->len);
+    p->nr_live--;
+
+    s->next = p->free;
+    p->free = h;
+
+    if (p->dead >= INTERN_COMPACT_MIN && p->dead * 2 >= p->used)
+        intern_compact(p);
+
+}
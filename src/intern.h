@@ -0,0 +1,77 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// interned strings: every distinct key is stored once in an arena as a
+// length prefixed record, and tables hold a 32 bit handle to it instead of
+// a MAX_DNAME_LEN buffer. the hash is computed once by the caller and kept
+// in the slot, so comparing two interned keys is comparing handles.
+// handles are reference counted slot numbers and stay valid while
+// referenced; when half of the arena is dead it is compacted, which moves
+// the bytes but not the handles, so pointers from intern_str are only
+// good until the next intern_get or intern_put.
+#define INTERN_NONE 0
+
+struct intern_rec {
+    // owner, INTERN_NONE once released
+    uint32_t slot;
+    uint16_t len;
+    char str[];
+};
+
+struct intern_slot {
+    uint64_t hash;
+    // of the record in the arena
+    uint32_t off;
+    // 0 for a free slot
+    uint32_t ref;
+    // hash chain, or the free list for free slots
+    uint32_t next;
+};
+
+// a zeroed struct intern is an empty pool
+struct intern {
+    char *arena;
+    size_t used, cap, dead;
+    // slot 0 is never used, so 0 ends chains
+    struct intern_slot *slot;
+    uint32_t nr_slot, cap_slot, free;
+    uint32_t *bucket;
+    uint32_t mask;
+    uint32_t nr_live;
+    // arena compactions so far
+    uint64_t compact;
+};
+
+void intern_free(struct intern *p);
+uint32_t intern_find(const struct intern *p, const char *str, size_t len, uint64_t hash);
+uint32_t intern_get(struct intern *p, const char *str, size_t len, uint64_t hash);
+void intern_put(struct intern *p, uint32_t h);
+
+static inline void intern_ref(struct intern *p, uint32_t h) {
+    p->slot[h].ref++;
+}
+
+static inline const struct intern_rec *intern_rec(const struct intern *p, uint32_t h) {
+    return (const struct intern_rec *)(p->arena + p->slot[h].off);
+}
+
+static inline const char *intern_str(const struct intern *p, uint32_t h) {
+    return intern_rec(p, h)->str;
+}
+
+static inline size_t intern_len(const struct intern *p, uint32_t h) {
+    return intern_rec(p, h)->len;
+}
+
+static inline uint64_t intern_hash(const struct intern *p, uint32_t h) {
+    return p->slot[h].hash;
+}
+
+#endif /* INTERN_H */
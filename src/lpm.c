@@ -0,0 +1,206 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "lpm.h"
+#include "xmalloc.h"
+#include "built_in.h"
+#include "die.h"
+
+struct lpm *lpm_new(unsigned int bits, const uint8_t *len, unsigned int nr_len, uint32_t max_node) {
+
+    struct lpm *t;
+    unsigned int i;
+
+    bug_on(bits != 32 && bits != 128);
+    bug_on(!nr_len || nr_len > LPM_MAX_LEVELS);
+
+    t = xzmalloc(sizeof(*t));
+    t->bits = bits;
+    t->nr_len = nr_len;
+    memset(t->level, -1, sizeof(t->level));
+    for (i = 0; i < nr_len; i++) {
+        bug_on(len[i] % LPM_STRIDE || !len[i] || len[i] > bits);
+        t->len[i] = len[i];
+        t->level[len[i] / LPM_STRIDE - 1] = i;
+    }
+    t->depth = len[nr_len - 1] / LPM_STRIDE;
+
+    // the root, it is never a child so index 0 means no child
+    t->max_node = max_node ? max_node : 1;
+    t->cap_node = t->max_node < 64 ? t->max_node : 64;
+    t->node = xzmalloc(t->cap_node * sizeof(*t->node));
+    t->nr_node = 1;
+
+    return t;
+
+}
+
+void lpm_free(struct lpm *t) {
+    xfree(t->node);
+    xfree(t);
+}
+
+void lpm_reset(struct lpm *t) {
+    memset(&t->node[0], 0, sizeof(t->node[0]));
+    t->nr_node = 1;
+    t->total = 0;
+    memset(t->overflow, 0, sizeof(t->overflow));
+}
+
+// 0 once the array is at max_node
+static uint32_t lpm_alloc(struct lpm *t) {
+
+    uint32_t cap;
+
+    if (t->nr_node == t->cap_node) {
+        if (t->cap_node == t->max_node)
+            return 0;
+        cap = t->cap_node * 2 < t->max_node ? t->cap_node * 2 : t->max_node;
+        t->node = xrealloc(t->node, cap, sizeof(*t->node));
+        t->cap_node = cap;
+    }
+    memset(&t->node[t->nr_node], 0, sizeof(t->node[0]));
+
+    return t->nr_node++;
+
+}
+
+static inline unsigned int nibble(const uint8_t *addr, unsigned int d) {
+    return (addr[d >> 1] >> ((d & 1) ? 0 : 4)) & (LPM_FANOUT - 1);
+}
+
+// addr in network order, 4 or 16 bytes
+void lpm_add(struct lpm *t, const uint8_t *addr) {
+
+    uint32_t n = 0, c;
+    unsigned int d, nib;
+
+    t->total++;
+    for (d = 0; ; d++) {
+        nib = nibble(addr, d);
+        if (t->level[d] >= 0)
+            t->node[n].count[nib]++;
+        if (d + 1 == t->depth)
+            return;
+
+        c = t->node[n].child[nib];
+        if (!c) {
+            c = lpm_alloc(t);
+            if (!c)
+                break;
+            t->node[n].child[nib] = c;
+        }
+        n = c;
+    }
+
+    // out of nodes: the longer lengths miss this packet
+    for (d++; d < t->depth; d++) {
+        if (t->level[d] >= 0)
+            t->overflow[t->level[d]]++;
+    }
+
+}
+
+// insert into a descending top list of at most k
+static void top_insert(struct lpm_top *top, size_t *n, size_t k, const uint8_t *addr, uint64_t count) {
+
+    size_t pos = *n;
+
+    if (pos == k) {
+        if (count <= top[k - 1].count)
+            return;
+        pos--;
+    }
+    else {
+        (*n)++;
+    }
+
+    while (pos > 0 && top[pos - 1].count < count) {
+        top[pos] = top[pos - 1];
+        pos--;
+    }
+    memcpy(top[pos].addr, addr, sizeof(top[pos].addr));
+    top[pos].count = count;
+
+}
+
+static void top_walk(const struct lpm *t, uint32_t n, unsigned int d, unsigned int target,
+                     uint8_t *addr, struct lpm_top *top, size_t *nr, size_t k) {
+
+    unsigned int nib, shift = (d & 1) ? 0 : 4;
+
+    for (nib = 0; nib < LPM_FANOUT; nib++) {
+        addr[d >> 1] = (addr[d >> 1] & ~(0xf << shift)) | (nib << shift);
+        if (d == target) {
+            if (t->node[n].count[nib])
+                top_insert(top, nr, k, addr, t->node[n].count[nib]);
+        }
+        else if (t->node[n].child[nib]) {
+            top_walk(t, t->node[n].child[nib], d + 1, target, addr, top, nr, k);
+        }
+    }
+    addr[d >> 1] &= ~(0xf << shift);
+
+}
+
+// the k prefixes of a level with the most packets, sorted
+size_t lpm_top(const struct lpm *t, unsigned int level, struct lpm_top *top, size_t k) {
+
+    uint8_t addr[16];
+    size_t n = 0;
+
+    if (level >= t->nr_len || !k)
+        return 0;
+
+    memset(addr, 0, sizeof(addr));
+    top_walk(t, 0, 0, t->len[level] / LPM_STRIDE - 1, addr, top, &n, k);
+
+    return n;
+
+}
+
+// comma separated ascending lengths, multiples of LPM_STRIDE in min..max.
+// returns how many, 0 for "none" or "0" and -1 if invalid
+int lpm_parse_lengths(const char *str, unsigned int min, unsigned int max, uint8_t *len) {
+
+    unsigned long v;
+    char *end;
+    int n = 0;
+
+    if (!strcmp(str, "none") || !strcmp(str, "0"))
+        return 0;
+
+    while (*str) {
+        v = strtoul(str, &end, 10);
+        if (end == str || v < min || v > max || v % LPM_STRIDE)
+            return -1;
+        if (n == LPM_MAX_LEVELS || (n && v <= len[n - 1]))
+            return -1;
+        len[n++] = v;
+        str = end;
+        if (*str == ',')
+            str++;
+        else if (*str)
+            return -1;
+    }
+
+    return n;
+
+}
+
+char *lpm_prefix_str(const struct lpm *t, const uint8_t *addr, unsigned int level, char *buf, size_t size) {
+
+    char ip[INET6_ADDRSTRLEN];
+
+    inet_ntop(t->bits == 32 ? AF_INET : AF_INET6, addr, ip, sizeof(ip));
+    snprintf(buf, size, "%s/%u", ip, t->len[level]);
+
+    return buf;
+
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#ifndef LPM_H
+#define LPM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// prefix rollups: a multibit trie over the address, 4 bits per level. a node
+// covers one prefix and holds the child index and the packet count of each
+// of its 16 longer prefixes, so one walk from the root counts a packet at
+// every configured length and the last length needs no nodes at all. nodes
+// live in one array that grows up to max_node; once it is full packets are
+// still counted at the lengths whose nodes exist and the rest go to
+// overflow, so coarse lengths stay exact under spoofed floods.
+#define LPM_STRIDE 4
+#define LPM_FANOUT (1 << LPM_STRIDE)
+#define LPM_MAX_LEVELS 8
+#define LPM_MAX_NODES_DEFAULT (1 << 15)
+
+struct lpm_node {
+    uint32_t child[LPM_FANOUT];
+    uint64_t count[LPM_FANOUT];
+};
+
+struct lpm {
+    // address length in bits, 32 or 128
+    unsigned int bits;
+    // nibbles walked per insert, the longest length / LPM_STRIDE
+    unsigned int depth;
+    unsigned int nr_len;
+    uint8_t len[LPM_MAX_LEVELS];
+    // level of the prefixes counted at a node depth, -1 if none
+    int8_t level[128 / LPM_STRIDE];
+    struct lpm_node *node;
+    uint32_t nr_node, cap_node, max_node;
+    uint64_t total;
+    uint64_t overflow[LPM_MAX_LEVELS];
+};
+
+struct lpm_top {
+    uint8_t addr[16];
+    uint64_t count;
+};
+
+struct lpm *lpm_new(unsigned int bits, const uint8_t *len, unsigned int nr_len, uint32_t max_node);
+void lpm_free(struct lpm *t);
+void lpm_reset(struct lpm *t);
+void lpm_add(struct lpm *t, const uint8_t *addr);
+size_t lpm_top(const struct lpm *t, unsigned int level, struct lpm_top *top, size_t k);
+int lpm_parse_lengths(const char *str, unsigned int min, unsigned int max, uint8_t *len);
+char *lpm_prefix_str(const struct lpm *t, const uint8_t *addr, unsigned int level, char *buf, size_t size);
+
+#endif /* LPM_H */
@@ -0,0 +1,223 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "merge.h"
+#include "xmalloc.h"
+#include "die.h"
+
+void merge_init(struct merge *m, uint64_t window) {
+
+    int i;
+
+    memset(m, 0, sizeof(*m));
+    m->window = window;
+    for (i = 0; i < EXPORT_SKETCHES; i++)
+        m->uniq[i] = hll_new(EXPORT_HLL_P);
+
+}
+
+void merge_free(struct merge *m) {
+
+    struct merge_source *src, *tmp;
+    int i;
+
+    HASH_ITER(hh, m->sources, src, tmp) {
+        HASH_DEL(m->sources, src);
+        xfree(src);
+    }
+    for (i = 0; i < EXPORT_SKETCHES; i++)
+        hll_free(m->uniq[i]);
+    if (m->keys)
+        xfree(m->keys);
+
+}
+
+static void add_counters(struct statshm_data *d, const struct statshm_data *s) {
+
+    int i;
+
+    d->seen += s->seen;
+    d->incoming += s->incoming;
+    d->cnt_query += s->cnt_query;
+    d->cnt_reply += s->cnt_reply;
+    d->cnt_status_noerror += s->cnt_status_noerror;
+    d->cnt_status_srvfail += s->cnt_status_srvfail;
+    d->cnt_status_nxdomain += s->cnt_status_nxdomain;
+    d->cnt_status_refused += s->cnt_status_refused;
+    d->cnt_malformed += s->cnt_malformed;
+    d->cnt_edns += s->cnt_edns;
+    for (i = 0; i < STATSHM_LAT_BUCKETS; i++) {
+        d->lat_bound[i] = s->lat_bound[i];
+        d->lat_bucket[i] += s->lat_bucket[i];
+    }
+    d->lat_sum += s->lat_sum;
+    d->lat_count += s->lat_count;
+    d->lat_unmatched += s->lat_unmatched;
+    d->kernel_drops += s->kernel_drops;
+    d->sampled_out += s->sampled_out;
+    // the most loaded node's
+    if (s->shed_tier > d->shed_tier)
+        d->shed_tier = s->shed_tier;
+    if (s->shed_rate > d->shed_rate)
+        d->shed_rate = s->shed_rate;
+    if (s->first_ts && (!d->first_ts || s->first_ts < d->first_ts))
+        d->first_ts = s->first_ts;
+    if (s->ts > d->ts)
+        d->ts = s->ts;
+
+}
+
+void merge_add(struct merge *m, const struct export_rec *rec) {
+
+    const struct statshm_data *d = &rec->data;
+    struct merge_source *src;
+    int i;
+
+    if (!m->nr_rec) {
+        m->start = d->ts - d->ts % m->window;
+        m->end = m->start + m->window;
+        memset(&m->delta, 0, sizeof(m->delta));
+        for (i = 0; i < EXPORT_SKETCHES; i++)
+            hll_reset(m->uniq[i]);
+    }
+    else if (d->ts < m->start) {
+        m->nr_late++;
+    }
+    m->nr_rec++;
+
+    HASH_FIND_STR(m->sources, rec->source, src);
+    if (!src) {
+        src = xzmalloc(sizeof(*src));
+        strcpy(src->name, rec->source);
+        HASH_ADD_STR(m->sources, name, src);
+        m->nr_source++;
+    }
+    if (src->first_ts != d->first_ts) {
+        src->first_ts = d->first_ts;
+        src->next_seq = rec->seq;
+    }
+    if (rec->seq > src->next_seq)
+        src->nr_lost += rec->seq - src->next_seq;
+    src->next_seq = rec->seq + 1;
+    src->nr_rec++;
+
+    // since start, so the latest record has all of it
+    if (d->ts >= src->ts) {
+        src->ts = d->ts;
+        src->nr_table = d->nr_table < STATSHM_TABLES ? d->nr_table : STATSHM_TABLES;
+        memcpy(src->table, d->table, src->nr_table * sizeof(src->table[0]));
+    }
+
+    add_counters(&m->delta, d);
+    for (i = 0; i < EXPORT_SKETCHES; i++)
+        hll_merge(m->uniq[i], rec->uniq[i]);
+
+}
+
+// every key of the nodes' lists is a candidate, which are at most
+// STATSHM_TOPK per node
+static void merge_table(struct merge *m, uint32_t t, struct statshm_table *out) {
+
+    struct merge_source *src, *tmp;
+    struct merge_key *keys = NULL, *k, *top[STATSHM_TOPK];
+    const struct statshm_table *in;
+    size_t nr = 0, i;
+    uint64_t bound = 0, last;
+    uint32_t j, n = 0, pos;
+
+    if (m->nr_key_alloc < (size_t)m->nr_source * STATSHM_TOPK) {
+        if (m->keys)
+            xfree(m->keys);
+        m->nr_key_alloc = (size_t)m->nr_source * STATSHM_TOPK;
+        m->keys = xmalloc(m->nr_key_alloc * sizeof(*m->keys));
+    }
+
+    out->title[0] = 0;
+    HASH_ITER(hh, m->sources, src, tmp) {
+        if (src->ts < m->start || t >= src->nr_table)
+            continue;
+        in = &src->table[t];
+        if (!out->title[0])
+            memcpy(out->title, in->title, sizeof(out->title));
+        // a short list is all the node has
+        last = in->n == STATSHM_TOPK ? in->entry[in->n - 1].count : 0;
+        bound += last;
+        for (j = 0; j < in->n && j < STATSHM_TOPK; j++) {
+            HASH_FIND_STR(keys, in->entry[j].key, k);
+            if (!k) {
+                k = &m->keys[nr++];
+                k->key = in->entry[j].key;
+                k->count = 0;
+                k->covered = 0;
+                HASH_ADD_KEYPTR(hh, keys, k->key, strlen(k->key), k);
+            }
+            k->count += in->entry[j].count;
+            k->covered += last;
+        }
+    }
+
+    // the STATSHM_TOPK largest, without sorting them all
+    for (i = 0; i < nr; i++) {
+        k = &m->keys[i];
+        pos = n;
+        if (pos == STATSHM_TOPK) {
+            if (k->count <= top[pos - 1]->count)
+                continue;
+            pos--;
+        }
+        else {
+            n++;
+        }
+        while (pos > 0 && top[pos - 1]->count < k->count) {
+            top[pos] = top[pos - 1];
+            pos--;
+        }
+        top[pos] = k;
+    }
+
+    for (j = 0; j < n; j++) {
+        snprintf(out->entry[j].key, sizeof(out->entry[j].key), "%s", top[j]->key);
+        out->entry[j].count = top[j]->count;
+        out->entry[j].rate = 0;
+        out->entry[j].error = bound - top[j]->covered;
+    }
+    out->n = n;
+
+    HASH_CLEAR(hh, keys);
+
+}
+
+// out gets the totals since the first window, and the distinct counts and
+// tables merged over the nodes heard from in this one. the window's own
+// counters stay in m->delta until the next one opens
+void merge_close(struct merge *m, struct statshm_data *out) {
+
+    struct merge_source *src, *tmp;
+    uint32_t t, nr_table = 0;
+
+    add_counters(&m->total, &m->delta);
+    memcpy(out, &m->total, offsetof(struct statshm_data, nr_table));
+    out->ts = m->end;
+    out->shed_tier = m->delta.shed_tier;
+    out->shed_rate = m->delta.shed_rate ? m->delta.shed_rate : 1;
+    out->uniq_source = hll_count(m->uniq[EXPORT_UNIQ_SOURCE]);
+    out->uniq_source24 = hll_count(m->uniq[EXPORT_UNIQ_SOURCE24]);
+    out->uniq_qname = hll_count(m->uniq[EXPORT_UNIQ_QNAME]);
+
+    HASH_ITER(hh, m->sources, src, tmp) {
+        if (src->ts >= m->start && src->nr_table > nr_table)
+            nr_table = src->nr_table;
+    }
+    for (t = 0; t < nr_table; t++)
+        merge_table(m, t, &out->table[t]);
+    out->nr_table = nr_table;
+
+    m->nr_rec = 0;
+    m->nr_window++;
+
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <stdint.h>
+
+#include "uthash.h"
+#include "hll.h"
+#include "statshm.h"
+#include "export.h"
+
+// export records of many nodes combined into tumbling windows of record
+// time. each part merges the way it was built: counters and latency
+// buckets are deltas and add up, sketches, being of a record's period,
+// merge by register max into the fleet's distinct sets of the window, and
+// the top tables, being since start per node, merge the last record of
+// each node in the window. a node's
+// list misses keys below its last entry, so a merged count may be short by
+// up to that entry's count for every full list the key is not in; that
+// bound goes with each merged entry as its error. it holds for lists by
+// count, that is nodes without --decay.
+struct merge_source {
+    char name[EXPORT_SOURCE_LEN];
+    // a new first_ts is a restart, seq starts over
+    uint64_t first_ts;
+    uint64_t next_seq;
+    uint64_t nr_rec, nr_lost;
+    // record time of the last record, its tables
+    uint64_t ts;
+    uint32_t nr_table;
+    struct statshm_table table[STATSHM_TABLES];
+    UT_hash_handle hh;
+};
+
+// a key of one table while the window closes
+struct merge_key {
+    const char *key;
+    uint64_t count;
+    // sum of the last entry counts of the full lists the key is in
+    uint64_t covered;
+    UT_hash_handle hh;
+};
+
+struct merge {
+    uint64_t window;
+    // open window, empty while nr_rec is 0
+    uint64_t start, end, nr_rec;
+    // counters of the window as deltas, and since the first window
+    struct statshm_data delta;
+    struct statshm_data total;
+    // distinct sets of the window
+    struct hll *uniq[EXPORT_SKETCHES];
+    struct merge_source *sources;
+    uint32_t nr_source;
+    struct merge_key *keys;
+    size_t nr_key_alloc;
+    // records older than the open window, counted into it
+    uint64_t nr_late;
+    uint64_t nr_window;
+};
+
+void merge_init(struct merge *m, uint64_t window);
+void merge_free(struct merge *m);
+void merge_add(struct merge *m, const struct export_rec *rec);
+void merge_close(struct merge *m, struct statshm_data *out);
+
+// a record past the open window closes it first
+static inline int merge_due(const struct merge *m, const struct export_rec *rec) {
+    return m->nr_rec && rec->data.ts >= m->end;
+}
+
+#endif /* MERGE_H */
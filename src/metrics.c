@@ -0,0 +1,474 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "metrics.h"
+#include "dnsctxt.h"
+#include "xmalloc.h"
+#include "die.h"
+
+// room kept for the terminating "# EOF", a full buffer cuts the families
+#define METRICS_EOF_ROOM 16
+// a scrape that does not send its request or read the reply in time is
+// dropped, the next one is waiting
+#define METRICS_TIMEOUT_SEC 5
+
+struct metrics {
+    int fd;
+    // written to by metrics_stop
+    int stop[2];
+    // of a unix socket, to unlink
+    char *path;
+    const struct statshm *shm;
+    // for /lookup, NULL without sketches
+    struct dnsctxt_sketches *sketches;
+    pthread_t thread;
+    struct statshm_data data;
+    char req[4096];
+    char *buf;
+    size_t len;
+    int full;
+};
+
+static void out(struct metrics *m, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void out(struct metrics *m, const char *fmt, ...) {
+
+    size_t room = METRICS_BUF_SIZE - METRICS_EOF_ROOM - m->len;
+    va_list ap;
+    int n;
+
+    if (m->full)
+        return;
+    va_start(ap, fmt);
+    n = vsnprintf(m->buf + m->len, room, fmt, ap);
+    va_end(ap);
+    // a cut line is overwritten by what follows
+    if (n < 0 || (size_t)n >= room)
+        m->full = 1;
+    else
+        m->len += n;
+
+}
+
+// label value, with backslash, quote and newline escaped
+static const char *esc(const char *src, char *dst, size_t size) {
+
+    size_t i = 0;
+
+    for (; *src && i + 2 < size; src++) {
+        if (*src == '\\' || *src == '"') {
+            dst[i++] = '\\';
+            dst[i++] = *src;
+        }
+        else if (*src == '\n') {
+            dst[i++] = '\\';
+            dst[i++] = 'n';
+        }
+        else {
+            dst[i++] = *src;
+        }
+    }
+    dst[i] = 0;
+
+    return dst;
+
+}
+
+// table title as a label value, "Incoming Source IPs" is incoming_source_ips
+static const char *slug(const char *title, char *dst, size_t size) {
+
+    size_t i = 0;
+
+    for (; *title && i + 1 < size; title++) {
+        if (isalnum((unsigned char)*title))
+            dst[i++] = tolower((unsigned char)*title);
+        else if (i && dst[i - 1] != '_')
+            dst[i++] = '_';
+    }
+    while (i && dst[i - 1] == '_')
+        i--;
+    dst[i] = 0;
+
+    return dst;
+
+}
+
+static void family(struct metrics *m, const char *name, const char *type, const char *help) {
+    out(m, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+static void render(struct metrics *m) {
+
+    const struct statshm_data *d = &m->data;
+    const struct statshm_table *t;
+    char key[2 * STATSHM_KEY_LEN], table[STATSHM_TITLE_LEN];
+    uint64_t cum = 0;
+    uint32_t i, j;
+
+    m->len = 0;
+    m->full = 0;
+
+    family(m, "pktvisor_packets", "counter", "DNS packets seen.");
+    out(m, "pktvisor_packets_total %lu\n", d->seen);
+    family(m, "pktvisor_incoming_packets", "counter", "DNS packets to the local networks.");
+    out(m, "pktvisor_incoming_packets_total %lu\n", d->incoming);
+
+    family(m, "pktvisor_dns_messages", "counter", "DNS messages by query/reply flag.");
+    out(m, "pktvisor_dns_messages_total{qr=\"query\"} %lu\n", d->cnt_query);
+    out(m, "pktvisor_dns_messages_total{qr=\"reply\"} %lu\n", d->cnt_reply);
+
+    family(m, "pktvisor_dns_replies", "counter", "Outgoing DNS replies by rcode.");
+    out(m, "pktvisor_dns_replies_total{rcode=\"NOERROR\"} %lu\n", d->cnt_status_noerror);
+    out(m, "pktvisor_dns_replies_total{rcode=\"SERVFAIL\"} %lu\n", d->cnt_status_srvfail);
+    out(m, "pktvisor_dns_replies_total{rcode=\"NXDOMAIN\"} %lu\n", d->cnt_status_nxdomain);
+    out(m, "pktvisor_dns_replies_total{rcode=\"REFUSED\"} %lu\n", d->cnt_status_refused);
+
+    family(m, "pktvisor_dns_malformed", "counter", "Malformed DNS packets.");
+    out(m, "pktvisor_dns_malformed_total %lu\n", d->cnt_malformed);
+    family(m, "pktvisor_dns_edns", "counter", "DNS packets with EDNS.");
+    out(m, "pktvisor_dns_edns_total %lu\n", d->cnt_edns);
+
+    family(m, "pktvisor_dns_qtype", "counter", "Incoming DNS queries by type.");
+    t = &d->table[DNS_TABLE_QTYPE];
+    for (j = 0; DNS_TABLE_QTYPE < d->nr_table && j < t->n && j < STATSHM_TOPK; j++)
+        out(m, "pktvisor_dns_qtype_total{qtype=\"%s\"} %lu\n",
+            esc(t->entry[j].key, key, sizeof(key)), t->entry[j].count);
+
+    family(m, "pktvisor_unique", "gauge", "Distinct counts since start, estimated.");
+    out(m, "pktvisor_unique{set=\"source_ips\"} %lu\n", d->uniq_source);
+    out(m, "pktvisor_unique{set=\"source_24s\"} %lu\n", d->uniq_source24);
+    out(m, "pktvisor_unique{set=\"qnames\"} %lu\n", d->uniq_qname);
+
+    family(m, "pktvisor_dns_latency_seconds", "histogram", "Query to reply latency of the local server.");
+    for (i = 0; i < STATSHM_LAT_BUCKETS; i++) {
+        cum += d->lat_bucket[i];
+        if (d->lat_bound[i] == UINT64_MAX)
+            out(m, "pktvisor_dns_latency_seconds_bucket{le=\"+Inf\"} %lu\n", cum);
+        else
+            out(m, "pktvisor_dns_latency_seconds_bucket{le=\"%g\"} %lu\n", d->lat_bound[i] / 1e9, cum);
+    }
+    out(m, "pktvisor_dns_latency_seconds_count %lu\n", d->lat_count);
+    out(m, "pktvisor_dns_latency_seconds_sum %.9f\n", d->lat_sum / 1e9);
+    family(m, "pktvisor_dns_unmatched_replies", "counter", "Replies without a query seen.");
+    out(m, "pktvisor_dns_unmatched_replies_total %lu\n", d->lat_unmatched);
+
+    family(m, "pktvisor_top_count", "gauge", "Top entries of the tables, by count or by rate with decay.");
+    for (i = 0; i < d->nr_table && i < STATSHM_TABLES; i++) {
+        if (i == DNS_TABLE_QTYPE)
+            continue;
+        t = &d->table[i];
+        slug(t->title, table, sizeof(table));
+        for (j = 0; j < t->n && j < STATSHM_TOPK; j++)
+            out(m, "pktvisor_top_count{table=\"%s\",key=\"%s\"} %lu\n",
+                table, esc(t->entry[j].key, key, sizeof(key)), t->entry[j].count);
+    }
+    family(m, "pktvisor_top_rate", "gauge", "Decayed rate of the top entries, per second.");
+    for (i = 0; i < d->nr_table && i < STATSHM_TABLES; i++) {
+        t = &d->table[i];
+        slug(t->title, table, sizeof(table));
+        for (j = 0; j < t->n && j < STATSHM_TOPK; j++) {
+            if (t->entry[j].rate)
+                out(m, "pktvisor_top_rate{table=\"%s\",key=\"%s\"} %.3f\n",
+                    table, esc(t->entry[j].key, key, sizeof(key)), t->entry[j].rate);
+        }
+    }
+
+    family(m, "pktvisor_shed_tier", "stateset", "Analysis tier, cheaper ones while the capture falls behind.");
+    for (i = 0; i < DNS_TIER_NR; i++)
+        out(m, "pktvisor_shed_tier{pktvisor_shed_tier=\"%s\"} %d\n", dnsctxt_tier_name[i], i == d->shed_tier);
+    family(m, "pktvisor_shed_sample_rate", "gauge", "1 in this many packets analysed.");
+    out(m, "pktvisor_shed_sample_rate %u\n", d->shed_rate);
+    family(m, "pktvisor_sampled_out_packets", "counter", "Packets skipped by sampling, included in the counts by scaling.");
+    out(m, "pktvisor_sampled_out_packets_total %lu\n", d->sampled_out);
+    family(m, "pktvisor_kernel_drops", "counter", "Packets the kernel dropped for a full capture ring.");
+    out(m, "pktvisor_kernel_drops_total %lu\n", d->kernel_drops);
+
+    family(m, "pktvisor_snapshot_timestamp_seconds", "gauge", "Packet time of the snapshot.");
+    out(m, "pktvisor_snapshot_timestamp_seconds %.3f\n", d->ts / 1e9);
+
+    m->len += snprintf(m->buf + m->len, METRICS_BUF_SIZE - m->len, "# EOF\n");
+
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+
+    ssize_t n;
+
+    while (len) {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+
+}
+
+// %XX and + of a query string value, up to a space or &. returns -1 if
+// it does not fit or is malformed
+static int unescape(const char *src, char *dst, size_t size) {
+
+    size_t i = 0;
+    unsigned int c;
+
+    for (; *src && *src != ' ' && *src != '&' && *src != '\r' && *src != '\n'; src++) {
+        if (i + 1 >= size)
+            return -1;
+        if (*src == '%') {
+            if (!isxdigit((unsigned char)src[1]) || !isxdigit((unsigned char)src[2]) ||
+                sscanf(src + 1, "%2x", &c) != 1 || !c)
+                return -1;
+            dst[i++] = c;
+            src += 2;
+        }
+        else {
+            dst[i++] = *src == '+' ? ' ' : *src;
+        }
+    }
+    dst[i] = 0;
+
+    return 0;
+
+}
+
+// one line per table the key can be in, its sketch estimate and the bound
+// of the overcount
+static int render_lookup(struct metrics *m, const char *key) {
+
+    struct dnsctxt_freq freq[DNS_TABLE_NR];
+    int t;
+
+    m->len = 0;
+    m->full = 0;
+
+    if (!dnsctxt_lookup_sketches(m->sketches, key, freq))
+        return -1;
+    for (t = 0; t < DNS_TABLE_NR; t++) {
+        if (!freq[t].queried)
+            continue;
+        if (freq[t].have_sketch)
+            out(m, "%s <= %lu (+-%lu)\n", dnsctxt_table_name[t], freq[t].sketch, freq[t].sketch_error);
+        else
+            out(m, "%s no sketch\n", dnsctxt_table_name[t]);
+    }
+
+    return 0;
+
+}
+
+static void reply(struct metrics *m, int fd, const char *type) {
+
+    char hdr[256];
+    int hlen;
+
+    hlen = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: %s\r\n"
+                    "Content-Length: %zu\r\nConnection: close\r\n\r\n", type, m->len);
+    if (!write_all(fd, hdr, hlen))
+        write_all(fd, m->buf, m->len);
+
+}
+
+static void serve(struct metrics *m, int fd) {
+
+    static const char *not_found = "HTTP/1.1 404 Not Found\r\n"
+        "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    static const char *bad_request = "HTTP/1.1 400 Bad Request\r\n"
+        "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    static const char *unavailable = "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    char key[MAX_DNAME_LEN + 1];
+    size_t len = 0;
+    ssize_t n;
+
+    // only the request line matters, the rest of the request is ignored
+    while (len < sizeof(m->req) - 1 && !memchr(m->req, '\n', len)) {
+        n = recv(fd, m->req + len, sizeof(m->req) - 1 - len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        len += n;
+    }
+    m->req[len] = 0;
+
+    // point query of a key, answered from a copy of the sketches
+    if (m->sketches && !strncmp(m->req, "GET /lookup?key=", 16)) {
+        if (unescape(m->req + 16, key, sizeof(key)) || !key[0] || render_lookup(m, key)) {
+            write_all(fd, bad_request, strlen(bad_request));
+            return;
+        }
+        reply(m, fd, "text/plain; charset=utf-8");
+        return;
+    }
+
+    if (strncmp(m->req, "GET /metrics", 12) || (m->req[12] != ' ' && m->req[12] != '?')) {
+        write_all(fd, not_found, strlen(not_found));
+        return;
+    }
+
+    if (statshm_read(m->shm, &m->data)) {
+        write_all(fd, unavailable, strlen(unavailable));
+        return;
+    }
+    render(m);
+    reply(m, fd, "application/openmetrics-text; version=1.0.0; charset=utf-8");
+
+}
+
+static void *metrics_thread(void *arg) {
+
+    struct metrics *m = arg;
+    struct timeval tv = { .tv_sec = METRICS_TIMEOUT_SEC };
+    struct pollfd pfd[2] = {
+        { .fd = m->fd, .events = POLLIN },
+        { .fd = m->stop[0], .events = POLLIN },
+    };
+    int fd;
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfd[1].revents)
+            break;
+        if (!(pfd[0].revents & POLLIN))
+            continue;
+        fd = accept(m->fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        serve(m, fd);
+        close(fd);
+    }
+
+    return NULL;
+
+}
+
+// "/path" or "unix:/path" for a unix socket, "[host:]port" for tcp with
+// host defaulting to 127.0.0.1, ipv6 hosts in brackets
+static int metrics_listen(struct metrics *m, const char *listen_on) {
+
+    struct sockaddr_un sun;
+    struct addrinfo hints, *ai;
+    char host[256], *port;
+    int fd, one = 1;
+
+    if (!strncmp(listen_on, "unix:", 5))
+        listen_on += 5;
+    if (listen_on[0] == '/') {
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(listen_on) >= sizeof(sun.sun_path))
+            panic("Metrics socket path too long: %s\n", listen_on);
+        strcpy(sun.sun_path, listen_on);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        unlink(listen_on);
+        if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) || listen(fd, 16)) {
+            close(fd);
+            return -1;
+        }
+        m->path = xstrdup(listen_on);
+        return fd;
+    }
+
+    if (strlen(listen_on) >= sizeof(host))
+        panic("Metrics address too long: %s\n", listen_on);
+    strcpy(host, "127.0.0.1");
+    port = (char *)listen_on;
+    if (strrchr(listen_on, ':')) {
+        strcpy(host, listen_on[0] == '[' ? listen_on + 1 : listen_on);
+        port = strrchr(host, ':');
+        *port++ = 0;
+        if (listen_on[0] == '[' && strchr(host, ']'))
+            *strchr(host, ']') = 0;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    if (getaddrinfo(host, port, &hints, &ai))
+        panic("Cannot resolve metrics address %s\n", listen_on);
+    fd = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (fd >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) || listen(fd, 16)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(ai);
+
+    return fd;
+
+}
+
+struct metrics *metrics_start(const char *listen_on, const struct statshm *shm,
+                              struct dnsctxt_sketches *sketches) {
+
+    struct metrics *m = xzmalloc(sizeof(*m));
+    sigset_t all, old;
+
+    m->shm = shm;
+    m->sketches = sketches;
+    m->buf = xmalloc(METRICS_BUF_SIZE);
+    m->fd = metrics_listen(m, listen_on);
+    if (m->fd < 0)
+        panic("Cannot listen for metrics on %s: %s\n", listen_on, strerror(errno));
+    if (pipe(m->stop))
+        panic("Cannot create pipe: %s\n", strerror(errno));
+
+    // signals stay with the capture thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&m->thread, NULL, metrics_thread, m))
+        panic("Cannot start the metrics thread\n");
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return m;
+
+}
+
+void metrics_stop(struct metrics *m) {
+
+    if (write(m->stop[1], "", 1) != 1)
+        panic("Cannot stop the metrics thread\n");
+    pthread_join(m->thread, NULL);
+
+    close(m->fd);
+    close(m->stop[0]);
+    close(m->stop[1]);
+    if (m->path) {
+        unlink(m->path);
+        xfree(m->path);
+    }
+    xfree(m->buf);
+    xfree(m);
+
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "statshm.h"
+#include "dnsctxt.h"
+
+// OpenMetrics exporter for Prometheus. its own thread accepts scrapes on
+// a local socket and renders the last snapshot published to the stats
+// segment, read under its seqlock like any external reader, so a scrape
+// never touches the capture thread or its tables. the snapshot copy and
+// the output buffer are allocated once at start.
+//
+// with sketches on, GET /lookup?key=<ip|port|ASn|CC/SUB|name> answers a
+// point query from a copy of them, see dnsctxt_lookup_sketches, as one
+// "<table> <= <count> (+-<error>)" line per table the key can be in.
+#define METRICS_LISTEN_DEFAULT "127.0.0.1:9998"
+#define METRICS_BUF_SIZE (1024 * 1024)
+
+struct metrics;
+
+struct metrics *metrics_start(const char *listen, const struct statshm *shm,
+                              struct dnsctxt_sketches *sketches);
+void metrics_stop(struct metrics *m);
+
+#endif /* METRICS_H */
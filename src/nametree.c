@@ -0,0 +1,328 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#include <string.h>
+
+#include "nametree.h"
+#include "xmalloc.h"
+#include "built_in.h"
+#include "die.h"
+
+struct ntree *ntree_new(unsigned int depth, uint32_t max_node) {
+
+    struct ntree *t;
+    uint32_t n;
+
+    bug_on(!depth || depth > NTREE_MAX_DEPTH);
+    bug_on(max_node < 4 * NTREE_MAX_DEPTH);
+
+    t = xzmalloc(sizeof(*t));
+    t->depth = depth;
+    t->max_node = max_node;
+    t->cap_node = max_node < 1024 ? max_node : 1024;
+    t->node = xzmalloc(t->cap_node * sizeof(*t->node));
+    // the root
+    t->nr_node = 1;
+
+    for (n = 1; n < max_node; n <<= 1)
+        ;
+    t->bucket = xzmalloc(n * sizeof(*t->bucket));
+    t->mask = n - 1;
+
+    return t;
+
+}
+
+void ntree_free(struct ntree *t) {
+
+    uint32_t i;
+
+    for (i = 1; i < t->nr_node; i++) {
+        if (t->node[i].hll)
+            hll_free(t->node[i].hll);
+    }
+    xfree(t->bucket);
+    xfree(t->node);
+    xfree(t);
+
+}
+
+// free nodes have depth 0 and are chained through next
+static uint32_t ntree_alloc(struct ntree *t) {
+
+    uint32_t i, cap;
+
+    if (t->free) {
+        i = t->free;
+        t->free = t->node[i].next;
+        t->nr_free--;
+    }
+    else if (t->nr_node < t->max_node) {
+        if (t->nr_node == t->cap_node) {
+            cap = t->cap_node * 2 < t->max_node ? t->cap_node * 2 : t->max_node;
+            t->node = xrealloc(t->node, cap, sizeof(*t->node));
+            t->cap_node = cap;
+        }
+        i = t->nr_node++;
+    }
+    else {
+        return 0;
+    }
+    memset(&t->node[i], 0, sizeof(t->node[i]));
+
+    return i;
+
+}
+
+// drop the leaves counted at most cutoff, doubling it until a quarter of
+// the nodes is free. links are rebuilt after each round instead of
+// unlinking from sibling lists, which are long below a flooded zone
+static void ntree_prune(struct ntree *t) {
+
+    struct ntree_node *n;
+    uint32_t i, freed = 0, want = t->max_node / 4;
+    uint64_t cutoff;
+
+    for (cutoff = 1; freed < want && cutoff <= t->node[0].count; cutoff *= 2) {
+        for (i = 1; i < t->nr_node; i++) {
+            n = &t->node[i];
+            if (!n->depth || n->child || n->count > cutoff)
+                continue;
+            if (n->hll) {
+                hll_free(n->hll);
+                n->hll = NULL;
+                t->nr_hll--;
+            }
+            n->depth = 0;
+            n->next = t->free;
+            t->free = i;
+            t->nr_free++;
+            t->pruned++;
+            freed++;
+        }
+
+        memset(t->bucket, 0, (t->mask + 1) * sizeof(*t->bucket));
+        t->node[0].child = 0;
+        for (i = 1; i < t->nr_node; i++) {
+            if (t->node[i].depth)
+                t->node[i].child = 0;
+        }
+        for (i = 1; i < t->nr_node; i++) {
+            n = &t->node[i];
+            if (!n->depth)
+                continue;
+            n->sibling = t->node[n->parent].child;
+            t->node[n->parent].child = i;
+            n->next = t->bucket[n->hash & t->mask];
+            t->bucket[n->hash & t->mask] = i;
+        }
+    }
+
+}
+
+static uint32_t find_child(const struct ntree *t, uint32_t parent, uint64_t hash, const char *label, size_t len) {
+
+    const struct ntree_node *n;
+    uint32_t i;
+
+    for (i = t->bucket[hash & t->mask]; i; i = n->next) {
+        n = &t->node[i];
+        if (n->hash == hash && n->parent == parent && n->len == len && !memcmp(n->label, label, len))
+            return i;
+    }
+
+    return 0;
+
+}
+
+// previous label of a name walked right to left, NULL at the start
+static inline const char *prev_label(const char *name, const char **end, size_t *len) {
+
+    const char *p = *end;
+
+    if (p <= name)
+        return NULL;
+    while (p > name && p[-1] != '.')
+        p--;
+    *len = *end - p;
+    if (*len >= NTREE_LABEL_LEN)
+        *len = NTREE_LABEL_LEN - 1;
+    *end = p > name ? p - 1 : name;
+
+    return p;
+
+}
+
+// count a name without its trailing dot at every depth. fills path with
+// the node and hash with the suffix hash of each depth, path being
+// NTREE_NONE where no node was left. returns the depth reached
+unsigned int ntree_add(struct ntree *t, const char *name, uint32_t *path, uint64_t *hash) {
+
+    const char *end = name + strlen(name), *label;
+    struct ntree_node *n;
+    uint32_t cur = 0, c;
+    uint64_t h = 0;
+    size_t len;
+    unsigned int d = 0;
+
+    if (t->nr_free + (t->max_node - t->nr_node) < t->depth)
+        ntree_prune(t);
+
+    t->node[0].count++;
+    while (d < t->depth && (label = prev_label(name, &end, &len))) {
+        h = ntree_hash_label(h, label, len);
+        hash[d] = h;
+
+        if (cur != NTREE_NONE) {
+            c = find_child(t, cur, h, label, len);
+            if (!c && (c = ntree_alloc(t))) {
+                n = &t->node[c];
+                n->hash = h;
+                n->parent = cur;
+                n->depth = d + 1;
+                n->len = len;
+                memcpy(n->label, label, len);
+                n->sibling = t->node[cur].child;
+                t->node[cur].child = c;
+                n->next = t->bucket[h & t->mask];
+                t->bucket[h & t->mask] = c;
+            }
+            if (c) {
+                t->node[c].count++;
+                cur = c;
+            }
+            else {
+                cur = NTREE_NONE;
+            }
+        }
+        if (cur == NTREE_NONE)
+            t->overflow++;
+        path[d++] = cur;
+    }
+
+    return d;
+
+}
+
+// node of a name, the root for "", NTREE_NONE if not in the tree or
+// deeper than the depth limit
+uint32_t ntree_find(const struct ntree *t, const char *name) {
+
+    const char *end = name + strlen(name), *label;
+    uint32_t cur = 0;
+    uint64_t h = 0;
+    size_t len;
+    unsigned int d;
+
+    for (d = 0; (label = prev_label(name, &end, &len)); d++) {
+        if (d == t->depth)
+            return NTREE_NONE;
+        h = ntree_hash_label(h, label, len);
+        cur = find_child(t, cur, h, label, len);
+        if (!cur)
+            return NTREE_NONE;
+    }
+
+    return cur;
+
+}
+
+// suffix hash of a name as ntree_add computes it, names deeper than depth
+// hash as their suffix
+uint64_t ntree_hash(const char *name, unsigned int depth) {
+
+    const char *end = name + strlen(name), *label;
+    uint64_t h = 0;
+    size_t len;
+    unsigned int d;
+
+    for (d = 0; d < depth && (label = prev_label(name, &end, &len)); d++)
+        h = ntree_hash_label(h, label, len);
+
+    return h;
+
+}
+
+// insert into a descending top list of at most k
+static void top_insert(uint32_t *top, double *val, size_t *n, size_t k, uint32_t i, double v) {
+
+    size_t pos = *n;
+
+    if (pos == k) {
+        if (v <= val[k - 1])
+            return;
+        pos--;
+    }
+    else {
+        (*n)++;
+    }
+
+    while (pos > 0 && val[pos - 1] < v) {
+        top[pos] = top[pos - 1];
+        val[pos] = val[pos - 1];
+        pos--;
+    }
+    top[pos] = i;
+    val[pos] = v;
+
+}
+
+size_t ntree_top_children(struct ntree *t, uint32_t parent, ntree_rank_fn rank, uint32_t *top, size_t k) {
+
+    double *val;
+    uint32_t i;
+    size_t n = 0;
+
+    if (!k)
+        return 0;
+
+    val = xmalloc(k * sizeof(*val));
+    for (i = t->node[parent].child; i; i = t->node[i].sibling)
+        top_insert(top, val, &n, k, i, rank(&t->node[i]));
+    xfree(val);
+
+    return n;
+
+}
+
+// across the whole tree, e.g. the top zones at depth 2
+size_t ntree_top_depth(struct ntree *t, unsigned int depth, ntree_rank_fn rank, uint32_t *top, size_t k) {
+
+    double *val;
+    uint32_t i;
+    size_t n = 0;
+
+    if (!k)
+        return 0;
+
+    val = xmalloc(k * sizeof(*val));
+    for (i = 1; i < t->nr_node; i++) {
+        if (t->node[i].depth == depth)
+            top_insert(top, val, &n, k, i, rank(&t->node[i]));
+    }
+    xfree(val);
+
+    return n;
+
+}
+
+char *ntree_name(const struct ntree *t, uint32_t node, char *buf, size_t size) {
+
+    const struct ntree_node *n;
+    size_t pos = 0;
+
+    buf[0] = 0;
+    for (n = &t->node[node]; n->depth; n = &t->node[n->parent]) {
+        if (pos + n->len + 2 > size)
+            break;
+        if (pos)
+            buf[pos++] = '.';
+        memcpy(buf + pos, n->label, n->len);
+        pos += n->len;
+        buf[pos] = 0;
+    }
+
+    return buf;
+
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#ifndef NAMETREE_H
+#define NAMETREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "hll.h"
+
+// query names as a tree of labels read right to left: com -> example.com
+// -> www.example.com. a node is one label and counts the queries at or
+// below it, so names share the storage of their suffixes and every depth
+// rolls up from one walk. labels past the depth limit are counted at the
+// deepest node. nodes come from one array of at most max_node; when it
+// runs low the leaves with the smallest counts are pruned, doubling the
+// cutoff until a quarter of the array is free, so heavy hitters stay and
+// one-off names (random subdomains) make room for each other.
+#define NTREE_DEPTH_DEFAULT 5
+#define NTREE_MAX_DEPTH 16
+#define NTREE_MAX_NODES_DEFAULT (1 << 16)
+#define NTREE_LABEL_LEN 64
+#define NTREE_NONE UINT32_MAX
+
+struct ntree_node {
+    // of the whole suffix, see ntree_hash_label
+    uint64_t hash;
+    uint64_t count;
+    // time decayed count, see struct dnsctxt_decay
+    double score;
+    uint32_t epoch;
+    // tree links and the hash chain, 0 is none as the root is nobody's
+    uint32_t parent, child, sibling, next;
+    // distinct leftmost labels below a zone (depth 2) and the zone count
+    // when it was allocated
+    struct hll *hll;
+    uint64_t hll_start;
+    uint8_t depth;
+    uint8_t len;
+    char label[NTREE_LABEL_LEN];
+};
+
+struct ntree {
+    struct ntree_node *node;
+    uint32_t *bucket;
+    uint32_t mask;
+    // high water mark, array size and cap, head of the free list
+    uint32_t nr_node, cap_node, max_node, free;
+    uint32_t nr_free;
+    unsigned int depth;
+    // zone sketches allocated
+    size_t nr_hll;
+    // nodes pruned and labels not counted for lack of nodes
+    uint64_t pruned;
+    uint64_t overflow;
+};
+
+// rank of a node for the top lists, e.g. its count or decayed score
+typedef double (*ntree_rank_fn)(struct ntree_node *node);
+
+struct ntree *ntree_new(unsigned int depth, uint32_t max_node);
+void ntree_free(struct ntree *t);
+unsigned int ntree_add(struct ntree *t, const char *name, uint32_t *path, uint64_t *hash);
+uint32_t ntree_find(const struct ntree *t, const char *name);
+uint64_t ntree_hash(const char *name, unsigned int depth);
+size_t ntree_top_children(struct ntree *t, uint32_t parent, ntree_rank_fn rank, uint32_t *top, size_t k);
+size_t ntree_top_depth(struct ntree *t, unsigned int depth, ntree_rank_fn rank, uint32_t *top, size_t k);
+char *ntree_name(const struct ntree *t, uint32_t node, char *buf, size_t size);
+
+// FNV-1a of the label on top of the parent suffix hash, then mixed
+static inline uint64_t ntree_hash_label(uint64_t parent, const char *label, size_t len) {
+    uint64_t h = parent ^ 0xcbf29ce484222325ULL;
+    for ( ; len; label++, len--) {
+        h ^= (uint8_t)*label;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+#endif /* NAMETREE_H */
@@ -0,0 +1,219 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "netset.h"
+#include "xmalloc.h"
+
+struct range4 {
+    uint32_t start, end;
+};
+
+struct range6 {
+    struct netset_addr6 start, end;
+};
+
+void netset_init(struct netset *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+void netset_free(struct netset *s) {
+    free(s->start4);
+    free(s->end4);
+    free(s->start6);
+    free(s->end6);
+    netset_init(s);
+}
+
+// "addr" or "addr/len", either family. 0 if added, -1 if invalid
+int netset_add(struct netset *s, const char *cidr) {
+
+    char buf[INET6_ADDRSTRLEN + 4], *slash, *end;
+    uint8_t addr[16];
+    unsigned long len;
+    uint32_t a4, m4;
+    struct netset_addr6 a6, m6;
+    int v6;
+
+    if (strlen(cidr) >= sizeof(buf))
+        return -1;
+    strcpy(buf, cidr);
+
+    v6 = strchr(buf, ':') != NULL;
+    len = v6 ? 128 : 32;
+    if ((slash = strchr(buf, '/'))) {
+        *slash++ = 0;
+        len = strtoul(slash, &end, 10);
+        if (end == slash || *end || len > (v6 ? 128 : 32))
+            return -1;
+    }
+    if (inet_pton(v6 ? AF_INET6 : AF_INET, buf, addr) != 1)
+        return -1;
+
+    if (!v6) {
+        memcpy(&a4, addr, sizeof(a4));
+        a4 = ntohl(a4);
+        m4 = len ? 0xFFFFFFFFu << (32 - len) : 0;
+        s->start4 = xrealloc(s->start4, s->nr_v4 + 1, sizeof(*s->start4));
+        s->end4 = xrealloc(s->end4, s->nr_v4 + 1, sizeof(*s->end4));
+        s->start4[s->nr_v4] = a4 & m4;
+        s->end4[s->nr_v4] = a4 | ~m4;
+        s->nr_v4++;
+    }
+    else {
+        a6 = netset_addr6(addr);
+        if (len >= 64) {
+            m6.hi = ~0ULL;
+            m6.lo = len == 64 ? 0 : ~0ULL << (128 - len);
+        }
+        else {
+            m6.hi = len ? ~0ULL << (64 - len) : 0;
+            m6.lo = 0;
+        }
+        s->start6 = xrealloc(s->start6, s->nr_v6 + 1, sizeof(*s->start6));
+        s->end6 = xrealloc(s->end6, s->nr_v6 + 1, sizeof(*s->end6));
+        s->start6[s->nr_v6].hi = a6.hi & m6.hi;
+        s->start6[s->nr_v6].lo = a6.lo & m6.lo;
+        s->end6[s->nr_v6].hi = a6.hi | ~m6.hi;
+        s->end6[s->nr_v6].lo = a6.lo | ~m6.lo;
+        s->nr_v6++;
+    }
+    s->dirty = 1;
+
+    return 0;
+
+}
+
+// comma or space separated prefixes
+int netset_add_list(struct netset *s, const char *list) {
+
+    char buf[INET6_ADDRSTRLEN + 4];
+    size_t n;
+
+    while (*list) {
+        n = strcspn(list, ", \t\r\n");
+        if (n >= sizeof(buf))
+            return -1;
+        if (n) {
+            memcpy(buf, list, n);
+            buf[n] = 0;
+            if (netset_add(s, buf))
+                return -1;
+        }
+        list += n;
+        if (*list)
+            list++;
+    }
+
+    return 0;
+
+}
+
+// one or more prefixes per line, # starts a comment. returns 0, the
+// number of the first bad line, or -1 if the file cannot be read
+int netset_load(struct netset *s, const char *path) {
+
+    FILE *fp;
+    char line[1024], *hash;
+    int nr = 0, ret = 0;
+
+    if (!(fp = fopen(path, "r")))
+        return -1;
+
+    while (fgets(line, sizeof(line), fp)) {
+        nr++;
+        if ((hash = strchr(line, '#')))
+            *hash = 0;
+        if (netset_add_list(s, line)) {
+            ret = nr;
+            break;
+        }
+    }
+    fclose(fp);
+
+    return ret;
+
+}
+
+static int cmp_range4(const void *a, const void *b) {
+    const struct range4 *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static int cmp_range6(const void *a, const void *b) {
+    const struct range6 *x = a, *y = b;
+    if (x->start.hi != y->start.hi)
+        return x->start.hi < y->start.hi ? -1 : 1;
+    return x->start.lo < y->start.lo ? -1 : x->start.lo > y->start.lo;
+}
+
+// sort by start and merge overlapping or adjacent ranges
+void netset_compile(struct netset *s) {
+
+    struct range4 *r4;
+    struct range6 *r6;
+    struct netset_addr6 next;
+    size_t i, n;
+
+    if (!s->dirty)
+        return;
+
+    if (s->nr_v4) {
+        r4 = xmalloc(s->nr_v4 * sizeof(*r4));
+        for (i = 0; i < s->nr_v4; i++) {
+            r4[i].start = s->start4[i];
+            r4[i].end = s->end4[i];
+        }
+        qsort(r4, s->nr_v4, sizeof(*r4), cmp_range4);
+        for (i = 1, n = 0; i < s->nr_v4; i++) {
+            if (r4[n].end == UINT32_MAX || r4[i].start <= r4[n].end + 1) {
+                if (r4[i].end > r4[n].end)
+                    r4[n].end = r4[i].end;
+            }
+            else {
+                r4[++n] = r4[i];
+            }
+        }
+        s->nr_v4 = n + 1;
+        for (i = 0; i < s->nr_v4; i++) {
+            s->start4[i] = r4[i].start;
+            s->end4[i] = r4[i].end;
+        }
+        xfree(r4);
+    }
+
+    if (s->nr_v6) {
+        r6 = xmalloc(s->nr_v6 * sizeof(*r6));
+        for (i = 0; i < s->nr_v6; i++) {
+            r6[i].start = s->start6[i];
+            r6[i].end = s->end6[i];
+        }
+        qsort(r6, s->nr_v6, sizeof(*r6), cmp_range6);
+        for (i = 1, n = 0; i < s->nr_v6; i++) {
+            next = r6[n].end;
+            if (++next.lo == 0)
+                next.hi++;
+            if ((next.hi == 0 && next.lo == 0) || netset_addr6_le(r6[i].start, next)) {
+                if (!netset_addr6_le(r6[i].end, r6[n].end))
+                    r6[n].end = r6[i].end;
+            }
+            else {
+                r6[++n] = r6[i];
+            }
+        }
+        s->nr_v6 = n + 1;
+        for (i = 0; i < s->nr_v6; i++) {
+            s->start6[i] = r6[i].start;
+            s->end6[i] = r6[i].end;
+        }
+        xfree(r6);
+    }
+
+    s->dirty = 0;
+
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#ifndef NETSET_H
+#define NETSET_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+
+// a set of ipv4 and ipv6 prefixes for membership tests, e.g. the local
+// service networks. prefixes are added as text, then netset_compile turns
+// them into sorted, merged address ranges per family so a lookup is a
+// binary search: 8 or 9 compares for hundreds of prefixes, in one or two
+// cache lines of range starts.
+
+struct netset_addr6 {
+    uint64_t hi, lo;
+};
+
+struct netset {
+    // host order, start[i] <= end[i] < start[i + 1]
+    uint32_t *start4, *end4;
+    size_t nr_v4;
+    struct netset_addr6 *start6, *end6;
+    size_t nr_v6;
+    // prefixes added since the last compile
+    int dirty;
+};
+
+void netset_init(struct netset *s);
+void netset_free(struct netset *s);
+int netset_add(struct netset *s, const char *cidr);
+int netset_add_list(struct netset *s, const char *list);
+int netset_load(struct netset *s, const char *path);
+void netset_compile(struct netset *s);
+
+static inline struct netset_addr6 netset_addr6(const uint8_t *addr) {
+    struct netset_addr6 a = { 0, 0 };
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        a.hi = a.hi << 8 | addr[i];
+        a.lo = a.lo << 8 | addr[i + 8];
+    }
+    return a;
+}
+
+static inline int netset_addr6_le(struct netset_addr6 a, struct netset_addr6 b) {
+    return a.hi < b.hi || (a.hi == b.hi && a.lo <= b.lo);
+}
+
+// addr in network order
+static inline int netset_match4(const struct netset *s, uint32_t addr) {
+    size_t lo = 0, hi = s->nr_v4, mid;
+
+    addr = ntohl(addr);
+    // last range starting at or below addr
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (s->start4[mid] <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo && addr <= s->end4[lo - 1];
+}
+
+static inline int netset_match6(const struct netset *s, const uint8_t *addr) {
+    struct netset_addr6 a = netset_addr6(addr);
+    size_t lo = 0, hi = s->nr_v6, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (netset_addr6_le(s->start6[mid], a))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo && netset_addr6_le(a, s->end6[lo - 1]);
+}
+
+#endif /* NETSET_H */
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "numa.h"
+#include "str.h"
+
+// read a sysfs list like "0-7,16-23" into set, returns the number of
+// entries or -1
+static int read_list(const char *path, cpu_set_t *set) {
+
+    char buf[1024], *p, *end;
+    unsigned long from, to;
+    FILE *fp = fopen(path, "r");
+    int n = 0;
+
+    if (!fp)
+        return -1;
+    p = fgets(buf, sizeof(buf), fp);
+    fclose(fp);
+    if (!p)
+        return -1;
+
+    CPU_ZERO(set);
+    while (*p && *p != '\n') {
+        from = to = strtoul(p, &end, 10);
+        if (end == p)
+            return -1;
+        if (*end == '-')
+            to = strtoul(end + 1, &end, 10);
+        for (; from <= to && from < CPU_SETSIZE; from++, n++)
+            CPU_SET(from, set);
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return n;
+
+}
+
+int numa_nr_nodes(void) {
+
+    cpu_set_t nodes;
+    int n = read_list("/sys/devices/system/node/online", &nodes);
+
+    return n > 0 ? n : 1;
+
+}
+
+int numa_node_cpus(int node, cpu_set_t *set) {
+
+    char path[128];
+
+    slprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    return read_list(path, set);
+
+}
+
+int numa_cpu_node(int cpu) {
+
+    cpu_set_t set;
+    int node;
+
+    for (node = 0; node < NUMA_MAX_NODES; node++) {
+        if (numa_node_cpus(node, &set) > 0 && CPU_ISSET(cpu, &set))
+            return node;
+    }
+
+    return -1;
+
+}
+
+// pages the process faults in from now on, including the kernel's
+// allocations on its behalf like the packet rings, come from node first
+int numa_prefer_node(int node) {
+
+    unsigned long mask;
+
+    if (node < 0 || node >= NUMA_MAX_NODES)
+        return -1;
+    mask = 1UL << node;
+
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, NUMA_MAX_NODES + 1);
+
+}
+
+// same for a mapping that is not faulted in yet
+int numa_bind_mem(void *addr, size_t len, int node) {
+
+    unsigned long mask;
+
+    if (node < 0 || node >= NUMA_MAX_NODES)
+        return -1;
+    mask = 1UL << node;
+
+    return syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask, NUMA_MAX_NODES + 1, 0);
+
+}
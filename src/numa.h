@@ -0,0 +1,21 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stddef.h>
+#include <sched.h>
+
+// NUMA placement from sysfs and the raw mempolicy syscalls, no libnuma.
+// nodes are numbered as in /sys/devices/system/node, -1 is "no node"
+#define NUMA_MAX_NODES 64
+
+int numa_nr_nodes(void);
+int numa_node_cpus(int node, cpu_set_t *set);
+int numa_cpu_node(int cpu);
+int numa_prefer_node(int node);
+int numa_bind_mem(void *addr, size_t len, int node);
+
+#endif /* NUMA_H */
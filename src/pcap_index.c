@@ -0,0 +1,207 @@
+/*
+ * pktvisor
+ * Copyright 2015 NSONE, Inc.
+ * Subject to the GPL, version 2.
+ *
+ * Sparse time index for classic pcap files, so --from/--to can seek
+ * straight into a large capture instead of streaming it from the start.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pcap_index.h"
+#include "pcap_io.h"
+#include "xmalloc.h"
+#include "ioops.h"
+#include "str.h"
+#include "die.h"
+
+static void pcap_index_name(char *buf, size_t len, const char *pcap)
+{
+	slprintf(buf, len, "%s.idx", pcap);
+}
+
+struct pcap_index *pcap_index_create(const char *pcap)
+{
+	struct pcap_index *idx = xzmalloc(sizeof(*idx));
+	struct pcap_index_hdr hdr;
+	char path[PATH_MAX];
+
+	pcap_index_name(path, sizeof(path), pcap);
+
+	idx->fd = open_or_die_m(path, O_WRONLY | O_CREAT | O_TRUNC |
+				O_LARGEFILE, DEFFILEMODE);
+
+	fmemset(&hdr, 0, sizeof(hdr));
+	hdr.magic = PCAP_INDEX_MAGIC;
+	hdr.version = PCAP_INDEX_VERSION;
+	hdr.step_ns = PCAP_INDEX_STEP_NS;
+	hdr.step_bytes = PCAP_INDEX_STEP_BYTES;
+
+	if (write_or_die(idx->fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		panic("Cannot write pcap index header!\n");
+
+	return idx;
+}
+
+static void pcap_index_flush(struct pcap_index *idx)
+{
+	ssize_t len = idx->nr * sizeof(idx->buf[0]);
+
+	if (idx->nr == 0)
+		return;
+
+	if (write_or_die(idx->fd, idx->buf, len) != len)
+		panic("Cannot write pcap index!\n");
+
+	idx->nr = 0;
+}
+
+void __pcap_index_add(struct pcap_index *idx, uint64_t ts, uint64_t off)
+{
+	/* Keep entries sorted for the binary search, slightly reordered
+	 * packets are caught by the linear scan after seeking
+	 */
+	if (unlikely(ts < idx->last_ts)) {
+		idx->next_off = off + PCAP_INDEX_STEP_BYTES;
+		return;
+	}
+
+	idx->buf[idx->nr].ts = ts;
+	idx->buf[idx->nr].off = off;
+	if (++idx->nr == array_size(idx->buf))
+		pcap_index_flush(idx);
+
+	idx->last_ts = ts;
+	idx->next_ts = ts - ts % PCAP_INDEX_STEP_NS + PCAP_INDEX_STEP_NS;
+	idx->next_off = off + PCAP_INDEX_STEP_BYTES;
+}
+
+void pcap_index_close(struct pcap_index *idx)
+{
+	pcap_index_flush(idx);
+	close(idx->fd);
+	xfree(idx);
+}
+
+off_t pcap_index_seek(const char *pcap, uint64_t ts)
+{
+	const struct pcap_index_hdr *hdr;
+	const struct pcap_index_ent *ent;
+	char path[PATH_MAX];
+	struct stat sb;
+	size_t nr, lo, hi;
+	off_t off = -1;
+	void *map;
+	int fd;
+
+	pcap_index_name(path, sizeof(path), pcap);
+
+	fd = open(path, O_RDONLY | O_LARGEFILE);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &sb) || sb.st_size < (off_t) sizeof(*hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	hdr = map;
+	if (hdr->magic != PCAP_INDEX_MAGIC ||
+	    hdr->version != PCAP_INDEX_VERSION)
+		goto out;
+
+	ent = map + sizeof(*hdr);
+	nr = (sb.st_size - sizeof(*hdr)) / sizeof(*ent);
+	if (nr == 0)
+		goto out;
+
+	/* Last entry at or before ts */
+	lo = 0;
+	hi = nr;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (ent[mid].ts <= ts)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	off = ent[lo].off;
+out:
+	munmap(map, sb.st_size);
+	return off;
+}
+
+void pcap_index_build(const char *pcap, bool verbose)
+{
+	struct pcap_index *idx;
+	struct stat sb;
+	uint32_t magic, linktype;
+	uint8_t *map;
+	off_t off;
+	unsigned long nr_pkts = 0;
+	int fd;
+
+	fd = open_or_die(pcap, O_RDONLY | O_LARGEFILE);
+
+	if (pcap_generic_pull_fhdr(fd, &magic, &linktype))
+		panic("Error reading pcap header!\n");
+	if (magic == PCAPNG_MAGIC)
+		panic("Only classic pcap files can be indexed!\n");
+
+	if (fstat(fd, &sb))
+		panic("Cannot fstat pcap file!\n");
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		panic("mmap of pcap file failed!\n");
+	madvise(map, sb.st_size, MADV_SEQUENTIAL);
+
+	idx = pcap_index_create(pcap);
+
+	off = sizeof(struct pcap_filehdr);
+	while (1) {
+		pcap_pkthdr_t phdr;
+		struct tpacket2_hdr thdr;
+		size_t hdrsize = pcap_get_hdr_length(&phdr, magic);
+
+		if (off + (off_t) hdrsize > sb.st_size)
+			break;
+
+		fmemcpy(&phdr.raw, map + off, hdrsize);
+		pcap_pkthdr_to_tpacket_hdr(&phdr, magic, &thdr, NULL);
+		if (off + (off_t) (hdrsize + thdr.tp_snaplen) > sb.st_size)
+			break;
+
+		pcap_index_add(idx, (uint64_t) thdr.tp_sec * 1000000000ULL +
+			       thdr.tp_nsec, off);
+
+		off += hdrsize + thdr.tp_snaplen;
+		nr_pkts++;
+	}
+
+	pcap_index_close(idx);
+	munmap(map, sb.st_size);
+	close(fd);
+
+	if (verbose)
+		printf("Indexed %lu packets, %llu bytes of %s\n", nr_pkts,
+		       (unsigned long long) off, pcap);
+}
@@ -0,0 +1,60 @@
+/*
+ * pktvisor
+ * Copyright 2015 NSONE, Inc.
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef PCAP_INDEX_H
+#define PCAP_INDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "built_in.h"
+
+/* Sidecar <pcap>.idx: header, then (ts, offset) pairs of classic pcap
+ * records, one per second of capture time or per PCAP_INDEX_STEP_BYTES
+ * of file, whichever comes first. Host byte order, timestamps in ns.
+ */
+#define PCAP_INDEX_MAGIC		0x58495650	/* "PVIX" */
+#define PCAP_INDEX_VERSION		1
+#define PCAP_INDEX_STEP_NS		1000000000ULL
+#define PCAP_INDEX_STEP_BYTES		(4ULL << 20)
+
+struct pcap_index_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	uint64_t step_ns;
+	uint64_t step_bytes;
+};
+
+struct pcap_index_ent {
+	uint64_t ts;
+	uint64_t off;
+};
+
+struct pcap_index {
+	int fd;
+	uint64_t next_ts, next_off, last_ts;
+	size_t nr;
+	struct pcap_index_ent buf[256];
+};
+
+extern struct pcap_index *pcap_index_create(const char *pcap);
+extern void __pcap_index_add(struct pcap_index *idx, uint64_t ts, uint64_t off);
+extern void pcap_index_close(struct pcap_index *idx);
+extern off_t pcap_index_seek(const char *pcap, uint64_t ts);
+extern void pcap_index_build(const char *pcap, bool verbose);
+
+static inline void pcap_index_add(struct pcap_index *idx, uint64_t ts,
+				  uint64_t off)
+{
+	if (likely(ts < idx->next_ts && off < idx->next_off))
+		return;
+
+	__pcap_index_add(idx, ts, off);
+}
+
+#endif /* PCAP_INDEX_H */
@@ -29,6 +29,8 @@
 #define NSEC_TCPDUMP_MAGIC			0xa1b23c4d
 #define KUZNETZOV_TCPDUMP_MAGIC			0xa1b2cd34
 #define BORKMANN_TCPDUMP_MAGIC			0xa1e2cb12
+/* pcapng section header block type, byte order independent */
+#define PCAPNG_MAGIC				0x0a0d0d0a
 
 #define PCAP_VERSION_MAJOR			2
 #define PCAP_VERSION_MINOR			4
@@ -90,11 +92,23 @@ struct pcap_pkthdr_bkm {
 	uint8_t pkttype;
 };
 
+/* pcapng packets are normalized into this host order header by the
+ * block reader, it does not exist as such on disc.
+ */
+struct pcap_pkthdr_ng {
+	struct pcap_timeval_ns ts;
+	uint32_t caplen;
+	uint32_t len;
+	uint32_t ifindex;
+	uint32_t linktype;
+};
+
 typedef union {
 	struct pcap_pkthdr	ppo;
 	struct pcap_pkthdr_ns	ppn;
 	struct pcap_pkthdr_kuz	ppk;
 	struct pcap_pkthdr_bkm	ppb;
+	struct pcap_pkthdr_ng	png;
 	uint8_t			raw;
 } pcap_pkthdr_t;
 
@@ -103,6 +117,7 @@ enum pcap_type {
 	NSEC		  =	NSEC_TCPDUMP_MAGIC,
 	KUZNETZOV	  =	KUZNETZOV_TCPDUMP_MAGIC,
 	BORKMANN	  =	BORKMANN_TCPDUMP_MAGIC,
+	PCAPNG		  =	PCAPNG_MAGIC,
 
 	DEFAULT_SWAPPED	  =	___constant_swab32(ORIGINAL_TCPDUMP_MAGIC),
 	NSEC_SWAPPED	  =	___constant_swab32(NSEC_TCPDUMP_MAGIC),
@@ -114,6 +129,13 @@ enum pcap_ops_groups {
 	PCAP_OPS_RW = 0,
 	PCAP_OPS_SG,
 	PCAP_OPS_MM,
+	PCAP_OPS_ZIO,
+};
+
+enum pcap_zio_codec {
+	PCAP_ZIO_NONE = 0,
+	PCAP_ZIO_GZIP,
+	PCAP_ZIO_ZSTD,
 };
 
 enum pcap_mode {
@@ -130,6 +152,11 @@ struct pcap_file_ops {
 			      const uint8_t *packet, size_t len);
 	ssize_t (*read_pcap)(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
 			     uint8_t *packet, size_t len);
+	/* Optional, zero-copy variant of read_pcap: *packet is pointed into
+	 * the backend's own buffer and stays valid until the next read.
+	 */
+	ssize_t (*read_pcap_zc)(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+				uint8_t **packet);
 	void (*prepare_close_pcap)(int fd, enum pcap_mode mode);
 	void (*fsync_pcap)(int fd);
 };
@@ -137,6 +164,67 @@ struct pcap_file_ops {
 extern const struct pcap_file_ops pcap_rw_ops __maybe_unused;
 extern const struct pcap_file_ops pcap_sg_ops __maybe_unused;
 extern const struct pcap_file_ops pcap_mm_ops __maybe_unused;
+extern const struct pcap_file_ops pcap_zio_ops __maybe_unused;
+
+extern enum pcap_zio_codec pcap_zio_probe(int fd);
+extern void pcap_zio_set_codec(enum pcap_zio_codec codec);
+extern void pcap_zio_stats(uint64_t *bytes_file, uint64_t *bytes_pcap);
+
+struct pcap_zio;
+
+/* Independent read streams beside pcap_zio_ops, e.g. for merging files */
+extern struct pcap_zio *pcap_zio_open(int fd, uint32_t *magic,
+				      uint32_t *linktype);
+extern ssize_t pcap_zio_read_next(struct pcap_zio *z, pcap_pkthdr_t *phdr,
+				  uint32_t magic, uint8_t **packet);
+extern void pcap_zio_close(struct pcap_zio *z);
+/* Header and first packet header only, without a worker thread */
+extern int pcap_zio_peek(int fd, uint32_t *magic, uint32_t *linktype,
+			 pcap_pkthdr_t *phdr);
+
+#define PCAPNG_MAX_IFACES			64
+
+struct pcapng_iface {
+	uint32_t linktype;
+	uint32_t snaplen;
+	/* timestamp units per second if decimal, else 0 and ts_shift holds
+	 * the binary exponent (if_tsresol)
+	 */
+	uint64_t ts_units;
+	uint8_t ts_shift;
+	int64_t ts_offset;
+};
+
+struct pcapng_state {
+	bool swapped;
+	uint32_t nr_ifaces;
+	struct pcapng_iface ifaces[PCAPNG_MAX_IFACES];
+	/* Rest of the block of a packet handed out in place, dropped on the
+	 * next read so the packet stays in the source's buffer until then
+	 */
+	uint32_t trailer;
+	uint8_t buf[4096];
+};
+
+/* Byte source of a pcap_file_ops backend for the pcapng block reader.
+ * pull() returns a pointer to len contiguous bytes, either copied into buf
+ * or pointing into the backend's own buffer, or NULL on EOF. skip() drops
+ * len bytes and returns 0 on success.
+ */
+struct pcapng_source {
+	const uint8_t *(*pull)(int fd, uint8_t *buf, size_t len);
+	int (*skip)(int fd, size_t len);
+};
+
+extern struct pcapng_state pcapng_state;
+extern const struct pcapng_source pcapng_fd_source;
+
+extern int pcapng_pull_fhdr(struct pcapng_state *st, int fd,
+			    const struct pcapng_source *src, const void *shb,
+			    size_t shb_len, uint32_t *linktype);
+extern ssize_t pcapng_read(struct pcapng_state *st, int fd,
+			   const struct pcapng_source *src, pcap_pkthdr_t *phdr,
+			   uint8_t *packet, size_t len, uint8_t **data);
 
 static inline uint16_t tp_to_pcap_tsource(uint32_t status)
 {
@@ -192,7 +280,7 @@ static inline int pcap_devtype_to_linktype(const char *ifname)
 	}
 }
 
-static inline void pcap_check_magic(uint32_t magic)
+static inline bool pcap_magic_is_known(uint32_t magic)
 {
 	switch (magic) {
 
@@ -205,13 +293,21 @@ static inline void pcap_check_magic(uint32_t magic)
 	case ___constant_swab32(NSEC_TCPDUMP_MAGIC):
 	case ___constant_swab32(KUZNETZOV_TCPDUMP_MAGIC):
 	case ___constant_swab32(BORKMANN_TCPDUMP_MAGIC):
-		break;
+
+	case PCAPNG_MAGIC:
+		return true;
 
 	default:
-		panic("This file has not a valid pcap header\n");
+		return false;
 	}
 }
 
+static inline void pcap_check_magic(uint32_t magic)
+{
+	if (!pcap_magic_is_known(magic))
+		panic("This file has not a valid pcap header\n");
+}
+
 static inline bool pcap_magic_is_swapped(uint32_t magic)
 {
 	bool swapped = false;
@@ -239,6 +335,7 @@ static inline u32 pcap_get_length(pcap_pkthdr_t *phdr, enum pcap_type type)
 	CASE_RET_CAPLEN(NSEC, ppn, 0);
 	CASE_RET_CAPLEN(KUZNETZOV, ppk, 0);
 	CASE_RET_CAPLEN(BORKMANN, ppb, 0);
+	CASE_RET_CAPLEN(PCAPNG, png, 0);
 
 	CASE_RET_CAPLEN(DEFAULT_SWAPPED, ppo, 1);
 	CASE_RET_CAPLEN(NSEC_SWAPPED, ppn, 1);
@@ -262,6 +359,7 @@ static inline void pcap_set_length(pcap_pkthdr_t *phdr, enum pcap_type type, u32
 	CASE_SET_CAPLEN(NSEC, ppn, 0);
 	CASE_SET_CAPLEN(KUZNETZOV, ppk, 0);
 	CASE_SET_CAPLEN(BORKMANN, ppb, 0);
+	CASE_SET_CAPLEN(PCAPNG, png, 0);
 
 	CASE_SET_CAPLEN(DEFAULT_SWAPPED, ppo, 1);
 	CASE_SET_CAPLEN(NSEC_SWAPPED, ppn, 1);
@@ -284,6 +382,7 @@ static inline u32 pcap_get_hdr_length(pcap_pkthdr_t *phdr, enum pcap_type type)
 	CASE_RET_HDRLEN(NSEC, ppn);
 	CASE_RET_HDRLEN(KUZNETZOV, ppk);
 	CASE_RET_HDRLEN(BORKMANN, ppb);
+	CASE_RET_HDRLEN(PCAPNG, png);
 
 	CASE_RET_HDRLEN(DEFAULT_SWAPPED, ppo);
 	CASE_RET_HDRLEN(NSEC_SWAPPED, ppn);
@@ -307,6 +406,7 @@ static inline u32 pcap_get_total_length(pcap_pkthdr_t *phdr, enum pcap_type type
 	CASE_RET_TOTLEN(NSEC, ppn, 0);
 	CASE_RET_TOTLEN(KUZNETZOV, ppk, 0);
 	CASE_RET_TOTLEN(BORKMANN, ppb, 0);
+	CASE_RET_TOTLEN(PCAPNG, png, 0);
 
 	CASE_RET_TOTLEN(DEFAULT_SWAPPED, ppo, 1);
 	CASE_RET_TOTLEN(NSEC_SWAPPED, ppn, 1);
@@ -512,11 +612,27 @@ static inline void pcap_pkthdr_to_tpacket_hdr(pcap_pkthdr_t *phdr,
 		}
 		break;
 
+	case PCAPNG:
+		thdr->tp_sec = phdr->png.ts.tv_sec;
+		thdr->tp_nsec = phdr->png.ts.tv_nsec;
+		thdr->tp_snaplen = phdr->png.caplen;
+		thdr->tp_len = phdr->png.len;
+		if (sll)
+			sll->sll_ifindex = phdr->png.ifindex;
+		break;
+
 	default:
 		bug();
 	}
 }
 
+static inline uint32_t pcap_get_linktype(pcap_pkthdr_t *phdr, enum pcap_type type,
+					 uint32_t linktype)
+{
+	/* pcapng interfaces within one file may differ in their link type */
+	return type == PCAPNG ? phdr->png.linktype : linktype;
+}
+
 #define FEATURE_UNKNOWN		(0 << 0)
 #define FEATURE_TIMEVAL_MS	(1 << 0)
 #define FEATURE_TIMEVAL_NS	(1 << 1)
@@ -567,6 +683,13 @@ static const struct pcap_magic_type pcap_magic_types[] __maybe_unused = {
 			    FEATURE_PROTO |
 			    FEATURE_HATYPE |
 			    FEATURE_PKTTYPE,
+	}, {
+		.magic = PCAPNG_MAGIC,
+		.desc = "pcapng (read only)",
+		.features = FEATURE_TIMEVAL_NS |
+			    FEATURE_LEN |
+			    FEATURE_CAPLEN |
+			    FEATURE_IFINDEX,
 	},
 };
 
@@ -611,12 +734,20 @@ static const char *pcap_ops_group_to_str[] __maybe_unused = {
 	[PCAP_OPS_RW] = "read/write",
 	[PCAP_OPS_SG] = "scatter-gather",
 	[PCAP_OPS_MM] = "mmap",
+	[PCAP_OPS_ZIO] = "compressed stream",
+};
+
+static const char *pcap_zio_codec_to_ext[] __maybe_unused = {
+	[PCAP_ZIO_NONE] = "",
+	[PCAP_ZIO_GZIP] = ".gz",
+	[PCAP_ZIO_ZSTD] = ".zst",
 };
 
 static const struct pcap_file_ops *pcap_ops[] __maybe_unused = {
 	[PCAP_OPS_RW]		=	&pcap_rw_ops,
 	[PCAP_OPS_SG]		=	&pcap_sg_ops,
 	[PCAP_OPS_MM]		=	&pcap_mm_ops,
+	[PCAP_OPS_ZIO]		=	&pcap_zio_ops,
 };
 
 static inline void pcap_prepare_header(struct pcap_filehdr *hdr, uint32_t magic,
@@ -681,17 +812,24 @@ static inline void pcap_validate_header(const struct pcap_filehdr *hdr)
 		panic("This file has an invalid pcap minor version (must be %d)\n", PCAP_VERSION_MINOR);
 }
 
-static int pcap_generic_pull_fhdr(int fd, uint32_t *magic,
-				  uint32_t *linktype) __maybe_unused;
-
-static int pcap_generic_pull_fhdr(int fd, uint32_t *magic, uint32_t *linktype)
+static inline int pcap_source_pull_fhdr(int fd, const struct pcapng_source *src,
+					struct pcapng_state *st,
+					uint32_t *magic, uint32_t *linktype)
 {
-	ssize_t ret;
+	const uint8_t *ptr;
 	struct pcap_filehdr hdr;
 
-	ret = read(fd, &hdr, sizeof(hdr));
-	if (unlikely(ret != sizeof(hdr)))
+	ptr = src->pull(fd, (uint8_t *) &hdr, sizeof(hdr));
+	if (unlikely(!ptr))
 		return -EIO;
+	if (ptr != (const uint8_t *) &hdr)
+		memcpy(&hdr, ptr, sizeof(hdr));
+
+	if (hdr.magic == PCAPNG_MAGIC) {
+		*magic = PCAPNG_MAGIC;
+		return pcapng_pull_fhdr(st, fd, src, &hdr, sizeof(hdr),
+					linktype);
+	}
 
 	pcap_validate_header(&hdr);
 
@@ -701,6 +839,15 @@ static int pcap_generic_pull_fhdr(int fd, uint32_t *magic, uint32_t *linktype)
 	return 0;
 }
 
+static int pcap_generic_pull_fhdr(int fd, uint32_t *magic,
+				  uint32_t *linktype) __maybe_unused;
+
+static int pcap_generic_pull_fhdr(int fd, uint32_t *magic, uint32_t *linktype)
+{
+	return pcap_source_pull_fhdr(fd, &pcapng_fd_source, &pcapng_state,
+				     magic, linktype);
+}
+
 static int pcap_generic_push_fhdr(int fd, uint32_t magic,
 				  uint32_t linktype) __maybe_unused;
 
@@ -709,6 +856,9 @@ static int pcap_generic_push_fhdr(int fd, uint32_t magic, uint32_t linktype)
 	ssize_t ret;
 	struct pcap_filehdr hdr;
 
+	if (magic == PCAPNG_MAGIC)
+		panic("Writing pcapng files is not supported!\n");
+
 	memset(&hdr, 0, sizeof(hdr));
 
 	pcap_prepare_header(&hdr, magic, linktype, 0, PCAP_DEFAULT_SNAPSHOT_LEN);
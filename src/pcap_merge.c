@@ -0,0 +1,387 @@
+/*
+ * pktvisor
+ * Copyright 2015 NSONE, Inc.
+ * Subject to the GPL, version 2.
+ *
+ * Multi-file pcap input: a directory, a glob or a comma separated list of
+ * pcap/pcapng files (compressed or not), merged into one stream in packet
+ * timestamp order with a k-way min-heap. Every open file is read through
+ * its own pcap_zio stream, whose worker thread doubles as prefetcher.
+ * Files are only opened once the merge reaches their first packet, so
+ * hours of per-minute rotations from a few taps keep just a few open.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "pcap_merge.h"
+#include "pcap_io.h"
+#include "built_in.h"
+#include "xmalloc.h"
+#include "ioops.h"
+#include "str.h"
+#include "die.h"
+
+struct pcap_merge_in {
+	char *path;
+	int fd;
+	struct pcap_zio *z;
+	uint32_t magic, linktype;
+	/* key, packet time in ns; first packet only while not opened */
+	uint64_t ts;
+	size_t idx;
+	pcap_pkthdr_t phdr;
+	uint8_t *pkt;
+};
+
+struct pcap_merge {
+	struct pcap_merge_in *in;
+	size_t nr_in;
+	struct pcap_merge_in **heap;
+	size_t heap_len;
+	/* returned last, its packet stays valid until the next call */
+	struct pcap_merge_in *pending;
+	uint32_t linktype;
+	bool mixed_warned;
+};
+
+bool pcap_merge_wanted(const char *spec)
+{
+	struct stat sb;
+
+	if (strchr(spec, ',') || strpbrk(spec, "*?["))
+		return true;
+
+	return stat(spec, &sb) == 0 && S_ISDIR(sb.st_mode);
+}
+
+/* Directories may hold other files, e.g. index sidecars, leave them out */
+static bool merge_is_capture(const char *path)
+{
+	uint32_t magic = 0;
+	bool ret;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_LARGEFILE);
+	if (fd < 0)
+		return false;
+
+	ret = pcap_zio_probe(fd) != PCAP_ZIO_NONE ||
+	      (pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) &&
+	       pcap_magic_is_known(magic));
+
+	close(fd);
+	return ret;
+}
+
+static void merge_add_path(struct pcap_merge *m, const char *path)
+{
+	struct stat sb;
+
+	if (stat(path, &sb) || !S_ISREG(sb.st_mode))
+		return;
+	if (!merge_is_capture(path)) {
+		fprintf(stderr, "%s is not a pcap file, skipping\n", path);
+		return;
+	}
+
+	m->in = xrealloc(m->in, m->nr_in + 1, sizeof(*m->in));
+	fmemset(&m->in[m->nr_in], 0, sizeof(*m->in));
+	m->in[m->nr_in].path = xstrdup(path);
+	m->in[m->nr_in].fd = -1;
+	m->in[m->nr_in].idx = m->nr_in;
+	m->nr_in++;
+}
+
+static void merge_add_glob(struct pcap_merge *m, const char *pattern)
+{
+	glob_t gl;
+	size_t i;
+
+	if (glob(pattern, 0, NULL, &gl))
+		return;
+
+	for (i = 0; i < gl.gl_pathc; ++i)
+		merge_add_path(m, gl.gl_pathv[i]);
+
+	globfree(&gl);
+}
+
+static int merge_dirent_filter(const struct dirent *de)
+{
+	return de->d_name[0] != '.';
+}
+
+static void merge_add_dir(struct pcap_merge *m, const char *dir)
+{
+	struct dirent **list;
+	char path[PATH_MAX];
+	int i, n;
+
+	n = scandir(dir, &list, merge_dirent_filter, alphasort);
+	if (n < 0)
+		panic("Cannot read directory %s: %s\n", dir, strerror(errno));
+
+	for (i = 0; i < n; ++i) {
+		slprintf(path, sizeof(path), "%s/%s", dir, list[i]->d_name);
+		merge_add_path(m, path);
+		free(list[i]);
+	}
+
+	free(list);
+}
+
+static uint64_t merge_pkt_ts(pcap_pkthdr_t *phdr, uint32_t magic)
+{
+	struct tpacket2_hdr thdr;
+
+	pcap_pkthdr_to_tpacket_hdr(phdr, magic, &thdr, NULL);
+
+	return (uint64_t) thdr.tp_sec * 1000000000ULL + thdr.tp_nsec;
+}
+
+static inline bool merge_less(const struct pcap_merge_in *a,
+			      const struct pcap_merge_in *b)
+{
+	/* Ties keep input order, i.e. name order within a directory */
+	return a->ts < b->ts || (a->ts == b->ts && a->idx < b->idx);
+}
+
+static void merge_heap_push(struct pcap_merge *m, struct pcap_merge_in *in)
+{
+	size_t pos = m->heap_len++;
+
+	while (pos > 0) {
+		size_t parent = (pos - 1) / 2;
+
+		if (!merge_less(in, m->heap[parent]))
+			break;
+
+		m->heap[pos] = m->heap[parent];
+		pos = parent;
+	}
+
+	m->heap[pos] = in;
+}
+
+static struct pcap_merge_in *merge_heap_pop(struct pcap_merge *m)
+{
+	struct pcap_merge_in *top, *last;
+	size_t pos = 0;
+
+	if (m->heap_len == 0)
+		return NULL;
+
+	top = m->heap[0];
+	last = m->heap[--m->heap_len];
+
+	while (2 * pos + 1 < m->heap_len) {
+		size_t child = 2 * pos + 1;
+
+		if (child + 1 < m->heap_len &&
+		    merge_less(m->heap[child + 1], m->heap[child]))
+			child++;
+		if (!merge_less(m->heap[child], last))
+			break;
+
+		m->heap[pos] = m->heap[child];
+		pos = child;
+	}
+
+	if (m->heap_len > 0)
+		m->heap[pos] = last;
+
+	return top;
+}
+
+static void merge_in_close(struct pcap_merge_in *in)
+{
+	if (in->z) {
+		pcap_zio_close(in->z);
+		in->z = NULL;
+	}
+	if (in->fd >= 0) {
+		close(in->fd);
+		in->fd = -1;
+	}
+}
+
+static bool merge_in_open(struct pcap_merge_in *in)
+{
+	in->fd = open(in->path, O_RDONLY | O_LARGEFILE | O_NOATIME);
+	if (in->fd < 0)
+		in->fd = open(in->path, O_RDONLY | O_LARGEFILE);
+	if (in->fd < 0) {
+		fprintf(stderr, "Cannot open %s: %s, skipping\n", in->path,
+			strerror(errno));
+		return false;
+	}
+
+	in->z = pcap_zio_open(in->fd, &in->magic, &in->linktype);
+	if (!in->z) {
+		fprintf(stderr, "%s is not a pcap file, skipping\n", in->path);
+		merge_in_close(in);
+		return false;
+	}
+
+	return true;
+}
+
+/* First timestamp of a file not opened yet, read without a zio stream */
+static bool merge_in_peek(struct pcap_merge_in *in)
+{
+	int fd, ret;
+
+	fd = open(in->path, O_RDONLY | O_LARGEFILE);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open %s: %s, skipping\n", in->path,
+			strerror(errno));
+		return false;
+	}
+
+	ret = pcap_zio_peek(fd, &in->magic, &in->linktype, &in->phdr);
+	close(fd);
+	if (ret < 0)
+		return false;
+
+	in->ts = merge_pkt_ts(&in->phdr, in->magic);
+	return true;
+}
+
+static bool merge_in_advance(struct pcap_merge_in *in)
+{
+	ssize_t ret;
+
+	ret = pcap_zio_read_next(in->z, &in->phdr, in->magic, &in->pkt);
+	if (ret < 0) {
+		if (ret != -EIO)
+			fprintf(stderr, "%s is truncated or corrupt, "
+				"stopping there\n", in->path);
+		merge_in_close(in);
+		return false;
+	}
+
+	in->ts = merge_pkt_ts(&in->phdr, in->magic);
+	return true;
+}
+
+struct pcap_merge *pcap_merge_open(const char *spec, uint32_t *magic,
+				   uint32_t *linktype)
+{
+	struct pcap_merge *m = xzmalloc(sizeof(*m));
+	struct stat sb;
+	char *list, *tok, *save = NULL;
+	size_t i;
+
+	list = xstrdup(spec);
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (stat(tok, &sb) == 0 && S_ISDIR(sb.st_mode))
+			merge_add_dir(m, tok);
+		else if (strpbrk(tok, "*?["))
+			merge_add_glob(m, tok);
+		else
+			merge_add_path(m, tok);
+	}
+	xfree(list);
+
+	if (m->nr_in == 0)
+		panic("No pcap files found in %s!\n", spec);
+
+	m->heap = xmalloc(m->nr_in * sizeof(*m->heap));
+
+	/* Peek at every file for its first timestamp, its stream is only
+	 * set up once the merge gets there
+	 */
+	for (i = 0; i < m->nr_in; ++i) {
+		struct pcap_merge_in *in = &m->in[i];
+
+		if (!merge_in_peek(in))
+			continue;
+
+		if (m->heap_len == 0) {
+			*magic = in->magic;
+			*linktype = m->linktype = in->linktype;
+		}
+
+		merge_heap_push(m, in);
+	}
+
+	if (m->heap_len == 0)
+		panic("No packets found in %s!\n", spec);
+
+	return m;
+}
+
+ssize_t pcap_merge_next(struct pcap_merge *m, pcap_pkthdr_t *phdr,
+			uint32_t *magic, uint32_t *linktype, uint8_t **packet)
+{
+	struct pcap_merge_in *in;
+
+	if (m->pending) {
+		if (merge_in_advance(m->pending))
+			merge_heap_push(m, m->pending);
+		m->pending = NULL;
+	}
+
+	while ((in = merge_heap_pop(m))) {
+		if (in->z)
+			break;
+
+		/* Reached a file not opened yet, its first packet has to
+		 * compete with the open ones again
+		 */
+		if (!merge_in_open(in) || !merge_in_advance(in))
+			continue;
+
+		if (in->linktype != m->linktype && !m->mixed_warned) {
+			fprintf(stderr, "Merging pcaps of different link types, "
+				"filters apply to the first one only\n");
+			m->mixed_warned = true;
+		}
+
+		merge_heap_push(m, in);
+	}
+
+	if (!in)
+		return -EIO;
+
+	m->pending = in;
+
+	fmemcpy(phdr, &in->phdr, sizeof(*phdr));
+	*magic = in->magic;
+	*linktype = pcap_get_linktype(&in->phdr, in->magic, in->linktype);
+	*packet = in->pkt;
+
+	return pcap_get_total_length(&in->phdr, in->magic);
+}
+
+size_t pcap_merge_inputs(const struct pcap_merge *m)
+{
+	return m->nr_in;
+}
+
+void pcap_merge_close(struct pcap_merge *m)
+{
+	size_t i;
+
+	for (i = 0; i < m->nr_in; ++i) {
+		merge_in_close(&m->in[i]);
+		xfree(m->in[i].path);
+	}
+
+	xfree(m->heap);
+	xfree(m->in);
+	xfree(m);
+}
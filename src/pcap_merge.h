@@ -0,0 +1,27 @@
+/*
+ * pktvisor
+ * Copyright 2015 NSONE, Inc.
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef PCAP_MERGE_H
+#define PCAP_MERGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "pcap_io.h"
+
+struct pcap_merge;
+
+extern bool pcap_merge_wanted(const char *spec);
+extern struct pcap_merge *pcap_merge_open(const char *spec, uint32_t *magic,
+					  uint32_t *linktype);
+extern ssize_t pcap_merge_next(struct pcap_merge *m, pcap_pkthdr_t *phdr,
+			       uint32_t *magic, uint32_t *linktype,
+			       uint8_t **packet);
+extern size_t pcap_merge_inputs(const struct pcap_merge *m);
+extern void pcap_merge_close(struct pcap_merge *m);
+
+#endif /* PCAP_MERGE_H */
@@ -64,11 +64,42 @@ static ssize_t pcap_mm_write(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
 	return hdrsize + len;
 }
 
-static ssize_t pcap_mm_read(int fd __maybe_unused, pcap_pkthdr_t *phdr,
-			    enum pcap_type type, uint8_t *packet, size_t len)
+static const uint8_t *pcap_mm_ng_pull(int fd __maybe_unused,
+				      uint8_t *buf __maybe_unused, size_t len)
+{
+	const uint8_t *ptr = (const uint8_t *) ptr_va_curr;
+
+	if (unlikely((off_t) (ptr_va_curr + len - ptr_va_start) > (off_t) map_size))
+		return NULL;
+
+	ptr_va_curr += len;
+	return ptr;
+}
+
+static int pcap_mm_ng_skip(int fd __maybe_unused, size_t len)
+{
+	if (unlikely((off_t) (ptr_va_curr + len - ptr_va_start) > (off_t) map_size))
+		return -EIO;
+
+	ptr_va_curr += len;
+	return 0;
+}
+
+static const struct pcapng_source pcap_mm_ng_source = {
+	.pull = pcap_mm_ng_pull,
+	.skip = pcap_mm_ng_skip,
+};
+
+static ssize_t pcap_mm_read_zc(int fd __maybe_unused, pcap_pkthdr_t *phdr,
+			       enum pcap_type type, uint8_t **packet)
 {
-	size_t hdrsize = pcap_get_hdr_length(phdr, type), hdrlen;
+	size_t hdrsize, hdrlen;
 
+	if (type == PCAPNG)
+		return pcapng_read(&pcapng_state, fd, &pcap_mm_ng_source,
+				   phdr, NULL, 0, packet);
+
+	hdrsize = pcap_get_hdr_length(phdr, type);
 	if (unlikely((off_t) (ptr_va_curr + hdrsize - ptr_va_start) > (off_t) map_size))
 		return -EIO;
 
@@ -78,15 +109,39 @@ static ssize_t pcap_mm_read(int fd __maybe_unused, pcap_pkthdr_t *phdr,
 
 	if (unlikely((off_t) (ptr_va_curr + hdrlen - ptr_va_start) > (off_t) map_size))
 		return -EIO;
-	if (unlikely(hdrlen == 0 || hdrlen > len))
+	if (unlikely(hdrlen == 0))
 		return -EINVAL;
 
-	fmemcpy(packet, ptr_va_curr, hdrlen);
+	*packet = (uint8_t *) ptr_va_curr;
 	ptr_va_curr += hdrlen;
 
 	return hdrsize + hdrlen;
 }
 
+static ssize_t pcap_mm_read(int fd, pcap_pkthdr_t *phdr,
+			    enum pcap_type type, uint8_t *packet, size_t len)
+{
+	uint8_t *data;
+	ssize_t ret;
+	size_t hdrlen;
+
+	if (type == PCAPNG)
+		return pcapng_read(&pcapng_state, fd, &pcap_mm_ng_source,
+				   phdr, packet, len, &data);
+
+	ret = pcap_mm_read_zc(fd, phdr, type, &data);
+	if (unlikely(ret < 0))
+		return ret;
+
+	hdrlen = pcap_get_length(phdr, type);
+	if (unlikely(hdrlen > len))
+		return -EINVAL;
+
+	fmemcpy(packet, data, hdrlen);
+
+	return ret;
+}
+
 static inline off_t ____get_map_size(bool jumbo)
 {
 	int allocsz = jumbo ? 16 : 3;
@@ -129,6 +184,7 @@ static void __pcap_mm_prepare_access_wr(int fd, bool jumbo)
 static void __pcap_mm_prepare_access_rd(int fd)
 {
 	int ret;
+	off_t pos, map_off;
 	struct stat sb;
 
 	ret = fstat(fd, &sb);
@@ -137,15 +193,24 @@ static void __pcap_mm_prepare_access_rd(int fd)
 	if (!S_ISREG (sb.st_mode))
 		panic("pcap dump file is not a regular file!\n");
 
-	map_size = sb.st_size;
-	ptr_va_start = mmap(NULL, map_size, PROT_READ, MAP_SHARED | MAP_LOCKED, fd, 0);
+	/* File header length differs between pcap and pcapng, and an index
+	 * seek may have moved us further in; map from that page on only
+	 */
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos < 0)
+		panic("Cannot lseek pcap file!\n");
+
+	map_off = pos & ~((off_t) getpagesize() - 1);
+	map_size = sb.st_size - map_off;
+	ptr_va_start = mmap(NULL, map_size, PROT_READ, MAP_SHARED | MAP_LOCKED,
+			    fd, map_off);
 	if (ptr_va_start == MAP_FAILED)
 		panic("mmap of file failed!");
 	ret = madvise(ptr_va_start, map_size, MADV_SEQUENTIAL);
 	if (ret < 0)
 		panic("Failed to give kernel mmap advise!\n");
 
-	ptr_va_curr = ptr_va_start + sizeof(struct pcap_filehdr);
+	ptr_va_curr = ptr_va_start + (pos - map_off);
 }
 
 static void pcap_mm_init_once(void)
@@ -196,6 +261,7 @@ const struct pcap_file_ops pcap_mm_ops = {
 	.prepare_access_pcap = pcap_mm_prepare_access,
 	.prepare_close_pcap = pcap_mm_prepare_close,
 	.read_pcap = pcap_mm_read,
+	.read_pcap_zc = pcap_mm_read_zc,
 	.write_pcap = pcap_mm_write,
 	.fsync_pcap = pcap_mm_fsync,
 };
@@ -0,0 +1,484 @@
+/*
+ * pktvisor
+ * Copyright 2015 NSONE, Inc.
+ * Subject to the GPL, version 2.
+ *
+ * Streaming pcapng block reader. Handles section header, interface
+ * description, enhanced and simple packet blocks, everything else is
+ * skipped. Packets are normalized into struct pcap_pkthdr_ng, so the
+ * rest of the pcap code can treat pcapng as just another pcap_type.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "pcap_io.h"
+#include "built_in.h"
+#include "die.h"
+
+#define PCAPNG_BOM			0x1a2b3c4d
+
+#define PCAPNG_BT_SHB			PCAPNG_MAGIC
+#define PCAPNG_BT_IDB			0x00000001
+#define PCAPNG_BT_SPB			0x00000003
+#define PCAPNG_BT_EPB			0x00000006
+
+#define PCAPNG_OPT_ENDOFOPT		0
+#define PCAPNG_OPT_IF_TSRESOL		9
+#define PCAPNG_OPT_IF_TSOFFSET		14
+
+#define NSEC_PER_SEC			1000000000ULL
+
+struct pcapng_bhdr {
+	uint32_t type;
+	uint32_t len;
+};
+
+struct pcapng_shb {
+	uint32_t bom;
+	uint16_t major;
+	uint16_t minor;
+	uint64_t section_len;
+};
+
+struct pcapng_idb {
+	uint16_t linktype;
+	uint16_t reserved;
+	uint32_t snaplen;
+};
+
+struct pcapng_epb {
+	uint32_t ifindex;
+	uint32_t ts_high;
+	uint32_t ts_low;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+struct pcapng_spb {
+	uint32_t len;
+};
+
+/* Reader state for the single input of the pcap_file_ops backends */
+struct pcapng_state pcapng_state;
+
+static inline uint16_t ng16(const struct pcapng_state *st, uint16_t val)
+{
+	return st->swapped ? ___constant_swab16(val) : val;
+}
+
+static inline uint32_t ng32(const struct pcapng_state *st, uint32_t val)
+{
+	return st->swapped ? ___constant_swab32(val) : val;
+}
+
+static inline uint64_t ng64(const struct pcapng_state *st, uint64_t val)
+{
+	return st->swapped ? bswap_64(val) : val;
+}
+
+static void pcapng_reset_section(struct pcapng_state *st, uint32_t bom)
+{
+	if (bom == PCAPNG_BOM)
+		st->swapped = false;
+	else if (bom == ___constant_swab32(PCAPNG_BOM))
+		st->swapped = true;
+	else
+		panic("This file has an invalid pcapng byte order magic!\n");
+
+	st->nr_ifaces = 0;
+}
+
+static void pcapng_set_tsresol(struct pcapng_iface *ifc, uint8_t resol)
+{
+	uint8_t exp = resol & 0x7f;
+
+	if (resol & 0x80) {
+		ifc->ts_units = 0;
+		ifc->ts_shift = min_t(uint8_t, exp, 63);
+	} else {
+		ifc->ts_units = 1;
+		exp = min_t(uint8_t, exp, 19);
+		while (exp--)
+			ifc->ts_units *= 10;
+	}
+}
+
+static void pcapng_parse_idb(struct pcapng_state *st, const uint8_t *body,
+			     size_t len)
+{
+	const struct pcapng_idb *idb = (const void *) body;
+	struct pcapng_iface *ifc;
+	size_t off = sizeof(*idb);
+
+	if (unlikely(len < sizeof(*idb)))
+		panic("This file has a truncated pcapng interface block!\n");
+	if (unlikely(st->nr_ifaces >= PCAPNG_MAX_IFACES))
+		panic("This file has more than %u pcapng interfaces!\n",
+		      PCAPNG_MAX_IFACES);
+
+	ifc = &st->ifaces[st->nr_ifaces++];
+	ifc->linktype = ng16(st, idb->linktype);
+	ifc->snaplen = ng32(st, idb->snaplen);
+	ifc->ts_offset = 0;
+	/* Default resolution is microseconds */
+	pcapng_set_tsresol(ifc, 6);
+
+	while (off + 4 <= len) {
+		uint16_t code, olen;
+
+		memcpy(&code, body + off, sizeof(code));
+		memcpy(&olen, body + off + 2, sizeof(olen));
+		code = ng16(st, code);
+		olen = ng16(st, olen);
+		off += 4;
+
+		if (code == PCAPNG_OPT_ENDOFOPT || off + olen > len)
+			break;
+
+		if (code == PCAPNG_OPT_IF_TSRESOL && olen >= 1) {
+			pcapng_set_tsresol(ifc, body[off]);
+		} else if (code == PCAPNG_OPT_IF_TSOFFSET && olen >= 8) {
+			uint64_t tsoff;
+
+			memcpy(&tsoff, body + off, sizeof(tsoff));
+			ifc->ts_offset = (int64_t) ng64(st, tsoff);
+		}
+
+		off += round_up(olen, 4);
+	}
+}
+
+static void pcapng_ts_to_timeval(const struct pcapng_iface *ifc, uint64_t ts,
+				 struct pcap_timeval_ns *tv)
+{
+	uint64_t sec, frac;
+
+	if (ifc->ts_units) {
+		sec = ts / ifc->ts_units;
+		frac = ts % ifc->ts_units;
+		if (ifc->ts_units >= NSEC_PER_SEC)
+			frac /= ifc->ts_units / NSEC_PER_SEC;
+		else
+			frac *= NSEC_PER_SEC / ifc->ts_units;
+	} else {
+		uint8_t shift = ifc->ts_shift;
+
+		sec = ts >> shift;
+		frac = ts & ((1ULL << shift) - 1);
+		/* keep frac * 10^9 within 64 bit */
+		if (shift > 34) {
+			frac >>= shift - 34;
+			shift = 34;
+		}
+		frac = (frac * NSEC_PER_SEC) >> shift;
+	}
+
+	tv->tv_sec = (int32_t) (sec + ifc->ts_offset);
+	tv->tv_nsec = (int32_t) frac;
+}
+
+/* Reads and validates the remainder of a block header, type is already
+ * consumed by the caller. Returns the body length without the trailing
+ * length field.
+ */
+static ssize_t pcapng_body_len(const struct pcapng_state *st, uint32_t len)
+{
+	len = ng32(st, len);
+	if (unlikely(len < sizeof(struct pcapng_bhdr) + sizeof(uint32_t) ||
+		     len % 4))
+		return -EINVAL;
+
+	return len - sizeof(struct pcapng_bhdr) - sizeof(uint32_t);
+}
+
+static ssize_t pcapng_read_shb(struct pcapng_state *st, int fd,
+			       const struct pcapng_source *src, uint32_t len)
+{
+	const struct pcapng_shb *shb;
+	ssize_t body;
+
+	shb = (const void *) src->pull(fd, st->buf, sizeof(*shb));
+	if (unlikely(!shb))
+		return -EIO;
+
+	pcapng_reset_section(st, shb->bom);
+
+	body = pcapng_body_len(st, len);
+	if (unlikely(body < (ssize_t) sizeof(*shb)))
+		return -EINVAL;
+	if (unlikely(ng16(st, shb->major) != 1))
+		panic("This file has an unsupported pcapng major version!\n");
+
+	if (src->skip(fd, body - sizeof(*shb) + sizeof(uint32_t)))
+		return -EIO;
+
+	return body;
+}
+
+static ssize_t pcapng_read_idb(struct pcapng_state *st, int fd,
+			       const struct pcapng_source *src, ssize_t body)
+{
+	size_t head = min_t(size_t, body, sizeof(st->buf));
+	const uint8_t *data;
+
+	data = src->pull(fd, st->buf, head);
+	if (unlikely(!data))
+		return -EIO;
+
+	pcapng_parse_idb(st, data, head);
+
+	if (src->skip(fd, body - head + sizeof(uint32_t)))
+		return -EIO;
+
+	return body;
+}
+
+static const uint8_t *pcapng_fd_pull(int fd, uint8_t *buf, size_t len)
+{
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < len) {
+		ret = read(fd, buf + done, len - done);
+		if (unlikely(ret <= 0))
+			return NULL;
+		done += ret;
+	}
+
+	return buf;
+}
+
+static int pcapng_fd_skip(int fd, size_t len)
+{
+	uint8_t tmp[512];
+
+	while (len > 0) {
+		size_t chunk = min_t(size_t, len, sizeof(tmp));
+
+		if (unlikely(!pcapng_fd_pull(fd, tmp, chunk)))
+			return -EIO;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+/* Plain read(2) source, used for file headers and by the rw backend */
+const struct pcapng_source pcapng_fd_source = {
+	.pull = pcapng_fd_pull,
+	.skip = pcapng_fd_skip,
+};
+
+int pcapng_pull_fhdr(struct pcapng_state *st, int fd,
+		     const struct pcapng_source *src, const void *shb,
+		     size_t shb_len, uint32_t *linktype)
+{
+	const struct pcapng_bhdr *bh = shb;
+	const struct pcapng_shb *sh = shb + sizeof(*bh);
+	ssize_t body;
+
+	bug_on(shb_len < sizeof(*bh) + sizeof(*sh));
+
+	pcapng_reset_section(st, sh->bom);
+	st->trailer = 0;
+
+	body = pcapng_body_len(st, bh->len);
+	if (unlikely(body < (ssize_t) sizeof(*sh)))
+		return -EINVAL;
+	if (unlikely(ng16(st, sh->major) != 1))
+		panic("This file has an unsupported pcapng major version!\n");
+
+	/* Rest of the section header, then everything up to and including
+	 * the first interface, so that we can report a link type.
+	 */
+	if (src->skip(fd, body - (shb_len - sizeof(*bh)) + sizeof(uint32_t)))
+		return -EIO;
+
+	while (st->nr_ifaces == 0) {
+		const struct pcapng_bhdr *next;
+		uint32_t type;
+
+		next = (const void *) src->pull(fd, st->buf, sizeof(*next));
+		if (unlikely(!next))
+			return -EIO;
+
+		type = ng32(st, next->type);
+		body = pcapng_body_len(st, next->len);
+		if (unlikely(body < 0))
+			return -EINVAL;
+
+		switch (type) {
+		case PCAPNG_BT_IDB:
+			if (unlikely(body > (ssize_t) sizeof(st->buf)))
+				panic("This file has an oversized pcapng interface block!\n");
+			if (unlikely(pcapng_read_idb(st, fd, src, body) < 0))
+				return -EIO;
+			break;
+		case PCAPNG_BT_SPB:
+		case PCAPNG_BT_EPB:
+			panic("This file has pcapng packets before any interface!\n");
+		default:
+			if (src->skip(fd, body + sizeof(uint32_t)))
+				return -EIO;
+			break;
+		}
+	}
+
+	*linktype = st->ifaces[0].linktype;
+
+	return 0;
+}
+
+/* Pulls caplen bytes of packet data, copying at most len of them into
+ * packet, or pointing *data into the source if packet is NULL. Returns the
+ * number of bytes delivered.
+ */
+static ssize_t pcapng_pull_data(int fd, const struct pcapng_source *src,
+				uint32_t caplen, uint8_t *packet, size_t len,
+				uint8_t **data)
+{
+	const uint8_t *ptr;
+	size_t take = caplen;
+
+	if (packet) {
+		take = min_t(size_t, caplen, len);
+		ptr = src->pull(fd, packet, take);
+		if (unlikely(!ptr))
+			return -EIO;
+		if (ptr != packet)
+			fmemcpy(packet, ptr, take);
+		*data = packet;
+
+		if (take < caplen && src->skip(fd, caplen - take))
+			return -EIO;
+	} else {
+		ptr = src->pull(fd, NULL, take);
+		if (unlikely(!ptr))
+			return -EIO;
+		*data = (uint8_t *) ptr;
+	}
+
+	return take;
+}
+
+ssize_t pcapng_read(struct pcapng_state *st, int fd,
+		    const struct pcapng_source *src, pcap_pkthdr_t *phdr,
+		    uint8_t *packet, size_t len, uint8_t **data)
+{
+	const struct pcapng_bhdr *bh;
+	struct pcapng_iface *ifc;
+	ssize_t body, ret;
+	uint32_t type, caplen, ifindex;
+	uint64_t ts;
+
+	if (st->trailer) {
+		ret = src->skip(fd, st->trailer);
+		st->trailer = 0;
+		if (ret)
+			return -EIO;
+	}
+
+	while (1) {
+		bh = (const void *) src->pull(fd, st->buf, sizeof(*bh));
+		if (unlikely(!bh))
+			return -EIO;
+
+		type = ng32(st, bh->type);
+		if (type == PCAPNG_BT_SHB) {
+			ret = pcapng_read_shb(st, fd, src, bh->len);
+			if (unlikely(ret < 0))
+				return ret;
+			continue;
+		}
+
+		body = pcapng_body_len(st, bh->len);
+		if (unlikely(body < 0))
+			return body;
+
+		switch (type) {
+		case PCAPNG_BT_IDB:
+			ret = pcapng_read_idb(st, fd, src, body);
+			if (unlikely(ret < 0))
+				return ret;
+			continue;
+
+		case PCAPNG_BT_EPB: {
+			const struct pcapng_epb *epb;
+
+			if (unlikely(body < (ssize_t) sizeof(*epb)))
+				return -EINVAL;
+			epb = (const void *) src->pull(fd, st->buf, sizeof(*epb));
+			if (unlikely(!epb))
+				return -EIO;
+
+			ifindex = ng32(st, epb->ifindex);
+			caplen = ng32(st, epb->caplen);
+			if (unlikely(ifindex >= st->nr_ifaces ||
+				     caplen > body - sizeof(*epb)))
+				return -EINVAL;
+
+			ifc = &st->ifaces[ifindex];
+			ts = ((uint64_t) ng32(st, epb->ts_high) << 32) |
+			     ng32(st, epb->ts_low);
+			pcapng_ts_to_timeval(ifc, ts, &phdr->png.ts);
+			phdr->png.len = ng32(st, epb->len);
+			body -= sizeof(*epb);
+			break;
+		}
+
+		case PCAPNG_BT_SPB: {
+			const struct pcapng_spb *spb;
+
+			if (unlikely(body < (ssize_t) sizeof(*spb) ||
+				     st->nr_ifaces == 0))
+				return -EINVAL;
+			spb = (const void *) src->pull(fd, st->buf, sizeof(*spb));
+			if (unlikely(!spb))
+				return -EIO;
+
+			ifindex = 0;
+			ifc = &st->ifaces[0];
+			phdr->png.len = ng32(st, spb->len);
+			body -= sizeof(*spb);
+
+			/* Captured length is implied by snaplen and padding */
+			caplen = min_t(uint32_t, phdr->png.len, body);
+			if (ifc->snaplen)
+				caplen = min_t(uint32_t, caplen, ifc->snaplen);
+
+			/* No timestamps in simple packet blocks */
+			phdr->png.ts.tv_sec = 0;
+			phdr->png.ts.tv_nsec = 0;
+			break;
+		}
+
+		default:
+			if (src->skip(fd, body + sizeof(uint32_t)))
+				return -EIO;
+			continue;
+		}
+
+		ret = pcapng_pull_data(fd, src, caplen, packet, len, data);
+		if (unlikely(ret < 0))
+			return ret;
+
+		phdr->png.caplen = ret;
+		phdr->png.ifindex = ifindex;
+		phdr->png.linktype = ifc->linktype;
+
+		/* Skipping now could release the buffer *data points into */
+		if (packet) {
+			if (src->skip(fd, body - caplen + sizeof(uint32_t)))
+				return -EIO;
+		} else {
+			st->trailer = body - caplen + sizeof(uint32_t);
+		}
+
+		return sizeof(phdr->png) + ret;
+	}
+}
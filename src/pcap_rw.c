@@ -42,6 +42,13 @@ static ssize_t pcap_rw_read(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
 {
 	ssize_t ret, hdrsize = pcap_get_hdr_length(phdr, type), hdrlen = 0;
 
+	if (type == PCAPNG) {
+		uint8_t *data;
+
+		return pcapng_read(&pcapng_state, fd, &pcapng_fd_source,
+				   phdr, packet, len, &data);
+	}
+
 	ret = read_or_die(fd, &phdr->raw, hdrsize);
 	if (unlikely(ret != hdrsize))
 		return -EIO;
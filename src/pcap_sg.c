@@ -104,12 +104,78 @@ static ssize_t __pcap_sg_inter_iov_data_read(int fd, uint8_t *packet, size_t hdr
 	return hdrlen;
 }
 
+/* Copies (or with buf == NULL, skips) len bytes, crossing as many iovs
+ * as needed. pcapng blocks are not bounded by the iov size.
+ */
+static int __pcap_sg_ng_consume(int fd, uint8_t *buf, size_t len)
+{
+	int ret;
+	size_t chunk;
+
+	while (len > 0) {
+		if (iov_off_rd == (off_t) iov[iov_slot].iov_len) {
+			iov_off_rd = 0;
+			iov_slot++;
+
+			if (iov_slot == array_size(iov)) {
+				iov_slot = 0;
+				ret = readv(fd, iov, array_size(iov));
+				if (unlikely(ret <= 0))
+					return -EIO;
+			}
+		}
+
+		chunk = min_t(size_t, len, iov[iov_slot].iov_len - iov_off_rd);
+		if (buf) {
+			fmemcpy(buf, iov[iov_slot].iov_base + iov_off_rd, chunk);
+			buf += chunk;
+		}
+
+		iov_off_rd += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+static const uint8_t *pcap_sg_ng_pull(int fd, uint8_t *buf, size_t len)
+{
+	if (likely(iov[iov_slot].iov_len - iov_off_rd >= len)) {
+		const uint8_t *ptr = iov[iov_slot].iov_base + iov_off_rd;
+
+		iov_off_rd += len;
+		return ptr;
+	}
+
+	if (unlikely(!buf || __pcap_sg_ng_consume(fd, buf, len)))
+		return NULL;
+
+	return buf;
+}
+
+static int pcap_sg_ng_skip(int fd, size_t len)
+{
+	return __pcap_sg_ng_consume(fd, NULL, len);
+}
+
+static const struct pcapng_source pcap_sg_ng_source = {
+	.pull = pcap_sg_ng_pull,
+	.skip = pcap_sg_ng_skip,
+};
+
 static ssize_t pcap_sg_read(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
 			    uint8_t *packet, size_t len)
 {
 	ssize_t ret = 0;
 	size_t hdrsize = pcap_get_hdr_length(phdr, type), hdrlen;
 
+	if (type == PCAPNG) {
+		uint8_t *data;
+
+		return pcapng_read(&pcapng_state, fd, &pcap_sg_ng_source,
+				   phdr, packet, len, &data);
+	}
+
 	if (likely(iov[iov_slot].iov_len - iov_off_rd >= hdrsize)) {
 		fmemcpy(&phdr->raw, iov[iov_slot].iov_base + iov_off_rd, hdrsize);
 		iov_off_rd += hdrsize;
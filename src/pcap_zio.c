@@ -0,0 +1,992 @@
+/*
+ * pktvisor
+ * Copyright 2015 NSONE, Inc.
+ * Subject to the GPL, version 2.
+ *
+ * Compressed pcap stream I/O. A worker thread (de)compresses between the
+ * file and a ring of buffers, so the packet loop only ever touches plain
+ * pcap/pcapng data and decompression runs in parallel to dissection.
+ * Uncompressed streams pass through the same ring, which is how stdin
+ * input is handled.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+
+#include "config.h"
+#ifdef HAVE_LIBZ
+# include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+# include <zstd.h>
+#endif
+
+#include "pcap_io.h"
+#include "built_in.h"
+#include "xmalloc.h"
+#include "iosched.h"
+#include "ioops.h"
+#include "die.h"
+
+#define ZIO_NR_BUFS		8
+#define ZIO_BUF_SIZE		(1 << 20)
+#define ZIO_STAGE_SIZE		(256 << 10)
+/* Largest packet handed out in place when it spans two ring buffers */
+#define ZIO_BOUNCE_SIZE		(256 << 10)
+/* Decoded window when only peeking at a file's first packet */
+#define ZIO_PEEK_SIZE		(64 << 10)
+
+struct zio_buf {
+	uint8_t *data;
+	size_t len;
+};
+
+struct pcap_zio {
+	struct zio_buf bufs[ZIO_NR_BUFS];
+	/* head is filled by the producer, tail drained by the consumer,
+	 * full counts the buffers in between; all under lock
+	 */
+	unsigned int head, tail, full;
+	bool eof, stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* owned by the consumer (read) or producer (write) side only */
+	bool held;
+	size_t off;
+
+	pthread_t thread;
+	enum pcap_mode mode;
+	enum pcap_zio_codec codec;
+	int fd;
+
+	/* compressed side staging buffer */
+	uint8_t *stage;
+	size_t stage_len, stage_off;
+	uint8_t *bounce;
+
+	uint64_t bytes_file, bytes_pcap;
+	struct pcapng_state ng;
+#ifdef HAVE_LIBZ
+	z_stream zs;
+#endif
+#ifdef HAVE_LIBZSTD
+	ZSTD_DStream *zds;
+	ZSTD_CStream *zcs;
+#endif
+};
+
+/* Instance behind pcap_zio_ops, further ones come from pcap_zio_open() */
+static struct pcap_zio zio_std = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* pcapng_source callbacks carry no context, the instance being parsed is
+ * parked here by the consumer side before handing out zio_source
+ */
+static struct pcap_zio *zio_cur = &zio_std;
+
+static enum pcap_zio_codec zio_codec_wr = PCAP_ZIO_NONE;
+
+static enum pcap_zio_codec zio_sniff(const uint8_t *buf, size_t len)
+{
+	if (len >= 2 && buf[0] == 0x1f && buf[1] == 0x8b)
+		return PCAP_ZIO_GZIP;
+	if (len >= 4 && buf[0] == 0x28 && buf[1] == 0xb5 &&
+	    buf[2] == 0x2f && buf[3] == 0xfd)
+		return PCAP_ZIO_ZSTD;
+
+	return PCAP_ZIO_NONE;
+}
+
+enum pcap_zio_codec pcap_zio_probe(int fd)
+{
+	uint8_t magic[4];
+	ssize_t ret;
+
+	/* Only works on seekable files, streams are sniffed on open */
+	ret = pread(fd, magic, sizeof(magic), 0);
+	if (ret < 2)
+		return PCAP_ZIO_NONE;
+
+	return zio_sniff(magic, ret);
+}
+
+void pcap_zio_set_codec(enum pcap_zio_codec codec)
+{
+#ifndef HAVE_LIBZ
+	if (codec == PCAP_ZIO_GZIP)
+		panic("pktvisor was built without zlib support!\n");
+#endif
+#ifndef HAVE_LIBZSTD
+	if (codec == PCAP_ZIO_ZSTD)
+		panic("pktvisor was built without zstd support!\n");
+#endif
+	zio_codec_wr = codec;
+}
+
+void pcap_zio_stats(uint64_t *bytes_file, uint64_t *bytes_pcap)
+{
+	struct pcap_zio *z = &zio_std;
+
+	*bytes_file = z->bytes_file;
+	*bytes_pcap = z->bytes_pcap;
+}
+
+static void zio_codec_init(struct pcap_zio *z)
+{
+	switch (z->codec) {
+#ifdef HAVE_LIBZ
+	case PCAP_ZIO_GZIP:
+		fmemset(&z->zs, 0, sizeof(z->zs));
+		/* 15 + 32 autodetects gzip/zlib, 15 + 16 writes gzip */
+		if (z->mode == PCAP_MODE_RD ?
+		    inflateInit2(&z->zs, 15 + 32) != Z_OK :
+		    deflateInit2(&z->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+				 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			panic("Cannot initialize zlib stream!\n");
+		break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case PCAP_ZIO_ZSTD:
+		if (z->mode == PCAP_MODE_RD) {
+			z->zds = ZSTD_createDStream();
+			if (!z->zds || ZSTD_isError(ZSTD_initDStream(z->zds)))
+				panic("Cannot initialize zstd stream!\n");
+		} else {
+			z->zcs = ZSTD_createCStream();
+			if (!z->zcs || ZSTD_isError(ZSTD_initCStream(z->zcs, 3)))
+				panic("Cannot initialize zstd stream!\n");
+		}
+		break;
+#endif
+	case PCAP_ZIO_NONE:
+		break;
+	default:
+		panic("pktvisor was built without support for this compression!\n");
+	}
+}
+
+static void zio_codec_free(struct pcap_zio *z)
+{
+	switch (z->codec) {
+#ifdef HAVE_LIBZ
+	case PCAP_ZIO_GZIP:
+		if (z->mode == PCAP_MODE_RD)
+			inflateEnd(&z->zs);
+		else
+			deflateEnd(&z->zs);
+		break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case PCAP_ZIO_ZSTD:
+		if (z->mode == PCAP_MODE_RD)
+			ZSTD_freeDStream(z->zds);
+		else
+			ZSTD_freeCStream(z->zcs);
+		break;
+#endif
+	default:
+		break;
+	}
+}
+
+/* Read side, worker thread: file -> decoder -> ring */
+
+static bool zio_stage_refill(struct pcap_zio *z)
+{
+	ssize_t ret;
+
+	if (z->stage_off < z->stage_len)
+		return true;
+
+	/* Only point where a reader blocked on a pipe may be cancelled */
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	ret = read(z->fd, z->stage, ZIO_STAGE_SIZE);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	if (ret <= 0)
+		return false;
+
+	z->stage_len = ret;
+	z->stage_off = 0;
+	z->bytes_file += ret;
+
+	return true;
+}
+
+static size_t zio_decode(struct pcap_zio *z, uint8_t *out, size_t cap,
+			 bool *eof)
+{
+	size_t done = 0;
+
+	while (done < cap) {
+		size_t chunk;
+
+		/* Plain streams skip the stage once the sniffed bytes are used */
+		if (z->codec == PCAP_ZIO_NONE && z->stage_off == z->stage_len) {
+			ssize_t ret;
+
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+			ret = read(z->fd, out + done, cap - done);
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			if (ret <= 0) {
+				*eof = true;
+				break;
+			}
+
+			z->bytes_file += ret;
+			done += ret;
+			continue;
+		}
+
+		if (!zio_stage_refill(z)) {
+			*eof = true;
+			break;
+		}
+
+		switch (z->codec) {
+		case PCAP_ZIO_NONE:
+			chunk = min_t(size_t, cap - done,
+				      z->stage_len - z->stage_off);
+			fmemcpy(out + done, z->stage + z->stage_off, chunk);
+			z->stage_off += chunk;
+			done += chunk;
+			break;
+#ifdef HAVE_LIBZ
+		case PCAP_ZIO_GZIP: {
+			int ret;
+
+			z->zs.next_in = z->stage + z->stage_off;
+			z->zs.avail_in = z->stage_len - z->stage_off;
+			z->zs.next_out = out + done;
+			z->zs.avail_out = cap - done;
+
+			ret = inflate(&z->zs, Z_NO_FLUSH);
+
+			z->stage_off = z->stage_len - z->zs.avail_in;
+			done = cap - z->zs.avail_out;
+
+			/* Concatenated gzip members, as written by rotation */
+			if (ret == Z_STREAM_END)
+				inflateReset(&z->zs);
+			else if (ret != Z_OK && ret != Z_BUF_ERROR)
+				panic("Corrupt gzip stream: %s\n",
+				      z->zs.msg ? : "unknown error");
+			break;
+		}
+#endif
+#ifdef HAVE_LIBZSTD
+		case PCAP_ZIO_ZSTD: {
+			ZSTD_inBuffer in = {
+				.src = z->stage,
+				.size = z->stage_len,
+				.pos = z->stage_off,
+			};
+			ZSTD_outBuffer ob = {
+				.dst = out,
+				.size = cap,
+				.pos = done,
+			};
+			size_t ret;
+
+			ret = ZSTD_decompressStream(z->zds, &ob, &in);
+			if (ZSTD_isError(ret))
+				panic("Corrupt zstd stream: %s\n",
+				      ZSTD_getErrorName(ret));
+
+			z->stage_off = in.pos;
+			done = ob.pos;
+			break;
+		}
+#endif
+		default:
+			bug();
+		}
+	}
+
+	return done;
+}
+
+static void *zio_reader(void *arg)
+{
+	struct pcap_zio *z = arg;
+	bool eof = false;
+	unsigned int slot;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	while (!eof) {
+		pthread_mutex_lock(&z->lock);
+		while (z->full == ZIO_NR_BUFS && !z->stop)
+			pthread_cond_wait(&z->cond, &z->lock);
+		slot = z->head;
+		if (z->stop) {
+			pthread_mutex_unlock(&z->lock);
+			break;
+		}
+		pthread_mutex_unlock(&z->lock);
+
+		z->bufs[slot].len = zio_decode(z, z->bufs[slot].data,
+						ZIO_BUF_SIZE, &eof);
+
+		pthread_mutex_lock(&z->lock);
+		z->head = (slot + 1) % ZIO_NR_BUFS;
+		z->full++;
+		z->eof = eof;
+		pthread_cond_broadcast(&z->cond);
+		pthread_mutex_unlock(&z->lock);
+	}
+
+	return NULL;
+}
+
+/* Read side, packet loop: ring -> pcap parser */
+
+static bool zio_rd_advance(struct pcap_zio *z)
+{
+	pthread_mutex_lock(&z->lock);
+	if (z->held) {
+		z->tail = (z->tail + 1) % ZIO_NR_BUFS;
+		z->full--;
+		z->held = false;
+		pthread_cond_broadcast(&z->cond);
+	}
+
+	while (z->full == 0 && !z->eof)
+		pthread_cond_wait(&z->cond, &z->lock);
+
+	if (z->full > 0) {
+		z->held = true;
+		z->off = 0;
+	}
+	pthread_mutex_unlock(&z->lock);
+
+	return z->held;
+}
+
+static inline size_t zio_rd_avail(const struct pcap_zio *z)
+{
+	return z->held ? z->bufs[z->tail].len - z->off : 0;
+}
+
+/* Pointers returned stay valid until the next pull or skip */
+static const uint8_t *zio_pull(int fd __maybe_unused, uint8_t *buf, size_t len)
+{
+	struct pcap_zio *z = zio_cur;
+	const uint8_t *ptr;
+	uint8_t *dst;
+	size_t done = 0;
+
+	while (zio_rd_avail(z) == 0) {
+		if (!zio_rd_advance(z))
+			return NULL;
+	}
+
+	z->bytes_pcap += len;
+
+	if (likely(zio_rd_avail(z) >= len)) {
+		ptr = z->bufs[z->tail].data + z->off;
+		z->off += len;
+		return ptr;
+	}
+
+	dst = buf;
+	if (!dst) {
+		if (unlikely(len > ZIO_BOUNCE_SIZE))
+			return NULL;
+		dst = z->bounce;
+	}
+
+	while (done < len) {
+		size_t chunk;
+
+		while (zio_rd_avail(z) == 0) {
+			if (!zio_rd_advance(z))
+				return NULL;
+		}
+
+		chunk = min_t(size_t, len - done, zio_rd_avail(z));
+		fmemcpy(dst + done, z->bufs[z->tail].data + z->off, chunk);
+		z->off += chunk;
+		done += chunk;
+	}
+
+	return dst;
+}
+
+static int zio_skip(int fd __maybe_unused, size_t len)
+{
+	struct pcap_zio *z = zio_cur;
+
+	z->bytes_pcap += len;
+
+	while (len > 0) {
+		size_t chunk;
+
+		while (zio_rd_avail(z) == 0) {
+			if (!zio_rd_advance(z))
+				return -EIO;
+		}
+
+		chunk = min_t(size_t, len, zio_rd_avail(z));
+		z->off += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+static const struct pcapng_source zio_source = {
+	.pull = zio_pull,
+	.skip = zio_skip,
+};
+
+/* Peek side: no worker thread and no ring, the decoder runs in the
+ * caller and fills bufs[0] as a sliding window of ZIO_PEEK_SIZE
+ */
+
+static bool zio_peek_fill(struct pcap_zio *z)
+{
+	struct zio_buf *b = &z->bufs[0];
+	bool eof = false;
+	size_t got;
+
+	memmove(b->data, b->data + z->off, b->len - z->off);
+	b->len -= z->off;
+	z->off = 0;
+
+	got = zio_decode(z, b->data + b->len, ZIO_PEEK_SIZE - b->len, &eof);
+	b->len += got;
+
+	return got > 0;
+}
+
+static const uint8_t *zio_peek_pull(int fd __maybe_unused,
+				    uint8_t *buf __maybe_unused, size_t len)
+{
+	struct pcap_zio *z = zio_cur;
+	const uint8_t *ptr;
+
+	if (unlikely(len > ZIO_PEEK_SIZE))
+		return NULL;
+
+	while (z->bufs[0].len - z->off < len) {
+		if (!zio_peek_fill(z))
+			return NULL;
+	}
+
+	ptr = z->bufs[0].data + z->off;
+	z->off += len;
+
+	return ptr;
+}
+
+static int zio_peek_skip(int fd __maybe_unused, size_t len)
+{
+	struct pcap_zio *z = zio_cur;
+
+	while (len > 0) {
+		size_t chunk;
+
+		if (z->bufs[0].len == z->off && !zio_peek_fill(z))
+			return -EIO;
+
+		chunk = min_t(size_t, len, z->bufs[0].len - z->off);
+		z->off += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+static const struct pcapng_source zio_peek_source = {
+	.pull = zio_peek_pull,
+	.skip = zio_peek_skip,
+};
+
+/* Write side, worker thread: ring -> encoder -> file */
+
+static void zio_stage_flush(struct pcap_zio *z)
+{
+	ssize_t ret;
+
+	if (z->stage_len == 0)
+		return;
+
+	ret = write_or_die(z->fd, z->stage, z->stage_len);
+	if (unlikely(ret != (ssize_t) z->stage_len))
+		panic("Failed to write compressed pcap data!\n");
+
+	z->bytes_file += ret;
+	z->stage_len = 0;
+}
+
+static void zio_encode(struct pcap_zio *z, const uint8_t *in, size_t len,
+		       bool finish)
+{
+	switch (z->codec) {
+	case PCAP_ZIO_NONE:
+		if (len > 0 && write_or_die(z->fd, in, len) != (ssize_t) len)
+			panic("Failed to write pcap data!\n");
+		z->bytes_file += len;
+		break;
+#ifdef HAVE_LIBZ
+	case PCAP_ZIO_GZIP: {
+		int ret;
+
+		z->zs.next_in = (uint8_t *) in;
+		z->zs.avail_in = len;
+
+		do {
+			z->zs.next_out = z->stage + z->stage_len;
+			z->zs.avail_out = ZIO_STAGE_SIZE - z->stage_len;
+
+			ret = deflate(&z->zs, finish ? Z_FINISH : Z_NO_FLUSH);
+			if (ret == Z_STREAM_ERROR)
+				panic("Cannot deflate pcap data!\n");
+
+			z->stage_len = ZIO_STAGE_SIZE - z->zs.avail_out;
+			if (z->stage_len == ZIO_STAGE_SIZE ||
+			    (finish && ret == Z_STREAM_END))
+				zio_stage_flush(z);
+		} while (z->zs.avail_in > 0 || (finish && ret != Z_STREAM_END));
+		break;
+	}
+#endif
+#ifdef HAVE_LIBZSTD
+	case PCAP_ZIO_ZSTD: {
+		ZSTD_inBuffer ib = {
+			.src = in,
+			.size = len,
+			.pos = 0,
+		};
+		ZSTD_outBuffer ob;
+		size_t ret;
+
+		do {
+			ob.dst = z->stage;
+			ob.size = ZIO_STAGE_SIZE;
+			ob.pos = z->stage_len;
+
+			if (ib.pos < ib.size)
+				ret = ZSTD_compressStream(z->zcs, &ob, &ib);
+			else
+				ret = ZSTD_endStream(z->zcs, &ob);
+			if (ZSTD_isError(ret))
+				panic("Cannot compress pcap data: %s\n",
+				      ZSTD_getErrorName(ret));
+
+			z->stage_len = ob.pos;
+			if (z->stage_len == ZIO_STAGE_SIZE ||
+			    (finish && ib.pos == ib.size && ret == 0))
+				zio_stage_flush(z);
+		} while (ib.pos < ib.size || (finish && ret != 0));
+		break;
+	}
+#endif
+	default:
+		bug();
+	}
+}
+
+static void *zio_writer(void *arg)
+{
+	struct pcap_zio *z = arg;
+	unsigned int slot;
+
+	while (1) {
+		pthread_mutex_lock(&z->lock);
+		while (z->full == 0 && !z->stop)
+			pthread_cond_wait(&z->cond, &z->lock);
+		if (z->full == 0) {
+			pthread_mutex_unlock(&z->lock);
+			break;
+		}
+		slot = z->tail;
+		pthread_mutex_unlock(&z->lock);
+
+		zio_encode(z, z->bufs[slot].data, z->bufs[slot].len, false);
+
+		pthread_mutex_lock(&z->lock);
+		z->tail = (slot + 1) % ZIO_NR_BUFS;
+		z->full--;
+		pthread_cond_broadcast(&z->cond);
+		pthread_mutex_unlock(&z->lock);
+	}
+
+	zio_encode(z, NULL, 0, true);
+
+	return NULL;
+}
+
+/* Write side, packet loop: pcap records -> ring */
+
+static void zio_wr_publish(struct pcap_zio *z)
+{
+	if (!z->held)
+		return;
+
+	pthread_mutex_lock(&z->lock);
+	z->head = (z->head + 1) % ZIO_NR_BUFS;
+	z->full++;
+	z->held = false;
+	pthread_cond_broadcast(&z->cond);
+	pthread_mutex_unlock(&z->lock);
+}
+
+static void zio_wr_put(struct pcap_zio *z, const void *ptr, size_t len)
+{
+	const uint8_t *data = ptr;
+
+	while (len > 0) {
+		struct zio_buf *b;
+		size_t chunk;
+
+		if (!z->held) {
+			pthread_mutex_lock(&z->lock);
+			while (z->full == ZIO_NR_BUFS)
+				pthread_cond_wait(&z->cond, &z->lock);
+			z->held = true;
+			z->bufs[z->head].len = 0;
+			pthread_mutex_unlock(&z->lock);
+		}
+
+		b = &z->bufs[z->head];
+		chunk = min_t(size_t, len, ZIO_BUF_SIZE - b->len);
+		fmemcpy(b->data + b->len, data, chunk);
+		b->len += chunk;
+		data += chunk;
+		len -= chunk;
+
+		if (b->len == ZIO_BUF_SIZE)
+			zio_wr_publish(z);
+	}
+}
+
+static void zio_start(struct pcap_zio *z, int fd, enum pcap_mode mode,
+		      enum pcap_zio_codec codec)
+{
+	size_t i;
+	int ret;
+
+	z->fd = fd;
+	z->mode = mode;
+	z->codec = codec;
+	z->head = z->tail = z->full = 0;
+	z->eof = z->stop = z->held = false;
+	z->off = 0;
+
+	for (i = 0; i < array_size(z->bufs); ++i) {
+		if (!z->bufs[i].data)
+			z->bufs[i].data = xmalloc_aligned(ZIO_BUF_SIZE,
+							   CO_CACHE_LINE_SIZE);
+		z->bufs[i].len = 0;
+	}
+	if (!z->bounce)
+		z->bounce = xmalloc_aligned(ZIO_BOUNCE_SIZE, CO_CACHE_LINE_SIZE);
+
+	zio_codec_init(z);
+
+	ret = pthread_create(&z->thread, NULL, mode == PCAP_MODE_RD ?
+			     zio_reader : zio_writer, z);
+	if (ret)
+		panic("Cannot create compression thread: %s\n", strerror(ret));
+}
+
+static void zio_stop(struct pcap_zio *z)
+{
+	size_t i;
+
+	pthread_mutex_lock(&z->lock);
+	z->stop = true;
+	pthread_cond_broadcast(&z->cond);
+	pthread_mutex_unlock(&z->lock);
+
+	/* A reader may still sit in read(2) on a pipe that never ends */
+	if (z->mode == PCAP_MODE_RD)
+		pthread_cancel(z->thread);
+	pthread_join(z->thread, NULL);
+
+	zio_codec_free(z);
+
+	for (i = 0; i < array_size(z->bufs); ++i) {
+		xfree(z->bufs[i].data);
+		z->bufs[i].data = NULL;
+	}
+	xfree(z->bounce);
+	z->bounce = NULL;
+	xfree(z->stage);
+	z->stage = NULL;
+}
+
+static enum pcap_zio_codec zio_stage_sniff(struct pcap_zio *z, int fd)
+{
+	ssize_t ret;
+
+	z->bytes_file = z->bytes_pcap = 0;
+	z->stage = xmalloc_aligned(ZIO_STAGE_SIZE, CO_CACHE_LINE_SIZE);
+	z->stage_len = z->stage_off = 0;
+
+	/* Sniff the codec from the first bytes, they stay staged for the
+	 * decoder so this also works on pipes
+	 */
+	while (z->stage_len < 4) {
+		ret = read(fd, z->stage + z->stage_len,
+			   ZIO_STAGE_SIZE - z->stage_len);
+		if (ret <= 0)
+			break;
+		z->stage_len += ret;
+	}
+	z->bytes_file = z->stage_len;
+
+	return zio_sniff(z->stage, z->stage_len);
+}
+
+static int zio_open_rd(struct pcap_zio *z, int fd, uint32_t *magic,
+		       uint32_t *linktype)
+{
+	enum pcap_zio_codec codec;
+
+	/* Pipes will refuse, which is fine */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	codec = zio_stage_sniff(z, fd);
+	zio_start(z, fd, PCAP_MODE_RD, codec);
+
+	zio_cur = z;
+	return pcap_source_pull_fhdr(fd, &zio_source, &z->ng, magic, linktype);
+}
+
+static ssize_t zio_read_zc(struct pcap_zio *z, pcap_pkthdr_t *phdr,
+			   enum pcap_type type, uint8_t **packet)
+{
+	const uint8_t *ptr;
+	size_t hdrsize, hdrlen;
+
+	zio_cur = z;
+
+	if (type == PCAPNG)
+		return pcapng_read(&z->ng, z->fd, &zio_source, phdr,
+				   NULL, 0, packet);
+
+	hdrsize = pcap_get_hdr_length(phdr, type);
+	ptr = zio_pull(z->fd, (uint8_t *) &phdr->raw, hdrsize);
+	if (unlikely(!ptr))
+		return -EIO;
+	if (ptr != (const uint8_t *) &phdr->raw)
+		fmemcpy(&phdr->raw, ptr, hdrsize);
+
+	hdrlen = pcap_get_length(phdr, type);
+	if (unlikely(hdrlen == 0 || hdrlen > ZIO_BOUNCE_SIZE))
+		return -EINVAL;
+
+	*packet = (uint8_t *) zio_pull(z->fd, NULL, hdrlen);
+	if (unlikely(!*packet))
+		return -EIO;
+
+	return hdrsize + hdrlen;
+}
+
+struct pcap_zio *pcap_zio_open(int fd, uint32_t *magic, uint32_t *linktype)
+{
+	struct pcap_zio *z = xzmalloc(sizeof(*z));
+
+	pthread_mutex_init(&z->lock, NULL);
+	pthread_cond_init(&z->cond, NULL);
+
+	if (zio_open_rd(z, fd, magic, linktype)) {
+		pcap_zio_close(z);
+		return NULL;
+	}
+
+	return z;
+}
+
+/* File header and first packet header of fd, decoded in the caller. The
+ * packet data is not read, so phdr may report a caplen of 0 on pcapng.
+ */
+int pcap_zio_peek(int fd, uint32_t *magic, uint32_t *linktype,
+		  pcap_pkthdr_t *phdr)
+{
+	struct pcap_zio *z = xzmalloc(sizeof(*z));
+	struct pcap_zio *prev = zio_cur;
+	const uint8_t *ptr;
+	uint8_t *data;
+	ssize_t ret;
+
+	z->fd = fd;
+	z->mode = PCAP_MODE_RD;
+	z->codec = zio_stage_sniff(z, fd);
+	zio_codec_init(z);
+	z->bufs[0].data = xmalloc_aligned(ZIO_PEEK_SIZE, CO_CACHE_LINE_SIZE);
+
+	zio_cur = z;
+
+	ret = pcap_source_pull_fhdr(fd, &zio_peek_source, &z->ng, magic,
+				    linktype);
+	if (ret)
+		goto out;
+
+	if (*magic == PCAPNG_MAGIC) {
+		ret = pcapng_read(&z->ng, fd, &zio_peek_source, phdr,
+				  z->bufs[0].data, 0, &data);
+	} else {
+		size_t hdrsize = pcap_get_hdr_length(phdr, *magic);
+
+		ptr = zio_peek_pull(fd, NULL, hdrsize);
+		if (ptr)
+			fmemcpy(&phdr->raw, ptr, hdrsize);
+		else
+			ret = -EIO;
+	}
+out:
+	zio_cur = prev;
+	zio_codec_free(z);
+	xfree(z->bufs[0].data);
+	xfree(z->stage);
+	xfree(z);
+
+	return ret < 0 ? ret : 0;
+}
+
+ssize_t pcap_zio_read_next(struct pcap_zio *z, pcap_pkthdr_t *phdr,
+			   uint32_t magic, uint8_t **packet)
+{
+	return zio_read_zc(z, phdr, magic, packet);
+}
+
+void pcap_zio_close(struct pcap_zio *z)
+{
+	zio_stop(z);
+
+	if (zio_cur == z)
+		zio_cur = &zio_std;
+
+	pthread_mutex_destroy(&z->lock);
+	pthread_cond_destroy(&z->cond);
+	xfree(z);
+}
+
+static void pcap_zio_init_once(void)
+{
+	set_ioprio_be();
+}
+
+static int pcap_zio_pull_fhdr(int fd, uint32_t *magic, uint32_t *linktype)
+{
+	return zio_open_rd(&zio_std, fd, magic, linktype);
+}
+
+static int pcap_zio_push_fhdr(int fd, uint32_t magic, uint32_t linktype)
+{
+	struct pcap_zio *z = &zio_std;
+	struct pcap_filehdr hdr;
+
+	if (magic == PCAPNG_MAGIC)
+		panic("Writing pcapng files is not supported!\n");
+
+	z->bytes_file = z->bytes_pcap = 0;
+	z->stage = xmalloc_aligned(ZIO_STAGE_SIZE, CO_CACHE_LINE_SIZE);
+	z->stage_len = z->stage_off = 0;
+
+	zio_start(z, fd, PCAP_MODE_WR, zio_codec_wr);
+
+	fmemset(&hdr, 0, sizeof(hdr));
+	pcap_prepare_header(&hdr, magic, linktype, 0, PCAP_DEFAULT_SNAPSHOT_LEN);
+
+	zio_wr_put(z, &hdr, sizeof(hdr));
+	z->bytes_pcap += sizeof(hdr);
+
+	return 0;
+}
+
+static ssize_t pcap_zio_read_zc(int fd __maybe_unused, pcap_pkthdr_t *phdr,
+				enum pcap_type type, uint8_t **packet)
+{
+	return zio_read_zc(&zio_std, phdr, type, packet);
+}
+
+static ssize_t pcap_zio_read(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+			     uint8_t *packet, size_t len)
+{
+	uint8_t *data;
+	ssize_t ret;
+	size_t hdrlen;
+
+	if (type == PCAPNG) {
+		zio_cur = &zio_std;
+		return pcapng_read(&zio_std.ng, fd, &zio_source, phdr,
+				   packet, len, &data);
+	}
+
+	ret = zio_read_zc(&zio_std, phdr, type, &data);
+	if (unlikely(ret < 0))
+		return ret;
+
+	hdrlen = pcap_get_length(phdr, type);
+	if (unlikely(hdrlen > len))
+		return -EINVAL;
+
+	fmemcpy(packet, data, hdrlen);
+
+	return ret;
+}
+
+static ssize_t pcap_zio_write(int fd __maybe_unused, pcap_pkthdr_t *phdr,
+			      enum pcap_type type, const uint8_t *packet,
+			      size_t len)
+{
+	struct pcap_zio *z = &zio_std;
+	size_t hdrsize = pcap_get_hdr_length(phdr, type);
+
+	zio_wr_put(z, &phdr->raw, hdrsize);
+	zio_wr_put(z, packet, len);
+	z->bytes_pcap += hdrsize + len;
+
+	return hdrsize + len;
+}
+
+static void pcap_zio_fsync(int fd __maybe_unused)
+{
+	struct pcap_zio *z = &zio_std;
+
+	if (z->mode != PCAP_MODE_WR)
+		return;
+
+	zio_wr_publish(z);
+
+	pthread_mutex_lock(&z->lock);
+	while (z->full > 0)
+		pthread_cond_wait(&z->cond, &z->lock);
+	pthread_mutex_unlock(&z->lock);
+}
+
+static void pcap_zio_prepare_close(int fd, enum pcap_mode mode)
+{
+	struct pcap_zio *z = &zio_std;
+
+	if (mode == PCAP_MODE_WR)
+		zio_wr_publish(z);
+
+	zio_stop(z);
+
+	if (mode == PCAP_MODE_WR)
+		fdatasync(fd);
+}
+
+const struct pcap_file_ops pcap_zio_ops = {
+	.init_once_pcap = pcap_zio_init_once,
+	.pull_fhdr_pcap = pcap_zio_pull_fhdr,
+	.push_fhdr_pcap = pcap_zio_push_fhdr,
+	.prepare_close_pcap = pcap_zio_prepare_close,
+	.read_pcap = pcap_zio_read,
+	.read_pcap_zc = pcap_zio_read_zc,
+	.write_pcap = pcap_zio_write,
+	.fsync_pcap = pcap_zio_fsync,
+};
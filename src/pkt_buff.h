@@ -28,16 +28,19 @@ struct pkt_buff {
     /* add layer2/3 info */
     uint32_t *src_addr;
     uint32_t *dest_addr;
+    /* or, for ipv6, 16 bytes each */
+    uint8_t *src_addr6;
+    uint8_t *dest_addr6;
     /* add udp info */
     uint16_t *udp_src_port;
     uint16_t *udp_dest_port;
 
 };
 
-static inline struct pkt_buff *pkt_alloc(uint8_t *packet, unsigned int len)
+/* for a pkt_buff on the caller's stack, no allocation per packet */
+static inline struct pkt_buff *pkt_init(struct pkt_buff *pkt, uint8_t *packet,
+					unsigned int len)
 {
-	struct pkt_buff *pkt = xmalloc(sizeof(*pkt));
-
 	pkt->head = packet;
 	pkt->data = packet;
 	pkt->tail = packet + len;
@@ -48,12 +51,19 @@ static inline struct pkt_buff *pkt_alloc(uint8_t *packet, unsigned int len)
 
     pkt->src_addr = NULL;
     pkt->dest_addr = NULL;
+    pkt->src_addr6 = NULL;
+    pkt->dest_addr6 = NULL;
     pkt->udp_src_port = NULL;
     pkt->udp_dest_port = NULL;
 
 	return pkt;
 }
 
+static inline struct pkt_buff *pkt_alloc(uint8_t *packet, unsigned int len)
+{
+	return pkt_init(xmalloc(sizeof(struct pkt_buff)), packet, len);
+}
+
 static inline void pkt_free(struct pkt_buff *pkt)
 {
 	xfree(pkt);
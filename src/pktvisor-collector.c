@@ -0,0 +1,511 @@
+/*
+ * pktvisor-collector
+ * Copyright 2015 NSONE, Inc.
+ * Subject to the GPL, version 2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "export.h"
+#include "merge.h"
+#include "statshm.h"
+#include "xmalloc.h"
+#include "die.h"
+#include "built_in.h"
+
+#define COLLECTOR_NAME_DEFAULT "/pktvisor-collector"
+#define COLLECTOR_LISTEN_MAX 8
+#define COLLECTOR_CONN_MAX 256
+// holds a whole record wherever the last read cut it
+#define INPUT_BUF_SIZE (2 * EXPORT_RECORD_MAX)
+
+enum input_type {
+    INPUT_FILE,
+    INPUT_UNIX_LISTEN,
+    INPUT_UDP,
+    INPUT_CONN,
+};
+
+struct input {
+    enum input_type type;
+    const char *name;
+    int fd;
+    // read and not decoded yet, not for udp
+    uint8_t *buf;
+    size_t len, off;
+    int eof;
+    // next record of a file, for reading files in time order
+    struct export_rec *rec;
+    int have;
+};
+
+struct collector {
+    struct merge m;
+    struct statshm *shm;
+    char *shm_name;
+    struct statshm_data *out;
+    struct export_rec *rec;
+    unsigned int top;
+    bool quiet;
+    uint64_t nr_bad;
+};
+
+static const char *short_options = "l:w:s::t:qvh";
+static const struct option long_options[] = {
+    {"listen",		required_argument,	NULL, 'l'},
+    {"window",		required_argument,	NULL, 'w'},
+    {"shm",		optional_argument,	NULL, 's'},
+    {"top",		required_argument,	NULL, 't'},
+    {"quiet",		no_argument,		NULL, 'q'},
+    {"version",		no_argument,		NULL, 'v'},
+    {"help",		no_argument,		NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
+
+static const char *copyright = "Please report bugs to https://github.com/nsone\n"
+    "Copyright (C) 2015 NSONE, Inc. <dev@nsone.net>\n"
+    "License: GNU GPL version 2.0\n"
+    "This is free software: you are free to change and redistribute it.\n"
+    "There is NO WARRANTY, to the extent permitted by law.";
+
+static volatile sig_atomic_t sigint = 0;
+
+static void signal_handler(int number)
+{
+    sigint = 1;
+}
+
+static void __noreturn help(void)
+{
+    printf("pktvisor-collector %s", VERSION_STRING);
+    puts("Usage: pktvisor-collector [options] [file...]\n"
+         "Merges the records pktvisor --export sends from many nodes into windows\n"
+         "Options:\n"
+         "  -l|--listen <unix:path|udp:[host:]port>\n"
+         "                                 Receive records on a socket, may be repeated\n"
+         "  -w|--window <sec>              Window length in record time (default 10)\n"
+         "  -s|--shm[=name]                Publish every window to shared memory segment\n"
+         "                                 <name> (default " COLLECTOR_NAME_DEFAULT ") for pktvisor-stats\n"
+         "  -t|--top <n>                   Entries per table (default 10)\n"
+         "  -q|--quiet                     Do not print the windows\n"
+         "  -v|--version                   Print version and exit\n"
+         "  -h|--help                      Guess what?!\n\n"
+         "Examples:\n"
+         "  pktvisor-collector pop1.pvx pop2.pvx pop3.pvx\n"
+         "  pktvisor-collector -l unix:/run/pktvisor.sock -l udp:9999 -s\n"
+         "  pktvisor --in eth0 --export udp:collector:9999\n");
+    puts(copyright);
+    die();
+}
+
+static void __noreturn version(void)
+{
+    printf("pktvisor-collector %s, Git id: %s\n", VERSION_LONG, GITVERSION);
+    puts(copyright);
+    die();
+}
+
+static void print_window(struct collector *c)
+{
+    const struct merge *m = &c->m;
+    const struct statshm_data *d = &m->delta, *out = c->out;
+    const struct statshm_table *t;
+    struct merge_source *src, *tmp;
+    uint64_t nr_lost = 0;
+    uint32_t nr_src = 0, i, j;
+    char when[32];
+    time_t sec = m->start / 1000000000ULL;
+
+    HASH_ITER(hh, m->sources, src, tmp) {
+        if (src->ts >= m->start)
+            nr_src++;
+        nr_lost += src->nr_lost;
+    }
+
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", gmtime(&sec));
+    printf("\nWindow %s +%lus: %u of %u nodes, %lu late and %lu lost records\n",
+           when, m->window / 1000000000UL, nr_src, m->nr_source, m->nr_late, nr_lost);
+    printf("%12lu  seen (%lu total)\n", d->seen, out->seen);
+    printf("%12lu  incoming\n", d->incoming);
+    printf("%12lu  Query flag\n", d->cnt_query);
+    printf("%12lu  Reply flag\n", d->cnt_reply);
+    printf("%12lu  NOERROR\n", d->cnt_status_noerror);
+    printf("%12lu  SRVFAIL\n", d->cnt_status_srvfail);
+    printf("%12lu  NXDOMAIN\n", d->cnt_status_nxdomain);
+    printf("%12lu  REFUSED\n", d->cnt_status_refused);
+    printf("%12lu  malformed\n", d->cnt_malformed);
+    if (d->lat_count)
+        printf("%12.3f  ms mean latency\n", (double)d->lat_sum / d->lat_count / 1e6);
+
+    printf("\nUnique (estimated, all nodes)\n");
+    printf("%20s %lu\n", "source IPs", out->uniq_source);
+    printf("%20s %lu\n", "source /24s", out->uniq_source24);
+    printf("%20s %lu\n", "qnames", out->uniq_qname);
+
+    for (i = 0; i < out->nr_table; i++) {
+        t = &out->table[i];
+        if (!t->n)
+            continue;
+        printf("\n%s\n", t->title);
+        for (j = 0; j < t->n && j < c->top; j++) {
+            if (t->entry[j].error)
+                printf("%20s %lu (+%lu)\n", t->entry[j].key, t->entry[j].count, t->entry[j].error);
+            else
+                printf("%20s %lu\n", t->entry[j].key, t->entry[j].count);
+        }
+    }
+    fflush(stdout);
+}
+
+static void emit(struct collector *c)
+{
+    merge_close(&c->m, c->out);
+    if (!c->quiet)
+        print_window(c);
+    if (c->shm) {
+        statshm_write_begin(c->shm);
+        memcpy(&c->shm->data, c->out, sizeof(*c->out));
+        statshm_write_end(c->shm);
+    }
+}
+
+static void consume(struct collector *c, const struct export_rec *rec)
+{
+    if (merge_due(&c->m, rec))
+        emit(c);
+    merge_add(&c->m, rec);
+}
+
+// 1 with a record, 0 if the buffer holds none whole
+static int input_next(struct collector *c, struct input *in, struct export_rec *rec)
+{
+    long n;
+
+    while (in->off < in->len) {
+        n = export_decode(in->buf + in->off, in->len - in->off, rec);
+        if (n > 0) {
+            in->off += n;
+            return 1;
+        }
+        if (!n)
+            break;
+        // not a record, look for the next one
+        in->off++;
+        c->nr_bad++;
+    }
+    memmove(in->buf, in->buf + in->off, in->len - in->off);
+    in->len -= in->off;
+    in->off = 0;
+
+    return 0;
+}
+
+static int input_fill(struct input *in)
+{
+    ssize_t n;
+
+    n = read(in->fd, in->buf + in->len, INPUT_BUF_SIZE - in->len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return 0;
+    if (n <= 0) {
+        in->eof = 1;
+        return -1;
+    }
+    in->len += n;
+
+    return 0;
+}
+
+static void file_next(struct collector *c, struct input *in)
+{
+    in->have = 0;
+    while (!in->have && !in->eof) {
+        in->have = input_next(c, in, in->rec);
+        if (!in->have)
+            input_fill(in);
+    }
+    if (!in->have)
+        in->have = input_next(c, in, in->rec);
+}
+
+// oldest record first over all files, so windows close in order
+static void read_files(struct collector *c, struct input *in, int nr)
+{
+    struct input *min;
+    int i;
+
+    for (i = 0; i < nr; i++)
+        file_next(c, &in[i]);
+    while (!sigint) {
+        min = NULL;
+        for (i = 0; i < nr; i++) {
+            if (in[i].have && (!min || in[i].rec->data.ts < min->rec->data.ts))
+                min = &in[i];
+        }
+        if (!min)
+            break;
+        consume(c, min->rec);
+        file_next(c, min);
+    }
+}
+
+static int open_listen(const char *spec)
+{
+    struct sockaddr_un sun;
+    struct addrinfo hints, *ai;
+    char host[256], *port;
+    int fd, one = 1;
+
+    if (!strncmp(spec, "unix:", 5)) {
+        spec += 5;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(spec) >= sizeof(sun.sun_path))
+            panic("Socket path too long: %s\n", spec);
+        strcpy(sun.sun_path, spec);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            panic("Cannot create socket: %s\n", strerror(errno));
+        unlink(spec);
+        if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) || listen(fd, 64))
+            panic("Cannot listen on %s: %s\n", spec, strerror(errno));
+        return fd;
+    }
+    if (strncmp(spec, "udp:", 4))
+        panic("Unknown listen address %s, use unix:path or udp:[host:]port\n", spec);
+
+    spec += 4;
+    if (strlen(spec) >= sizeof(host))
+        panic("Listen address too long: %s\n", spec);
+    strcpy(host, spec[0] == '[' ? spec + 1 : spec);
+    port = strrchr(host, ':');
+    if (port) {
+        *port++ = 0;
+        if (strchr(host, ']'))
+            *strchr(host, ']') = 0;
+    }
+    else {
+        port = host;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    if (getaddrinfo(port == host ? NULL : host, port, &hints, &ai))
+        panic("Cannot resolve %s\n", spec);
+    fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        panic("Cannot create socket: %s\n", strerror(errno));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen))
+        panic("Cannot bind %s: %s\n", spec, strerror(errno));
+    freeaddrinfo(ai);
+
+    return fd;
+}
+
+// records go into the window as they arrive; with nothing heard for a
+// whole window the open one is closed anyway
+static void serve(struct collector *c, const char **listen_on, int nr_listen)
+{
+    struct input *in = xzmalloc((COLLECTOR_LISTEN_MAX + COLLECTOR_CONN_MAX) * sizeof(*in));
+    struct pollfd pfd[COLLECTOR_LISTEN_MAX + COLLECTOR_CONN_MAX];
+    int i, j, nr = 0, fd, ret;
+    ssize_t n;
+
+    for (i = 0; i < nr_listen; i++, nr++) {
+        in[nr].name = listen_on[i];
+        in[nr].fd = open_listen(listen_on[i]);
+        in[nr].type = strncmp(listen_on[i], "udp:", 4) ? INPUT_UNIX_LISTEN : INPUT_UDP;
+        in[nr].buf = xmalloc(INPUT_BUF_SIZE);
+    }
+
+    while (!sigint) {
+        for (i = 0; i < nr; i++) {
+            pfd[i].fd = in[i].fd;
+            pfd[i].events = POLLIN;
+            pfd[i].revents = 0;
+        }
+        ret = poll(pfd, nr, c->m.window / 1000000);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            panic("poll: %s\n", strerror(errno));
+        }
+        if (!ret) {
+            if (c->m.nr_rec)
+                emit(c);
+            continue;
+        }
+
+        for (i = 0; i < nr; i++) {
+            if (!pfd[i].revents)
+                continue;
+            switch (in[i].type) {
+            case INPUT_UNIX_LISTEN:
+                fd = accept(in[i].fd, NULL, NULL);
+                if (fd < 0)
+                    break;
+                if (nr == COLLECTOR_LISTEN_MAX + COLLECTOR_CONN_MAX) {
+                    close(fd);
+                    break;
+                }
+                memset(&in[nr], 0, sizeof(in[nr]));
+                in[nr].type = INPUT_CONN;
+                in[nr].name = in[i].name;
+                in[nr].fd = fd;
+                in[nr].buf = xmalloc(INPUT_BUF_SIZE);
+                nr++;
+                break;
+            case INPUT_UDP:
+                n = recv(in[i].fd, in[i].buf, INPUT_BUF_SIZE, MSG_DONTWAIT);
+                if (n <= 0)
+                    break;
+                if (export_decode(in[i].buf, n, c->rec) == n)
+                    consume(c, c->rec);
+                else
+                    c->nr_bad += n;
+                break;
+            default:
+                input_fill(&in[i]);
+                while (input_next(c, &in[i], c->rec))
+                    consume(c, c->rec);
+                break;
+            }
+        }
+
+        // drop closed connections, a record they cut short is lost
+        for (i = 0, j = 0; i < nr; i++) {
+            if (in[i].type == INPUT_CONN && in[i].eof) {
+                close(in[i].fd);
+                xfree(in[i].buf);
+                continue;
+            }
+            in[j++] = in[i];
+        }
+        nr = j;
+    }
+
+    for (i = 0; i < nr; i++) {
+        close(in[i].fd);
+        xfree(in[i].buf);
+        if (in[i].type == INPUT_UNIX_LISTEN)
+            unlink(in[i].name + 5);
+    }
+    xfree(in);
+}
+
+int main(int argc, char **argv)
+{
+    struct collector c;
+    const char *listen_on[COLLECTOR_LISTEN_MAX];
+    uint64_t window = 10;
+    struct input *files;
+    int ch, opt_index, i, nr_listen = 0, nr_file;
+
+    memset(&c, 0, sizeof(c));
+    c.top = 10;
+
+    while ((ch = getopt_long(argc, argv, short_options, long_options,
+                             &opt_index)) != EOF) {
+        switch (ch) {
+        case 'l':
+            if (nr_listen == COLLECTOR_LISTEN_MAX)
+                panic("At most %d listen addresses\n", COLLECTOR_LISTEN_MAX);
+            listen_on[nr_listen++] = optarg;
+            break;
+        case 'w':
+            window = strtoul(optarg, NULL, 0);
+            if (!window)
+                panic("Window must be at least a second\n");
+            break;
+        case 's':
+            c.shm_name = xstrdup(optarg ? optarg : COLLECTOR_NAME_DEFAULT);
+            break;
+        case 't':
+            c.top = strtoul(optarg, NULL, 0);
+            break;
+        case 'q':
+            c.quiet = true;
+            break;
+        case 'v':
+            version();
+            break;
+        case 'h':
+        default:
+            help();
+            break;
+        }
+    }
+
+    nr_file = argc - optind;
+    if (!nr_file && !nr_listen)
+        help();
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    merge_init(&c.m, window * 1000000000ULL);
+    // large, off the stack
+    c.out = xzmalloc(sizeof(*c.out));
+    c.rec = xmalloc(sizeof(*c.rec));
+    export_rec_init(c.rec);
+    if (c.shm_name)
+        c.shm = statshm_create(c.shm_name, window * 1000000000ULL);
+
+    if (nr_file) {
+        files = xzmalloc(nr_file * sizeof(*files));
+        for (i = 0; i < nr_file; i++) {
+            files[i].type = INPUT_FILE;
+            files[i].name = argv[optind + i];
+            files[i].fd = strcmp(files[i].name, "-") ? open(files[i].name, O_RDONLY) : 0;
+            if (files[i].fd < 0)
+                panic("Cannot open %s: %s\n", files[i].name, strerror(errno));
+            files[i].buf = xmalloc(INPUT_BUF_SIZE);
+            files[i].rec = xmalloc(sizeof(*files[i].rec));
+            export_rec_init(files[i].rec);
+        }
+        read_files(&c, files, nr_file);
+        for (i = 0; i < nr_file; i++) {
+            if (files[i].fd)
+                close(files[i].fd);
+            xfree(files[i].buf);
+            export_rec_free(files[i].rec);
+            xfree(files[i].rec);
+        }
+        xfree(files);
+    }
+
+    if (nr_listen)
+        serve(&c, listen_on, nr_listen);
+
+    if (c.m.nr_rec)
+        emit(&c);
+    if (c.nr_bad && !c.quiet)
+        printf("\n%lu bytes skipped that were not records\n", c.nr_bad);
+
+    if (c.shm)
+        statshm_destroy(c.shm, c.shm_name);
+    free(c.shm_name);
+    export_rec_free(c.rec);
+    xfree(c.rec);
+    xfree(c.out);
+    merge_free(&c.m);
+
+    return 0;
+}
@@ -0,0 +1,256 @@
+/*
+ * pktvisor-stats
+ * Copyright 2015 NSONE, Inc.
+ * Subject to the GPL, version 2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "statshm.h"
+#include "state.h"
+#include "xmalloc.h"
+#include "die.h"
+#include "built_in.h"
+
+static const char *short_options = "n:f:i:c:t:vh";
+static const struct option long_options[] = {
+    {"name",		required_argument,	NULL, 'n'},
+    {"file",		required_argument,	NULL, 'f'},
+    {"interval",		required_argument,	NULL, 'i'},
+    {"count",		required_argument,	NULL, 'c'},
+    {"top",		required_argument,	NULL, 't'},
+    {"version",		no_argument,		NULL, 'v'},
+    {"help",		no_argument,		NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
+
+static const char *copyright = "Please report bugs to https://github.com/nsone\n"
+    "Copyright (C) 2015 NSONE, Inc. <dev@nsone.net>\n"
+    "License: GNU GPL version 2.0\n"
+    "This is free software: you are free to change and redistribute it.\n"
+    "There is NO WARRANTY, to the extent permitted by law.";
+
+// dnsctxt_tier_name, without linking the dnsctxt
+static const char *tier_name[DNS_TIER_NR] = {
+    [DNS_TIER_FULL] = "full",
+    [DNS_TIER_HEADER] = "header",
+    [DNS_TIER_SAMPLE] = "sample",
+};
+
+static volatile sig_atomic_t sigint = 0;
+
+static void signal_handler(int number)
+{
+    sigint = 1;
+}
+
+static void __noreturn help(void)
+{
+    printf("pktvisor-stats %s", VERSION_STRING);
+    puts("Usage: pktvisor-stats [options]\n"
+         "Reads the statistics a pktvisor run with --shm publishes\n"
+         "Options:\n"
+         "  -n|--name <name>               Shared memory segment (default " STATSHM_NAME_DEFAULT ")\n"
+         "  -f|--file <file>               Read the last save of a pktvisor run with --state instead\n"
+         "  -i|--interval <sec>            Print every <sec> seconds instead of once\n"
+         "  -c|--count <n>                 Stop after <n> prints\n"
+         "  -t|--top <n>                   Entries per table (default 10)\n"
+         "  -v|--version                   Print version and exit\n"
+         "  -h|--help                      Guess what?!\n\n"
+         "Examples:\n"
+         "  pktvisor --in eth0 --shm &\n"
+         "  pktvisor-stats -i 1\n"
+         "  pktvisor-stats -f /var/lib/pktvisor/eth0.state\n");
+    puts(copyright);
+    die();
+}
+
+static void __noreturn version(void)
+{
+    printf("pktvisor-stats %s, Git id: %s\n", VERSION_LONG, GITVERSION);
+    puts(copyright);
+    die();
+}
+
+// rates against the previous print, if there was one
+static void print_stats(const struct statshm_data *d, const struct statshm_data *prev,
+                        unsigned int top)
+{
+    double secs = prev && d->ts > prev->ts ? (double)(d->ts - prev->ts) / 1e9 : 0;
+    const struct statshm_table *t;
+    char le[32];
+    uint32_t i, j;
+
+    printf("\nDNS Results (%.0f s of traffic):\n",
+           d->first_ts ? (double)(d->ts - d->first_ts) / 1e9 : 0);
+    printf("%12lu  seen", d->seen);
+    if (secs)
+        printf(" (%.1f/s)", (d->seen - prev->seen) / secs);
+    printf("\n%12lu  incoming", d->incoming);
+    if (secs)
+        printf(" (%.1f/s)", (d->incoming - prev->incoming) / secs);
+    printf("\n%12lu  Query flag\n", d->cnt_query);
+    printf("%12lu  Reply flag\n", d->cnt_reply);
+    printf("%12lu  NOERROR\n", d->cnt_status_noerror);
+    printf("%12lu  SRVFAIL\n", d->cnt_status_srvfail);
+    printf("%12lu  NXDOMAIN\n", d->cnt_status_nxdomain);
+    printf("%12lu  REFUSED\n", d->cnt_status_refused);
+    printf("%12lu  malformed\n", d->cnt_malformed);
+    printf("%12lu  EDNS\n", d->cnt_edns);
+    if (d->shed_tier != DNS_TIER_FULL || d->kernel_drops || d->sampled_out) {
+        printf("\nUnder load: %s analysis", d->shed_tier < DNS_TIER_NR ? tier_name[d->shed_tier] : "?");
+        if (d->shed_tier == DNS_TIER_SAMPLE)
+            printf(" of 1 in %u packets", d->shed_rate);
+        printf(", %lu kernel drops, %lu packets not sampled\n", d->kernel_drops, d->sampled_out);
+    }
+
+    printf("\nUnique (estimated)\n");
+    printf("%20s %lu\n", "source IPs", d->uniq_source);
+    printf("%20s %lu\n", "source /24s", d->uniq_source24);
+    printf("%20s %lu\n", "qnames", d->uniq_qname);
+
+    if (d->lat_count) {
+        printf("\nQuery to Reply Latency (%lu replies, mean %.3f ms, %lu unmatched)\n",
+               d->lat_count, (double)d->lat_sum / d->lat_count / 1e6, d->lat_unmatched);
+        for (i = 0; i < STATSHM_LAT_BUCKETS; i++) {
+            if (!d->lat_bucket[i])
+                continue;
+            if (d->lat_bound[i] == UINT64_MAX)
+                snprintf(le, sizeof(le), "slower");
+            else
+                snprintf(le, sizeof(le), "<= %g ms", d->lat_bound[i] / 1e6);
+            printf("%20s %lu\n", le, d->lat_bucket[i]);
+        }
+    }
+
+    for (i = 0; i < d->nr_table && i < STATSHM_TABLES; i++) {
+        t = &d->table[i];
+        if (!t->n)
+            continue;
+        printf("\n%s\n", t->title);
+        for (j = 0; j < t->n && j < top && j < STATSHM_TOPK; j++) {
+            if (t->entry[j].rate)
+                printf("%20s %lu %.1f/s\n", t->entry[j].key, t->entry[j].count, t->entry[j].rate);
+            else if (t->entry[j].error)
+                printf("%20s %lu (+%lu)\n", t->entry[j].key, t->entry[j].count, t->entry[j].error);
+            else
+                printf("%20s %lu\n", t->entry[j].key, t->entry[j].count);
+        }
+    }
+    fflush(stdout);
+}
+
+// the stats rendered at the last save, the process may be long gone
+static void read_state(const char *path, struct statshm_data *d)
+{
+    const struct state_hdr *h;
+    const struct statshm_data *data;
+    struct stat st;
+    time_t saved;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st))
+        panic("Cannot open %s: %s\n", path, strerror(errno));
+    if ((size_t)st.st_size < sizeof(*h))
+        panic("%s is not a pktvisor state file\n", path);
+    h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (h == MAP_FAILED)
+        panic("Cannot map %s: %s\n", path, strerror(errno));
+    close(fd);
+
+    data = state_sect(h, st.st_size, STATE_STATS, sizeof(*data));
+    if (!state_check(h, st.st_size) || !data || h->sect[STATE_STATS].size != sizeof(*data))
+        panic("%s is not a pktvisor state file of this version\n", path);
+    memcpy(d, data, sizeof(*d));
+    saved = h->saved;
+    printf("State of pid %d saved %s", h->pid, ctime(&saved));
+
+    munmap((void *)h, st.st_size);
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = STATSHM_NAME_DEFAULT, *file = NULL;
+    unsigned long interval = 0, count = 0, n;
+    unsigned int top = 10;
+    const struct statshm *shm;
+    struct statshm_data *d, *prev, *tmp;
+    int c, opt_index;
+
+    while ((c = getopt_long(argc, argv, short_options, long_options,
+                            &opt_index)) != EOF) {
+        switch (c) {
+        case 'n':
+            name = optarg;
+            break;
+        case 'f':
+            file = optarg;
+            break;
+        case 'i':
+            interval = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            top = strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            version();
+            break;
+        case 'h':
+        default:
+            help();
+            break;
+        }
+    }
+
+    if (file) {
+        d = xzmalloc(sizeof(*d));
+        read_state(file, d);
+        print_stats(d, NULL, top);
+        xfree(d);
+        return 0;
+    }
+
+    shm = statshm_attach(name);
+    if (!shm)
+        panic("Cannot attach to %s: %s\n", name,
+              errno == EPROTO ? "not a pktvisor segment of this version" : strerror(errno));
+
+    signal(SIGINT, signal_handler);
+
+    // large, off the stack
+    d = xzmalloc(sizeof(*d));
+    prev = xzmalloc(sizeof(*prev));
+    for (n = 0; !sigint; ) {
+        if (statshm_read(shm, d))
+            panic("Cannot read %s: %s\n", name,
+                  errno == ESRCH ? "pktvisor died while publishing" : strerror(errno));
+        print_stats(d, n ? prev : NULL, top);
+        if (!interval || ++n == count)
+            break;
+        tmp = prev;
+        prev = d;
+        d = tmp;
+        sleep(interval);
+    }
+
+    xfree(d);
+    xfree(prev);
+    statshm_detach(shm);
+
+    return 0;
+}
@@ -33,6 +33,8 @@
 #include "dev.h"
 #include "built_in.h"
 #include "pcap_io.h"
+#include "pcap_merge.h"
+#include "pcap_index.h"
 #include "privs.h"
 #include "proc.h"
 #include "bpf.h"
@@ -52,6 +54,13 @@
 #include "xmalloc.h"
 
 #include "dnsctxt.h"
+#include "dnswindow.h"
+#include "slab.h"
+#include "numa.h"
+#include "statshm.h"
+#include "metrics.h"
+#include "export.h"
+#include "state.h"
 #include "pktvisorui.h"
 
 enum dump_mode {
@@ -60,21 +69,84 @@ enum dump_mode {
 };
 
 struct ctx {
-    char *device_in, *device_out, *device_trans, *filter, *prefix, *local_net, *geoip_loc, *geoip_asn;
+    char *device_in, *device_out, *device_trans, *filter, *prefix, *local_net, *local_file, *geoip_loc, *geoip_asn;
     int cpu, /*rfraw,*/ dump, print_mode, dump_dir, packet_type, local_prefix;
 	unsigned long kpull, dump_interval, tx_bytes, tx_packets;
 	size_t reserve_size;
     bool randomize, promiscuous, enforce, jumbo, dump_bpf, hwtimestamp, verbose,
          ui, nolock;
     enum pcap_ops_groups pcap; enum dump_mode dump_mode;
+    enum pcap_zio_codec compress;
+    // --from/--to in ns since the epoch, 0 if unset
+    uint64_t ts_from, ts_to;
+    bool index;
+    struct pcap_index *dump_idx; uint64_t dump_off;
+    // packet timestamps drive rates, rotation and snapshots
+    bool event_time;
+    unsigned long stats_interval; uint64_t dump_next;
+    // tumbling windows kept per length, 0 = off
+    unsigned long windows;
+    // time constant of decayed per key rates in sec, 0 = off
+    double decay;
+    // Count-Min sketch width in bits, 0 = off; keys to look up at the end
+    unsigned int cms_bits; char *lookup;
+    // prefix lengths rolled up per address family
+    uint8_t prefix4[LPM_MAX_LEVELS], prefix6[LPM_MAX_LEVELS];
+    int nr_prefix4, nr_prefix6;
+    // labels kept per query name, 0 = default
+    unsigned int name_depth;
+    // look geo up in tables flattened from the databases, resolve it per
+    // source /24 when the tables are read
+    bool geo_flat, geo_defer;
+    // cpu given with -b, -1 if none. otherwise the capture runs on the
+    // cpus of the NIC's NUMA node
+    int bind_cpu;
+    // stats segment for readers in other processes, NULL if off
+    char *shm_name;
+    struct statshm *shm;
+    // OpenMetrics listener, reading the stats segment, NULL if off
+    char *metrics_listen;
+    struct metrics *metrics;
+    // binary records for a collector, NULL if off
+    char *export_dest;
+    struct export *exp;
+    // aggregation state restored at start and saved periodically, NULL if off
+    char *state_file;
+    // keep the full analysis however far the capture falls behind
+    bool no_shed;
     uid_t uid; gid_t gid; uint32_t link_type, magic;
     struct dnsctxt dns_ctxt;
 };
 
+enum {
+	OPT_FROM = 256,
+	OPT_TO,
+	OPT_INDEX,
+	OPT_BUILD_INDEX,
+	OPT_EVENT_TIME,
+	OPT_STATS_INTERVAL,
+	OPT_WINDOWS,
+	OPT_DECAY,
+	OPT_COUNT_MIN,
+	OPT_LOOKUP,
+	OPT_PREFIX4,
+	OPT_PREFIX6,
+	OPT_LOCAL_FILE,
+	OPT_NAME_DEPTH,
+	OPT_GEO_FLAT,
+	OPT_GEO_DEFER,
+	OPT_HUGEPAGES,
+	OPT_SHM,
+	OPT_METRICS,
+	OPT_EXPORT,
+	OPT_STATE,
+	OPT_NO_SHED,
+};
+
 static volatile sig_atomic_t sigint = 0;
 static volatile bool next_dump = false;
 
-static const char *short_options = "d:i:o:rf:MNJt:S:k:n:b:HQmcZYsqXxlvhF:GAP:Vu:g:T:DBUL:W:C:a:";
+static const char *short_options = "d:i:o:rf:MNJt:S:k:n:b:HQmcZYsqXxlvhF:GAP:Vu:g:T:DBUL:W:C:a:z:";
 static const struct option long_options[] = {
 	{"dev",			required_argument,	NULL, 'd'},
 	{"in",			required_argument,	NULL, 'i'},
@@ -116,8 +188,31 @@ static const struct option long_options[] = {
     {"normal",		no_argument,		NULL, 'Z'},
     {"local-net",		required_argument,		NULL, 'L'},
     {"local-net-prefix",		required_argument,		NULL, 'W'},
+    {"local-file",		required_argument,		NULL, OPT_LOCAL_FILE},
+    {"name-depth",		required_argument,		NULL, OPT_NAME_DEPTH},
+    {"geo-flat",		no_argument,		NULL, OPT_GEO_FLAT},
+    {"geo-defer",		no_argument,		NULL, OPT_GEO_DEFER},
+    {"hugepages",		optional_argument,		NULL, OPT_HUGEPAGES},
+    {"shm",		optional_argument,		NULL, OPT_SHM},
+    {"metrics",		optional_argument,		NULL, OPT_METRICS},
+    {"export",		required_argument,		NULL, OPT_EXPORT},
+    {"state",		required_argument,		NULL, OPT_STATE},
+    {"no-shed",		no_argument,		NULL, OPT_NO_SHED},
     {"geoip-city",		required_argument,		NULL, 'C'},
     {"geoip-asn",		required_argument,		NULL, 'a'},
+    {"compress",		required_argument,		NULL, 'z'},
+    {"from",		required_argument,		NULL, OPT_FROM},
+    {"to",		required_argument,		NULL, OPT_TO},
+    {"index",		no_argument,		NULL, OPT_INDEX},
+    {"build-index",		no_argument,		NULL, OPT_BUILD_INDEX},
+    {"event-time",		no_argument,		NULL, OPT_EVENT_TIME},
+    {"stats-interval",		required_argument,		NULL, OPT_STATS_INTERVAL},
+    {"windows",		required_argument,		NULL, OPT_WINDOWS},
+    {"decay",		required_argument,		NULL, OPT_DECAY},
+    {"count-min",		optional_argument,		NULL, OPT_COUNT_MIN},
+    {"lookup",		required_argument,		NULL, OPT_LOOKUP},
+    {"prefix4",		required_argument,		NULL, OPT_PREFIX4},
+    {"prefix6",		required_argument,		NULL, OPT_PREFIX6},
     {NULL, 0, NULL, 0}
 };
 
@@ -144,7 +239,10 @@ static void signal_handler(int number)
 	case SIGQUIT:
 	case SIGTERM:
 		sigint = 1;
+		break;
 	case SIGHUP:
+		geoip_request_reload();
+		break;
 	default:
 		break;
 	}
@@ -194,6 +292,52 @@ static inline bool dump_to_pcap(struct ctx *ctx)
 	return ctx->dump;
 }
 
+static void dns_interval_summary(const struct dnsctxt_snap *start,
+                                 const struct dnsctxt_snap *end)
+{
+    double secs = (double)(end->ts - start->ts) / 1e9;
+    time_t ts = start->ts / 1000000000ULL;
+    char when[32];
+
+    if (secs <= 0)
+        return;
+
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", gmtime(&ts));
+    printf("%s %6.2fs seen %lu in %.0f/s out %.0f/s query %.0f/s reply %.0f/s "
+           "srvfail %lu nxdomain %lu refused %lu malformed %lu\n", when, secs,
+           end->seen - start->seen,
+           (end->incoming - start->incoming) / secs,
+           ((end->seen - end->incoming) - (start->seen - start->incoming)) / secs,
+           (end->cnt_query - start->cnt_query) / secs,
+           (end->cnt_reply - start->cnt_reply) / secs,
+           end->cnt_status_srvfail - start->cnt_status_srvfail,
+           end->cnt_status_nxdomain - start->cnt_status_nxdomain,
+           end->cnt_status_refused - start->cnt_status_refused,
+           end->cnt_malformed - start->cnt_malformed);
+}
+
+// feed the packet time to the dns clock, before the packet is counted
+static inline void dns_clock(struct ctx *ctx, uint32_t sec, uint32_t nsec)
+{
+    if (dnsctxt_tick(&ctx->dns_ctxt, (uint64_t)sec * 1000000000ULL + nsec) &&
+        !ctx->ui)
+        dns_interval_summary(&ctx->dns_ctxt.closed_start,
+                             &ctx->dns_ctxt.closed_end);
+}
+
+// last, partial interval at the end of a run
+static void dns_interval_flush(struct ctx *ctx)
+{
+    struct dnsctxt_snap end;
+
+    if (!ctx->dns_ctxt.interval_end || ctx->ui)
+        return;
+
+    // up to the last packet, as the first interval starts at the first
+    dnsctxt_snapshot(&ctx->dns_ctxt, &end, ctx->dns_ctxt.now);
+    dns_interval_summary(&ctx->dns_ctxt.interval_start, &end);
+}
+
 static void pcap_to_xmit(struct ctx *ctx)
 {
 	uint8_t *out = NULL;
@@ -217,10 +361,12 @@ static void pcap_to_xmit(struct ctx *ctx)
 	if (!strncmp("-", ctx->device_in, strlen("-"))) {
 		fd = dup_or_die(fileno(stdin));
 		close(fileno(stdin));
-		if (ctx->pcap == PCAP_OPS_MM)
-			ctx->pcap = PCAP_OPS_SG;
+		/* stdin may carry a compressed stream, sniffed on open */
+		ctx->pcap = PCAP_OPS_ZIO;
 	} else {
 		fd = open_or_die(ctx->device_in, O_RDONLY | O_LARGEFILE | O_NOATIME);
+		if (pcap_zio_probe(fd) != PCAP_ZIO_NONE)
+			ctx->pcap = PCAP_OPS_ZIO;
 	}
 
 	if (__pcap_io->init_once_pcap)
@@ -302,6 +448,7 @@ static void pcap_to_xmit(struct ctx *ctx)
 						 pcap_get_length(&phdr, ctx->magic)));
 
 			pcap_pkthdr_to_tpacket_hdr(&phdr, ctx->magic, &hdr->tp_h, NULL);
+			dns_clock(ctx, hdr->tp_h.tp_sec, hdr->tp_h.tp_nsec);
 
 			ctx->tx_bytes += hdr->tp_h.tp_len;;
 			ctx->tx_packets++;
@@ -460,6 +607,8 @@ static void receive_to_xmit(struct ctx *ctx)
 			show_frame_hdr(in, hdr_in->tp_h.tp_snaplen,
 				       ctx->link_type, hdr_in, ctx->print_mode);
 
+			dns_clock(ctx, hdr_in->tp_h.tp_sec, hdr_in->tp_h.tp_nsec);
+
 			dissector_entry_point(in, hdr_in->tp_h.tp_snaplen,
                           ctx->link_type, ctx->print_mode,
                           hdr_in->s_ll.sll_pkttype, &ctx->dns_ctxt);
@@ -541,6 +690,70 @@ static void translate_pcap_to_txf(int fdo, uint8_t *out, size_t len)
 	write_or_die(fdo, bout, strlen(bout));
 }
 
+static void dns_window_summary(struct ctx *ctx)
+{
+    const struct dnswin_closed *last;
+    char ip[INET_ADDRSTRLEN];
+    int level;
+    size_t i;
+
+    if (!ctx->dns_ctxt.win)
+        return;
+
+    for (level = 0; level < DNSWIN_LEVELS; level++) {
+        last = dnswin_get(ctx->dns_ctxt.win, level, 0);
+        if (!last)
+            continue;
+
+        printf("\nLast Full %lus Window\n",
+               (unsigned long)(dnswin_len[level] / 1000000000ULL));
+        dns_interval_summary(&last->start, &last->end);
+        printf("unique sources %lu, /24s %lu, qnames %lu (estimated)\n",
+               last->uniq_source, last->uniq_source24, last->uniq_qname);
+        for (i = 0; i < last->n_source && i < 3; i++) {
+            inet_ntop(AF_INET, &last->source[i].key, ip, sizeof(ip));
+            printf("%16s %lu\n", ip, last->source[i].count);
+        }
+        for (i = 0; i < last->n_query && i < 3; i++)
+            printf("%20s %lu\n", intern_str(&dnsctxt_names, last->query[i].key), last->query[i].count);
+        for (i = 0; i < last->n_nxdomain && i < 3; i++)
+            printf("%20s %lu (NXDOMAIN)\n", intern_str(&dnsctxt_names, last->nxdomain[i].key),
+                   last->nxdomain[i].count);
+    }
+}
+
+// point queries for the keys given with --lookup, comma separated
+static void dns_lookup_summary(struct ctx *ctx)
+{
+    struct dnsctxt_freq freq[DNS_TABLE_NR];
+    char *key, *save = NULL;
+    int t;
+
+    if (!ctx->lookup)
+        return;
+
+    printf("\nLookups:\n");
+    for (key = strtok_r(ctx->lookup, ",", &save); key; key = strtok_r(NULL, ",", &save)) {
+        if (!dnsctxt_lookup(&ctx->dns_ctxt, key, freq)) {
+            printf("%s: not a valid key\n", key);
+            continue;
+        }
+        printf("%s\n", key);
+        for (t = 0; t < DNS_TABLE_NR; t++) {
+            if (!freq[t].queried)
+                continue;
+            printf("  %-26s", dnsctxt_table_name[t]);
+            if (freq[t].in_table)
+                printf(" %12lu", freq[t].table);
+            else
+                printf(" %12s", "-");
+            if (freq[t].have_sketch)
+                printf("   <= %lu (+-%lu)", freq[t].sketch, freq[t].sketch_error);
+            printf("\n");
+        }
+    }
+}
+
 static void dns_summary(struct ctx *ctx)
 {
 
@@ -573,43 +786,90 @@ static void dns_summary(struct ctx *ctx)
            ctx->dns_ctxt.cnt_status_refused,
            ((double)ctx->dns_ctxt.cnt_status_refused / outgoing)*100);
 
+    if (ctx->dns_ctxt.shed.nr_change)
+        printf("\r%12lu  packets not sampled under load, counts above are estimates (last tier: %s)\n\n",
+               ctx->dns_ctxt.shed.sampled_out, dnsctxt_tier_name[ctx->dns_ctxt.shed.tier]);
+
     dnsctxt_table_summary(&ctx->dns_ctxt, 3);
 
+    dns_window_summary(ctx);
+
+    dns_lookup_summary(ctx);
+
+    if (ctx->verbose)
+        slab_print_stats();
+
 }
 
 static void read_pcap(struct ctx *ctx)
 {
-	uint8_t *out;
+	uint8_t *out, *pkt;
 	int ret, fd, fdo = 0;
+	uint32_t link_type;
 	unsigned long trunced = 0;
 	size_t out_len;
 	pcap_pkthdr_t phdr;
 	struct sock_fprog bpf_ops;
 	struct frame_map fm;
 	struct timeval start, end, diff;
+	uint64_t zio_file, zio_pcap;
+	double secs, capture;
+	struct pcap_merge *merge = NULL;
+	uint64_t ts;
+	off_t off;
 
 	bug_on(!__pcap_io);
 
-	if (!strncmp("-", ctx->device_in, strlen("-"))) {
+	if (pcap_merge_wanted(ctx->device_in)) {
+		fd = -1;
+		merge = pcap_merge_open(ctx->device_in, &ctx->magic,
+					&ctx->link_type);
+		if (ctx->verbose)
+			printf("Merging %zu pcap files by timestamp\n",
+			       pcap_merge_inputs(merge));
+	} else if (!strncmp("-", ctx->device_in, strlen("-"))) {
 		fd = dup_or_die(fileno(stdin));
 		close(fileno(stdin));
-		if (ctx->pcap == PCAP_OPS_MM)
-			ctx->pcap = PCAP_OPS_SG;
+		/* stdin may carry a compressed stream, sniffed on open */
+		ctx->pcap = PCAP_OPS_ZIO;
 	} else {
 		fd = open_or_die(ctx->device_in, O_RDONLY | O_LARGEFILE | O_NOATIME);
+		if (pcap_zio_probe(fd) != PCAP_ZIO_NONE)
+			ctx->pcap = PCAP_OPS_ZIO;
 	}
 
 	if (__pcap_io->init_once_pcap)
 		__pcap_io->init_once_pcap();
 
-	ret = __pcap_io->pull_fhdr_pcap(fd, &ctx->magic, &ctx->link_type);
-	if (ret)
-		panic("Error reading pcap header!\n");
-
-	if (__pcap_io->prepare_access_pcap) {
-		ret = __pcap_io->prepare_access_pcap(fd, PCAP_MODE_RD, ctx->jumbo);
+	if (!merge) {
+		ret = __pcap_io->pull_fhdr_pcap(fd, &ctx->magic, &ctx->link_type);
 		if (ret)
-			panic("Error prepare reading pcap!\n");
+			panic("Error reading pcap header!\n");
+
+		/* Skip ahead with the sidecar index, the time filter below
+		 * takes care of the rest
+		 */
+		if (ctx->ts_from && ctx->pcap != PCAP_OPS_ZIO &&
+		    ctx->magic != PCAPNG_MAGIC) {
+			off = pcap_index_seek(ctx->device_in, ctx->ts_from);
+			if (off > 0) {
+				if (lseek(fd, off, SEEK_SET) != off)
+					panic("Cannot lseek pcap file!\n");
+				if (ctx->verbose)
+					printf("Index: starting at offset %llu\n",
+					       (unsigned long long) off);
+			} else if (ctx->verbose) {
+				printf("No index for %s, scanning from the start\n",
+				       ctx->device_in);
+			}
+		}
+
+		if (__pcap_io->prepare_access_pcap) {
+			ret = __pcap_io->prepare_access_pcap(fd, PCAP_MODE_RD,
+							     ctx->jumbo);
+			if (ret)
+				panic("Error prepare reading pcap!\n");
+		}
 	}
 
 	fmemset(&fm, 0, sizeof(fm));
@@ -636,7 +896,8 @@ static void read_pcap(struct ctx *ctx)
 	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
 
     if (!ctx->ui) {
-        printf("Running! Local network: %s/%d. Hang up with ^C!\n\n", ctx->local_net, ctx->local_prefix);
+        printf("Running! Local networks: %zu IPv4, %zu IPv6 ranges. Hang up with ^C!\n\n",
+               ctx->dns_ctxt.local.nr_v4, ctx->dns_ctxt.local.nr_v6);
         fflush(stdout);
     }
     else {
@@ -647,8 +908,17 @@ static void read_pcap(struct ctx *ctx)
 
 	while (likely(sigint == 0)) {
 		do {
-			ret = __pcap_io->read_pcap(fd, &phdr, ctx->magic,
-						   out, out_len);
+			if (merge) {
+				ret = pcap_merge_next(merge, &phdr, &ctx->magic,
+						      &link_type, &pkt);
+			} else if (__pcap_io->read_pcap_zc) {
+				ret = __pcap_io->read_pcap_zc(fd, &phdr, ctx->magic,
+							      &pkt);
+			} else {
+				ret = __pcap_io->read_pcap(fd, &phdr, ctx->magic,
+							   out, out_len);
+				pkt = out;
+			}
 			if (unlikely(ret < 0))
 				goto out;
 
@@ -662,26 +932,41 @@ static void read_pcap(struct ctx *ctx)
 				trunced++;
 			}
 		} while (ctx->filter &&
-			 !bpf_run_filter(&bpf_ops, out,
+			 !bpf_run_filter(&bpf_ops, pkt,
 					 pcap_get_length(&phdr, ctx->magic)));
 
 		pcap_pkthdr_to_tpacket_hdr(&phdr, ctx->magic, &fm.tp_h, &fm.s_ll);
 
+		if (unlikely(ctx->ts_from || ctx->ts_to)) {
+			ts = (uint64_t) fm.tp_h.tp_sec * 1000000000ULL +
+			     fm.tp_h.tp_nsec;
+			if (ts < ctx->ts_from)
+				continue;
+			if (ctx->ts_to && ts > ctx->ts_to)
+				break;
+		}
+
+		if (!merge)
+			link_type = pcap_get_linktype(&phdr, ctx->magic,
+						      ctx->link_type);
+
 		ctx->tx_bytes += fm.tp_h.tp_len;
 		ctx->tx_packets++;
 
-		show_frame_hdr(out, fm.tp_h.tp_snaplen, ctx->link_type, &fm,
+		show_frame_hdr(pkt, fm.tp_h.tp_snaplen, link_type, &fm,
 			       ctx->print_mode);
 
-		dissector_entry_point(out, fm.tp_h.tp_snaplen,
-                      ctx->link_type, ctx->print_mode,
+		dns_clock(ctx, fm.tp_h.tp_sec, fm.tp_h.tp_nsec);
+
+		dissector_entry_point(pkt, fm.tp_h.tp_snaplen,
+                      link_type, ctx->print_mode,
                       fm.s_ll.sll_pkttype, &ctx->dns_ctxt);
 
         if (ctx->ui)
             pktvisor_ui(&ctx->dns_ctxt);
 
 		if (ctx->device_out)
-			translate_pcap_to_txf(fdo, out, fm.tp_h.tp_snaplen);
+			translate_pcap_to_txf(fdo, pkt, fm.tp_h.tp_snaplen);
 
 		if (frame_count_max != 0) {
 			if (ctx->tx_packets >= frame_count_max) {
@@ -694,23 +979,41 @@ static void read_pcap(struct ctx *ctx)
 out:
 	bug_on(gettimeofday(&end, NULL));
 	timersub(&end, &start, &diff);
+	secs = diff.tv_sec + diff.tv_usec / 1e6;
 
 	bpf_release(&bpf_ops);
 
 	dissector_cleanup_all();
 
-	if (__pcap_io->prepare_close_pcap)
+	if (merge)
+		pcap_merge_close(merge);
+	else if (__pcap_io->prepare_close_pcap)
 		__pcap_io->prepare_close_pcap(fd, PCAP_MODE_RD);
 
 	xfree(out);
 
     if (!ctx->ui) {
+        dns_interval_flush(ctx);
         fflush(stdout);
         printf("\n");
         printf("\r%12lu packets seen\n", ctx->tx_packets);
         printf("\r%12lu packets truncated in file\n", trunced);
         printf("\r%12lu bytes seen\n", ctx->tx_bytes);
         printf("\r%12lu sec, %lu usec in total\n", diff.tv_sec, diff.tv_usec);
+        printf("\r%12.2f MiB/s packet data (%s)\n",
+               secs > 0 ? ctx->tx_bytes / secs / (1 << 20) : 0.0,
+               merge ? "merge" : pcap_ops_group_to_str[ctx->pcap]);
+        if (ctx->pcap == PCAP_OPS_ZIO && !merge) {
+            pcap_zio_stats(&zio_file, &zio_pcap);
+            printf("\r%12.2f MiB/s stream input, %.2f MiB/s decompressed\n",
+                   secs > 0 ? zio_file / secs / (1 << 20) : 0.0,
+                   secs > 0 ? zio_pcap / secs / (1 << 20) : 0.0);
+        }
+        if (ctx->dns_ctxt.first_ts) {
+            capture = (ctx->dns_ctxt.now - ctx->dns_ctxt.first_ts) / 1e9;
+            printf("\r%12.2f sec of capture time (%.1fx real time)\n",
+                   capture, secs > 0 ? capture / secs : 0.0);
+        }
 
         dns_summary(ctx);
     }
@@ -720,7 +1023,8 @@ out:
 
 	if (!strncmp("-", ctx->device_in, strlen("-")))
 		dup2(fd, fileno(stdin));
-	close(fd);
+	if (fd >= 0)
+		close(fd);
 
 	if (ctx->device_out) {
 		if (!strncmp("-", ctx->device_out, strlen("-")))
@@ -729,6 +1033,35 @@ out:
 	}
 }
 
+static void dump_index_begin(struct ctx *ctx, const char *fname)
+{
+	if (!ctx->index)
+		return;
+
+	ctx->dump_idx = pcap_index_create(fname);
+	ctx->dump_off = sizeof(struct pcap_filehdr);
+}
+
+static void dump_index_end(struct ctx *ctx)
+{
+	if (!ctx->dump_idx)
+		return;
+
+	pcap_index_close(ctx->dump_idx);
+	ctx->dump_idx = NULL;
+}
+
+static inline void dump_index_add(struct ctx *ctx, uint32_t sec, uint32_t nsec,
+				  int len)
+{
+	if (!ctx->dump_idx)
+		return;
+
+	pcap_index_add(ctx->dump_idx, (uint64_t) sec * 1000000000ULL + nsec,
+		       ctx->dump_off);
+	ctx->dump_off += len;
+}
+
 static void finish_multi_pcap_file(struct ctx *ctx, int fd)
 {
 	__pcap_io->fsync_pcap(fd);
@@ -737,6 +1070,7 @@ static void finish_multi_pcap_file(struct ctx *ctx, int fd)
 		__pcap_io->prepare_close_pcap(fd, PCAP_MODE_WR);
 
 	close(fd);
+	dump_index_end(ctx);
 
 	fmemset(&itimer, 0, sizeof(itimer));
 	setitimer(ITIMER_REAL, &itimer, NULL);
@@ -753,9 +1087,11 @@ static int next_multi_pcap_file(struct ctx *ctx, int fd)
 		__pcap_io->prepare_close_pcap(fd, PCAP_MODE_WR);
 
 	close(fd);
+	dump_index_end(ctx);
 
-	slprintf(fname, sizeof(fname), "%s/%s%lu.pcap", ctx->device_out,
-		 ctx->prefix ? : "dump-", time(NULL));
+	slprintf(fname, sizeof(fname), "%s/%s%lu.pcap%s", ctx->device_out,
+		 ctx->prefix ? : "dump-", time(NULL),
+		 pcap_zio_codec_to_ext[ctx->compress]);
 
 	fd = open_or_die_m(fname, O_RDWR | O_CREAT | O_TRUNC |
 			   O_LARGEFILE, DEFFILEMODE);
@@ -770,6 +1106,8 @@ static int next_multi_pcap_file(struct ctx *ctx, int fd)
 			panic("Error prepare writing pcap!\n");
 	}
 
+	dump_index_begin(ctx, fname);
+
 	return fd;
 }
 
@@ -783,8 +1121,9 @@ static int begin_multi_pcap_file(struct ctx *ctx)
 	if (ctx->device_out[strlen(ctx->device_out) - 1] == '/')
 		ctx->device_out[strlen(ctx->device_out) - 1] = 0;
 
-	slprintf(fname, sizeof(fname), "%s/%s%lu.pcap", ctx->device_out,
-		 ctx->prefix ? : "dump-", time(NULL));
+	slprintf(fname, sizeof(fname), "%s/%s%lu.pcap%s", ctx->device_out,
+		 ctx->prefix ? : "dump-", time(NULL),
+		 pcap_zio_codec_to_ext[ctx->compress]);
 
 	fd = open_or_die_m(fname, O_RDWR | O_CREAT | O_TRUNC |
 			   O_LARGEFILE, DEFFILEMODE);
@@ -799,7 +1138,9 @@ static int begin_multi_pcap_file(struct ctx *ctx)
 			panic("Error prepare writing pcap!\n");
 	}
 
-	if (ctx->dump_mode == DUMP_INTERVAL_TIME) {
+	dump_index_begin(ctx, fname);
+
+	if (ctx->dump_mode == DUMP_INTERVAL_TIME && !ctx->event_time) {
 		interval = ctx->dump_interval;
 
 		set_itimer_interval_value(&itimer, interval, 0);
@@ -822,6 +1163,8 @@ static void finish_single_pcap_file(struct ctx *ctx, int fd)
 		close(fd);
 	else
 		dup2(fd, fileno(stdout));
+
+	dump_index_end(ctx);
 }
 
 static int begin_single_pcap_file(struct ctx *ctx)
@@ -851,26 +1194,31 @@ static int begin_single_pcap_file(struct ctx *ctx)
 			panic("Error prepare writing pcap!\n");
 	}
 
+	if (strncmp("-", ctx->device_out, strlen("-")))
+		dump_index_begin(ctx, ctx->device_out);
+
 	return fd;
 }
 
 static void print_pcap_file_stats(int sock, struct ctx *ctx)
 {
 	int ret;
-	struct tpacket_stats kstats;
-	socklen_t slen = sizeof(kstats);
-
-	fmemset(&kstats, 0, sizeof(kstats));
+	uint64_t packets, drops;
+	static uint64_t last_packets, last_drops;
 
-	ret = getsockopt(sock, SOL_PACKET, PACKET_STATISTICS, &kstats, &slen);
+	/* Totals since start, shared with load shedding and the summary */
+	ret = sock_rx_net_read(sock, &packets, &drops);
 	if (unlikely(ret))
 		panic("Cannot get packet statistics!\n");
 
 	if (ctx->print_mode == PRINT_NONE) {
-		printf(".(+%u/-%u)", kstats.tp_packets - kstats.tp_drops,
-		       kstats.tp_drops);
+		printf(".(+%lu/-%lu)",
+		       (packets - last_packets) - (drops - last_drops),
+		       drops - last_drops);
 		fflush(stdout);
 	}
+	last_packets = packets;
+	last_drops = drops;
 }
 
 static void update_pcap_next_dump(struct ctx *ctx, unsigned long snaplen, int *fd, int sock)
@@ -884,6 +1232,15 @@ static void update_pcap_next_dump(struct ctx *ctx, unsigned long snaplen, int *f
 			next_dump = true;
 			interval = 0;
 		}
+	} else if (ctx->event_time) {
+		if (ctx->dump_next == 0) {
+			ctx->dump_next = ctx->dns_ctxt.now +
+					 ctx->dump_interval * 1000000000ULL;
+		} else if (ctx->dns_ctxt.now >= ctx->dump_next) {
+			next_dump = true;
+			ctx->dump_next = ctx->dns_ctxt.now +
+					 ctx->dump_interval * 1000000000ULL;
+		}
 	}
 
 	if (next_dump) {
@@ -896,6 +1253,22 @@ static void update_pcap_next_dump(struct ctx *ctx, unsigned long snaplen, int *f
 }
 
 #ifdef HAVE_TPACKET3
+// how far the capture is behind decides the analysis tier
+static void dns_shed_check(struct ctx *ctx, int sock, struct ring *ring, unsigned int it)
+{
+	struct dnsctxt_shed *s = &ctx->dns_ctxt.shed;
+	unsigned int occupancy;
+	uint64_t packets, drops;
+
+	occupancy = user_rx_blocks_pending(ring, it) * 100 / ring->layout3.tp_block_nr;
+	if (sock_rx_net_read(sock, &packets, &drops))
+		drops = s->drops;
+
+	if (dnsctxt_shed_update(&ctx->dns_ctxt, occupancy, drops) && ctx->verbose && !ctx->ui)
+		printf("Load shedding: %s analysis of 1 in %u packets (ring %u%% full, %lu drops)\n",
+		       dnsctxt_tier_name[s->tier], s->rate, occupancy, drops);
+}
+
 static void walk_t3_block(struct block_desc *pbd, struct ctx *ctx,
 			  int sock, int *fd, unsigned long *frame_count)
 {
@@ -925,11 +1298,18 @@ static void walk_t3_block(struct block_desc *pbd, struct ctx *ctx,
 						    pcap_get_length(&phdr, ctx->magic));
 			if (unlikely(ret != (int) pcap_get_total_length(&phdr, ctx->magic)))
 				panic("Write error to pcap!\n");
+
+			dump_index_add(ctx, hdr->tp_sec, hdr->tp_nsec, ret);
         }
 
 		__show_frame_hdr(packet, hdr->tp_snaplen, ctx->link_type, sll,
 				 hdr, ctx->print_mode, true);
 
+		dns_clock(ctx, hdr->tp_sec, hdr->tp_nsec);
+
+		if (dnsctxt_shed_skip(&ctx->dns_ctxt))
+			goto next;
+
 		dissector_entry_point(packet, hdr->tp_snaplen, ctx->link_type,
                       ctx->print_mode, sll->sll_pkttype, &ctx->dns_ctxt);
 next:
@@ -948,6 +1328,35 @@ next:
 }
 #endif /* HAVE_TPACKET3 */
 
+// keep the capture, its rings and the table slabs on the NIC's node. the
+// rings are allocated by the kernel on our behalf, so the memory policy has
+// to be set before they are
+static void numa_place(struct ctx *ctx)
+{
+	int node = device_numa_node(ctx->device_in), nr_nodes = numa_nr_nodes();
+	cpu_set_t cpus;
+
+	if (node < 0 || nr_nodes < 2)
+		return;
+
+	if (numa_prefer_node(node))
+		fprintf(stderr, "Cannot prefer NUMA node %d: %s\n", node, strerror(errno));
+	slab_numa_node = node;
+
+	if (ctx->bind_cpu < 0) {
+		if (numa_node_cpus(node, &cpus) > 0 &&
+		    sched_setaffinity(0, sizeof(cpus), &cpus))
+			fprintf(stderr, "Cannot bind to the cpus of NUMA node %d: %s\n",
+				node, strerror(errno));
+	} else if (numa_cpu_node(ctx->bind_cpu) != node) {
+		fprintf(stderr, "CPU%d is not on NUMA node %d of %s\n",
+			ctx->bind_cpu, node, ctx->device_in);
+	}
+
+	if (ctx->verbose)
+		printf("NUMA: %s on node %d of %d\n", ctx->device_in, node, nr_nodes);
+}
+
 static void recv_only_or_dump(struct ctx *ctx)
 {
 	short ifflags = 0;
@@ -989,7 +1398,13 @@ static void recv_only_or_dump(struct ctx *ctx)
 			printf("HW timestamping enabled\n");
 	}
 
+	numa_place(ctx);
+
 	ring_rx_setup(&rx_ring, sock, size, ifindex, &rx_poll, is_defined(HAVE_TPACKET3), true, ctx->verbose);
+	if (ctx->verbose)
+		printf("TLB: RX ring mapped in %zu 4K pages\n", rx_ring.mm_len / 4096);
+	if (is_defined(HAVE_TPACKET3) && !ctx->no_shed)
+		dnsctxt_enable_shed(&ctx->dns_ctxt);
 
 	dissector_init_all(ctx->print_mode);
 
@@ -1026,7 +1441,8 @@ static void recv_only_or_dump(struct ctx *ctx)
 	}
 
     if (!ctx->ui) {
-        printf("Running! Local network: %s/%d. Hang up with ^C!\n\n", ctx->local_net, ctx->local_prefix);
+        printf("Running! Local networks: %zu IPv4, %zu IPv6 ranges. Hang up with ^C!\n\n",
+               ctx->dns_ctxt.local.nr_v4, ctx->dns_ctxt.local.nr_v6);
         fflush(stdout);
     }
     else {
@@ -1045,6 +1461,9 @@ static void recv_only_or_dump(struct ctx *ctx)
 			kernel_may_pull_from_rx_block(pbd);
 			it = (it + 1) % rx_ring.layout3.tp_block_nr;
 
+			if (dnsctxt_shed_due(&ctx->dns_ctxt))
+				dns_shed_check(ctx, sock, &rx_ring, it);
+
 			if (unlikely(sigint == 1))
 				break;
 		}
@@ -1073,11 +1492,16 @@ static void recv_only_or_dump(struct ctx *ctx)
 							    pcap_get_length(&phdr, ctx->magic));
 				if (unlikely(ret != (int) pcap_get_total_length(&phdr, ctx->magic)))
 					panic("Write error to pcap!\n");
+
+				dump_index_add(ctx, hdr->tp_h.tp_sec,
+					       hdr->tp_h.tp_nsec, ret);
 			}
 
 			show_frame_hdr(packet, hdr->tp_h.tp_snaplen,
 				       ctx->link_type, hdr, ctx->print_mode);
 
+			dns_clock(ctx, hdr->tp_h.tp_sec, hdr->tp_h.tp_nsec);
+
 			dissector_entry_point(packet, hdr->tp_h.tp_snaplen,
                           ctx->link_type, ctx->print_mode,
                           hdr->s_ll.sll_pkttype, &ctx->dns_ctxt);
@@ -1116,6 +1540,7 @@ next:
 	timersub(&end, &start, &diff);
 
     if (!ctx->ui && !(ctx->dump_dir && ctx->print_mode == PRINT_NONE)) {
+        dns_interval_flush(ctx);
 		sock_rx_net_stats(sock, frame_count);
 
 		printf("\r%12lu  sec, %lu usec in total\n",
@@ -1157,6 +1582,7 @@ static void init_ctx(struct ctx *ctx)
 	ctx->uid = getgid();
 
 	ctx->cpu = -1;
+	ctx->bind_cpu = -1;
 	ctx->packet_type = -1;
 	ctx->local_prefix = -1;
 
@@ -1172,6 +1598,9 @@ static void init_ctx(struct ctx *ctx)
 	ctx->nolock = false;
 	ctx->hwtimestamp = true;
 	ctx->ui = false;
+
+    ctx->nr_prefix4 = lpm_parse_lengths("8,16,24", 8, 32, ctx->prefix4);
+    ctx->nr_prefix6 = lpm_parse_lengths("32,48,64", 32, 64, ctx->prefix6);
 }
 
 static void destroy_ctx(struct ctx *ctx)
@@ -1183,6 +1612,20 @@ static void destroy_ctx(struct ctx *ctx)
     free(ctx->prefix);
 
     free(ctx->local_net);
+    free(ctx->local_file);
+    free(ctx->lookup);
+
+    if (ctx->metrics)
+        metrics_stop(ctx->metrics);
+    free(ctx->metrics_listen);
+
+    if (ctx->shm)
+        statshm_destroy(ctx->shm, ctx->shm_name);
+    free(ctx->shm_name);
+    if (ctx->exp)
+        export_close(ctx->exp);
+    free(ctx->export_dest);
+    free(ctx->state_file);
 
     dnsctxt_free(&ctx->dns_ctxt);
 }
@@ -1192,7 +1635,8 @@ static void __noreturn help(void)
     printf("pktvisor %s", VERSION_STRING);
     puts("Usage: pktvisor [options] [filter-expression]\n"
 	     "Options:\n"
-	     "  -i|-d|--dev|--in <dev|pcap|->  Input source as netdev, pcap or pcap stdin\n"
+	     "  -i|-d|--dev|--in <dev|pcap|->  Input source as netdev, pcap/pcapng or stdin; a\n"
+	     "                                 directory, glob or list a,b,c merges pcaps by time\n"
 	     "  -o|--out <dev|pcap|dir|cfg|->  Output sink as netdev, pcap, directory, trafgen, or stdout\n"
 	     "  -f|--filter <bpf-file|expr>    Use BPF filter file from bpfc or tcpdump-like expression\n"
 	     "  -t|--type <type>               Filter for: host|broadcast|multicast|others|outgoing\n"
@@ -1225,10 +1669,45 @@ static void __noreturn help(void)
 	     "  -l|--ascii                     Print human-readable packet data\n"
 	     "  -V|--verbose                   Be more verbose\n"
          "  -Y|--ui                        Use curses UI interface\n"
-         "  -L|--local-net                 Set local network address\n"
+         "  -L|--local-net                 Set local network address, or a list of IPv4/IPv6\n"
+         "                                 prefixes like 192.0.2.0/24,2001:db8::/32\n"
          "  -W|--local-net-prefix          Set local network prefix length (default 32)\n"
+         "  --local-file <file>            Read more local prefixes from <file>, one or more per line\n"
          "  -C|--geoip-city                Location of GeoIP City database\n"
          "  -a|--geoip-asn                 Location of GeoIP ASN database\n"
+         "  --geo-flat                     Flatten the GeoIP databases into IPv4 range tables at\n"
+         "                                 startup for faster lookups, rebuilt on SIGHUP\n"
+         "  --geo-defer                    Count sources per /24 and resolve each /24 to geo once\n"
+         "                                 per interval instead of every packet\n"
+         "  --hugepages[=2M|1G]            Allocate table entries from hugepage backed slabs\n"
+         "  --shm[=name]                   Publish stats every second to shared memory segment\n"
+         "                                 <name> (default " STATSHM_NAME_DEFAULT ") for pktvisor-stats\n"
+         "  --metrics[=[host:]port|/path]  Serve OpenMetrics for Prometheus on /metrics\n"
+         "                                 (default " METRICS_LISTEN_DEFAULT "), with --count-min\n"
+         "                                 sketch point queries on /lookup?key=<key>\n"
+         "  --export <file|unix:path|udp:host:port>\n"
+         "                                 Send a compact binary record of the stats every\n"
+         "                                 --stats-interval (default 10 s) for central collection\n"
+         "  --state <file>                 Restore the tables from <file> at start, save them to it\n"
+         "                                 every minute and at exit for warm restarts\n"
+         "  --no-shed                      Keep parsing every packet when the RX ring backs up,\n"
+         "                                 instead of counting headers only or sampling 1 in N\n"
+         "  -z|--compress <gzip|zstd>      Compress pcaps written with -o (.gz/.zst input is detected)\n"
+         "  --from <time>                  Skip packets before time, seeks via <pcap>.idx if present\n"
+         "  --to <time>                    Stop at the first packet after time\n"
+         "                                 (epoch seconds or YYYY-MM-DDTHH:MM:SS, UTC)\n"
+         "  --index                        Write a <pcap>.idx time index next to dumped pcaps\n"
+         "  --build-index                  Write <pcap>.idx for the pcap given with -i and quit\n"
+         "  --event-time                   Packet timestamps drive rates and -F rotation (def. for pcaps)\n"
+         "  --stats-interval <sec>         Print DNS counters and rates every <sec> of packet time\n"
+         "  --windows <num>                Keep the last <num> 1s/10s/60s windows with top tables\n"
+         "  --decay <sec>                  Rank tables by rates decayed with time constant <sec>\n"
+         "  --count-min[=<bits>]           Keep 2^<bits> wide Count-Min sketches (def. 14) so evicted\n"
+         "                                 keys can still be looked up\n"
+         "  --lookup <key>[,<key>...]      Print the counts of these ips, ports or names at the end\n"
+         "  --prefix4 <len>[,<len>...]     IPv4 prefix lengths to roll up, 8..32 (def. 8,16,24, none = off)\n"
+         "  --prefix6 <len>[,<len>...]     IPv6 prefix lengths to roll up, 32..64 (def. 32,48,64, none = off)\n"
+         "  --name-depth <n>               Count query names by up to <n> labels, 2..16 (def. 5)\n"
          "  -v|--version                   Show version and exit\n"
 	     "  -h|--help                      Guess what?!\n\n"
 	     "Examples:\n"
@@ -1238,7 +1717,8 @@ static void __noreturn help(void)
          "  pktvisor --in eth0 --out eth1 --silent --bind-cpu 0 -J --type host\n"
          "  pktvisor --in eth1 --out /opt/probe/ -s -m --interval 100MiB -b 0\n"
          "  pktvisor --in vlan0 --out dump.pcap -c -u `id -u bob` -g `id -g bob`\n"
-         "  pktvisor --in any --filter http.bpf --jumbo-support --ascii -V\n\n"
+         "  pktvisor --in any --filter http.bpf --jumbo-support --ascii -V\n"
+         "  pktvisor --in dump.pcap --from 2015-06-01T12:00:00 --to 2015-06-01T12:05:00\n\n"
          "Note:\n"
 	     "  For introducing bit errors, delays with random variation and more\n"
 	     "  while replaying pcaps, make use of tc(8) with its disciplines (e.g. netem).\n");
@@ -1253,14 +1733,49 @@ static void __noreturn version(void)
 	die();
 }
 
+static uint64_t parse_time_ns(const char *str)
+{
+	struct tm tm;
+	char *end;
+	double secs;
+
+	fmemset(&tm, 0, sizeof(tm));
+	end = strptime(str, "%Y-%m-%dT%H:%M:%S", &tm);
+	if (!end)
+		end = strptime(str, "%Y-%m-%d %H:%M:%S", &tm);
+	if (end && *end == 0)
+		return (uint64_t) timegm(&tm) * 1000000000ULL;
+
+	secs = strtod(str, &end);
+	if (end == str || *end != 0 || secs < 0)
+		panic("Invalid time: %s\n", str);
+
+	return (uint64_t) (secs * 1e9);
+}
+
+static unsigned long parse_ulong(const char *str, unsigned long min,
+				 unsigned long max, const char *what)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(str, &end, 0);
+	if (end == str || *end != 0 || errno || *str == '-' ||
+	    val < min || val > max)
+		panic("Invalid %s: %s, must be %lu..%lu\n", what, str, min, max);
+
+	return val;
+}
+
 int main(int argc, char **argv)
 {
 	char *ptr;
 	int c, i, j, cpu_tmp, opt_index, ops_touched = 0, vals[4] = {0};
-	bool prio_high = false, setsockmem = true;
+	bool prio_high = false, setsockmem = true, build_index = false;
 	void (*main_loop)(struct ctx *ctx) = NULL;
     struct ctx ctx;
-    struct in_addr ln;
+    int ret;
 
     init_ctx(&ctx);
 	srand(time(NULL));
@@ -1366,6 +1881,7 @@ int main(int argc, char **argv)
 			cpu_tmp = strtol(optarg, NULL, 0);
 
 			cpu_affinity(cpu_tmp);
+			ctx.bind_cpu = cpu_tmp;
 			if (ctx.cpu != -2)
 				ctx.cpu = cpu_tmp;
 			break;
@@ -1399,6 +1915,98 @@ int main(int argc, char **argv)
         case 'Y':
             ctx.ui = true;
             break;
+        case 'z':
+            if (!strncmp(optarg, "gz", strlen("gz")))
+                ctx.compress = PCAP_ZIO_GZIP;
+            else if (!strncmp(optarg, "zst", strlen("zst")))
+                ctx.compress = PCAP_ZIO_ZSTD;
+            else
+                panic("Unknown compression: %s (gzip or zstd)\n", optarg);
+            pcap_zio_set_codec(ctx.compress);
+            ctx.pcap = PCAP_OPS_ZIO;
+            ops_touched = 1;
+            break;
+        case OPT_FROM:
+            ctx.ts_from = parse_time_ns(optarg);
+            break;
+        case OPT_TO:
+            ctx.ts_to = parse_time_ns(optarg);
+            break;
+        case OPT_INDEX:
+            ctx.index = true;
+            break;
+        case OPT_BUILD_INDEX:
+            build_index = true;
+            break;
+        case OPT_EVENT_TIME:
+            ctx.event_time = true;
+            break;
+        case OPT_STATS_INTERVAL:
+            ctx.stats_interval = parse_ulong(optarg, 1, 86400, "stats interval");
+            break;
+        case OPT_WINDOWS:
+            ctx.windows = parse_ulong(optarg, 1, DNSWIN_RING_MAX, "number of windows");
+            break;
+        case OPT_DECAY:
+            ctx.decay = strtod(optarg, NULL);
+            if (ctx.decay < 0.001)
+                panic("Decay time constant too small: %s\n", optarg);
+            break;
+        case OPT_COUNT_MIN:
+            ctx.cms_bits = optarg ? strtoul(optarg, NULL, 0) : CMS_BITS_DEFAULT;
+            if (ctx.cms_bits < 4 || ctx.cms_bits > 24)
+                panic("Count-Min width must be 4..24 bits: %s\n", optarg);
+            break;
+        case OPT_LOOKUP:
+            ctx.lookup = xstrdup(optarg);
+            break;
+        case OPT_LOCAL_FILE:
+            ctx.local_file = xstrdup(optarg);
+            break;
+        case OPT_GEO_FLAT:
+            ctx.geo_flat = true;
+            break;
+        case OPT_GEO_DEFER:
+            ctx.geo_defer = true;
+            break;
+        case OPT_SHM:
+            ctx.shm_name = xstrdup(optarg ? optarg : STATSHM_NAME_DEFAULT);
+            break;
+        case OPT_EXPORT:
+            ctx.export_dest = xstrdup(optarg);
+            break;
+        case OPT_STATE:
+            ctx.state_file = xstrdup(optarg);
+            break;
+        case OPT_NO_SHED:
+            ctx.no_shed = true;
+            break;
+        case OPT_METRICS:
+            ctx.metrics_listen = xstrdup(optarg ? optarg : METRICS_LISTEN_DEFAULT);
+            break;
+        case OPT_HUGEPAGES:
+            if (!optarg || !strcasecmp(optarg, "2M"))
+                slab_hugepages = SLAB_HUGE_2M;
+            else if (!strcasecmp(optarg, "1G"))
+                slab_hugepages = SLAB_HUGE_1G;
+            else
+                panic("Hugepage size must be 2M or 1G: %s\n", optarg);
+            break;
+        case OPT_NAME_DEPTH:
+            ctx.name_depth = strtoul(optarg, NULL, 0);
+            if (ctx.name_depth < 2 || ctx.name_depth > NTREE_MAX_DEPTH)
+                panic("Name depth must be 2..%d labels: %s\n", NTREE_MAX_DEPTH, optarg);
+            break;
+        case OPT_PREFIX4:
+            ctx.nr_prefix4 = lpm_parse_lengths(optarg, 8, 32, ctx.prefix4);
+            if (ctx.nr_prefix4 < 0)
+                panic("Bad IPv4 prefix lengths, need ascending multiples of 4: %s\n", optarg);
+            break;
+        case OPT_PREFIX6:
+            ctx.nr_prefix6 = lpm_parse_lengths(optarg, 32, 64, ctx.prefix6);
+            if (ctx.nr_prefix6 < 0)
+                panic("Bad IPv6 prefix lengths, need ascending multiples of 4: %s\n", optarg);
+            break;
 		case 'X':
 			ctx.print_mode =
 				(ctx.print_mode == PRINT_ASCII) ?
@@ -1515,31 +2123,86 @@ int main(int argc, char **argv)
 	if (!ctx.device_in)
 		ctx.device_in = xstrdup("any");
 
-    if (!ctx.local_net) {
-        if (getenv("PKTVISOR_LOCAL_NET"))
-            ctx.local_net = xstrdup(getenv("PKTVISOR_LOCAL_NET"));
-        else {
-            ctx.local_net = xstrdup("0.0.0.0");
-            if (ctx.local_prefix == -1)
-                ctx.local_prefix = 0;
+	if (build_index) {
+		pcap_index_build(ctx.device_in, true);
+		return 0;
+	}
+
+	if (ctx.ts_to && ctx.ts_to < ctx.ts_from)
+		panic("--to lies before --from!\n");
+
+	if (ctx.index && ctx.compress != PCAP_ZIO_NONE) {
+		fprintf(stderr, "No time index for compressed pcaps, ignoring --index\n");
+		ctx.index = false;
+	}
+
+    if (!ctx.local_net && getenv("PKTVISOR_LOCAL_NET"))
+        ctx.local_net = xstrdup(getenv("PKTVISOR_LOCAL_NET"));
+    if (ctx.local_prefix == -1 && getenv("PKTVISOR_LOCAL_PREFIX"))
+        ctx.local_prefix = strtoul(getenv("PKTVISOR_LOCAL_PREFIX"), NULL, 0);
+
+    dnsctxt_init(&ctx.dns_ctxt);
+    if (ctx.shm_name) {
+        ctx.shm = statshm_create(ctx.shm_name, 1000000000ULL);
+        dnsctxt_enable_shm(&ctx.dns_ctxt, ctx.shm);
+    }
+    // the exporter reads the same snapshots, from a private segment
+    // unless --shm is given too
+    if (ctx.metrics_listen) {
+        if (!ctx.shm) {
+            ctx.shm = statshm_create(NULL, 1000000000ULL);
+            dnsctxt_enable_shm(&ctx.dns_ctxt, ctx.shm);
         }
     }
-    if (ctx.local_prefix == -1) {
-        if (getenv("PKTVISOR_LOCAL_PREFIX"))
-            ctx.local_prefix = strtoul(getenv("PKTVISOR_LOCAL_PREFIX"), NULL, 0);
-        else
-            ctx.local_prefix = 32;
+    if (ctx.export_dest) {
+        ctx.exp = export_open(ctx.export_dest, NULL);
+        dnsctxt_enable_export(&ctx.dns_ctxt, ctx.exp, ctx.stats_interval ?
+                              ctx.stats_interval * 1000000000ULL : EXPORT_PERIOD_DEFAULT);
     }
-
-    if (inet_aton(ctx.local_net, &ln) == 0) {
-        panic("Invalid local_net");
+    if (ctx.state_file)
+        dnsctxt_enable_state(&ctx.dns_ctxt, ctx.state_file, STATE_PERIOD_DEFAULT);
+    if (ctx.name_depth)
+        dnsctxt_set_name_tree(&ctx.dns_ctxt, ctx.name_depth, NTREE_MAX_NODES_DEFAULT);
+
+    // no local networks means the packet type decides, as does a single
+    // address with prefix length 0
+    if (ctx.local_net && !strpbrk(ctx.local_net, "/, ")) {
+        if (ctx.local_prefix == -1)
+            ctx.local_prefix = strchr(ctx.local_net, ':') ? 128 : 32;
+        if (ctx.local_prefix) {
+            char cidr[INET6_ADDRSTRLEN + 4];
+            snprintf(cidr, sizeof(cidr), "%s/%d", ctx.local_net, ctx.local_prefix);
+            if (netset_add(&ctx.dns_ctxt.local, cidr))
+                panic("Invalid local_net: %s\n", cidr);
+        }
     }
-
-    dnsctxt_init(&ctx.dns_ctxt, ln.s_addr, ctx.local_prefix);
+    else if (ctx.local_net && netset_add_list(&ctx.dns_ctxt.local, ctx.local_net)) {
+        panic("Invalid local_net: %s\n", ctx.local_net);
+    }
+    if (ctx.local_file) {
+        ret = netset_load(&ctx.dns_ctxt.local, ctx.local_file);
+        if (ret < 0)
+            panic("Cannot read local networks from %s: %s\n", ctx.local_file, strerror(errno));
+        if (ret > 0)
+            panic("Invalid local network in %s, line %d\n", ctx.local_file, ret);
+    }
+    netset_compile(&ctx.dns_ctxt.local);
     if (ctx.geoip_asn)
         ctx.dns_ctxt.have_geo_asn = 1;
     if (ctx.geoip_loc)
         ctx.dns_ctxt.have_geo_loc = 1;
+    if (ctx.geo_defer && (ctx.geoip_loc || ctx.geoip_asn))
+        dnsctxt_enable_geo_defer(&ctx.dns_ctxt);
+    if (ctx.windows)
+        ctx.dns_ctxt.win = dnswin_new(ctx.windows);
+    if (ctx.decay)
+        dnsctxt_set_decay(&ctx.dns_ctxt, ctx.decay * 1e9);
+    if (ctx.cms_bits)
+        dnsctxt_enable_cms(&ctx.dns_ctxt, ctx.cms_bits);
+    // started once the sketches it answers lookups from exist
+    if (ctx.metrics_listen)
+        ctx.metrics = metrics_start(ctx.metrics_listen, ctx.shm, dnsctxt_enable_sketches(&ctx.dns_ctxt));
+    dnsctxt_set_prefixes(&ctx.dns_ctxt, ctx.prefix4, ctx.nr_prefix4, ctx.prefix6, ctx.nr_prefix6);
 
 	register_signal(SIGINT, signal_handler);
 	register_signal(SIGQUIT, signal_handler);
@@ -1569,6 +2232,8 @@ int main(int argc, char **argv)
 				ctx.pcap = PCAP_OPS_SG;
 		}
 	} else {
+		/* Wall clock rates are meaningless for pcaps */
+		ctx.event_time = true;
 		if (ctx.device_out && device_mtu(ctx.device_out)) {
 			register_signal_f(SIGALRM, timer_elapsed, SA_SIGINFO);
 			main_loop = pcap_to_xmit;
@@ -1583,7 +2248,18 @@ int main(int argc, char **argv)
 
 	bug_on(!main_loop);
 
+	ctx.dns_ctxt.event_time = ctx.event_time;
+	dnsctxt_set_interval(&ctx.dns_ctxt, ctx.stats_interval * 1000000000ULL);
+
     init_geoip(ctx.geoip_loc, ctx.geoip_asn);
+    if (ctx.geo_flat && (ctx.geoip_loc || ctx.geoip_asn)) {
+        size_t nr_loc, nr_asn;
+
+        if (geoip_flatten(&nr_loc, &nr_asn))
+            panic("Cannot flatten the GeoIP databases\n");
+        if (ctx.verbose)
+            printf("GeoIP flattened: %zu location and %zu ASN ranges\n", nr_loc, nr_asn);
+    }
 	if (setsockmem)
 		set_system_socket_memory(vals, array_size(vals));
 	if (!ctx.enforce && !ctx.nolock)
@@ -1592,6 +2268,13 @@ int main(int argc, char **argv)
 	if (ctx.verbose)
 		printf("pcap file I/O method: %s\n", pcap_ops_group_to_str[ctx.pcap]);
 
+    // into tables configured as above, a first run has no file yet
+    if (ctx.state_file && state_load(&ctx.dns_ctxt, ctx.state_file) && errno != ENOENT)
+        fprintf(stderr, "Cannot restore state from %s: %s\n", ctx.state_file,
+                errno == EINVAL ? "not a pktvisor state file of this version" : strerror(errno));
+    else if (ctx.state_file && ctx.verbose && ctx.dns_ctxt.seen)
+        printf("State restored from %s: %lu packets seen\n", ctx.state_file, ctx.dns_ctxt.seen);
+
     if (ctx.ui)
         pktvisor_ui_init(1);
 
@@ -1600,6 +2283,18 @@ int main(int argc, char **argv)
     if (ctx.ui)
         pktvisor_ui_shutdown();
 
+    // last figures for readers still attached, while geo still resolves
+    if (ctx.shm)
+        dnsctxt_publish(&ctx.dns_ctxt);
+    if (ctx.exp) {
+        dnsctxt_export(&ctx.dns_ctxt);
+        if (ctx.verbose)
+            printf("Export: %lu records, %lu bytes sent, %lu dropped\n",
+                   ctx.exp->nr_sent, ctx.exp->bytes_sent, ctx.exp->nr_dropped);
+    }
+    if (ctx.state_file)
+        dnsctxt_save_state(&ctx.dns_ctxt);
+
 	if (!ctx.enforce && !ctx.nolock)
 		xunlockme();
 	if (setsockmem)
@@ -7,9 +7,13 @@
 #include <curses.h>
 #include <stdio.h>
 #include <signal.h>
+#include <string.h>
+#include <ctype.h>
 #include <arpa/inet.h>
 
 #include "pktvisorui.h"
+#include "dnswindow.h"
+#include "xmalloc.h"
 
 #define START_COL 0
 #define START_ROW 5
@@ -32,13 +36,34 @@ enum redraw_target {
     GEO_ASN_TABLE,
     SUMMARY_TABLE,
     QTYPE_TABLE,
+    WINDOW_TABLE,
+    ZONE_TABLE,
+    PREFIX_TABLE,
+    NAME_TREE,
+    LOOKUP,
     HELP
 };
 int cur_target = SUMMARY_TABLE;
+// rank tables by decayed rate instead of lifetime count, with --decay
+bool sort_by_rate = false;
+// key entered at the lookup prompt
+char lookup_key[MAX_DNAME_LEN];
+// name whose children the name tree view shows, "" for the TLDs
+char drill_name[MAX_DNAME_LEN];
+// line being typed at the bottom prompt, read a key at a time like the
+// other keys so capture goes on while typing
+enum prompt_target {
+    PROMPT_NONE,
+    PROMPT_LOOKUP,
+    PROMPT_DRILL
+};
+int prompt_target = PROMPT_NONE;
+char prompt_buf[MAX_DNAME_LEN];
+size_t prompt_len;
 
-// rate computations
+// rate computations, last_rate_ts in ns of wall or event time
 uint64_t last_incoming, last_outgoing, last_query, last_reply;
-struct timeval last_rate_ts;
+uint64_t last_rate_ts;
 
 void gotsignalrm(int sig) {
     do_redraw = 1;
@@ -62,12 +87,17 @@ void redraw_table_int(struct int32_entry *table, char *txt_hdr, int row, int col
     // copy the table so we can sort it non destructively
     sorted_table = NULL;
     HASH_ITER(hh, table, entry, tmp_entry) {
+        if (sort_by_rate)
+            dnsctxt_decay_rescale(&entry->score, &entry->epoch);
         HASH_ADD(hh_srt, sorted_table, key, sizeof(uint32_t), entry);
     }
 
-    HASH_SRT(hh_srt, sorted_table, sort_int_by_count);
+    HASH_SRT(hh_srt, sorted_table, (sort_by_rate ? sort_int_by_score : sort_int_by_count));
     HASH_ITER(hh_srt, sorted_table, entry, tmp_entry) {
-        mvprintw(++row, col, "%6u %lu", entry->key, entry->count);
+        if (sort_by_rate)
+            mvprintw(++row, col, "%6u %.1f/s", entry->key, dnsctxt_decay_rate(entry->score));
+        else
+            mvprintw(++row, col, "%6u %lu", entry->key, entry->count);
         if (++i >= max)
             break;
     }
@@ -93,14 +123,65 @@ void redraw_table_ip(struct int32_entry *table, char *txt_hdr, int row, int col,
     // copy the table so we can sort it non destructively
     sorted_table = NULL;
     HASH_ITER(hh, table, entry, tmp_entry) {
+        if (sort_by_rate)
+            dnsctxt_decay_rescale(&entry->score, &entry->epoch);
         HASH_ADD(hh_srt, sorted_table, key, sizeof(uint32_t), entry);
     }
 
 
-    HASH_SRT(hh_srt, sorted_table, sort_int_by_count);
+    HASH_SRT(hh_srt, sorted_table, (sort_by_rate ? sort_int_by_score : sort_int_by_count));
     HASH_ITER(hh_srt, sorted_table, entry, tmp_entry) {
         inet_ntop(AF_INET, &entry->key, ip, sizeof(ip));
-        mvprintw(++row, col, "%16s %lu", ip, entry->count);
+        if (sort_by_rate)
+            mvprintw(++row, col, "%16s %.1f/s", ip, dnsctxt_decay_rate(entry->score));
+        else
+            mvprintw(++row, col, "%16s %lu", ip, entry->count);
+        if (++i >= max)
+            break;
+    }
+    HASH_CLEAR(hh_srt, sorted_table);
+
+}
+
+// geo keys are integers, the display strings are made for the rows shown
+void redraw_table_geo(struct int32_entry *table, enum dnsctxt_table t, char *txt_hdr, int row, int col, int max) {
+    struct int32_entry *entry, *tmp_entry, *sorted_table;
+    char geo[80];
+    unsigned int i = 0;
+    int max_len = 0;
+
+    mvprintw(row, col, "%s", txt_hdr);
+
+    if (!table) {
+        mvprintw(++row, col, "(no data)");
+        return;
+    }
+
+    if (max <= 0)
+        max = getmaxy(w) - 10;
+
+    // copy the table so we can sort it non destructively
+    sorted_table = NULL;
+    HASH_ITER(hh, table, entry, tmp_entry) {
+        if (sort_by_rate)
+            dnsctxt_decay_rescale(&entry->score, &entry->epoch);
+        HASH_ADD(hh_srt, sorted_table, key, sizeof(uint32_t), entry);
+    }
+
+    HASH_SRT(hh_srt, sorted_table, (sort_by_rate ? sort_int_by_score : sort_int_by_count));
+    HASH_ITER(hh_srt, sorted_table, entry, tmp_entry) {
+        if (strlen(dnsctxt_geo_str(t, entry->key, geo, sizeof(geo))) > max_len)
+            max_len = strlen(geo);
+        if (++i >= max)
+            break;
+    }
+    i = 0;
+    HASH_ITER(hh_srt, sorted_table, entry, tmp_entry) {
+        dnsctxt_geo_str(t, entry->key, geo, sizeof(geo));
+        if (sort_by_rate)
+            mvprintw(++row, col, "%-*s %.1f/s", max_len, geo, dnsctxt_decay_rate(entry->score));
+        else
+            mvprintw(++row, col, "%-*s %lu", max_len, geo, entry->count);
         if (++i >= max)
             break;
     }
@@ -110,6 +191,7 @@ void redraw_table_ip(struct int32_entry *table, char *txt_hdr, int row, int col,
 
 void redraw_table_str(struct str_entry *table, char *txt_hdr, int row, int col, int max) {
     struct str_entry *entry, *tmp_entry, *sorted_table;
+    const char *key;
     unsigned int i = 0;
     int max_len = 0;
 
@@ -125,19 +207,26 @@ void redraw_table_str(struct str_entry *table, char *txt_hdr, int row, int col,
     // copy the table so we can sort it non destructively
     sorted_table = NULL;
     HASH_ITER(hh, table, entry, tmp_entry) {
-        HASH_ADD(hh_srt, sorted_table, key, MAX_DNAME_LEN, entry);
+        if (sort_by_rate)
+            dnsctxt_decay_rescale(&entry->score, &entry->epoch);
+        HASH_ADD(hh_srt, sorted_table, key, sizeof(uint32_t), entry);
     }
 
-    HASH_SRT(hh_srt, sorted_table, sort_str_by_count);
+    HASH_SRT(hh_srt, sorted_table, (sort_by_rate ? sort_str_by_score : sort_str_by_count));
     HASH_ITER(hh_srt, sorted_table, entry, tmp_entry) {
-        if (strlen(entry->key) > max_len)
-            max_len = strlen(entry->key);
+        if (intern_len(&dnsctxt_names, entry->key) > max_len)
+            max_len = intern_len(&dnsctxt_names, entry->key);
         if (++i >= max)
             break;
     }
     i = 0;
     HASH_ITER(hh_srt, sorted_table, entry, tmp_entry) {
-        mvprintw(++row, col, "%-*s %lu", max_len, strlen(entry->key) ? entry->key : "[empty]", entry->count);
+        key = intern_str(&dnsctxt_names, entry->key);
+        if (sort_by_rate)
+            mvprintw(++row, col, "%-*s %.1f/s", max_len, *key ? key : "[empty]",
+                     dnsctxt_decay_rate(entry->score));
+        else
+            mvprintw(++row, col, "%-*s %lu", max_len, *key ? key : "[empty]", entry->count);
         if (++i >= max)
             break;
     }
@@ -153,10 +242,10 @@ void pktvisor_ui_init(int interval) {
     redraw_interval = interval;
 
     last_incoming = last_query = last_reply = 0;
-    last_rate_ts.tv_sec = 0;
-    last_rate_ts.tv_usec = 0;
+    last_rate_ts = 0;
 
     cur_target = SUMMARY_TABLE;
+    sort_by_rate = dnsctxt_decay.tau != 0;
     signal(SIGALRM, gotsignalrm);
     redraw_itv.it_interval.tv_sec = redraw_interval;
     redraw_itv.it_interval.tv_usec = 0;
@@ -165,13 +254,93 @@ void pktvisor_ui_init(int interval) {
     setitimer(ITIMER_REAL, &redraw_itv, NULL);
 }
 
+// nodes of the name tree, ranked already
+void redraw_table_name(struct ntree *t, uint32_t *top, size_t n, char *txt_hdr, int row, int col, bool full) {
+    char names[n ? n : 1][MAX_DNAME_LEN];
+    struct ntree_node *node;
+    int max_len = 0;
+    size_t i;
+
+    mvprintw(row, col, "%s", txt_hdr);
+    if (!n) {
+        mvprintw(++row, col, "(no data)");
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        ntree_name(t, top[i], names[i], MAX_DNAME_LEN);
+        if (strlen(names[i]) > max_len)
+            max_len = strlen(names[i]);
+    }
+    for (i = 0; i < n; i++) {
+        node = &t->node[top[i]];
+        if (sort_by_rate)
+            mvprintw(++row, col, "%-*s %.1f/s", max_len, names[i], dnsctxt_decay_rate(node->score));
+        else
+            mvprintw(++row, col, "%-*s %lu", max_len, names[i], node->count);
+        if (node->hll && full)
+            printw(" (%lu uniq)", hll_count(node->hll));
+    }
+
+}
+
+// top names with depth labels, the zones at 2
+void redraw_table_depth(struct dnsctxt *dns_ctxt, unsigned int depth, char *txt_hdr, int row, int col, int max) {
+    struct ntree *t = dns_ctxt->qnames;
+    bool full = max <= 0;
+    uint32_t *top;
+    size_t n;
+
+    if (max <= 0)
+        max = getmaxy(w) - 10;
+    if (max <= 0 || depth > t->depth)
+        return;
+
+    top = xmalloc(max * sizeof(*top));
+    n = ntree_top_depth(t, depth, sort_by_rate ? dnsctxt_name_score : dnsctxt_name_count, top, max);
+    redraw_table_name(t, top, n, txt_hdr, row, col, full);
+    xfree(top);
+
+}
+
+// top children of drill_name, 'n' picks another name
+void redraw_name_tree(struct dnsctxt *dns_ctxt) {
+    struct ntree *t = dns_ctxt->qnames;
+    int max = getmaxy(w) - 12;
+    char hdr[MAX_DNAME_LEN + 32];
+    uint32_t node, *top;
+    size_t n;
+
+    node = ntree_find(t, drill_name);
+    if (node == NTREE_NONE) {
+        mvprintw(START_ROW, START_COL, "%s: not in the name tree (depth %u, %u nodes, %lu pruned)",
+                 drill_name, t->depth, t->nr_node - t->nr_free, t->pruned);
+        return;
+    }
+    mvprintw(START_ROW, START_COL, "%s: %lu queries, %u of %u nodes used, %lu pruned",
+             drill_name[0] ? drill_name : "(root)", t->node[node].count,
+             t->nr_node - t->nr_free, t->max_node, t->pruned);
+    if (max <= 0)
+        return;
+
+    snprintf(hdr, sizeof(hdr), "Below %s", drill_name[0] ? drill_name : "the root");
+    top = xmalloc(max * sizeof(*top));
+    n = ntree_top_children(t, node, sort_by_rate ? dnsctxt_name_score : dnsctxt_name_count, top, max);
+    redraw_table_name(t, top, n, hdr, START_ROW + 2, START_COL, true);
+    xfree(top);
+
+}
+
 void redraw_header(struct dnsctxt *dns_ctxt) {
 
     double outgoing = (double)dns_ctxt->seen - (double)dns_ctxt->incoming;
 
     // rates
     uint64_t incoming_pps = 0, outgoing_pps = 0, query_pps = 0, reply_pps = 0;
-    struct timeval time_now;
+    struct timeval tv;
+    uint64_t time_now;
+    time_t capture_sec;
+    char capture_time[32] = "";
     double t_delta = 0;
 
     // see HEADER_SIZE def
@@ -199,29 +368,47 @@ void redraw_header(struct dnsctxt *dns_ctxt) {
              dns_ctxt->cnt_status_refused,
              ((double)dns_ctxt->cnt_status_refused / outgoing)*100);
 
-    // calculate rates
-    gettimeofday(&time_now, NULL);
-    if (last_incoming > 0 && last_rate_ts.tv_sec > 0) {
-        t_delta = ((double)time_now.tv_sec+(double)time_now.tv_usec/1000000) -
-                         ((double)last_rate_ts.tv_sec+(double)last_rate_ts.tv_usec/1000000);
+    // calculate rates, over capture time when reading pcaps
+    if (dns_ctxt->event_time) {
+        time_now = dns_ctxt->now;
+        capture_sec = time_now / 1000000000ULL;
+        strftime(capture_time, sizeof(capture_time), " | at %Y-%m-%d %H:%M:%S",
+                 gmtime(&capture_sec));
+    } else {
+        gettimeofday(&tv, NULL);
+        time_now = (uint64_t)tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+    }
+    if (last_incoming > 0 && last_rate_ts > 0 && time_now > last_rate_ts) {
+        t_delta = (double)(time_now - last_rate_ts) / 1e9;
         incoming_pps = (uint64_t)((double)(dns_ctxt->incoming - last_incoming) / t_delta);
         outgoing_pps = (uint64_t)((double)(outgoing - last_outgoing) / t_delta);
         query_pps = (uint64_t)((double)(dns_ctxt->cnt_query - last_query) / t_delta);
         reply_pps = (uint64_t)((double)(dns_ctxt->cnt_reply - last_reply) / t_delta);
     }
-    last_rate_ts.tv_sec = time_now.tv_sec;
-    last_rate_ts.tv_usec = time_now.tv_usec;
+    last_rate_ts = time_now;
     last_incoming = dns_ctxt->incoming;
     last_outgoing = outgoing;
     last_query = dns_ctxt->cnt_query;
     last_reply = dns_ctxt->cnt_reply;
 
-    mvprintw(3, 0, "RATES  : incoming %lu | outgoing %lu | query %lu | reply %lu | pkts per %0.2fs",
+    mvprintw(4, 0, "UNIQUE : sources %lu, /24s %lu, qnames %lu",
+             hll_count(dns_ctxt->uniq.source),
+             hll_count(dns_ctxt->uniq.source24),
+             hll_count(dns_ctxt->uniq.qname));
+    if (dns_ctxt->shed.tier == DNS_TIER_SAMPLE)
+        printw(" | LOAD: %s 1/%u, %lu drops", dnsctxt_tier_name[dns_ctxt->shed.tier],
+               dns_ctxt->shed.rate, dns_ctxt->shed.drops);
+    else if (dns_ctxt->shed.enabled)
+        printw(" | LOAD: %s, %lu drops", dnsctxt_tier_name[dns_ctxt->shed.tier], dns_ctxt->shed.drops);
+    clrtoeol();
+
+    mvprintw(3, 0, "RATES  : incoming %lu | outgoing %lu | query %lu | reply %lu | pkts per %0.2fs%s",
              incoming_pps,
              outgoing_pps,
              query_pps,
              reply_pps,
-             t_delta);
+             t_delta,
+             capture_time);
 
 }
 
@@ -232,13 +419,208 @@ void redraw_summary(struct dnsctxt *dns_ctxt) {
     redraw_table_str(dns_ctxt->refused_table, "Refused Names", START_ROW, START_COL+65, 5);
 
     redraw_table_int(dns_ctxt->src_port_table, "Top Source Ports", START_ROW+7, START_COL, 5);
-    redraw_table_str(dns_ctxt->query_name2_table, "Top Queries (2)", START_ROW+7, START_COL+27, 5);
-    redraw_table_str(dns_ctxt->query_name3_table, "Top Queries (3)", START_ROW+7, START_COL+65, 5);
+    redraw_table_depth(dns_ctxt, 2, "Top Queries (2)", START_ROW+7, START_COL+27, 5);
+    redraw_table_depth(dns_ctxt, 3, "Top Queries (3)", START_ROW+7, START_COL+65, 5);
 
-    redraw_table_str(dns_ctxt->geo_loc_table, "By GeoLocation", START_ROW+14, START_COL, 5);
+    redraw_table_geo(dns_ctxt->geo_loc_table, DNS_TABLE_GEO_LOC, "By GeoLocation", START_ROW+14, START_COL, 5);
     redraw_table_str(dns_ctxt->qtype_table, "By QType", START_ROW+14, START_COL+27, 5);
-    redraw_table_str(dns_ctxt->geo_asn_table, "By ASN", START_ROW+14, START_COL+50, 5);
+    redraw_table_geo(dns_ctxt->geo_asn_table, DNS_TABLE_GEO_ASN, "By ASN", START_ROW+14, START_COL+50, 5);
+
+}
+
+// last closed window of every length against the one before it
+void redraw_windows(struct dnsctxt *dns_ctxt) {
+    const struct dnswin_closed *last, *prev;
+    char ip[INET_ADDRSTRLEN];
+    int level, row = START_ROW, i;
+    double secs, qps, prev_qps;
+
+    if (!dns_ctxt->win) {
+        mvprintw(row, START_COL, "(windows are off, see --windows)");
+        return;
+    }
+
+    for (level = 0; level < DNSWIN_LEVELS; level++) {
+        last = dnswin_get(dns_ctxt->win, level, 0);
+        prev = dnswin_get(dns_ctxt->win, level, 1);
+
+        mvprintw(row++, START_COL, "Last %lus", (unsigned long)(dnswin_len[level] / 1000000000ULL));
+        if (!last) {
+            mvprintw(row++, START_COL, "(no data)");
+            row++;
+            continue;
+        }
+
+        secs = (double)(last->end.ts - last->start.ts) / 1e9;
+        qps = (last->end.cnt_query - last->start.cnt_query) / secs;
+        mvprintw(row, START_COL, "query %.0f/s, incoming %.0f/s, nxdomain %lu, malformed %lu, "
+                 "unique sources %lu, /24s %lu, qnames %lu",
+                 qps,
+                 (last->end.incoming - last->start.incoming) / secs,
+                 last->end.cnt_status_nxdomain - last->start.cnt_status_nxdomain,
+                 last->end.cnt_malformed - last->start.cnt_malformed,
+                 last->uniq_source, last->uniq_source24, last->uniq_qname);
+        if (prev) {
+            secs = (double)(prev->end.ts - prev->start.ts) / 1e9;
+            prev_qps = (prev->end.cnt_query - prev->start.cnt_query) / secs;
+            if (prev_qps > 0)
+                printw(" (query %+.1f%%)", (qps - prev_qps) / prev_qps * 100);
+        }
+        row++;
+
+        for (i = 0; i < 3; i++) {
+            if (i < last->n_source) {
+                inet_ntop(AF_INET, &last->source[i].key, ip, sizeof(ip));
+                mvprintw(row + i, START_COL, "%16s %lu", ip, last->source[i].count);
+            }
+            if (i < last->n_query)
+                mvprintw(row + i, START_COL + 27, "%-30.30s %lu", intern_str(&dnsctxt_names, last->query[i].key),
+                         last->query[i].count);
+            if (i < last->n_nxdomain)
+                mvprintw(row + i, START_COL + 65, "%-30.30s %lu", intern_str(&dnsctxt_names, last->nxdomain[i].key),
+                         last->nxdomain[i].count);
+        }
+        row += 4;
+    }
+
+}
+
+// one column per prefix length, returns the rows used
+static int redraw_lpm(struct lpm *t, const char *txt_hdr, int row, int max) {
+    struct lpm_top top[MAX_SUMMARY_SIZE];
+    char buf[INET6_ADDRSTRLEN + 4];
+    unsigned int level, col_width = t->bits == 32 ? 28 : 52;
+    int col = START_COL, used = 0;
+    size_t i, n;
+
+    if (max > MAX_SUMMARY_SIZE)
+        max = MAX_SUMMARY_SIZE;
+
+    for (level = 0; level < t->nr_len; level++, col += col_width) {
+        if (col + col_width > getmaxx(w))
+            break;
+        mvprintw(row, col, "%s /%u", txt_hdr, t->len[level]);
+        n = lpm_top(t, level, top, max);
+        for (i = 0; i < n; i++)
+            mvprintw(row + 1 + i, col, "%-*s %lu", col_width - 12,
+                     lpm_prefix_str(t, top[i].addr, level, buf, sizeof(buf)), top[i].count);
+        if (n > used)
+            used = n;
+    }
 
+    return used + 2;
+}
+
+// incoming sources rolled up by prefix
+void redraw_prefixes(struct dnsctxt *dns_ctxt) {
+    struct lpm *v4 = dns_ctxt->prefix4[DNS_TABLE_SOURCE], *v6 = dns_ctxt->prefix6[DNS_TABLE_SOURCE];
+    int row = START_ROW, max = getmaxy(w) - 10;
+
+    if (!v4 && !v6) {
+        mvprintw(row, START_COL, "(prefix rollups are off, see --prefix4/--prefix6)");
+        return;
+    }
+
+    // split the screen when both families have traffic
+    if (v4 && v4->total && v6 && v6->total)
+        max = max / 2 - 1;
+    if (max <= 0)
+        return;
+
+    if (v4 && (v4->total || !v6 || !v6->total))
+        row += redraw_lpm(v4, "Source", row, max);
+    if (v6 && v6->total)
+        redraw_lpm(v6, "Source", row, max);
+
+}
+
+// zones by distinct leftmost labels per query, random subdomain floods on top
+void redraw_zones(struct dnsctxt *dns_ctxt) {
+    struct dnsctxt_zone_rank rank[ZONE_HLL_MAX];
+    char zone[MAX_DNAME_LEN];
+    int row = START_ROW, max = getmaxy(w) - 10;
+    size_t i, n;
+
+    mvprintw(row, START_COL, "Zones by Unique Labels per Query (%lu tracked)", dns_ctxt->qnames->nr_hll);
+
+    if (max <= 0)
+        return;
+    n = dnsctxt_zone_ranking(dns_ctxt, rank, max);
+    if (!n) {
+        mvprintw(++row, START_COL, "(no data)");
+        return;
+    }
+
+    for (i = 0; i < n; i++)
+        mvprintw(++row, START_COL, "%-40.40s %5.2f %10lu labels %10lu queries",
+                 ntree_name(dns_ctxt->qnames, rank[i].node, zone, sizeof(zone)), rank[i].ratio, rank[i].labels, rank[i].queries);
+
+}
+
+// point query over all tables, shown again on every redraw
+void redraw_lookup(struct dnsctxt *dns_ctxt) {
+    struct dnsctxt_freq freq[DNS_TABLE_NR];
+    int row = START_ROW, t;
+
+    mvprintw(row++, START_COL, "Lookup: %s", lookup_key);
+    if (!dnsctxt_lookup(dns_ctxt, lookup_key, freq)) {
+        mvprintw(++row, START_COL, "(not a valid key)");
+        return;
+    }
+    row++;
+
+    for (t = 0; t < DNS_TABLE_NR; t++) {
+        if (!freq[t].queried)
+            continue;
+        mvprintw(row, START_COL, "%-26s", dnsctxt_table_name[t]);
+        if (freq[t].in_table)
+            printw(" %12lu", freq[t].table);
+        else
+            printw(" %12s", "-");
+        if (freq[t].have_sketch)
+            printw("   <= %lu (+-%lu since start)", freq[t].sketch, freq[t].sketch_error);
+        row++;
+    }
+
+    if (!dns_ctxt->cms[0])
+        mvprintw(++row, START_COL, "(only keys still in the tables, see --count-min)");
+
+}
+
+static void prompt_open(int target) {
+    prompt_target = target;
+    prompt_len = 0;
+    prompt_buf[0] = 0;
+}
+
+// on the bottom line, over whatever the table left there
+static void prompt_draw() {
+    const char *msg;
+
+    if (prompt_target == PROMPT_NONE)
+        return;
+    msg = prompt_target == PROMPT_LOOKUP ? "lookup (ip, port or name): " : "names below (empty for the TLDs): ";
+    mvprintw(getmaxy(w) - 1, 0, "%s%s", msg, prompt_buf);
+    clrtoeol();
+}
+
+static void prompt_lookup(const char *buf) {
+    if (buf[0]) {
+        strcpy(lookup_key, buf);
+        cur_target = LOOKUP;
+    }
+}
+
+// a trailing dot is fine, empty goes back to the TLDs
+static void prompt_drill(const char *buf) {
+    size_t len;
+
+    for (len = 0; buf[len]; len++)
+        drill_name[len] = tolower(buf[len]);
+    if (len && drill_name[len - 1] == '.')
+        len--;
+    drill_name[len] = 0;
+    cur_target = NAME_TREE;
 }
 
 void redraw_help() {
@@ -257,10 +639,17 @@ void redraw_help() {
     printw(" 7 \t\tShow top REFUSED\n");
     printw(" 8 \t\tShow top source ports\n");
     printw(" 9 \t\tShow top GeoIP\n");
+    printw(" w \t\tShow the last 1s/10s/60s windows\n");
+    printw(" r \t\tRank by current rate or by total count (with --decay)\n");
+    printw(" p \t\tShow top source prefixes\n");
+    printw(" n \t\tShow the top names below a name, at any depth\n");
+    printw(" z \t\tShow zones by unique labels per query (random subdomains)\n");
+    printw(" l \t\tLook up the count of an ip, port or name\n");
 }
 
 void redraw(struct dnsctxt *dns_ctxt) {
 
+    dnsctxt_geo_flush(dns_ctxt);
     erase();
 
     redraw_header(dns_ctxt);
@@ -291,33 +680,84 @@ void redraw(struct dnsctxt *dns_ctxt) {
         redraw_table_int(dns_ctxt->src_port_table, "Top Source Ports", START_ROW, START_COL, FULL);
         break;
     case GEO_LOC_TABLE:
-        redraw_table_str(dns_ctxt->geo_loc_table, "By Incoming GeoLocation", START_ROW, START_COL, FULL);
+        redraw_table_geo(dns_ctxt->geo_loc_table, DNS_TABLE_GEO_LOC, "By Incoming GeoLocation", START_ROW, START_COL, FULL);
         break;
     case GEO_ASN_TABLE:
-        redraw_table_str(dns_ctxt->geo_asn_table, "By Incoming ASN", START_ROW, START_COL, FULL);
+        redraw_table_geo(dns_ctxt->geo_asn_table, DNS_TABLE_GEO_ASN, "By Incoming ASN", START_ROW, START_COL, FULL);
         break;
     case QUERY2_TABLE:
-        redraw_table_str(dns_ctxt->query_name2_table, "Top Queries (2)", START_ROW, START_COL, FULL);
+        redraw_table_depth(dns_ctxt, 2, "Top Queries (2)", START_ROW, START_COL, FULL);
+        break;
+    case WINDOW_TABLE:
+        redraw_windows(dns_ctxt);
+        break;
+    case ZONE_TABLE:
+        redraw_zones(dns_ctxt);
+        break;
+    case PREFIX_TABLE:
+        redraw_prefixes(dns_ctxt);
+        break;
+    case NAME_TREE:
+        redraw_name_tree(dns_ctxt);
+        break;
+    case LOOKUP:
+        redraw_lookup(dns_ctxt);
         break;
     case HELP:
         redraw_help();
         break;
     case QUERY3_TABLE:
     default:
-        redraw_table_str(dns_ctxt->query_name3_table, "Top Queries (3)", START_ROW, START_COL, FULL);
+        redraw_table_depth(dns_ctxt, 3, "Top Queries (3)", START_ROW, START_COL, FULL);
         break;
     }
 
+    prompt_draw();
     refresh();
     do_redraw = false;
 }
 
+// keys waiting for an open prompt: enter takes the line, escape drops it
+static int prompt_keys(struct dnsctxt *dns_ctxt) {
+    int ch, target;
+
+    while ((ch = getch()) != ERR) {
+        if (ch == '\n' || ch == '\r' || ch == KEY_ENTER || ch == 27) {
+            target = prompt_target;
+            prompt_target = PROMPT_NONE;
+            if (ch != 27 && target == PROMPT_LOOKUP)
+                prompt_lookup(prompt_buf);
+            else if (ch != 27)
+                prompt_drill(prompt_buf);
+            do_redraw = true;
+            redraw(dns_ctxt);
+            return ch;
+        }
+        if (ch == KEY_BACKSPACE || ch == 127 || ch == 8 || ch == erasechar()) {
+            if (prompt_len)
+                prompt_buf[--prompt_len] = 0;
+        }
+        else if (ch < 256 && isprint(ch) && prompt_len < sizeof(prompt_buf) - 1) {
+            prompt_buf[prompt_len++] = ch;
+            prompt_buf[prompt_len] = 0;
+        }
+    }
+
+    prompt_draw();
+    refresh();
+
+    return ERR;
+}
+
 
 int keyboard(struct dnsctxt *dns_ctxt) {
 
     int ch;
     bool no_key = false;
 
+    if (prompt_target != PROMPT_NONE)
+        return prompt_keys(dns_ctxt);
+
     ch = getch() & 0xff;
     if (ch == ERR) {
         return ERR;
@@ -364,6 +804,24 @@ int keyboard(struct dnsctxt *dns_ctxt) {
     case '8':
         cur_target = SRC_PORT_TABLE;
         break;
+    case 'w':
+        cur_target = WINDOW_TABLE;
+        break;
+    case 'r':
+        sort_by_rate = !sort_by_rate && dnsctxt_decay.tau;
+        break;
+    case 'z':
+        cur_target = ZONE_TABLE;
+        break;
+    case 'p':
+        cur_target = PREFIX_TABLE;
+        break;
+    case 'n':
+        prompt_open(PROMPT_DRILL);
+        break;
+    case 'l':
+        prompt_open(PROMPT_LOOKUP);
+        break;
     default:
         no_key = true;
     }
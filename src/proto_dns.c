@@ -16,6 +16,7 @@
 #include "lookup.h"
 #include "pkt_buff.h"
 #include "dnsctxt.h"
+#include "dnswindow.h"
 #include "dns.h"
 #include "geoip.h"
 
@@ -28,14 +29,6 @@
 // during DNS amplication attacks
 #define MAX_DNS_PKT_LEN 512
 
-bool cidr_match(uint32_t addr, uint32_t net, uint8_t bits) {
-  if (bits == 0) {
-    // C99 6.5.7 (3): u32 << 32 is undefined behaviour
-    return true;
-  }
-  return !((addr ^ net) & htonl(0xFFFFFFFFu << (32 - bits)));
-}
-
 const char* str_qtype(enum dns_type qtype) {
 
     switch (qtype) {
@@ -76,6 +69,71 @@ const char* str_qtype(enum dns_type qtype) {
     }
 }
 
+// parse buffer, reused per packet: dns_p_new would zero all of it every
+// time, dns_p_init only resets the header before the payload is copied in
+static __thread union {
+    unsigned char b[dns_p_calcsize(MAX_DNS_PKT_LEN)];
+    struct dns_packet p;
+} dns_scratch;
+
+// outgoing replies by result code
+static void count_rcode(struct dnsctxt *dns_ctxt, unsigned int rcode, uint64_t w)
+{
+    switch (rcode) {
+    case DNS_RC_NOERROR:
+        dns_ctxt->cnt_status_noerror += w;
+        break;
+    case DNS_RC_NXDOMAIN:
+        dns_ctxt->cnt_status_nxdomain += w;
+        break;
+    case DNS_RC_REFUSED:
+        dns_ctxt->cnt_status_refused += w;
+        break;
+    case DNS_RC_SERVFAIL:
+        dns_ctxt->cnt_status_srvfail += w;
+        break;
+    }
+}
+
+// time replies against the queries they answer
+static void time_reply(struct dnsctxt *dns_ctxt, struct pkt_buff *pkt, struct dns_header *hdr, int incoming)
+{
+    if (incoming && hdr->qr == 0) {
+        if (pkt->src_addr)
+            dnsctxt_lat_query(dns_ctxt, dnsctxt_lat_key(pkt->src_addr, 4, *pkt->udp_src_port, hdr->qid));
+        else
+            dnsctxt_lat_query(dns_ctxt, dnsctxt_lat_key(pkt->src_addr6, 16, *pkt->udp_src_port, hdr->qid));
+    }
+    else if (!incoming && hdr->qr == 1) {
+        if (pkt->dest_addr)
+            dnsctxt_lat_reply(dns_ctxt, dnsctxt_lat_key(pkt->dest_addr, 4, *pkt->udp_dest_port, hdr->qid));
+        else if (pkt->dest_addr6)
+            dnsctxt_lat_reply(dns_ctxt, dnsctxt_lat_key(pkt->dest_addr6, 16, *pkt->udp_dest_port, hdr->qid));
+    }
+}
+
+// cheaper tiers under load: the header counters only, scaled by the
+// sample rate. no tables, sketches or names, and no latency when sampled
+// as a query and its reply are rarely both sampled
+static void process_dns_header(struct dnsctxt *dns_ctxt, struct pkt_buff *pkt, int incoming)
+{
+    struct dns_header hdr;
+    uint64_t w = dns_ctxt->shed.rate;
+
+    memcpy(&hdr, pkt->data, sizeof(hdr));
+
+    if (incoming && (hdr.qr == 1 || hdr.ancount > 0))
+        dns_ctxt->cnt_malformed += w;
+    if (hdr.qr == 1)
+        dns_ctxt->cnt_reply += w;
+    else
+        dns_ctxt->cnt_query += w;
+    if (!incoming && hdr.qr == 1)
+        count_rcode(dns_ctxt, hdr.rcode, w);
+    if (dns_ctxt->shed.tier == DNS_TIER_HEADER)
+        time_reply(dns_ctxt, pkt, &hdr, incoming);
+}
+
 void process_dns(struct pkt_buff *pkt, void *ctxt)
 {
     size_t   len = pkt_len(pkt);
@@ -83,20 +141,29 @@ void process_dns(struct pkt_buff *pkt, void *ctxt)
     char qname[DNS_D_MAXNAME+1];
     struct dns_rr rr;
     int incoming = 1;
-    const char* geo = 0;
+    struct ntree_node *zone;
+    uint64_t h_source, h_source24, h_qname;
 
-    struct dns_packet *dns_pkt = dns_p_new(MAX_DNS_PKT_LEN);
+    struct dns_packet *dns_pkt = dns_p_init(&dns_scratch.p, sizeof(dns_scratch));
     struct dns_rr_i *I = dns_rr_i_new(dns_pkt, .section = DNS_S_QUESTION);
     struct dnsctxt *dns_ctxt = (struct dnsctxt *)ctxt;
 
-    // basic counts
-    dns_ctxt->seen++;
+    // ipv4 or ipv6, the latter only feeds the prefix rollups and the
+    // unique source counts
+    if (!pkt->src_addr && !pkt->src_addr6)
+        return;
+
+    // basic counts, a sampled packet stands for the ones skipped
+    dns_ctxt->seen += dns_ctxt->shed.rate;
 
     // decide whether this is incoming or outgoing
-    // if local net/bits was specified on command line, use that. this is useful for
+    // if local networks were specified on command line, use them. this is useful for
     // pcaps
-    if (dns_ctxt->local_bits != 0) {
-        incoming = cidr_match(*pkt->dest_addr, dns_ctxt->local_net, dns_ctxt->local_bits);
+    if (pkt->dest_addr && dns_ctxt->local.nr_v4) {
+        incoming = netset_match4(&dns_ctxt->local, *pkt->dest_addr);
+    }
+    else if (pkt->dest_addr6 && dns_ctxt->local.nr_v6) {
+        incoming = netset_match6(&dns_ctxt->local, pkt->dest_addr6);
     }
     // otherwise, use pkttype, which is based on interface we're sniffing
     else {
@@ -105,14 +172,23 @@ void process_dns(struct pkt_buff *pkt, void *ctxt)
 
     if (incoming) {
         // incoming packet
-        dns_ctxt->incoming++;
+        dns_ctxt->incoming += dns_ctxt->shed.rate;
     }
 
     // sanity check len is not 0 and is at least dns_header size
     if (!len || len < sizeof(struct dns_header)) {
-        dns_ctxt->cnt_malformed++;
-        if (incoming)
-            dnsctxt_count_ip(&dns_ctxt->malformed_table, *pkt->src_addr);
+        dns_ctxt->cnt_malformed += dns_ctxt->shed.rate;
+        if (dns_ctxt->shed.tier != DNS_TIER_FULL)
+            return;
+        if (incoming && pkt->src_addr)
+            dnsctxt_track_ip(dns_ctxt, DNS_TABLE_MALFORMED, *pkt->src_addr);
+        else if (incoming)
+            dnsctxt_track_ip6(dns_ctxt, DNS_TABLE_MALFORMED, pkt->src_addr6);
+        return;
+    }
+
+    if (dns_ctxt->shed.tier != DNS_TIER_FULL) {
+        process_dns_header(dns_ctxt, pkt, incoming);
         return;
     }
 
@@ -127,37 +203,60 @@ void process_dns(struct pkt_buff *pkt, void *ctxt)
     // table counters
 
     // if this is an incoming packet...
-    if (incoming) {
+    if (incoming && !pkt->src_addr) {
+        // ipv6 source, its /48 counts as the /24
+        dnsctxt_track_ip6(dns_ctxt, DNS_TABLE_SOURCE, pkt->src_addr6);
+        h_source = hll_hash_mem((const char *)pkt->src_addr6, 16);
+        h_source24 = hll_hash_mem((const char *)pkt->src_addr6, 6);
+        dnsctxt_uniq_source(&dns_ctxt->uniq, h_source, h_source24);
+        if (dns_ctxt->exp)
+            dnsctxt_uniq_source(&dns_ctxt->export_uniq, h_source, h_source24);
+        if (dns_ctxt->win)
+            dnswin_uniq_source(dns_ctxt->win, h_source, h_source24);
+        dnsctxt_track_ip(dns_ctxt, DNS_TABLE_SRC_PORT, ntohs(*pkt->udp_src_port));
+        if (dns_header(dns_pkt)->qr == 1 || dns_header(dns_pkt)->ancount > 0) {
+            dns_ctxt->cnt_malformed++;
+            dnsctxt_track_ip6(dns_ctxt, DNS_TABLE_MALFORMED, pkt->src_addr6);
+        }
+    }
+    else if (incoming) {
         // source by ip
-        dnsctxt_count_ip(&dns_ctxt->source_table, *pkt->src_addr);
+        dnsctxt_track_ip(dns_ctxt, DNS_TABLE_SOURCE, *pkt->src_addr);
+        h_source = hll_hash_u32(*pkt->src_addr);
+        h_source24 = dnsctxt_hash_source24(*pkt->src_addr);
+        dnsctxt_uniq_source(&dns_ctxt->uniq, h_source, h_source24);
+        if (dns_ctxt->exp)
+            dnsctxt_uniq_source(&dns_ctxt->export_uniq, h_source, h_source24);
+        if (dns_ctxt->win) {
+            dnswin_count_source(dns_ctxt->win, *pkt->src_addr);
+            dnswin_uniq_source(dns_ctxt->win, h_source, h_source24);
+        }
         // incoming: store source udp port
-        dnsctxt_count_int(&dns_ctxt->src_port_table, ntohs(*pkt->udp_src_port));
+        dnsctxt_track_ip(dns_ctxt, DNS_TABLE_SRC_PORT, ntohs(*pkt->udp_src_port));
         if (dns_header(dns_pkt)->qr == 1 || dns_header(dns_pkt)->ancount > 0) {
             // shouldn't see reply or answers on incoming
             dns_ctxt->cnt_malformed++;
-            dnsctxt_count_ip(&dns_ctxt->malformed_table, *pkt->src_addr);
+            dnsctxt_track_ip(dns_ctxt, DNS_TABLE_MALFORMED, *pkt->src_addr);
         }
 
-        // if we have it, count by geo
-        if (dns_ctxt->have_geo_loc) {
-            geo = geoip4_loc_by_ip(*pkt->src_addr);
-            if (geo) {
-                dnsctxt_count_name(&dns_ctxt->geo_loc_table, geo);
-                free(geo);
-            }
+        // if we have it, count by geo, or by /24 to be resolved later
+        if (dns_ctxt->geo_defer) {
+            dnsctxt_geo_defer(dns_ctxt, *pkt->src_addr);
         }
-        if (dns_ctxt->have_geo_asn) {
-            geo = geoip4_as_name_by_ip(*pkt->src_addr);
-            if (geo) {
-                dnsctxt_count_name(&dns_ctxt->geo_asn_table, geo);
-                free(geo);
-            }
+        else {
+            if (dns_ctxt->have_geo_loc)
+                dnsctxt_track_ip(dns_ctxt, DNS_TABLE_GEO_LOC, geoip4_loc_code_by_ip(*pkt->src_addr));
+            if (dns_ctxt->have_geo_asn)
+                dnsctxt_track_ip(dns_ctxt, DNS_TABLE_GEO_ASN, geoip4_asn_by_ip(*pkt->src_addr));
         }
     }
     // otherwise, outgoing packet...
-    else {
+    else if (pkt->dest_addr) {
         // store dest by ip
-        dnsctxt_count_ip(&dns_ctxt->dest_table, *pkt->dest_addr);
+        dnsctxt_track_ip(dns_ctxt, DNS_TABLE_DEST, *pkt->dest_addr);
+    }
+    else {
+        dnsctxt_track_ip6(dns_ctxt, DNS_TABLE_DEST, pkt->dest_addr6);
     }
 
     // Query/Reply flags
@@ -168,23 +267,11 @@ void process_dns(struct pkt_buff *pkt, void *ctxt)
         dns_ctxt->cnt_query++;
     }
 
+    time_reply(dns_ctxt, pkt, dns_header(dns_pkt), incoming);
+
     // track result code outgoing for replies
-    if (!incoming && dns_header(dns_pkt)->qr == 1) {
-        switch (dns_header(dns_pkt)->rcode) {
-        case DNS_RC_NOERROR:
-            dns_ctxt->cnt_status_noerror++;
-            break;
-        case DNS_RC_NXDOMAIN:
-            dns_ctxt->cnt_status_nxdomain++;
-            break;
-        case DNS_RC_REFUSED:
-            dns_ctxt->cnt_status_refused++;
-            break;
-        case DNS_RC_SERVFAIL:
-            dns_ctxt->cnt_status_srvfail++;
-            break;
-        }
-    }
+    if (!incoming && dns_header(dns_pkt)->qr == 1)
+        count_rcode(dns_ctxt, dns_header(dns_pkt)->rcode, 1);
 
     // XXX detect malformed DNS packet here?
     if (dns_rr_grep(&rr, 1, I, dns_pkt, &error)) {
@@ -192,7 +279,7 @@ void process_dns(struct pkt_buff *pkt, void *ctxt)
             goto skip_q_name;
         // incoming: query type
         if (incoming) {
-            dnsctxt_count_name(&dns_ctxt->qtype_table, str_qtype(rr.type));
+            dnsctxt_track_name(dns_ctxt, DNS_TABLE_QTYPE, str_qtype(rr.type));
         }
     }
 
@@ -202,7 +289,7 @@ void process_dns(struct pkt_buff *pkt, void *ctxt)
     // chop terminating .
     qname[strlen(qname)-1] = 0;
 
-    // break this out to labels of len 2 and 3
+    // find the zone (last 2 labels) for the windows
     // assumes terminating ".", which ldns always gives us in qname
     char *part = qname + strlen(qname) - 1;
     // zip to TLD .
@@ -214,21 +301,28 @@ void process_dns(struct pkt_buff *pkt, void *ctxt)
         part--;
 
     if (incoming) {
+        h_qname = hll_hash_str(qname);
+        dnsctxt_uniq_qname(&dns_ctxt->uniq, h_qname);
+        if (dns_ctxt->exp)
+            dnsctxt_uniq_qname(&dns_ctxt->export_uniq, h_qname);
+        if (dns_ctxt->win)
+            dnswin_uniq_qname(dns_ctxt->win, h_qname);
+
+        // every suffix of the name, down to the name tree depth
+        zone = dnsctxt_track_qname(dns_ctxt, qname);
+
         // if not qname begin, start after .
         if (part == qname) {
-            dnsctxt_count_name(&dns_ctxt->query_name2_table, part);
+            if (dns_ctxt->win)
+                dnswin_count_query(dns_ctxt->win, part);
         }
         else {
-            dnsctxt_count_name(&dns_ctxt->query_name2_table, part+1);
-            // may be go one more label length
-            part--;
-            while (part > qname && *part != '.')
-                part--;
-            if (part == qname)
-                dnsctxt_count_name(&dns_ctxt->query_name3_table, part);
-            else
-                // anything longer gets squished into this domain
-                dnsctxt_count_name(&dns_ctxt->query_name3_table, part+1);
+            // leftmost label
+            p = strchr(qname, '.');
+            if (zone)
+                dnsctxt_zone_uniq(dns_ctxt->qnames, zone, hll_hash_mem(qname, p - qname));
+            if (dns_ctxt->win)
+                dnswin_count_query(dns_ctxt->win, part+1);
         }
     }
 
@@ -237,10 +331,12 @@ void process_dns(struct pkt_buff *pkt, void *ctxt)
     if (!incoming && dns_header(dns_pkt)->qr == 1 && dns_header(dns_pkt)->rcode != DNS_RC_NOERROR) {
         switch (dns_header(dns_pkt)->rcode) {
         case DNS_RC_NXDOMAIN:
-            dnsctxt_count_name(&dns_ctxt->nxdomain_table, qname);
+            dnsctxt_track_name(dns_ctxt, DNS_TABLE_NXDOMAIN, qname);
+            if (dns_ctxt->win)
+                dnswin_count_nxdomain(dns_ctxt->win, qname);
             break;
         case DNS_RC_REFUSED:
-            dnsctxt_count_name(&dns_ctxt->refused_table, qname);
+            dnsctxt_track_name(dns_ctxt, DNS_TABLE_REFUSED, qname);
             break;
         }
     }
@@ -39,6 +39,8 @@ void ipv6(struct pkt_buff *pkt)
 
 	inet_ntop(AF_INET6, &ip->saddr, src_ip, sizeof(src_ip));
 	inet_ntop(AF_INET6, &ip->daddr, dst_ip, sizeof(dst_ip));
+	pkt->src_addr6 = (uint8_t *) &ip->saddr;
+	pkt->dest_addr6 = (uint8_t *) &ip->daddr;
 
 	tprintf(" [ IPv6 ");
 	tprintf("Addr (%s => %s), ", src_ip, dst_ip);
@@ -96,6 +98,8 @@ void ipv6_less(struct pkt_buff *pkt)
 
 	inet_ntop(AF_INET6, &ip->saddr, src_ip, sizeof(src_ip));
 	inet_ntop(AF_INET6, &ip->daddr, dst_ip, sizeof(dst_ip));
+	pkt->src_addr6 = (uint8_t *) &ip->saddr;
+	pkt->dest_addr6 = (uint8_t *) &ip->daddr;
 
 	tprintf(" %s/%s Len %u", src_ip, dst_ip,
 		ntohs(ip->payload_len));
@@ -103,8 +107,49 @@ void ipv6_less(struct pkt_buff *pkt)
 	pkt_set_proto(pkt, &eth_lay3, ip->nexthdr);
 }
 
+/* Walks hop-by-hop, routing, fragment and destination options headers on
+ * to the upper layer. Fragments past the first carry no UDP header, their
+ * dissection ends here.
+ */
+static void ipv6_visit(struct pkt_buff *pkt, void *ctxt)
+{
+	struct ipv6hdr *ip = (struct ipv6hdr *) pkt_pull(pkt, sizeof(*ip));
+	uint8_t nexthdr, *ext;
+
+	if (ip == NULL)
+		return;
+
+	pkt->src_addr6 = (uint8_t *) &ip->saddr;
+	pkt->dest_addr6 = (uint8_t *) &ip->daddr;
+
+	nexthdr = ip->nexthdr;
+	for (;;) {
+		switch (nexthdr) {
+		case IPPROTO_HOPOPTS:
+		case IPPROTO_ROUTING:
+		case IPPROTO_DSTOPTS:
+			/* Next header, length in 8 octets not counting the first */
+			ext = pkt_pull(pkt, 2);
+			if (ext == NULL || pkt_pull(pkt, ext[1] * 8 + 6) == NULL)
+				return;
+			nexthdr = ext[0];
+			break;
+		case IPPROTO_FRAGMENT:
+			ext = pkt_pull(pkt, 8);
+			if (ext == NULL || (((ext[2] << 8) | ext[3]) & ~0x7))
+				return;
+			nexthdr = ext[0];
+			break;
+		default:
+			pkt_set_proto(pkt, &eth_lay3, nexthdr);
+			return;
+		}
+	}
+}
+
 struct protocol ipv6_ops = {
 	.key = 0x86DD,
 	.print_full = ipv6,
 	.print_less = ipv6_less,
+	.visit = ipv6_visit,
 };
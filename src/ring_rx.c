@@ -222,13 +222,31 @@ void ring_rx_setup(struct ring *ring, int sock, size_t size, int ifindex,
 	prepare_polling(sock, poll);
 }
 
+/* The kernel resets its counters on every read, so sum them up here */
+static uint64_t rx_packets, rx_drops;
+
+int sock_rx_net_read(int sock, uint64_t *packets, uint64_t *drops)
+{
+	int ret;
+	uint64_t p, d;
+
+	ret = get_rx_net_stats(sock, &p, &d, is_tpacket_v3(sock));
+	if (ret == 0) {
+		rx_packets += p;
+		rx_drops += d;
+	}
+	*packets = rx_packets;
+	*drops = rx_drops;
+	return ret;
+}
+
 void sock_rx_net_stats(int sock, unsigned long seen)
 {
 	int ret;
 	uint64_t packets, drops;
 	bool v3 = is_tpacket_v3(sock);
 
-	ret = get_rx_net_stats(sock, &packets, &drops, v3);
+	ret = sock_rx_net_read(sock, &packets, &drops);
 	if (ret == 0) {
         printf("\r%12"PRIu64"  packets processed (%"PRIu64" unread on exit)\n",
 		       v3 ? (uint64_t)seen : packets, v3 ? packets - seen : 0);
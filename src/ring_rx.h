@@ -16,6 +16,7 @@ extern void ring_rx_setup(struct ring *ring, int sock, size_t size, int ifindex,
 			  bool verbose);
 extern void destroy_rx_ring(int sock, struct ring *ring);
 extern void sock_rx_net_stats(int sock, unsigned long seen);
+extern int sock_rx_net_read(int sock, uint64_t *packets, uint64_t *drops);
 
 static inline int user_may_pull_from_rx(struct tpacket2_hdr *hdr)
 {
@@ -37,6 +38,16 @@ static inline void kernel_may_pull_from_rx_block(struct block_desc *pbd)
 {
 	pbd->h1.block_status = TP_STATUS_KERNEL;
 }
+
+/* Blocks filled by the kernel and not yet released, from block it on */
+static inline unsigned int user_rx_blocks_pending(struct ring *ring, unsigned int it)
+{
+	unsigned int n = 0, nr = ring->layout3.tp_block_nr;
+
+	while (n < nr && user_may_pull_from_rx_block(ring->frames[(it + n) % nr].iov_base))
+		n++;
+	return n;
+}
 #endif /* HAVE_TPACKET3 */
 
 #endif /* RX_RING_H */
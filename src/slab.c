@@ -0,0 +1,240 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <linux/mman.h>
+
+#include "slab.h"
+#include "numa.h"
+#include "die.h"
+
+size_t slab_hugepages;
+int slab_numa_node = -1;
+struct slab *slab_list;
+
+// the 1GB page chunks are carved from, and chunks given back
+static struct {
+    char *base;
+    size_t used;
+    size_t nr;
+    int failed;
+    struct slab_chunk *free;
+} slab_arena;
+
+void slab_init(struct slab *s, const char *name, size_t size) {
+
+    memset(s, 0, sizeof(*s));
+    s->name = name;
+    s->size = (size < sizeof(void *) ? sizeof(void *) : size + 7) & ~(size_t)7;
+    s->chunk_size = slab_hugepages ? SLAB_HUGE_CHUNK_SIZE : SLAB_CHUNK_SIZE;
+    s->per_chunk = (s->chunk_size - SLAB_CHUNK_HDR) / s->size;
+    bug_on(!s->per_chunk);
+
+    s->next = slab_list;
+    slab_list = s;
+
+}
+
+void slab_destroy(struct slab *s) {
+
+    struct slab_chunk *c, *next;
+    struct slab **link;
+
+    for (c = s->chunk; c; c = next) {
+        next = c->next;
+        if (c->arena) {
+            c->next = slab_arena.free;
+            slab_arena.free = c;
+        }
+        else {
+            munmap(c, s->chunk_size);
+        }
+    }
+    for (link = &slab_list; *link; link = &(*link)->next) {
+        if (*link == s) {
+            *link = s->next;
+            break;
+        }
+    }
+    memset(s, 0, sizeof(*s));
+
+}
+
+// next 2MB of the current 1GB page, a new page once it is used up. NULL
+// if no 1GB page could be had, the 2MB ones are used from then on
+static struct slab_chunk *slab_arena_chunk(void) {
+
+    struct slab_chunk *c;
+    void *p;
+
+    if ((c = slab_arena.free)) {
+        slab_arena.free = c->next;
+        return c;
+    }
+    if (slab_arena.failed)
+        return NULL;
+
+    if (!slab_arena.base || slab_arena.used == SLAB_HUGE_1G) {
+        p = mmap(NULL, SLAB_HUGE_1G, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+        if (p == MAP_FAILED) {
+            slab_arena.failed = 1;
+            return NULL;
+        }
+        if (slab_numa_node >= 0)
+            numa_bind_mem(p, SLAB_HUGE_1G, slab_numa_node);
+        slab_arena.base = p;
+        slab_arena.used = 0;
+        slab_arena.nr++;
+    }
+
+    c = (struct slab_chunk *)(slab_arena.base + slab_arena.used);
+    slab_arena.used += SLAB_HUGE_CHUNK_SIZE;
+    c->arena = 1;
+
+    return c;
+
+}
+
+// a transparent hugepage only backs a 2MB aligned range, so map 2MB more
+// than asked for and trim the ends to get an aligned start
+static void *slab_map_aligned(size_t size) {
+
+    char *p;
+    size_t head;
+
+    p = mmap(NULL, size + SLAB_HUGE_2M, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return MAP_FAILED;
+
+    head = -(uintptr_t)p & (SLAB_HUGE_2M - 1);
+    if (head)
+        munmap(p, head);
+    munmap(p + head + size, SLAB_HUGE_2M - head);
+
+    return p + head;
+
+}
+
+// MAP_HUGETLB needs reserved hugepages, without them ask for transparent
+// ones on a plain, aligned mapping
+static struct slab_chunk *slab_chunk_new(struct slab *s) {
+
+    struct slab_chunk *c;
+    void *p = MAP_FAILED;
+
+    if (slab_hugepages == SLAB_HUGE_1G && (c = slab_arena_chunk())) {
+        s->nr_chunk++;
+        s->nr_huge++;
+        s->nr_arena++;
+        return c;
+    }
+
+    if (slab_hugepages) {
+        p = mmap(NULL, s->chunk_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+            s->nr_huge++;
+    }
+    if (p == MAP_FAILED && slab_hugepages) {
+        p = slab_map_aligned(s->chunk_size);
+        if (p != MAP_FAILED)
+            madvise(p, s->chunk_size, MADV_HUGEPAGE);
+    }
+    else if (p == MAP_FAILED) {
+        p = mmap(NULL, s->chunk_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (p == MAP_FAILED)
+        panic("slab %s: cannot map %zu bytes\n", s->name, s->chunk_size);
+    if (slab_numa_node >= 0)
+        numa_bind_mem(p, s->chunk_size, slab_numa_node);
+    s->nr_chunk++;
+    c = p;
+    c->arena = 0;
+
+    return c;
+
+}
+
+// the free list is empty: carve the next object, from the chunks kept by
+// slab_reset first
+void *__slab_carve(struct slab *s) {
+
+    struct slab_chunk *next;
+
+    if (!s->cur || s->pos == s->per_chunk) {
+        next = s->cur ? s->cur->next : s->chunk;
+        if (!next) {
+            next = slab_chunk_new(s);
+            next->next = NULL;
+            if (s->cur)
+                s->cur->next = next;
+            else
+                s->chunk = next;
+        }
+        s->cur = next;
+        s->pos = 0;
+    }
+
+    if (++s->nr_used > s->peak_used)
+        s->peak_used = s->nr_used;
+
+    return (char *)s->cur + SLAB_CHUNK_HDR + s->pos++ * s->size;
+
+}
+
+// every object is gone, the chunks stay for reuse
+void slab_reset(struct slab *s) {
+    s->free = NULL;
+    s->cur = NULL;
+    s->pos = 0;
+    s->nr_used = 0;
+    s->nr_reset++;
+}
+
+// slabs of the same name are summed, e.g. those of every window
+void slab_print_stats(void) {
+
+    struct slab *s, *t;
+    size_t nr, used, peak, chunk, huge, kib;
+    size_t total = 0, pages_2m = 0, pages_4k = 0;
+    uint64_t reset;
+
+    printf("\nSlabs (%s pages):\n", slab_hugepages == SLAB_HUGE_1G ? "1G" :
+           slab_hugepages ? "2M" : "4K");
+    for (s = slab_list; s; s = s->next) {
+        for (t = slab_list; t != s && strcmp(t->name, s->name); t = t->next)
+            ;
+        if (t != s)
+            continue;
+        nr = used = peak = chunk = huge = kib = reset = 0;
+        for (; t; t = t->next) {
+            if (strcmp(t->name, s->name))
+                continue;
+            nr++;
+            used += t->nr_used;
+            peak += t->peak_used;
+            chunk += t->nr_chunk;
+            huge += t->nr_huge;
+            kib += t->nr_chunk * t->chunk_size / 1024;
+            reset += t->nr_reset;
+            // TLB entries to cover the chunks, arena ones are counted
+            // as 1G pages below
+            pages_2m += t->nr_huge - t->nr_arena;
+            pages_4k += (t->nr_chunk - t->nr_huge) * t->chunk_size / 4096;
+        }
+        total += kib;
+        printf("%20s x%-2zu %4zu bytes, %8zu used, %8zu peak, %4zu chunks (%zu huge) %8zu KiB, %lu resets\n",
+               s->name, nr, s->size, used, peak, chunk, huge, kib, reset);
+    }
+    printf("%20s %zu KiB in %zu 1G + %zu 2M + %zu 4K pages, NUMA node %d\n",
+           "TLB reach", total, slab_arena.nr, pages_2m, pages_4k, slab_numa_node);
+
+}
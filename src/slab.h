@@ -0,0 +1,76 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "built_in.h"
+
+// fixed size objects carved from large mmap'd chunks, for the aggregation
+// table entries. LRU churn reuses objects through a free list instead of
+// going through malloc, a table of 10K entries sits in a few chunks, and
+// slab_reset drops every object at once while keeping the chunks, e.g.
+// for the tables of a closed window. with slab_hugepages chunks are 2MB
+// and hugepage backed: one 2MB page each, or carved from shared 1GB pages
+// so that all tables sit behind a single TLB entry. chunks are placed on
+// slab_numa_node if set. a slab is not locked, each thread keeps its own.
+#define SLAB_CHUNK_SIZE (64 * 1024)
+#define SLAB_HUGE_CHUNK_SIZE (2 * 1024 * 1024)
+// values of slab_hugepages
+#define SLAB_HUGE_2M (2UL << 20)
+#define SLAB_HUGE_1G (1UL << 30)
+// chunk header, objects start on a cache line
+#define SLAB_CHUNK_HDR 64
+
+struct slab_chunk {
+    struct slab_chunk *next;
+    // carved from a 1GB arena, goes back there instead of munmap
+    int arena;
+};
+
+struct slab {
+    const char *name;
+    size_t size, chunk_size, per_chunk;
+    void *free;
+    // all chunks in order, the one objects are carved from and how many
+    // were carved from it
+    struct slab_chunk *chunk, *cur;
+    size_t pos;
+    // nr_huge chunks are hugetlb backed, nr_arena of those in 1GB pages
+    size_t nr_chunk, nr_huge, nr_arena, nr_used, peak_used;
+    uint64_t nr_reset;
+    // in slab_list
+    struct slab *next;
+};
+
+extern size_t slab_hugepages;
+extern int slab_numa_node;
+extern struct slab *slab_list;
+
+void slab_init(struct slab *s, const char *name, size_t size);
+void slab_destroy(struct slab *s);
+void slab_reset(struct slab *s);
+void *__slab_carve(struct slab *s);
+void slab_print_stats(void);
+
+static inline void *slab_alloc(struct slab *s) {
+    void *p = s->free;
+
+    if (unlikely(!p))
+        return __slab_carve(s);
+    s->free = *(void **)p;
+    s->nr_used++;
+    return p;
+}
+
+static inline void slab_free(struct slab *s, void *p) {
+    *(void **)p = s->free;
+    s->free = p;
+    s->nr_used--;
+}
+
+#endif /* SLAB_H */
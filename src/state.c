@@ -0,0 +1,538 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "state.h"
+#include "xmalloc.h"
+#include "die.h"
+
+#define STATE_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+static uint64_t layout(struct state_hdr *h, enum state_section s, uint64_t off, uint64_t size) {
+    h->sect[s].off = size ? off : 0;
+    h->sect[s].size = size;
+    return off + STATE_ALIGN(size);
+}
+
+static size_t cms_bytes(const struct cms *c) {
+    return sizeof(*c) + (size_t)CMS_DEPTH * (c->mask + 1) * sizeof(c->cnt[0]);
+}
+
+static size_t ntree_bytes(const struct ntree *t) {
+    return sizeof(*t) + (size_t)t->nr_node * sizeof(t->node[0]) + ((size_t)t->mask + 1) * sizeof(t->bucket[0]);
+}
+
+static size_t lpm_bytes(const struct lpm *t) {
+    return sizeof(*t) + (size_t)t->nr_node * sizeof(t->node[0]);
+}
+
+static void save_ctxt(struct dnsctxt *ctxt, struct state_ctxt *c) {
+
+    c->first_ts = ctxt->first_ts;
+    c->now = ctxt->now;
+    c->seen = ctxt->seen;
+    c->incoming = ctxt->incoming;
+    c->cnt_query = ctxt->cnt_query;
+    c->cnt_reply = ctxt->cnt_reply;
+    c->cnt_status_noerror = ctxt->cnt_status_noerror;
+    c->cnt_status_srvfail = ctxt->cnt_status_srvfail;
+    c->cnt_status_nxdomain = ctxt->cnt_status_nxdomain;
+    c->cnt_status_refused = ctxt->cnt_status_refused;
+    c->cnt_malformed = ctxt->cnt_malformed;
+    c->cnt_edns = ctxt->cnt_edns;
+    memcpy(c->lat_bucket, ctxt->lat->bucket, sizeof(c->lat_bucket));
+    c->lat_sum = ctxt->lat->sum;
+    c->lat_count = ctxt->lat->count;
+    c->lat_unmatched = ctxt->lat->unmatched;
+    c->decay_tau = dnsctxt_decay.tau;
+    c->decay_landmark = dnsctxt_decay.landmark;
+    c->decay_epoch = dnsctxt_decay.epoch;
+
+}
+
+// entries in hash order, which is oldest first
+static void save_table(struct dnsctxt *ctxt, enum dnsctxt_table t, struct state_entry *out,
+                       char *str, uint64_t *str_pos) {
+
+    struct int32_entry **itable = dnsctxt_int_table(ctxt, t), *ientry, *itmp;
+    struct str_entry **stable = dnsctxt_str_table(ctxt, t), *sentry, *stmp;
+    size_t len;
+
+    if (itable) {
+        HASH_ITER(hh, *itable, ientry, itmp) {
+            out->key = ientry->key;
+            out->epoch = ientry->epoch;
+            out->count = ientry->count;
+            out->score = ientry->score;
+            out++;
+        }
+    }
+    if (stable) {
+        HASH_ITER(hh, *stable, sentry, stmp) {
+            len = intern_len(&dnsctxt_names, sentry->key);
+            memcpy(str + *str_pos, intern_str(&dnsctxt_names, sentry->key), len);
+            str[*str_pos + len] = 0;
+            out->key = *str_pos;
+            out->epoch = sentry->epoch;
+            out->count = sentry->count;
+            out->score = sentry->score;
+            *str_pos += len + 1;
+            out++;
+        }
+    }
+
+}
+
+static void save_ntree(const struct ntree *t, char *out, struct state_zone_hll *zone) {
+
+    struct ntree *hdr = (struct ntree *)out;
+    struct ntree_node *node = (struct ntree_node *)(out + sizeof(*t));
+    uint32_t i;
+
+    memcpy(hdr, t, sizeof(*t));
+    hdr->node = NULL;
+    hdr->bucket = NULL;
+    memcpy(node, t->node, (size_t)t->nr_node * sizeof(t->node[0]));
+    memcpy(node + t->nr_node, t->bucket, ((size_t)t->mask + 1) * sizeof(t->bucket[0]));
+
+    for (i = 0; i < t->nr_node; i++) {
+        if (!node[i].hll)
+            continue;
+        zone->node = i;
+        memcpy(zone->reg, t->node[i].hll->reg, sizeof(zone->reg));
+        zone++;
+        node[i].hll = NULL;
+    }
+
+}
+
+static void save_lpm(const struct lpm *t, char *out) {
+
+    struct lpm *hdr = (struct lpm *)out;
+
+    memcpy(hdr, t, sizeof(*t));
+    hdr->node = NULL;
+    memcpy(out + sizeof(*t), t->node, (size_t)t->nr_node * sizeof(t->node[0]));
+
+}
+
+// writes path.tmp and renames it over path. returns -1 with errno set,
+// leaving the last saved file as it was
+int state_save(struct dnsctxt *ctxt, const char *path) {
+
+    struct state_hdr hdr;
+    struct ntree *nt = ctxt->qnames;
+    char tmp[PATH_MAX], *base;
+    uint64_t off, str_size = 0, str_pos = 0;
+    size_t uniq_size = hll_size(ctxt->uniq.source->p), nr_zone = 0, i;
+    struct str_entry **stable, *sentry, *stmp;
+    struct int32_entry **itable;
+    int fd, t, err;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    // flushes deferred geo too
+    bug_on(!ctxt->stage);
+    dnsctxt_stage(ctxt);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = STATE_MAGIC;
+    hdr.version = STATE_VERSION;
+    hdr.pid = getpid();
+    hdr.saved = time(NULL);
+
+    off = STATE_ALIGN(sizeof(hdr));
+    off = layout(&hdr, STATE_CTXT, off, sizeof(struct state_ctxt));
+    off = layout(&hdr, STATE_STATS, off, sizeof(struct statshm_data));
+    off = layout(&hdr, STATE_UNIQ, off, 3 * uniq_size);
+    for (t = 0; t < DNS_TABLE_NR; t++) {
+        stable = dnsctxt_str_table(ctxt, t);
+        if (!stable)
+            continue;
+        HASH_ITER(hh, *stable, sentry, stmp)
+            str_size += intern_len(&dnsctxt_names, sentry->key) + 1;
+    }
+    off = layout(&hdr, STATE_STRINGS, off, str_size);
+    if (nt) {
+        for (i = 1; i < nt->nr_node; i++)
+            nr_zone += nt->node[i].hll != NULL;
+        off = layout(&hdr, STATE_NTREE, off, ntree_bytes(nt));
+        off = layout(&hdr, STATE_ZONE_HLL, off, nr_zone * sizeof(struct state_zone_hll));
+    }
+    for (t = 0; t < DNS_TABLE_NR; t++) {
+        itable = dnsctxt_int_table(ctxt, t);
+        stable = dnsctxt_str_table(ctxt, t);
+        off = layout(&hdr, STATE_TABLE + t, off, sizeof(struct state_entry) *
+                     (itable ? HASH_COUNT(*itable) : stable ? HASH_COUNT(*stable) : 0));
+        if (ctxt->cms[t])
+            off = layout(&hdr, STATE_CMS + t, off, cms_bytes(ctxt->cms[t]));
+    }
+    for (t = 0; t < DNS_PREFIX_NR; t++) {
+        if (ctxt->prefix4[t])
+            off = layout(&hdr, STATE_PREFIX4 + t, off, lpm_bytes(ctxt->prefix4[t]));
+        if (ctxt->prefix6[t])
+            off = layout(&hdr, STATE_PREFIX6 + t, off, lpm_bytes(ctxt->prefix6[t]));
+    }
+    hdr.size = off;
+
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    // allocated up front, a full disk is an error here and not a SIGBUS
+    // while filling the mapping
+    err = posix_fallocate(fd, 0, off);
+    if (err) {
+        errno = err;
+        goto out_unlink;
+    }
+    base = mmap(NULL, off, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        goto out_unlink;
+
+    memcpy(base, &hdr, sizeof(hdr));
+    save_ctxt(ctxt, (struct state_ctxt *)(base + hdr.sect[STATE_CTXT].off));
+    memcpy(base + hdr.sect[STATE_STATS].off, ctxt->stage, sizeof(*ctxt->stage));
+    memcpy(base + hdr.sect[STATE_UNIQ].off, ctxt->uniq.source, uniq_size);
+    memcpy(base + hdr.sect[STATE_UNIQ].off + uniq_size, ctxt->uniq.source24, uniq_size);
+    memcpy(base + hdr.sect[STATE_UNIQ].off + 2 * uniq_size, ctxt->uniq.qname, uniq_size);
+    if (nt)
+        save_ntree(nt, base + hdr.sect[STATE_NTREE].off,
+                   (struct state_zone_hll *)(base + hdr.sect[STATE_ZONE_HLL].off));
+    for (t = 0; t < DNS_TABLE_NR; t++) {
+        save_table(ctxt, t, (struct state_entry *)(base + hdr.sect[STATE_TABLE + t].off),
+                   base + hdr.sect[STATE_STRINGS].off, &str_pos);
+        if (ctxt->cms[t])
+            memcpy(base + hdr.sect[STATE_CMS + t].off, ctxt->cms[t], cms_bytes(ctxt->cms[t]));
+    }
+    for (t = 0; t < DNS_PREFIX_NR; t++) {
+        if (ctxt->prefix4[t])
+            save_lpm(ctxt->prefix4[t], base + hdr.sect[STATE_PREFIX4 + t].off);
+        if (ctxt->prefix6[t])
+            save_lpm(ctxt->prefix6[t], base + hdr.sect[STATE_PREFIX6 + t].off);
+    }
+
+    // on disk before the rename, or a crash could leave path renamed over
+    // a file whose data never made it
+    if (msync(base, off, MS_SYNC) || fsync(fd)) {
+        err = errno;
+        munmap(base, off);
+        errno = err;
+        goto out_unlink;
+    }
+    munmap(base, off);
+    close(fd);
+    if (rename(tmp, path)) {
+        err = errno;
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+
+out_unlink:
+    err = errno;
+    close(fd);
+    unlink(tmp);
+    errno = err;
+    return -1;
+
+}
+
+// scores carry over if they were decayed the same way, otherwise they
+// start over from the restored counts' next hits
+static int load_ctxt(struct dnsctxt *ctxt, const struct state_ctxt *c) {
+
+    ctxt->first_ts = c->first_ts;
+    ctxt->seen = c->seen;
+    ctxt->incoming = c->incoming;
+    ctxt->cnt_query = c->cnt_query;
+    ctxt->cnt_reply = c->cnt_reply;
+    ctxt->cnt_status_noerror = c->cnt_status_noerror;
+    ctxt->cnt_status_srvfail = c->cnt_status_srvfail;
+    ctxt->cnt_status_nxdomain = c->cnt_status_nxdomain;
+    ctxt->cnt_status_refused = c->cnt_status_refused;
+    ctxt->cnt_malformed = c->cnt_malformed;
+    ctxt->cnt_edns = c->cnt_edns;
+    memcpy(ctxt->lat->bucket, c->lat_bucket, sizeof(c->lat_bucket));
+    ctxt->lat->sum = c->lat_sum;
+    ctxt->lat->count = c->lat_count;
+    ctxt->lat->unmatched = c->lat_unmatched;
+
+    // packet time may lie before the old landmark with pcap input
+    if (!dnsctxt_decay.tau || c->decay_tau != dnsctxt_decay.tau || ctxt->event_time)
+        return 0;
+    dnsctxt_decay.landmark = c->decay_landmark;
+    dnsctxt_decay.epoch = c->decay_epoch;
+    dnsctxt_decay.next = 0;
+    ctxt->tick_end = 0;
+
+    return 1;
+
+}
+
+static void load_score(const struct state_entry *e, double *score, uint32_t *epoch, int decay) {
+    *score = decay ? e->score : 0;
+    *epoch = decay ? e->epoch : dnsctxt_decay.epoch;
+}
+
+// into empty tables, the newest MAX_LRU_SIZE - 1 entries in LRU order
+static void load_table(struct dnsctxt *ctxt, enum dnsctxt_table t, const struct state_hdr *h, size_t size,
+                       const char *str, size_t str_size, int decay) {
+
+    const struct state_entry *e = state_sect(h, size, STATE_TABLE + t, sizeof(*e));
+    struct int32_entry **itable = dnsctxt_int_table(ctxt, t), *ientry;
+    struct str_entry **stable = dnsctxt_str_table(ctxt, t), *sentry;
+    size_t n, i, len;
+    const char *s;
+
+    if (!e)
+        return;
+    n = h->sect[STATE_TABLE + t].size / sizeof(*e);
+    i = n >= MAX_LRU_SIZE ? n - (MAX_LRU_SIZE - 1) : 0;
+
+    for ( ; i < n; i++) {
+        if (itable) {
+            ientry = slab_alloc(&ctxt->int_slab);
+            ientry->key = e[i].key;
+            ientry->count = e[i].count;
+            load_score(&e[i], &ientry->score, &ientry->epoch, decay);
+            HASH_ADD(hh, *itable, key, sizeof(uint32_t), ientry);
+        }
+        else if (stable) {
+            if (e[i].key >= str_size || !memchr(str + e[i].key, 0, str_size - e[i].key))
+                continue;
+            s = str + e[i].key;
+            len = strlen(s);
+            sentry = slab_alloc(&ctxt->str_slab);
+            sentry->key = intern_get(&dnsctxt_names, s, len, hll_hash_mem(s, len));
+            sentry->count = e[i].count;
+            load_score(&e[i], &sentry->score, &sentry->epoch, decay);
+            HASH_ADD(hh, *stable, key, sizeof(uint32_t), sentry);
+        }
+    }
+
+}
+
+static void load_uniq(struct hll *h, const char *in, size_t size) {
+    if (((const struct hll *)in)->p == h->p)
+        memcpy(h, in, size);
+}
+
+// every link of a saved tree in range and every list of it free of loops,
+// so a damaged file cannot send a walk out of the arrays or round in
+// circles. in use nodes are one deeper than their parent, free ones have
+// depth 0 and are chained through next from free
+static int ntree_valid(const struct ntree *in, const struct ntree_node *node, const uint32_t *bucket) {
+
+    const struct ntree_node *n;
+    uint32_t nr = in->nr_node, nr_free = 0, i, j;
+    uint8_t *seen;
+    int ok = 0;
+
+    if (node[0].depth || in->free >= nr)
+        return 0;
+    for (i = 0; i < nr; i++) {
+        n = &node[i];
+        if (n->parent >= nr || n->child >= nr || n->sibling >= nr || n->next >= nr ||
+            n->len >= NTREE_LABEL_LEN || n->depth > in->depth)
+            return 0;
+        if (i && n->depth && (node[n->parent].depth != n->depth - 1 || (n->depth == 1 && n->parent)))
+            return 0;
+    }
+    for (i = 0; i <= in->mask; i++) {
+        if (bucket[i] >= nr)
+            return 0;
+    }
+
+    // bit 0 in a child list, 1 in a hash chain, 2 on the free list
+    seen = xzmalloc(nr);
+    for (i = 0; i < nr; i++) {
+        if (i && !node[i].depth)
+            continue;
+        for (j = node[i].child; j; j = node[j].sibling) {
+            if (!node[j].depth || node[j].parent != i || seen[j] & 1)
+                goto out;
+            seen[j] |= 1;
+        }
+    }
+    for (i = 0; i <= in->mask; i++) {
+        for (j = bucket[i]; j; j = node[j].next) {
+            if (!node[j].depth || seen[j] & 2)
+                goto out;
+            seen[j] |= 2;
+        }
+    }
+    for (j = in->free; j; j = node[j].next, nr_free++) {
+        if (node[j].depth || seen[j] & 4)
+            goto out;
+        seen[j] |= 4;
+    }
+    ok = nr_free == in->nr_free;
+
+out:
+    xfree(seen);
+    return ok;
+
+}
+
+// only into a tree of the same shape, which is the same --name-depth
+static void load_ntree(struct ntree *t, const struct state_hdr *h, size_t size, int decay) {
+
+    const struct ntree *in = state_sect(h, size, STATE_NTREE, sizeof(*in));
+    const struct state_zone_hll *zone = state_sect(h, size, STATE_ZONE_HLL, sizeof(*zone));
+    const struct ntree_node *node;
+    size_t nr_zone, i;
+
+    if (!in || in->depth != t->depth || in->max_node != t->max_node || in->mask != t->mask ||
+        !in->nr_node || in->nr_node > in->max_node ||
+        h->sect[STATE_NTREE].size != ntree_bytes(in))
+        return;
+    node = (const struct ntree_node *)(in + 1);
+    if (!ntree_valid(in, node, (const uint32_t *)(node + in->nr_node)))
+        return;
+
+    t->node = xrealloc(t->node, in->nr_node, sizeof(*t->node));
+    memcpy(t->node, node, (size_t)in->nr_node * sizeof(*t->node));
+    memcpy(t->bucket, node + in->nr_node, ((size_t)t->mask + 1) * sizeof(*t->bucket));
+    t->nr_node = t->cap_node = in->nr_node;
+    t->free = in->free;
+    t->nr_free = in->nr_free;
+    t->pruned = in->pruned;
+    t->overflow = in->overflow;
+    t->nr_hll = 0;
+    for (i = 0; i < t->nr_node; i++) {
+        t->node[i].hll = NULL;
+        if (!decay) {
+            t->node[i].score = 0;
+            t->node[i].epoch = dnsctxt_decay.epoch;
+        }
+    }
+
+    nr_zone = zone ? h->sect[STATE_ZONE_HLL].size / sizeof(*zone) : 0;
+    for (i = 0; i < nr_zone; i++) {
+        if (!zone[i].node || zone[i].node >= t->nr_node || t->node[zone[i].node].hll)
+            continue;
+        t->node[zone[i].node].hll = hll_new(ZONE_HLL_P);
+        memcpy(t->node[zone[i].node].hll->reg, zone[i].reg, sizeof(zone[i].reg));
+        t->nr_hll++;
+    }
+
+}
+
+// only into a trie with the same prefix lengths
+static void load_lpm(struct lpm *t, const struct state_hdr *h, size_t size, enum state_section s) {
+
+    const struct lpm *in = state_sect(h, size, s, sizeof(*in));
+    const struct lpm_node *node;
+    uint32_t i, j;
+
+    if (!in || in->bits != t->bits || in->nr_len != t->nr_len || memcmp(in->len, t->len, sizeof(t->len)) ||
+        in->max_node != t->max_node || !in->nr_node || in->nr_node > in->max_node ||
+        h->sect[s].size != lpm_bytes(in))
+        return;
+    node = (const struct lpm_node *)(in + 1);
+
+    // children are allocated after their parent, so a child index is past
+    // it, which also rules out loops
+    for (i = 0; i < in->nr_node; i++) {
+        for (j = 0; j < LPM_FANOUT; j++) {
+            if (node[i].child[j] && (node[i].child[j] <= i || node[i].child[j] >= in->nr_node))
+                return;
+        }
+    }
+
+    t->node = xrealloc(t->node, in->nr_node, sizeof(*t->node));
+    memcpy(t->node, node, (size_t)in->nr_node * sizeof(*t->node));
+    t->nr_node = t->cap_node = in->nr_node;
+    t->total = in->total;
+    memcpy(t->overflow, in->overflow, sizeof(t->overflow));
+
+}
+
+// call once the tables are configured and before the first packet. parts
+// that were configured differently when saved, a CMS width or prefix
+// lengths, are left empty. returns -1 with errno set, ENOENT if there is
+// no file yet
+int state_load(struct dnsctxt *ctxt, const char *path) {
+
+    const struct state_hdr *h;
+    const struct state_ctxt *c;
+    const struct cms *in;
+    const char *uniq, *str;
+    struct stat st;
+    size_t size, uniq_size = hll_size(ctxt->uniq.source->p), str_size;
+    int fd, t, decay;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+    size = st.st_size;
+    if (size < sizeof(*h)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    h = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED)
+        return -1;
+
+    c = state_sect(h, size, STATE_CTXT, sizeof(*c));
+    if (!state_check(h, size) || !c) {
+        munmap((void *)h, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    decay = load_ctxt(ctxt, c);
+
+    uniq = state_sect(h, size, STATE_UNIQ, 3 * uniq_size);
+    if (uniq) {
+        load_uniq(ctxt->uniq.source, uniq, uniq_size);
+        load_uniq(ctxt->uniq.source24, uniq + uniq_size, uniq_size);
+        load_uniq(ctxt->uniq.qname, uniq + 2 * uniq_size, uniq_size);
+    }
+
+    str = state_sect(h, size, STATE_STRINGS, 1);
+    str_size = str ? h->sect[STATE_STRINGS].size : 0;
+    for (t = 0; t < DNS_TABLE_NR; t++) {
+        load_table(ctxt, t, h, size, str, str_size, decay);
+        in = state_sect(h, size, STATE_CMS + t, sizeof(*in));
+        if (in && ctxt->cms[t] && in->mask == ctxt->cms[t]->mask &&
+            h->sect[STATE_CMS + t].size == cms_bytes(in))
+            memcpy(ctxt->cms[t], in, cms_bytes(in));
+    }
+
+    if (ctxt->qnames)
+        load_ntree(ctxt->qnames, h, size, decay);
+
+    for (t = 0; t < DNS_PREFIX_NR; t++) {
+        if (ctxt->prefix4[t])
+            load_lpm(ctxt->prefix4[t], h, size, STATE_PREFIX4 + t);
+        if (ctxt->prefix6[t])
+            load_lpm(ctxt->prefix6[t], h, size, STATE_PREFIX6 + t);
+    }
+
+    munmap((void *)h, size);
+
+    return 0;
+
+}
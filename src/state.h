@@ -0,0 +1,105 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#ifndef STATE_H
+#define STATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "dnsctxt.h"
+#include "statshm.h"
+
+// aggregation state of a dnsctxt checkpointed to a file, so a restarted
+// pktvisor picks up counting where the last one left off instead of from
+// empty tables. the file holds no pointers: sections sit at offsets from
+// the start, table entries are flat records with str keys as offsets into
+// a string section, and the name tree and prefix tries, which link by
+// index already, go in as their node arrays. a save writes a new file
+// through a shared mapping, syncs it and renames it over the old one, so
+// the file is always a whole checkpoint, also after a crash. a load
+// checks every node link before taking the arrays in. it carries the
+// counters and top tables rendered as in the stats segment, so
+// pktvisor-stats -f reads the last state of a process that is gone.
+// tumbling windows and queries waiting for their reply are not kept.
+#define STATE_MAGIC 0x70767374U
+#define STATE_VERSION 1
+#define STATE_PERIOD_DEFAULT (60 * 1000000000ULL)
+
+enum state_section {
+    STATE_CTXT,
+    STATE_STATS,
+    STATE_UNIQ,
+    STATE_STRINGS,
+    // struct ntree, its nodes and buckets
+    STATE_NTREE,
+    STATE_ZONE_HLL,
+    // per table, int and str ones, struct state_entry oldest first
+    STATE_TABLE,
+    STATE_CMS = STATE_TABLE + DNS_TABLE_NR,
+    // struct lpm and its nodes
+    STATE_PREFIX4 = STATE_CMS + DNS_TABLE_NR,
+    STATE_PREFIX6 = STATE_PREFIX4 + DNS_PREFIX_NR,
+    STATE_NR = STATE_PREFIX6 + DNS_PREFIX_NR
+};
+
+struct state_sect {
+    uint64_t off, size;
+};
+
+struct state_hdr {
+    uint32_t magic, version;
+    uint64_t size;
+    pid_t pid;
+    // wall clock of the save, s
+    uint64_t saved;
+    struct state_sect sect[STATE_NR];
+};
+
+struct state_ctxt {
+    uint64_t first_ts, now;
+    uint64_t seen, incoming;
+    uint64_t cnt_query, cnt_reply;
+    uint64_t cnt_status_noerror, cnt_status_srvfail, cnt_status_nxdomain, cnt_status_refused;
+    uint64_t cnt_malformed, cnt_edns;
+    uint64_t lat_bucket[DNS_LAT_BUCKETS];
+    uint64_t lat_sum, lat_count, lat_unmatched;
+    // scores are relative to these
+    uint64_t decay_tau, decay_landmark;
+    uint32_t decay_epoch;
+};
+
+struct state_entry {
+    // int key, or offset of the str key in STATE_STRINGS
+    uint32_t key;
+    uint32_t epoch;
+    uint64_t count;
+    double score;
+};
+
+struct state_zone_hll {
+    uint32_t node;
+    uint8_t reg[1 << ZONE_HLL_P];
+};
+
+int state_save(struct dnsctxt *ctxt, const char *path);
+int state_load(struct dnsctxt *ctxt, const char *path);
+
+// a section of a mapped file of size bytes if it is there whole
+static inline const void *state_sect(const struct state_hdr *h, size_t size,
+                                     enum state_section s, size_t min) {
+    const struct state_sect *sect = &h->sect[s];
+
+    if (!sect->size || sect->size < min || sect->off > size || sect->size > size - sect->off)
+        return NULL;
+    return (const char *)h + sect->off;
+}
+
+static inline int state_check(const struct state_hdr *h, size_t size) {
+    return size >= sizeof(*h) && h->magic == STATE_MAGIC &&
+        h->version == STATE_VERSION && h->size == size;
+}
+
+#endif /* STATE_H */
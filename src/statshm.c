@@ -0,0 +1,156 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "statshm.h"
+#include "die.h"
+
+// pid of the live pktvisor that created the segment name, 0 if it is
+// gone. only the fields every version has in front are looked at
+static pid_t statshm_owner(const char *name) {
+
+    struct statshm *shm;
+    struct stat st;
+    pid_t pid = 0;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &st) || st.st_size < (off_t)offsetof(struct statshm, period)) {
+        close(fd);
+        return 0;
+    }
+    shm = mmap(NULL, offsetof(struct statshm, period), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return 0;
+
+    if (shm->magic == STATSHM_MAGIC && shm->pid > 0 &&
+        (!kill(shm->pid, 0) || errno == EPERM))
+        pid = shm->pid;
+    munmap(shm, offsetof(struct statshm, period));
+
+    return pid;
+
+}
+
+// without a name the segment is anonymous, for readers in this process.
+// a segment of that name is only replaced if its pktvisor is gone
+struct statshm *statshm_create(const char *name, uint64_t period) {
+
+    struct statshm *shm;
+    pid_t owner;
+    int fd;
+
+    if (!name) {
+        shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shm == MAP_FAILED)
+            panic("Cannot map stats segment: %s\n", strerror(errno));
+        goto init;
+    }
+
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0 && errno == EEXIST) {
+        if ((owner = statshm_owner(name)))
+            panic("Shared memory segment %s is in use by pid %d\n", name, (int)owner);
+        shm_unlink(name);
+        fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    }
+    if (fd < 0)
+        panic("Cannot create shared memory segment %s: %s\n", name, strerror(errno));
+    if (ftruncate(fd, sizeof(*shm)))
+        panic("Cannot size shared memory segment %s: %s\n", name, strerror(errno));
+    shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED)
+        panic("Cannot map shared memory segment %s: %s\n", name, strerror(errno));
+    close(fd);
+
+init:
+    // fresh pages are zero, so seq is even and the data empty
+    shm->version = STATSHM_VERSION;
+    shm->size = sizeof(*shm);
+    shm->pid = getpid();
+    shm->period = period;
+    __atomic_store_n(&shm->magic, STATSHM_MAGIC, __ATOMIC_RELEASE);
+
+    return shm;
+
+}
+
+void statshm_destroy(struct statshm *shm, const char *name) {
+    munmap(shm, sizeof(*shm));
+    if (name)
+        shm_unlink(name);
+}
+
+// NULL with errno set if the segment is missing or of another layout
+const struct statshm *statshm_attach(const char *name) {
+
+    struct statshm *shm;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) || st.st_size != sizeof(*shm)) {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return NULL;
+
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != STATSHM_MAGIC ||
+        shm->version != STATSHM_VERSION || shm->size != sizeof(*shm)) {
+        munmap(shm, sizeof(*shm));
+        errno = EPROTO;
+        return NULL;
+    }
+
+    return shm;
+
+}
+
+void statshm_detach(const struct statshm *shm) {
+    munmap((void *)shm, sizeof(*shm));
+}
+
+// consistent copy of the data. -1 with errno ESRCH if the writer died
+// in the middle of a publish, EAGAIN if it is stuck there
+int statshm_read(const struct statshm *shm, struct statshm_data *data) {
+
+    uint64_t seq;
+    unsigned int tries;
+
+    for (tries = 1; tries <= STATSHM_READ_TRIES; tries++) {
+        seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            if (tries % STATSHM_READ_CHECK == 0 && kill(shm->pid, 0) && errno == ESRCH)
+                return -1;
+            sched_yield();
+            continue;
+        }
+        memcpy(data, &shm->data, sizeof(*data));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq)
+            return 0;
+    }
+
+    errno = EAGAIN;
+    return -1;
+
+}
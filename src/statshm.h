@@ -0,0 +1,103 @@
+/*
+ * Copyright 2015 NSONE, Inc.
+ */
+
+#ifndef STATSHM_H
+#define STATSHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// counters and top tables published into a POSIX shared memory segment,
+// for readers in other processes. the capture thread is the only writer
+// and rewrites the data in place once per period under a seqlock: seq is
+// odd while it writes, and a reader copies the data out and retries if seq
+// was odd or moved meanwhile. readers never write to the segment, so they
+// cannot slow the writer down, and once attached they read without
+// syscalls. keys are rendered to strings by the writer, so readers do not
+// need the geo databases or the name pool. the layout is fixed per
+// version; readers check magic, version and size before use.
+#define STATSHM_MAGIC 0x7076736dU
+#define STATSHM_VERSION 4
+#define STATSHM_NAME_DEFAULT "/pktvisor"
+
+#define STATSHM_TABLES 11
+#define STATSHM_TOPK 20
+#define STATSHM_KEY_LEN 256
+#define STATSHM_TITLE_LEN 32
+#define STATSHM_LAT_BUCKETS 14
+
+struct statshm_entry {
+    uint64_t count;
+    // per second, decayed, 0 without --decay
+    double rate;
+    // tables merged from many nodes only: count may be short by this much,
+    // for nodes where the key was below their top entries
+    uint64_t error;
+    char key[STATSHM_KEY_LEN];
+};
+
+struct statshm_table {
+    char title[STATSHM_TITLE_LEN];
+    uint32_t n;
+    struct statshm_entry entry[STATSHM_TOPK];
+};
+
+struct statshm_data {
+    // dnsctxt clock at publish time and at the first packet, ns
+    uint64_t ts, first_ts;
+    uint64_t seen, incoming;
+    uint64_t cnt_query, cnt_reply;
+    uint64_t cnt_status_noerror, cnt_status_srvfail, cnt_status_nxdomain, cnt_status_refused;
+    uint64_t cnt_malformed, cnt_edns;
+    uint64_t uniq_source, uniq_source24, uniq_qname;
+    // query to reply latency: upper bounds in ns, the last is UINT64_MAX,
+    // and counts per bucket, not cumulative. sum in ns
+    uint64_t lat_bound[STATSHM_LAT_BUCKETS];
+    uint64_t lat_bucket[STATSHM_LAT_BUCKETS];
+    uint64_t lat_sum, lat_count, lat_unmatched;
+    // analysis tier under load and its sample rate, see struct
+    // dnsctxt_shed, kernel ring drops and packets not sampled
+    uint32_t shed_tier, shed_rate;
+    uint64_t kernel_drops, sampled_out;
+    // the first DNS_TABLE_NR tables in enum dnsctxt_table order
+    uint32_t nr_table;
+    struct statshm_table table[STATSHM_TABLES];
+};
+
+// a reader finding a publish in progress yields, checks every
+// STATSHM_READ_CHECK tries whether the writer still lives and gives up
+// after STATSHM_READ_TRIES
+#define STATSHM_READ_CHECK 1024
+#define STATSHM_READ_TRIES (64 * STATSHM_READ_CHECK)
+
+struct statshm {
+    // set once at creation
+    uint32_t magic, version;
+    uint64_t size;
+    pid_t pid;
+    // publish period in ns
+    uint64_t period;
+    uint64_t seq;
+    uint64_t nr_publish;
+    struct statshm_data data;
+};
+
+struct statshm *statshm_create(const char *name, uint64_t period);
+void statshm_destroy(struct statshm *shm, const char *name);
+const struct statshm *statshm_attach(const char *name);
+void statshm_detach(const struct statshm *shm);
+int statshm_read(const struct statshm *shm, struct statshm_data *data);
+
+static inline void statshm_write_begin(struct statshm *shm) {
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void statshm_write_end(struct statshm *shm) {
+    shm->nr_publish++;
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* STATSHM_H */